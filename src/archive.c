@@ -0,0 +1,642 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* --archive: many files and directories in one archive, without tar.
+ *
+ * The files are read one after another as a single stream, so matches reach
+ * across them within the rzip window. Files are ordered by extension and
+ * then size, which puts files of a kind next to each other. The file table
+ * is written in front of the chunk index and says where each file is in the
+ * stream, so --extract only decompresses the chunks one file is in. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "lrzip_core.h"
+#include "util.h"
+#include "archive.h"
+
+#define COPY_BUF	(1 << 20)
+
+/* in_cb state while compressing */
+struct archive_reader {
+	rzip_control *control;
+	i64 file;		// Entry being read
+	i64 done;		// Bytes of it read so far
+	int fd;			// -1 not open yet, -2 could not be read
+};
+
+void free_archive(rzip_control *control)
+{
+	i64 i;
+
+	for (i = 0; i < control->nfiles; i++) {
+		dealloc(control->files[i].name);
+		dealloc(control->files[i].path);
+		dealloc(control->files[i].link);
+	}
+	dealloc(control->files);
+	control->nfiles = control->files_alloc = 0;
+}
+
+static bool add_entry(rzip_control *control, const char *path, const char *name, struct stat *st)
+{
+	struct archive_entry *e;
+
+	if (control->nfiles == control->files_alloc) {
+		i64 alloc = control->files_alloc ? control->files_alloc * 2 : 64;
+
+		e = realloc(control->files, alloc * sizeof(struct archive_entry));
+		if (unlikely(!e))
+			fatal_return(("Failed to realloc file table\n"), false);
+		control->files = e;
+		control->files_alloc = alloc;
+	}
+	e = &control->files[control->nfiles];
+	memset(e, 0, sizeof(struct archive_entry));
+	e->mode = st->st_mode;
+	e->mtime = st->st_mtime;
+	if (S_ISREG(st->st_mode))
+		e->size = st->st_size;
+	else if (S_ISLNK(st->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlink(path, target, sizeof(target) - 1);
+
+		if (unlikely(len == -1))
+			fatal_return(("Failed to read symlink %s\n", path), false);
+		target[len] = '\0';
+		e->link = strdup(target);
+		e->size = len;
+	}
+	e->name = strdup(name);
+	e->path = strdup(path);
+	if (unlikely(!e->name || !e->path || (S_ISLNK(st->st_mode) && !e->link)))
+		fatal_return(("Failed to allocate file table entry\n"), false);
+	control->nfiles++;
+	print_maxverbose("Added %s\n", name);
+	return true;
+}
+
+static bool add_tree(rzip_control *control, const char *path, const char *name)
+{
+	struct dirent *dp;
+	struct stat st;
+	DIR *dirp;
+
+	if (unlikely(lstat(path, &st)))
+		fatal_return(("Failed to stat %s\n", path), false);
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+			return add_entry(control, path, name, &st);
+		print_err("Not a file, directory or symlink, skipping %s\n", path);
+		return true;
+	}
+	/* Archiving / names its contents directly */
+	if (*name && !add_entry(control, path, name, &st))
+		return false;
+
+	dirp = opendir(path);
+	if (unlikely(!dirp))
+		fatal_return(("Unable to open directory %s\n", path), false);
+	while ((dp = readdir(dirp)) != NULL) {
+		char *cpath, *cname;
+		bool ret;
+
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		cpath = malloc(strlen(path) + strlen(dp->d_name) + 2);
+		cname = malloc(strlen(name) + strlen(dp->d_name) + 2);
+		if (unlikely(!cpath || !cname)) {
+			dealloc(cpath);
+			closedir(dirp);
+			fatal_return(("Failed to allocate path in add_tree\n"), false);
+		}
+		sprintf(cpath, "%s/%s", path, dp->d_name);
+		if (*name)
+			sprintf(cname, "%s/%s", name, dp->d_name);
+		else
+			strcpy(cname, dp->d_name);
+		ret = add_tree(control, cpath, cname);
+		dealloc(cpath);
+		dealloc(cname);
+		if (unlikely(!ret)) {
+			closedir(dirp);
+			return false;
+		}
+	}
+	closedir(dirp);
+	return true;
+}
+
+/* Add a file or a whole directory tree from the command line. Names in the
+ * archive start at the last part of the argument, like tar -C would give */
+bool archive_add(rzip_control *control, const char *arg)
+{
+	char *path = strdupa(arg), *name, *real = NULL;
+	size_t len = strlen(path);
+	bool ret;
+
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = '\0';
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		real = realpath(path, NULL);
+		if (unlikely(!real))
+			fatal_return(("Failed to resolve %s\n", arg), false);
+		name = strrchr(real, '/') + 1;
+	}
+	ret = add_tree(control, path, name);
+	free(real);
+	return ret;
+}
+
+static const char *extension(const char *name)
+{
+	const char *base = strrchr(name, '/'), *dot;
+
+	base = base ? base + 1 : name;
+	dot = strrchr(base, '.');
+	return dot && dot != base ? dot + 1 : "";
+}
+
+static int entry_name(const void *a, const void *b)
+{
+	return strcmp(((const struct archive_entry *)a)->name, ((const struct archive_entry *)b)->name);
+}
+
+/* Directories first so they are made before their files, then files of a
+ * kind together: by extension, then size, then name */
+static int entry_order(const void *a, const void *b)
+{
+	const struct archive_entry *x = a, *y = b;
+	int ret;
+
+	if (S_ISDIR(x->mode) != S_ISDIR(y->mode))
+		return S_ISDIR(x->mode) ? -1 : 1;
+	if (!S_ISDIR(x->mode)) {
+		ret = strcasecmp(extension(x->name), extension(y->name));
+		if (ret)
+			return ret;
+		if (x->size != y->size)
+			return x->size < y->size ? -1 : 1;
+	}
+	return strcmp(x->name, y->name);
+}
+
+/* compress_file's input: the data of every entry in turn. A file that has
+ * shrunk or gone since it was added is padded with zeroes so the offsets in
+ * the file table stay right, one that has grown is cut at its old size */
+static i64 archive_read(void *data, uchar *buf, i64 len, bool *chunk_end)
+{
+	struct archive_reader *ar = data;
+	rzip_control *control = ar->control;
+	i64 total = 0;
+
+	(void)chunk_end;
+	while (total < len && ar->file < control->nfiles) {
+		struct archive_entry *e = &control->files[ar->file];
+		i64 n = MIN(len - total, e->size - ar->done);
+
+		if (!n) {
+			if (ar->fd >= 0)
+				close(ar->fd);
+			ar->fd = -1;
+			ar->file++;
+			ar->done = 0;
+			continue;
+		}
+		if (S_ISLNK(e->mode))
+			memcpy(buf + total, e->link + ar->done, n);
+		else {
+			if (ar->fd == -1) {
+				ar->fd = open(e->path, O_RDONLY);
+				if (unlikely(ar->fd == -1)) {
+					print_err("Failed to open %s, storing zeroes in its place\n", e->path);
+					ar->fd = -2;
+				}
+			}
+			if (ar->fd >= 0) {
+				n = read(ar->fd, buf + total, n);
+				if (unlikely(n <= 0)) {
+					print_err("%s got shorter while archiving, padding it with zeroes\n", e->path);
+					close(ar->fd);
+					ar->fd = -2;
+				}
+			}
+			if (ar->fd == -2) {
+				n = MIN(len - total, e->size - ar->done);
+				memset(buf + total, 0, n);
+			}
+		}
+		ar->done += n;
+		total += n;
+	}
+	return total;
+}
+
+/* Compress every entry archive_add has collected into control->outname */
+bool compress_archive(rzip_control *control)
+{
+	struct archive_reader ar = { control, 0, 0, -1 };
+	i64 i, offset = 0;
+	bool ret;
+
+	qsort(control->files, control->nfiles, sizeof(struct archive_entry), entry_name);
+	for (i = 1; i < control->nfiles; i++) {
+		if (unlikely(!strcmp(control->files[i].name, control->files[i - 1].name)))
+			failure_return(("%s is in the archive more than once\n", control->files[i].name), false);
+	}
+	qsort(control->files, control->nfiles, sizeof(struct archive_entry), entry_order);
+	for (i = 0; i < control->nfiles; i++) {
+		control->files[i].offset = offset;
+		offset += control->files[i].size;
+	}
+	print_verbose("Archiving %lld files, %lld bytes\n", control->nfiles, offset);
+
+	/* The files are one stream in, the file table needs the index */
+	control->flags |= FLAG_STDIN | FLAG_INDEX;
+	control->in_cb = archive_read;
+	control->in_data = &ar;
+	ret = compress_file(control);
+	if (ar.fd >= 0)
+		close(ar.fd);
+	free_archive(control);
+	return ret;
+}
+
+/* The file table as it is stored, trailer included */
+uchar *archive_table(rzip_control *control, i64 *len)
+{
+	i64 i, tlen = 0;
+	uchar *buf, *p;
+
+	for (i = 0; i < control->nfiles; i++)
+		tlen += FILES_ENTRY + strlen(control->files[i].name);
+	*len = tlen + FILES_TRAILER;
+	p = buf = malloc(*len);
+	if (unlikely(!buf))
+		fatal_return(("Failed to malloc file table\n"), NULL);
+	for (i = 0; i < control->nfiles; i++) {
+		struct archive_entry *e = &control->files[i];
+		u32 nlen = strlen(e->name);
+
+		*(i64 *)p = htole64(e->offset);
+		*(i64 *)(p + 8) = htole64(e->size);
+		*(i64 *)(p + 16) = htole64(e->mtime);
+		*(u32 *)(p + 24) = htole32(e->mode);
+		*(u32 *)(p + 28) = htole32(nlen);
+		memcpy(p + FILES_ENTRY, e->name, nlen);
+		p += FILES_ENTRY + nlen;
+	}
+	*(i64 *)p = htole64(tlen);
+	*(i64 *)(p + 8) = htole64(control->nfiles);
+	memcpy(p + 16, FILES_MAGIC, 8);
+	print_maxverbose("Writing file table of %lld files\n", control->nfiles);
+	return buf;
+}
+
+/* Names come from the archive, keep them inside the directory extracted to */
+static bool safe_name(const char *name, u32 len)
+{
+	const char *p;
+
+	if (!len || strlen(name) != len || *name == '/')
+		return false;
+	for (p = name; ; p++) {
+		if (!strncmp(p, "..", 2) && (p[2] == '/' || !p[2]))
+			return false;
+		if (!(p = strchr(p, '/')))
+			return true;
+	}
+}
+
+/* Load the file table that ends where the chunk index starts, at end.
+ * Return the length it takes up in the archive, 0 when there is none */
+i64 archive_load(rzip_control *control, int fd_in, i64 end)
+{
+	i64 trailer[3], tlen, count, i = 0;
+	uchar *buf, *p;
+
+	if (end < MAGIC_LEN + FILES_TRAILER)
+		return 0;
+	if (unlikely(pread(fd_in, trailer, FILES_TRAILER, end - FILES_TRAILER) != FILES_TRAILER))
+		fatal_return(("Failed to read file table\n"), -1);
+	if (memcmp(&trailer[2], FILES_MAGIC, 8))
+		return 0;
+	tlen = le64toh(trailer[0]);
+	count = le64toh(trailer[1]);
+	if (unlikely(tlen < 0 || tlen > end - MAGIC_LEN - FILES_TRAILER || count < 0 || count > tlen / FILES_ENTRY))
+		failure_return(("Invalid file table\n"), -1);
+	buf = malloc(tlen + 1);
+	if (unlikely(!buf))
+		fatal_return(("Failed to malloc file table\n"), -1);
+	if (unlikely(pread(fd_in, buf, tlen, end - FILES_TRAILER - tlen) != tlen)) {
+		dealloc(buf);
+		fatal_return(("Failed to read file table\n"), -1);
+	}
+	free_archive(control);
+	control->files = calloc(count + 1, sizeof(struct archive_entry));
+	if (unlikely(!control->files)) {
+		dealloc(buf);
+		fatal_return(("Failed to malloc file table\n"), -1);
+	}
+	control->files_alloc = count + 1;
+	for (p = buf; i < count; i++) {
+		struct archive_entry *e = &control->files[i];
+		u32 nlen;
+
+		if (unlikely(p + FILES_ENTRY > buf + tlen))
+			goto invalid;
+		e->offset = le64toh(*(i64 *)p);
+		e->size = le64toh(*(i64 *)(p + 8));
+		e->mtime = le64toh(*(i64 *)(p + 16));
+		e->mode = le32toh(*(u32 *)(p + 24));
+		nlen = le32toh(*(u32 *)(p + 28));
+		if (unlikely(nlen > buf + tlen - p - FILES_ENTRY))
+			goto invalid;
+		e->name = strndup((char *)p + FILES_ENTRY, nlen);
+		if (unlikely(!e->name)) {
+			dealloc(buf);
+			free_archive(control);
+			fatal_return(("Failed to malloc file table\n"), -1);
+		}
+		control->nfiles = i + 1;
+		if (unlikely(!safe_name(e->name, nlen) || e->offset < 0 || e->size < 0 ||
+			     e->size > control->index_ulen - e->offset ||
+			     !(S_ISREG(e->mode) || S_ISDIR(e->mode) || S_ISLNK(e->mode))))
+			goto invalid;
+		p += FILES_ENTRY + nlen;
+	}
+	dealloc(buf);
+	print_maxverbose("Found file table of %lld files\n", count);
+	return tlen + FILES_TRAILER;
+invalid:
+	dealloc(buf);
+	free_archive(control);
+	failure_return(("Invalid entry %lld in file table\n", i + 1), -1);
+}
+
+void archive_list(rzip_control *control)
+{
+	i64 i;
+
+	print_output("Archive of %lld files:\n", control->nfiles);
+	for (i = 0; i < control->nfiles; i++) {
+		struct archive_entry *e = &control->files[i];
+
+		print_output("%c%04o %12lld %s%s\n", S_ISDIR(e->mode) ? 'd' : S_ISLNK(e->mode) ? 'l' : '-',
+			     e->mode & 07777, e->size, e->name, S_ISDIR(e->mode) ? "/" : "");
+	}
+}
+
+/* Where an entry is extracted to, under -O when it is given */
+static char *entry_path(rzip_control *control, struct archive_entry *e)
+{
+	const char *base = control->outdir ? control->outdir : "";
+	char *path = malloc(strlen(base) + strlen(e->name) + 1);
+
+	if (unlikely(!path))
+		fatal_return(("Failed to allocate output name\n"), NULL);
+	strcpy(path, base);
+	strcat(path, e->name);
+	return path;
+}
+
+/* Make the directories leading up to path. Below -O each of them has to be
+ * a directory, so no symlink, from the archive or already there, can take
+ * what is extracted after it outside the directory extracted to */
+static bool make_parents(rzip_control *control, char *path)
+{
+	size_t base = control->outdir ? strlen(control->outdir) : 0;
+	struct stat st;
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (unlikely(mkdir(path, 0777) && errno != EEXIST))
+			fatal_return(("Failed to create directory %s\n", path), false);
+		if ((size_t)(p - path) >= base && unlikely(lstat(path, &st) || !S_ISDIR(st.st_mode)))
+			failure_return(("Refusing to extract through %s, it is not a directory\n", path), false);
+		*p = '/';
+	}
+	return true;
+}
+
+static int create_file(rzip_control *control, const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+	if (FORCE_REPLACE && fd == -1 && errno == EEXIST) {
+		if (unlikely(unlink(path)))
+			fatal_return(("Failed to unlink an existing file: %s\n", path), -1);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	}
+	if (unlikely(fd == -1))
+		fatal_return(("Failed to create %s. Use -f to replace existing files\n", path), -1);
+	return fd;
+}
+
+/* Never through a symlink that has taken the place of what was extracted */
+static bool set_attrs(rzip_control *control, const char *path, struct archive_entry *e)
+{
+	struct timespec times[2];
+	struct stat st;
+
+	if (unlikely(lstat(path, &st) || S_ISLNK(st.st_mode) || chmod(path, e->mode & 07777)))
+		print_verbose("Warning, unable to set permissions on %s\n", path);
+	times[0].tv_sec = times[1].tv_sec = e->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (unlikely(utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW)))
+		print_verbose("Warning, unable to set time on %s\n", path);
+	return true;
+}
+
+/* Give a file --extract has written the mode and time it was archived with */
+bool archive_attrs(rzip_control *control, const char *name)
+{
+	return set_attrs(control, name, &control->files[control->extract_entry]);
+}
+
+static bool copy_data(rzip_control *control, int fd_in, int fd_out, struct archive_entry *e, uchar *buf)
+{
+	i64 done = 0;
+
+	while (done < e->size) {
+		ssize_t n = pread(fd_in, buf, MIN(COPY_BUF, e->size - done), e->offset + done);
+
+		if (unlikely(n <= 0))
+			fatal_return(("Failed to read %s from the archive stream\n", e->name), false);
+		if (unlikely(write(fd_out, buf, n) != n))
+			fatal_return(("Failed to write %s\n", e->name), false);
+		done += n;
+	}
+	return true;
+}
+
+static bool extract_entry(rzip_control *control, int fd_in, struct archive_entry *e, uchar *buf)
+{
+	char *path = entry_path(control, e);
+	bool ret = false;
+	int fd_out;
+
+	if (unlikely(!path))
+		return false;
+	if (unlikely(!make_parents(control, path)))
+		goto out;
+	if (S_ISDIR(e->mode)) {
+		struct stat st;
+
+		if (unlikely(mkdir(path, 0700) && (errno != EEXIST || stat(path, &st) || !S_ISDIR(st.st_mode))))
+			fatal_goto(("Failed to create directory %s\n", path), out);
+	} else if (S_ISLNK(e->mode)) {
+		char *target = malloc(e->size + 1);
+
+		if (unlikely(!target))
+			fatal_goto(("Failed to allocate symlink target\n"), out);
+		if (unlikely(pread(fd_in, target, e->size, e->offset) != e->size)) {
+			dealloc(target);
+			fatal_goto(("Failed to read %s from the archive stream\n", e->name), out);
+		}
+		target[e->size] = '\0';
+		if (FORCE_REPLACE)
+			unlink(path);
+		if (unlikely(symlink(target, path))) {
+			dealloc(target);
+			fatal_goto(("Failed to create symlink %s. Use -f to replace existing files\n", path), out);
+		}
+		dealloc(target);
+	} else {
+		fd_out = create_file(control, path);
+		if (unlikely(fd_out == -1))
+			goto out;
+		if (unlikely(!copy_data(control, fd_in, fd_out, e, buf))) {
+			close(fd_out);
+			goto out;
+		}
+		if (unlikely(close(fd_out)))
+			fatal_goto(("Failed to close %s\n", path), out);
+		set_attrs(control, path, e);
+	}
+	print_maxverbose("%s\n", e->name);
+	ret = true;
+out:
+	dealloc(path);
+	return ret;
+}
+
+/* Split the decompressed stream of an archive back into its files */
+bool archive_extract(rzip_control *control, const char *stream)
+{
+	bool ret = false;
+	uchar *buf;
+	int fd_in;
+	i64 i;
+
+	if (unlikely(!control->nfiles))
+		failure_return(("No file table found in the archive\n"), false);
+	fd_in = open(stream, O_RDONLY);
+	if (unlikely(fd_in == -1))
+		fatal_return(("Failed to open %s\n", stream), false);
+	buf = malloc(COPY_BUF);
+	if (unlikely(!buf)) {
+		close(fd_in);
+		fatal_return(("Failed to malloc copy buffer\n"), false);
+	}
+	print_progress("Extracting %lld files...\n", control->nfiles);
+	/* Symlinks go last so the files and directories are all there first.
+	 * make_parents refuses any entry whose path goes through a symlink,
+	 * such as a symlink q from the archive and a later q/t */
+	for (i = 0; i < control->nfiles; i++) {
+		if (!S_ISLNK(control->files[i].mode) && unlikely(!extract_entry(control, fd_in, &control->files[i], buf)))
+			goto out;
+	}
+	for (i = 0; i < control->nfiles; i++) {
+		if (S_ISLNK(control->files[i].mode) && unlikely(!extract_entry(control, fd_in, &control->files[i], buf)))
+			goto out;
+	}
+	/* Directory times last, writing into them changes them */
+	for (i = control->nfiles; i-- > 0; ) {
+		struct archive_entry *e = &control->files[i];
+		char *path;
+
+		if (!S_ISDIR(e->mode))
+			continue;
+		path = entry_path(control, e);
+		if (unlikely(!path))
+			goto out;
+		if (unlikely(!make_parents(control, path))) {
+			dealloc(path);
+			goto out;
+		}
+		set_attrs(control, path, e);
+		dealloc(path);
+	}
+	ret = true;
+out:
+	dealloc(buf);
+	close(fd_in);
+	return ret;
+}
+
+/* --extract: point the range at one file and name the output after it */
+bool archive_find(rzip_control *control, const char *infile, bool *done)
+{
+	struct archive_entry *e;
+	i64 i;
+	int fd;
+
+	*done = false;
+	if (unlikely(!read_file_table(control, infile)))
+		return false;
+	if (unlikely(!control->nfiles))
+		failure_return(("%s is not an --archive\n", infile), false);
+	for (i = 0; i < control->nfiles && strcmp(control->files[i].name, control->extract); i++)
+		;
+	if (unlikely(i == control->nfiles))
+		failure_return(("%s is not in %s\n", control->extract, infile), false);
+	e = &control->files[i];
+	if (unlikely(!S_ISREG(e->mode)))
+		failure_return(("%s is not a regular file\n", e->name), false);
+	control->extract_entry = i;
+	if (!control->outname) {
+		control->outname = entry_path(control, e);
+		if (unlikely(!control->outname || !make_parents(control, control->outname)))
+			return false;
+	}
+	if (!e->size) {
+		/* Nothing to decompress */
+		fd = create_file(control, control->outname);
+		if (unlikely(fd == -1))
+			return false;
+		close(fd);
+		*done = true;
+		return archive_attrs(control, control->outname);
+	}
+	control->range_start = e->offset;
+	control->range_len = e->size;
+	return true;
+}
@@ -0,0 +1,493 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* lrzip-bench - reproducible stage benchmarks, built with make bench.
+ *
+ * Every case runs in its own child so its peak RSS is its own. The corpus
+ * is generated from a fixed seed so runs on different trees and machines
+ * see the same bytes. Stage times come from the control->stats counters:
+ * rzip is hash_search with its match extension, runzip is the rebuilding
+ * of the data from the match and literal streams, and each backend is the
+ * time of its compress or decompress buf calls summed over the threads. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <getopt.h>
+
+#include "lrzip_core.h"
+#include "util.h"
+#include "stream.h"
+#include "7zCrc.h"
+
+static const char *corpus_names[] = { "logs", "vm", "source", "random" };
+#define CORPUS_KINDS	4
+
+static const struct method {
+	const char *name;
+	i64 flag;
+} methods[] = {
+	{ "rzip",	FLAG_NO_COMPRESS },
+	{ "lzo",	FLAG_LZO_COMPRESS },
+	{ "gzip",	FLAG_ZLIB_COMPRESS },
+	{ "bzip2",	FLAG_BZIP2_COMPRESS },
+	{ "lzma",	0 },
+	{ "zstd",	FLAG_ZSTD_COMPRESS },
+	{ "zpaq",	FLAG_ZPAQ_COMPRESS },
+};
+#define METHODS		(sizeof(methods) / sizeof(methods[0]))
+
+static i64 size = 32 * 1024 * 1024;
+static uint64_t seed = 0x6c727a6970ULL;
+static int level = 7, threads, repeat = 1, rows;
+static bool json;
+
+/* xorshift64*, the same bytes everywhere for a given seed */
+static uint64_t rnd_state;
+
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int gen_logs(uchar *buf, i64 len)
+{
+	static const char *verbs[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE" };
+	static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/static/app.js",
+				       "/login", "/api/v2/search", "/healthz" };
+	static const int codes[] = { 200, 200, 200, 200, 304, 404, 500 };
+	long long t = 1600000000;
+	char line[256];
+	i64 pos = 0;
+	int n;
+
+	while (pos < len) {
+		t += rnd() % 3;
+		n = snprintf(line, sizeof(line), "%lld.%03d host%02d nginx[%d]: %s %s/%u status=%d bytes=%u ms=%u\n",
+			     t, (int)(rnd() % 1000), (int)(rnd() % 16), 1000 + (int)(rnd() % 8),
+			     verbs[rnd() % 6], paths[rnd() % 6], (unsigned)(rnd() % 5000),
+			     codes[rnd() % 7], (unsigned)(rnd() % 65536), (unsigned)(rnd() % 900));
+		n = MIN(n, len - pos);
+		memcpy(buf + pos, line, n);
+		pos += n;
+	}
+	return 0;
+}
+
+/* Pages of a disk image: zeroes, copies of earlier pages with a few bytes
+ * changed, low entropy code like pages and some random ones */
+static int gen_vm(uchar *buf, i64 len)
+{
+	i64 pos, i;
+
+	for (pos = 0; pos < len; pos += 4096) {
+		i64 n = MIN(4096, len - pos);
+		int kind = rnd() % 10;
+
+		if (kind < 4)
+			memset(buf + pos, 0, n);
+		else if (kind < 7 && pos) {
+			memcpy(buf + pos, buf + (rnd() % (pos / 4096)) * 4096, n);
+			for (i = 0; i < 8; i++)
+				buf[pos + rnd() % n] = rnd();
+		} else if (kind < 9) {
+			for (i = 0; i < n; i++)
+				buf[pos + i] = "\x00\x48\x89\xe5\x8b\x45\xfc\xc3\x0f\x1f\x44\x55\x41\x5d\xe8\xff"[rnd() % 16];
+		} else {
+			for (i = 0; i < n; i++)
+				buf[pos + i] = rnd();
+		}
+	}
+	return 0;
+}
+
+static int gen_source(uchar *buf, i64 len)
+{
+	static const char *types[] = { "int", "i64", "bool", "uchar *", "struct stream *", "void" };
+	static const char *words[] = { "control", "sinfo", "buf", "len", "ret", "stream", "thread",
+				       "chunk", "offset", "total", "head", "cksum", "match", "ssize" };
+	char text[1024];
+	i64 pos = 0;
+	int n;
+
+	while (pos < len) {
+		const char *a = words[rnd() % 14], *b = words[rnd() % 14], *c = words[rnd() % 14];
+
+		n = snprintf(text, sizeof(text),
+			     "static %s %s_%s_%u(rzip_control *control, %s%s)\n{\n"
+			     "\t%s %s = 0;\n\n\tif (unlikely(!%s))\n\t\treturn -1;\n"
+			     "\twhile (%s < %s) {\n\t\t%s += %s_%s(control, %s);\n\t}\n"
+			     "\treturn %s;\n}\n\n",
+			     types[rnd() % 6], a, b, (unsigned)(rnd() % 100), types[rnd() % 6], c,
+			     types[rnd() % 5], a, c, a, b, a, c, b, c, a);
+		n = MIN(n, len - pos);
+		memcpy(buf + pos, text, n);
+		pos += n;
+	}
+	return 0;
+}
+
+static int gen_random(uchar *buf, i64 len)
+{
+	i64 i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rnd();
+	return 0;
+}
+
+static int (*generators[])(uchar *buf, i64 len) = { gen_logs, gen_vm, gen_source, gen_random };
+
+static uchar *make_corpus(int kind, i64 len)
+{
+	uchar *buf = malloc(len);
+
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate %lld bytes of corpus\n", (long long)len);
+		exit(1);
+	}
+	rnd_state = seed + kind;
+	generators[kind](buf, len);
+	return buf;
+}
+
+struct sink {
+	uchar *buf;
+	i64 len, size;
+};
+
+static bool sink_cb(void *data, const uchar *buf, i64 len)
+{
+	struct sink *s = data;
+
+	if (s->len + len > s->size) {
+		uchar *tmp;
+
+		s->size = (s->len + len) * 2;
+		tmp = realloc(s->buf, s->size);
+		if (!tmp)
+			return false;
+		s->buf = tmp;
+	}
+	memcpy(s->buf + s->len, buf, len);
+	s->len += len;
+	return true;
+}
+
+static double now(void)
+{
+	return stats_usecs() / 1000000.0;
+}
+
+static long peak_rss(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static void print_row(const char *bench, const char *corpus, const char *method, i64 bytes,
+		      double seconds, double ratio)
+{
+	double mbs = seconds > 0 ? bytes / 1048576.0 / seconds : 0;
+
+	if (json)
+		printf("%s\n  {\"bench\":\"%s\",\"corpus\":\"%s\",\"method\":\"%s\",\"bytes\":%lld,"
+		       "\"seconds\":%.6f,\"mb_s\":%.3f,\"ratio\":%.4f,\"peak_rss_kb\":%ld}",
+		       rows ? "," : "", bench, corpus, method, (long long)bytes, seconds, mbs, ratio, peak_rss());
+	else
+		printf("%s,%s,%s,%lld,%.6f,%.3f,%.4f,%ld\n", bench, corpus, method, (long long)bytes, seconds,
+		       mbs, ratio, peak_rss());
+	fflush(stdout);
+}
+
+/* Time of all the backend threads together and the uncompressed bytes
+ * they went through */
+static i64 backend_usecs(const struct lrz_stats *s, bool unzip, i64 *bytes)
+{
+	i64 usecs = 0;
+	int i;
+
+	*bytes = 0;
+	for (i = 0; i < STATS_THREADS; i++) {
+		usecs += s->thread[i].usecs;
+		*bytes += unzip ? s->thread[i].out_bytes : s->thread[i].in_bytes;
+	}
+	return usecs;
+}
+
+static void setup_control(rzip_control *control, struct lrz_stats *stats, i64 flag)
+{
+	initialise_control(control);
+	control->flags &= ~(FLAG_SHOW_PROGRESS | FLAG_NOT_LZMA);
+	control->flags |= flag;
+	control->compression_level = control->rzip_compression_level = level;
+	if (threads)
+		control->threads = threads;
+	control->msgout = NULL;
+	control->stats = stats;
+	/* As main does, lz4 testing is only for the slower backends */
+	if (flag & (FLAG_ZLIB_COMPRESS | FLAG_LZO_COMPRESS | FLAG_NO_COMPRESS))
+		control->flags &= ~FLAG_THRESHOLD;
+	setup_overhead(control);
+	setup_ram(control);
+}
+
+/* Checksum the corpus the way rzip does at the end of each chunk */
+static void bench_cksum(int kind)
+{
+	uchar *buf = make_corpus(kind, size);
+	double best_crc = 0, best_hash = 0, t;
+	volatile uint32_t crc;
+	gcry_md_hd_t md;
+	int r;
+
+	for (r = 0; r < repeat; r++) {
+		t = now();
+		crc = CrcUpdate(0xffffffff, buf, size);
+		t = now() - t;
+		if (!r || t < best_crc)
+			best_crc = t;
+
+		t = now();
+		gcry_md_open(&md, GCRY_MD_MD5, 0);
+		gcry_md_write(md, buf, size);
+		gcry_md_read(md, GCRY_MD_MD5);
+		gcry_md_close(md);
+		t = now() - t;
+		if (!r || t < best_hash)
+			best_hash = t;
+	}
+	(void)crc;
+	print_row("crc32", corpus_names[kind], "-", size, best_crc, 1);
+	rows++;
+	print_row("md5", corpus_names[kind], "-", size, best_hash, 1);
+	free(buf);
+}
+
+/* Time compress and decompress of one corpus with one method, reporting the
+ * whole run, its rzip or runzip stage and the backend on its own */
+static int bench_method(int kind, const struct method *m)
+{
+	uchar *buf = make_corpus(kind, size);
+	double best[6] = { 0 }, t[6];
+	i64 zbytes = 0, ubytes = 0;
+	struct lrz_stats stats;
+	rzip_control control;
+	struct sink arch = { 0 }, out = { 0 };
+	int r, i;
+
+	setup_control(&control, &stats, m->flag);
+	for (r = 0; r < repeat; r++) {
+		arch.len = out.len = 0;
+		init_stats(&stats);
+		t[0] = now();
+		if (!compress_buffer(&control, buf, size, sink_cb, &arch)) {
+			fprintf(stderr, "Failed to compress %s with %s\n", corpus_names[kind], m->name);
+			return 1;
+		}
+		t[0] = now() - t[0];
+		t[1] = stats.rzip_usecs / 1000000.0;
+		t[2] = backend_usecs(&stats, false, &zbytes) / 1000000.0;
+
+		init_stats(&stats);
+		t[3] = now();
+		if (!decompress_buffer(&control, arch.buf, arch.len, sink_cb, &out)) {
+			fprintf(stderr, "Failed to decompress %s with %s\n", corpus_names[kind], m->name);
+			return 1;
+		}
+		t[3] = now() - t[3];
+		t[4] = stats.rzip_usecs / 1000000.0;
+		t[5] = backend_usecs(&stats, true, &ubytes) / 1000000.0;
+		if (out.len != size || memcmp(out.buf, buf, size)) {
+			fprintf(stderr, "Mismatch after decompressing %s with %s\n", corpus_names[kind], m->name);
+			return 1;
+		}
+		for (i = 0; i < 6; i++) {
+			if (!r || t[i] < best[i])
+				best[i] = t[i];
+		}
+	}
+
+	print_row("compress", corpus_names[kind], m->name, size, best[0], (double)size / arch.len);
+	rows++;
+	print_row("decompress", corpus_names[kind], m->name, size, best[3], (double)size / arch.len);
+	rows++;
+	if (m->flag == FLAG_NO_COMPRESS) {
+		/* With no backend the run is all rzip */
+		print_row("hash_search", corpus_names[kind], m->name, size, best[1], (double)size / arch.len);
+		rows++;
+		print_row("runzip", corpus_names[kind], m->name, size, best[4], (double)size / arch.len);
+	} else {
+		/* Backends see what rzip left of the corpus */
+		print_row("backend_compress", corpus_names[kind], m->name, zbytes, best[2], (double)size / arch.len);
+		rows++;
+		print_row("backend_decompress", corpus_names[kind], m->name, ubytes, best[5], (double)size / arch.len);
+	}
+	free_stream_ctx(&control);
+	free(buf);
+	free(arch.buf);
+	free(out.buf);
+	return 0;
+}
+
+/* Write the corpus out for benchmarks of the command line */
+static int write_corpus(const char *dir)
+{
+	char name[4096];
+	uchar *buf;
+	FILE *f;
+	int kind;
+
+	for (kind = 0; kind < CORPUS_KINDS; kind++) {
+		snprintf(name, sizeof(name), "%s/%s", dir, corpus_names[kind]);
+		buf = make_corpus(kind, size);
+		f = fopen(name, "wb");
+		if (!f || fwrite(buf, 1, size, f) != (size_t)size || fclose(f)) {
+			fprintf(stderr, "Unable to write %s\n", name);
+			return 1;
+		}
+		free(buf);
+		printf("%s\n", name);
+	}
+	return 0;
+}
+
+static bool selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = list;
+
+	if (!list)
+		return true;
+	while ((p = strstr(p, name))) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || !p[len]))
+			return true;
+		p += len;
+	}
+	return false;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lrzip-bench [options]\n"
+		"	-s MB		corpus size of each kind (default 32)\n"
+		"	-c list		corpora to run, of logs,vm,source,random (default all)\n"
+		"	-m list		methods, of rzip,lzo,gzip,bzip2,lzma,zstd,zpaq (default all but zpaq)\n"
+		"	-L level	compression level (default 7)\n"
+		"	-p threads	threads to use (default all CPUs)\n"
+		"	-r count	runs of each case, the best is reported (default 1)\n"
+		"	-S seed		corpus seed\n"
+		"	-j		JSON instead of CSV\n"
+		"	-o dir		only write the corpus to dir, for command line benchmarks\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *corpora = NULL, *list = "rzip,lzo,gzip,bzip2,lzma,zstd", *dir = NULL;
+	int c, kind, status, failed = 0;
+	unsigned int i;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "c:jL:m:o:p:r:s:S:")) != -1) {
+		switch (c) {
+			case 'c':
+				corpora = optarg;
+				break;
+			case 'j':
+				json = true;
+				break;
+			case 'L':
+				level = atoi(optarg);
+				if (level < 1 || level > 9)
+					usage();
+				break;
+			case 'm':
+				list = optarg;
+				break;
+			case 'o':
+				dir = optarg;
+				break;
+			case 'p':
+				threads = atoi(optarg);
+				break;
+			case 'r':
+				repeat = MAX(atoi(optarg), 1);
+				break;
+			case 's':
+				size = strtoll(optarg, NULL, 10) * 1024 * 1024;
+				if (size < 1)
+					usage();
+				break;
+			case 'S':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	CrcGenerateTable();
+	if (dir)
+		return write_corpus(dir);
+
+	if (json)
+		printf("[");
+	else
+		printf("bench,corpus,method,bytes,seconds,mb_s,ratio,peak_rss_kb\n");
+	fflush(stdout);
+	for (kind = 0; kind < CORPUS_KINDS; kind++) {
+		if (!selected(corpora, corpus_names[kind]))
+			continue;
+		for (i = 0; i <= METHODS; i++) {
+			if (i < METHODS && !selected(list, methods[i].name))
+				continue;
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				return 1;
+			}
+			if (!pid) {
+				if (i == METHODS)
+					bench_cksum(kind);
+				else if (bench_method(kind, &methods[i]))
+					_exit(1);
+				_exit(0);
+			}
+			if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+				failed++;
+			/* The child counted its own rows, we only need to know
+			 * whether any went out */
+			rows = 1;
+		}
+	}
+	if (json)
+		printf("\n]\n");
+	return failed != 0;
+}
@@ -0,0 +1,32 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LRZIP_ARCHIVE_H
+#define LRZIP_ARCHIVE_H
+
+#include "lrzip_private.h"
+
+bool archive_add(rzip_control *control, const char *arg);
+bool compress_archive(rzip_control *control);
+uchar *archive_table(rzip_control *control, i64 *len);
+i64 archive_load(rzip_control *control, int fd_in, i64 end);
+void archive_list(rzip_control *control);
+bool archive_find(rzip_control *control, const char *infile, bool *done);
+bool archive_attrs(rzip_control *control, const char *name);
+bool archive_extract(rzip_control *control, const char *stream);
+void free_archive(rzip_control *control);
+
+#endif
@@ -20,8 +20,11 @@
 #define LRZIP_CORE_H
 
 #include "lrzip_private.h"
+#include "lrzip_next.h"
 
 i64 get_ram(rzip_control *control);
+i64 get_avail_ram(rzip_control *control);
+int get_processors(void);
 i64 nloops(i64 seconds, uchar *b1, uchar *b2);
 bool write_magic(rzip_control *control);
 bool read_magic(rzip_control *control, int fd_in, i64 *expected_size);
@@ -31,8 +34,10 @@ bool dump_tmpoutfile(rzip_control *control, int fd_out);
 int open_tmpinfile(rzip_control *control);
 bool read_tmpinfile(rzip_control *control, int fd_in);
 bool decompress_file(rzip_control *control);
-bool get_header_info(rzip_control *control, int fd_in, uchar *ctype, i64 *c_len, i64 *u_len, i64 *last_head);
+bool transcode_file(rzip_control *control);
+const char *ctype_name(uchar ctype);
 bool get_fileinfo(rzip_control *control);
+bool read_file_table(rzip_control *control, const char *name);
 bool compress_file(rzip_control *control);
 bool write_fdout(rzip_control *control, void *buf, i64 len);
 bool write_fdin(rzip_control *control);
@@ -0,0 +1,87 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* liblrzip-next: compressing and decompressing in memory.
+ *
+ * A control made by lrzip_new holds the options and the backend threads,
+ * which are kept between the calls made with it. Calls on one control
+ * must not overlap, use a control for each thread that compresses. The
+ * output is the same .lrz format lrzip-next writes. The lrzip_set calls
+ * print what is wrong with their arguments to stderr and return false. An
+ * error during a run, out_cb returning false among them, is printed and
+ * ends the process, as it does for lrzip-next. */
+
+#ifndef LRZIP_NEXT_H
+#define LRZIP_NEXT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rzip_control rzip_control;
+
+/* Output is handed to out_cb as it is made, in order */
+typedef bool (*lrz_out_cb)(void *data, const unsigned char *buf, int64_t len);
+
+/* A control with the options of lrzip-next run without any, lzma at level
+ * 7 with a thread for each CPU, quiet. NULL if it cannot be allocated */
+rzip_control *lrzip_new(void);
+/* Stop the threads of control and free it */
+void lrzip_free(rzip_control *control);
+/* Backend and level 1 to 9 for compressing: lzma, zstd, zpaq, bzip2,
+ * gzip, lzo or none for rzip alone. Decompression ignores them */
+bool lrzip_set_method(rzip_control *control, const char *method, int level);
+/* Threads to use, as -p does */
+bool lrzip_set_threads(rzip_control *control, int threads);
+
+/* Compress, or decompress, len bytes at buf in one call. What a chunk
+ * compresses to is kept in ram until it is handed over, so the archive of
+ * a chunk has to fit in ram */
+bool compress_buffer(rzip_control *control, const unsigned char *buf, int64_t len,
+		     lrz_out_cb out_cb, void *data);
+bool decompress_buffer(rzip_control *control, const unsigned char *buf, int64_t len,
+		       lrz_out_cb out_cb, void *data);
+
+/* Compress, or decompress, input handed over a piece at a time, with the
+ * run going on in a thread of its own. The control must not be used for
+ * anything else until lrz_stream_end. NULL if the run cannot start */
+struct lrz_stream;
+struct lrz_stream *compress_stream_init(rzip_control *control);
+struct lrz_stream *decompress_stream_init(rzip_control *control);
+/* Hand len bytes of input to the run. This waits while 16MB of input are
+ * not yet taken, and the run only takes more as its output is read, so
+ * feed and read from different threads */
+bool lrz_stream_feed(struct lrz_stream *ls, const unsigned char *buf, int64_t len);
+/* Compress what was fed so far as a chunk of its own, so all of its output
+ * can be read without feeding more. Chunks cut short compress less well */
+bool lrz_stream_flush(struct lrz_stream *ls);
+/* No more input follows */
+bool lrz_stream_finish(struct lrz_stream *ls);
+/* Read up to len bytes of output, waiting until there are some. 0 once
+ * the run is over and all was read, -1 if it failed */
+int64_t lrz_stream_read(struct lrz_stream *ls, unsigned char *buf, int64_t len);
+/* Finish, wait for the run and free ls, dropping output not read. Whether
+ * the run succeeded */
+bool lrz_stream_end(struct lrz_stream *ls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
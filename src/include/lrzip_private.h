@@ -82,6 +82,7 @@ void *alloca (size_t);
 #ifndef MD5_DIGEST_SIZE
 # define MD5_DIGEST_SIZE 16
 #endif
+#define MAX_DIGEST_SIZE 32	/* Largest of the hash_types digests */
 
 #define free(X) do { free((X)); (X) = NULL; } while (0)
 
@@ -144,6 +145,9 @@ extern int errno;
 #define likely(x)	__builtin_expect(!!(x), 1)
 #define unlikely(x)	__builtin_expect(!!(x), 0)
 #define __maybe_unused	__attribute__((unused))
+#ifndef __always_inline
+#define __always_inline	inline __attribute__((always_inline))
+#endif
 
 #if defined(__MINGW32__) || defined(__CYGWIN__) || defined(__ANDROID__) || defined(__APPLE__)
 # define ffsll __builtin_ffsll
@@ -235,9 +239,67 @@ typedef sem_t cksem_t;
 #define FLAG_TMP_OUTBUF		(1 << 21)
 #define FLAG_TMP_INBUF		(1 << 22)
 #define FLAG_ENCRYPT		(1 << 23)
+#define FLAG_INDEX		(1 << 24)
+#define FLAG_ZSTD_COMPRESS	(1 << 25)
+#define FLAG_ADAPTIVE		(1 << 26)
+#define FLAG_CDC		(1 << 27)
+#define FLAG_ARCHIVE		(1 << 28)
+#define FLAG_AUTO_FILTER	(1 << 29)
+#define FLAG_LONG_RANGE		(1 << 30)
+#define FLAG_STREAMED		(1UL << 31)
 
 #define NO_MD5		(!(HASH_CHECK) && !(HAS_MD5))
 
+/* Whole file hash stored at the end of the archive, as saved in the magic
+ * header. FLAG_MD5 means one of these is present, whichever it is. */
+#define HASH_TYPE_MD5		1
+#define HASH_TYPE_SHA256	2
+#define HASH_TYPE_BLAKE2B	3
+#define HASH_TYPE_MAX		HASH_TYPE_BLAKE2B
+
+/* How written output is pushed to disk, --sync */
+#define SYNC_NONE		0	/* Left to the kernel */
+#define SYNC_BACKGROUND		1	/* Writeback started after every block */
+#define SYNC_DROP		2	/* Also dropped from the page cache once written */
+#define SYNC_BLOCK		3	/* fsync after every block */
+
+/* --adaptive default, lz4 ratio in % at or under which a block goes to zstd */
+#define ADAPTIVE_TARGET		30
+
+/* --preset-dict sizes. No larger than the smallest part an LZMA block is
+ * split into, so a part is always primed from the block it came from */
+#define PRESET_DICT_SIZE	(1 << 20)
+#define PRESET_DICT_MIN		(1 << 16)
+#define PRESET_DICT_MAX		(1 << 22)
+
+#define MAGIC_LEN (24)
+
+/* Trailing chunk index, --index. Written before the whole file hash as
+ * INDEX_ENTRY bytes per chunk, then the total size, the chunk count and
+ * INDEX_MAGIC, all 8 byte little endian */
+#define INDEX_MAGIC		"LRZINDEX"
+#define INDEX_ENTRY		16
+#define INDEX_TRAILER		24
+
+/* File table of an --archive, in front of the chunk index. FILES_ENTRY
+ * bytes per file followed by its name, then the table length, the file
+ * count and FILES_MAGIC, all little endian */
+#define FILES_MAGIC		"LRZFILES"
+#define FILES_ENTRY		32
+#define FILES_TRAILER		24
+
+/* A --streamable archive, MAGIC_STREAMED, is written without ever going
+ * back. A chunk has no initial stream headers, its blocks follow one another
+ * with the stream number + 1 where the offset of the next block would be, and
+ * it ends with an empty CTYPE_NONE header whose stream is 0. Written out of
+ * a buffer of STREAMED_OUTBUF bytes */
+#define STREAMED_OUTBUF		(4 * 1024 * 1024)
+
+/* magic[15] bits */
+#define MAGIC_REFERENCE		1
+#define MAGIC_ARCHIVE		2
+#define MAGIC_STREAMED		4
+
 #define BITS32		(sizeof(long) == 4)
 
 #define CTYPE_NONE 3
@@ -246,6 +308,14 @@ typedef sem_t cksem_t;
 #define CTYPE_LZMA 6
 #define CTYPE_GZIP 7
 #define CTYPE_ZPAQ 8
+#define CTYPE_ZSTD 9
+
+/* The high nibble of a block's c_type is its --auto-filter filter, a
+ * FILTER_FLAG_* from 1 to 6 or from BLOCK_DELTA up the delta filter at one
+ * of the delta_strides */
+#define CTYPE_MASK 0x0f
+#define BLOCK_FILTER(c_type) ((c_type) >> 4)
+#define BLOCK_DELTA 7
 
 #define PASS_LEN 512
 #define HASH_LEN 64
@@ -288,7 +358,7 @@ typedef sem_t cksem_t;
 #define ARBITRARY_AT_EPOCH (ARBITRARY * pow (MOORE_TIMES_PER_SECOND, -T_ZERO))
 
 #define FLAG_VERBOSE (FLAG_VERBOSITY | FLAG_VERBOSITY_MAX)
-#define FLAG_NOT_LZMA (FLAG_NO_COMPRESS | FLAG_LZO_COMPRESS | FLAG_BZIP2_COMPRESS | FLAG_ZLIB_COMPRESS | FLAG_ZPAQ_COMPRESS)
+#define FLAG_NOT_LZMA (FLAG_NO_COMPRESS | FLAG_LZO_COMPRESS | FLAG_BZIP2_COMPRESS | FLAG_ZLIB_COMPRESS | FLAG_ZPAQ_COMPRESS | FLAG_ZSTD_COMPRESS)
 #define LZMA_COMPRESS	(!(control->flags & FLAG_NOT_LZMA))
 
 #define SHOW_PROGRESS	(control->flags & FLAG_SHOW_PROGRESS)
@@ -301,6 +371,8 @@ typedef sem_t cksem_t;
 #define BZIP2_COMPRESS	(control->flags & FLAG_BZIP2_COMPRESS)
 #define ZLIB_COMPRESS	(control->flags & FLAG_ZLIB_COMPRESS)
 #define ZPAQ_COMPRESS	(control->flags & FLAG_ZPAQ_COMPRESS)
+#define ZSTD_COMPRESS	(control->flags & FLAG_ZSTD_COMPRESS)
+#define ADAPTIVE	(control->flags & FLAG_ADAPTIVE)
 #define VERBOSE		(control->flags & FLAG_VERBOSE)
 #define VERBOSITY	(control->flags & FLAG_VERBOSITY)
 #define MAX_VERBOSE	(control->flags & FLAG_VERBOSITY_MAX)
@@ -316,6 +388,12 @@ typedef sem_t cksem_t;
 #define TMP_OUTBUF	(control->flags & FLAG_TMP_OUTBUF)
 #define TMP_INBUF	(control->flags & FLAG_TMP_INBUF)
 #define ENCRYPT		(control->flags & FLAG_ENCRYPT)
+#define INDEX		(control->flags & FLAG_INDEX)
+#define CDC		(control->flags & FLAG_CDC)
+#define ARCHIVE		(control->flags & FLAG_ARCHIVE)
+#define AUTO_FILTER	(control->flags & FLAG_AUTO_FILTER)
+#define LONG_RANGE	(control->flags & FLAG_LONG_RANGE)
+#define STREAMED	(control->flags & FLAG_STREAMED)
 
 /* Filter flags
  * 0 = none
@@ -340,6 +418,18 @@ typedef sem_t cksem_t;
 #define FILTER_MASK		0b00000111			// decode magic
 #define DELTA_OFFSET_MASK	0b11111000
 
+#define SB_WINDOWS	8
+
+struct sb_window {
+	uchar *buf;
+	i64 offset;
+	i64 size;
+};
+
+struct stream_ctx;
+struct remote;
+struct stdin_ahead;
+
 struct sliding_buffer {
 	uchar *buf_low;	/* The low window buffer */
 	uchar *buf_high;/* "" high "" */
@@ -352,15 +442,22 @@ struct sliding_buffer {
 	i64 size_high;	/* "" high "" */
 	i64 high_length;/* How big the high buffer should be */
 	int fd;		/* The fd of the mmap */
+	struct sb_window windows[SB_WINDOWS]; /* Older high buffers, newest first */
+	int nwindows;
+	i64 advised;	/* Search offset at which to read ahead again */
+	i64 dropped;	/* Low buffer below this has been given back */
+	i64 map_lead;	/* buf_low starts this far into its page aligned map */
 };
 
 struct checksum {
 	uint32_t *cksum;
 	uchar *buf;
 	i64 len;
+	bool owned;	/* buf is a copy to be freed once done */
 };
 
 typedef i64 tag;
+typedef uint64_t hash_slot;
 
 struct node {
 	void *data;
@@ -369,22 +466,39 @@ struct node {
 
 struct runzip_node {
 	struct stream_info *sinfo;
-	pthread_t *pthreads;
 	struct runzip_node *prev;
 };
 
+struct rzip_counts {
+	i64 inserts;
+	i64 literals;
+	i64 literal_bytes;
+	i64 matches;
+	i64 match_bytes;
+	i64 tag_hits;
+	i64 tag_misses;
+};
+
+/* Staged rzip records, each a head byte, a 2 byte length and up to an 8 byte
+ * offset */
+#define REC_MAX		(3 + 8)
+#define RECS_SIZE	(128 * REC_MAX)
+
 struct rzip_state {
 	void *ss;
 	struct node *sslist;
 	struct node *head;
 	struct level *level;
 	tag hash_index[256];
-	struct hash_entry *hash_table;
+	hash_slot *hash_table;
 	char hash_bits;
+	char slot_tag_bits;
+	tag slot_tag_mask;
 	i64 hash_count;
 	i64 hash_limit;
 	tag minimum_tag_mask;
 	i64 tag_clean_ptr;
+	i64 victim_round;	/* Which of max_chain_len equal tags to kill next */
 	i64 last_match;
 	i64 chunk_size;
 	i64 mmap_size;
@@ -392,18 +506,81 @@ struct rzip_state {
 	uint32_t cksum;
 	int fd_in, fd_out;
 	char stdin_eof;
+	uchar *carry;		/* Stdin read past a content defined cut */
+	i64 carry_len;
+	struct rzip_state *ref;	/* Hash table of the --reference file */
+	uchar *table_map;	/* Hash table is mapped from a --ref-index */
+	i64 table_map_len;
+	int table_fd;		/* File a --long-range table is mapped from, or -1 */
+	struct rzip_state *far;	/* Sampled --long-range hash table */
+	char far_shift;		/* Low tag bits all its anchors have set, not stored */
+	tag far_mask;		/* Anchors added to it have these bits set above them */
+	i64 tune_at;		/* Next offset --rzip-tune looks at the match yield */
+	i64 tune_from;		/* Offset and counts it last looked at */
+	struct rzip_counts tune_stats;
+	struct rzip_counts stats;
+	uchar recs[RECS_SIZE];	/* Match and literal records not yet in stream 0 */
+	int recs_len;
+};
+
+#define STATS_THREADS	64
+
+/* Counters the runs on a control add to when control->stats points at one,
+ * for a library caller to read with sample_stats at any time, or to get at
+ * each progress update through stats_cb. They are only updated once per
+ * chunk or block, under lock. Start one with init_stats */
+struct lrz_stats {
+	pthread_mutex_t lock;
+	i64 in_bytes;		/* Taken from the input */
+	i64 out_bytes;		/* Written to the output */
+	i64 chunks;
+	i64 rzip_bytes;		/* Through rzip, or rebuilt by runzip */
+	i64 rzip_usecs;
+	i64 rzip_cpu_usecs;
+	i64 chunk_usecs;	/* rzip or runzip time of the last chunk */
+	i64 cksum_usecs;	/* Computing checksums, in whichever thread */
+	i64 write_usecs;	/* Writing out the archive or the file */
+	/* Time spent waiting */
+	i64 cksum_wait_usecs;	/* For the checksum thread */
+	i64 backend_wait_usecs;	/* By rzip for a free backend slot, by runzip for a block */
+	i64 writer_wait_usecs;	/* By the writer for the next block in order */
+	i64 ram_wait_usecs;	/* By backends for ram */
 	struct {
-		i64 inserts;
-		i64 literals;
-		i64 literal_bytes;
-		i64 matches;
-		i64 match_bytes;
-		i64 tag_hits;
-		i64 tag_misses;
-	} stats;
+		i64 blocks;
+		i64 in_bytes;
+		i64 out_bytes;
+		i64 usecs;
+		i64 cpu_usecs;
+	} thread[STATS_THREADS];	/* Backend work of each thread slot */
+	struct rzip_counts rzip;	/* Of the rzip stage, added at the end of each file */
+	/* Only filled in by sample_stats */
+	int queued;		/* Blocks waiting for a backend thread */
+	int running;		/* Backend jobs holding ram */
+	i64 ram_budget;
+	i64 ram_reserved;	/* What the running jobs asked for */
+	i64 ram_mapped;		/* Stream and backend buffers held by the stream context */
+	int pct;		/* Last progress shown */
+};
+
+/* Time a stretch of work into one of the control->stats counters */
+#define stats_start(control)	((control)->stats ? stats_usecs() : 0)
+#define stats_since(control, counter, start) do { \
+	if ((control)->stats) \
+		stats_add(control, &(control)->stats->counter, stats_usecs() - (start)); \
+} while (0)
+
+/* A file, directory or symlink of an --archive. Its data, or the target of
+ * a symlink, is size bytes at offset in the uncompressed stream */
+struct archive_entry {
+	char *name;			// Relative path it is extracted to
+	char *path;			// Where it is read from when compressing
+	char *link;			// Symlink target when compressing
+	i64 offset;
+	i64 size;
+	i64 mtime;
+	u32 mode;			// st_mode, file type included
 };
 
-/* lrzip library callback code removed */
 struct rzip_control {
 	char *infile;
 	FILE *inFILE; 			// if a FILE is being read from
@@ -422,6 +599,16 @@ struct rzip_control {
 	i64 in_ofs;
 	i64 in_len;
 	i64 in_maxlen;
+	const uchar *in_buffer;		// compress_buffer/decompress_buffer input read in place of stdin
+	i64 in_buffer_len;
+	i64 in_buffer_ofs;		// How much of in_buffer has been taken
+	bool (*out_cb)(void *data, const uchar *buf, i64 len);	// Sink flushed output goes to in place of stdout
+	void *out_data;
+	i64 (*in_cb)(void *data, uchar *buf, i64 len, bool *chunk_end);	// lrz_stream input read in place of stdin
+	void *in_data;
+	struct lrz_stats *stats;	// counters to keep, or NULL
+	void (*stats_cb)(void *data, const struct lrz_stats *stats);	// called with them at each progress update
+	void *stats_data;
 	FILE *msgout;			//stream for output messages
 	FILE *msgerr;			//stream for output errors
 	char *suffix;
@@ -436,13 +623,21 @@ struct rzip_control {
 	u32 dictSize;			// lzma Dictionary size - set in overhead computation
 	unsigned zpaq_level;		// zpaq level
 	unsigned zpaq_bs;		// zpaq default block size
+	int zstd_level;			// zstd level - set in overhead computation
+	uchar stream0_ctype;		// --stream0 backend for the match stream, 0 for the main one
+	int stream0_level;		// --stream0 level, 0 for the main one
 	i64 window;
 	unsigned long flags;
 	i64 ramsize;
 	i64 max_chunk;
 	i64 max_mmap;
 	int threads;
+	struct stream_ctx *sctx;	// stream threads kept between runs, see stream.c
+	struct remote *remote;		// --remote workers and their idle connections, see remote.c
+	struct stdin_ahead *ahead;	// stdin read ahead of the run, see rzip.c
 	int threshold;			// threshold limit. 1-99%. Default no limiter
+	int adaptive;			// --adaptive, lz4 ratio in % at or under which a block goes to zstd
+	u32 preset_dict;		// --preset-dict, bytes of its stream each LZMA block is primed with
 	char nice_val;			// added for consistency
 	int current_priority;
 	char major_version;
@@ -467,9 +662,41 @@ struct rzip_control {
 
 	cksem_t cksumsem;
 	gcry_md_hd_t gcry_md5_handle;
-	uchar gcry_md5_resblock[MD5_DIGEST_SIZE];
+	uchar gcry_md5_resblock[MAX_DIGEST_SIZE];
+	uchar hash_type;		// HASH_TYPE_* used for gcry_md5_handle
+	uchar sync_mode;		// SYNC_*
+	i64 sync_prev;			// Output end after the previous block
+	i64 sync_drop;			// Output before this is dropped from the page cache
+	i64 *index;			// Compressed and uncompressed offset of each chunk
+	i64 index_chunks;		// Chunks in index
+	i64 index_alloc;		// Chunks index has room for
+	i64 index_ulen;			// Uncompressed bytes covered by index
+	i64 range_start;		// --range extraction start
+	i64 range_len;			// --range extraction length, 0 when unused
+	const char *reference;		// --reference file matches may point back into
+	const char *ref_index;		// --ref-index sidecar its hash table is kept in
+	uchar *ref_buf;			// The reference, mapped
+	i64 ref_len;
+	i64 ref_base;			// Uncompressed offset the output starts at
+	bool ref_needed;		// Archive was made against a reference
+	i64 long_range;			// --long-range table size in MB, 0 to size it from the chunk
+	i64 hash_mb;			// --rzip-table overrides of the rzip level, 0 to keep them
+	int hash_freq;
+	int chain_len;
+	bool rzip_tune;			// --rzip-tune the table and chain length from the match yield
+	i64 unzip_ram;			// --max-decompress-ram budget in bytes, 0 for no cap
+	struct archive_entry *files;	// --archive file table
+	i64 nfiles;
+	i64 files_alloc;
+	const char *extract;		// --extract file name
+	bool transcode;			// --transcode archives to another backend
+	i64 extract_entry;		// Its entry in files
 	i64 md5_read;			// How far into the file the md5 has done so far
 	struct checksum checksum;
+	uchar *ckbuf;			// records gathered for the next checksum
+	i64 cklen;
+	uchar *match_buf;		// matches read back from the output file are rebuilt in
+	i64 match_buflen;
 
 	const char *util_infile;
 	char delete_infile;
@@ -480,11 +707,7 @@ struct rzip_control {
 	char chunk_bytes;
 	struct sliding_buffer sb;
 	void (*do_mcpy)(rzip_control *, unsigned char *, i64, i64);
-	void (*next_tag)(rzip_control *, struct rzip_state *, i64, tag *);
-	tag (*full_tag)(rzip_control *, struct rzip_state *, i64);
-	i64 (*match_len)(rzip_control *, struct rzip_state *, i64, i64, i64, i64 *);
 
-	pthread_t *pthreads;
 	struct runzip_node *rulist;
 	struct runzip_node *ruhead;
 };
@@ -494,8 +717,22 @@ struct uncomp_thread {
 	i64 u_len, c_len;
 	i64 last_head;
 	uchar c_type;
+	uchar filter;	/* FILTER_FLAG_* to undo after decompressing */
+	unsigned delta;	/* distance of FILTER_FLAG_DELTA */
 	int busy;
 	int streamno;
+	bool failed;
+	cksem_t cksem;	/* Posted once s_buf is decompressed */
+	/* An LZMA block is instead handed over as soon as decoding starts.
+	 * s_buf is then the decoder's ring of ring_len bytes and the reader
+	 * takes it as it fills, produced and consumed count block bytes and
+	 * are guarded by the ring lock in stream.c */
+	i64 ring_len;
+	i64 produced, consumed;
+	bool done, abandon;
+	i64 ring_pre;	/* Preset dictionary in front of the block in the ring */
+	i64 seq;	/* Block number in its stream, orders the tails */
+	uchar salt[SALT_LEN];	/* Block salt, s_buf is decrypted by the worker */
 };
 
 struct stream {
@@ -509,6 +746,15 @@ struct stream {
 	long base_thread;
 	int total_threads;
 	i64 last_headofs;
+	i64 *heads;			/* --streamable: where its blocks are */
+	i64 nheads, head_no;
+	struct uncomp_thread *ring;	/* Block being read while it decodes */
+	/* --preset-dict: the end of the stream so far, which the next LZMA
+	 * block is primed with, and on decompression how many blocks have
+	 * been given out and have passed their end on */
+	uchar *tail;
+	i64 tail_len;
+	i64 blocks, tails;
 };
 
 struct stream_info {
@@ -526,6 +772,7 @@ struct stream_info {
 	long next_thread;
 	int chunks;
 	char chunk_bytes;
+	uchar eof;	/* Last chunk, as control->eof was when it was opened */
 };
 
 extern bool progress_flag ; // print newline when verbose and last print was progress indicator
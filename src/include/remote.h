@@ -0,0 +1,31 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LRZIP_REMOTE_H
+#define LRZIP_REMOTE_H
+
+#include "lrzip_private.h"
+
+bool remote_add(rzip_control *control, const char *list);
+int remote_get(rzip_control *control);
+void remote_put(rzip_control *control, int fd, bool ok);
+void free_remote(rzip_control *control);
+time_t remote_deadline(i64 len);
+bool remote_write(int fd, const void *buf, i64 len, time_t deadline);
+bool remote_read(int fd, void *buf, i64 len, time_t deadline);
+bool run_worker(rzip_control *control, const char *addr);
+
+#endif
@@ -23,5 +23,7 @@
 #include "lrzip_private.h"
 
 i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 expected_size);
+i64 runzip_range(rzip_control *control, int fd_in, int fd_out, int fd_hist);
+i64 transcode_fd(rzip_control *control, rzip_control *out, int fd_in, i64 infile_size);
 
 #endif
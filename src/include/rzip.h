@@ -22,6 +22,9 @@
 #include "lrzip_private.h"
 
 void rzip_fd(rzip_control *control, int fd_in, int fd_out);
+bool write_index(rzip_control *control);
 void rzip_control_free(rzip_control *control);
+void cksum_block(rzip_control *control, uint32_t *cksum, uchar *buf, i64 len);
+void *cksumthread(void *data);
 
 #endif
@@ -25,20 +25,38 @@
 
 bool create_pthread(rzip_control *control, pthread_t *thread, pthread_attr_t * attr,
 	void * (*start_routine)(void *), void *arg);
-bool join_pthread(pthread_t th, void **thread_return);
+bool join_pthread(rzip_control *control, pthread_t th, void **thread_return);
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex);
 bool unlock_mutex(rzip_control *control, pthread_mutex_t *mutex);
 bool lock_mutex(rzip_control *control, pthread_mutex_t *mutex);
+bool cond_wait(rzip_control *control, pthread_cond_t *cond, pthread_mutex_t *mutex);
+bool cond_broadcast(rzip_control *control, pthread_cond_t *cond);
 ssize_t write_1g(rzip_control *control, void *buf, i64 len);
 ssize_t read_1g(rzip_control *control, int fd, void *buf, i64 len);
+i64 read_stdin(rzip_control *control, uchar *buf, i64 len);
 i64 get_readseek(rzip_control *control, int fd);
+bool free_stream_ctx(rzip_control *control);
+bool serve_block(rzip_control *control, int fd);
+i64 stats_usecs(void);
+i64 stats_cpu_usecs(void);
+void init_stats(struct lrz_stats *stats);
+void sample_stats(rzip_control *control, struct lrz_stats *out);
+void stats_add(rzip_control *control, i64 *counter, i64 val);
+void stats_io(rzip_control *control, i64 in, i64 out);
+void stats_chunk(rzip_control *control, i64 len, i64 usecs, i64 cpu_usecs);
+void stats_rzip(rzip_control *control, const struct rzip_counts *counts);
+void report_stats(rzip_control *control, int pct);
+void wait_cksum(rzip_control *control);
+void keep_stream_ctx(rzip_control *control, rzip_control *run);
 bool prepare_streamout_threads(rzip_control *control);
 bool close_streamout_threads(rzip_control *control);
+bool close_streamin_threads(rzip_control *control);
 void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_limit, char cbytes);
 void *open_stream_in(rzip_control *control, int f, int n, char cbytes);
 void flush_buffer(rzip_control *control, struct stream_info *sinfo, int stream);
 void write_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
 i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
+i64 peek_stream(rzip_control *control, void *ss, int streamno, uchar **p, i64 len);
 int close_stream_out(rzip_control *control, void *ss);
 int close_stream_in(rzip_control *control, void *ss);
 ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret);
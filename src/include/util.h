@@ -29,6 +29,7 @@
 void register_infile(rzip_control *control, const char *name, char delete);
 void register_outfile(rzip_control *control, const char *name, char delete);
 void unlink_files(rzip_control *control);
+void remove_broken(rzip_control *control);
 void register_outputfile(rzip_control *control, FILE *f);
 void fatal_exit(rzip_control *control);
 void setup_overhead(rzip_control *control);
@@ -44,6 +45,24 @@ bool lrz_crypt(const rzip_control *control, uchar *buf, i64 len, const uchar *sa
  * Valdidate will suppress printing message during validation or info
  */
 bool decrypt_header(rzip_control *control, uchar *head, uchar *c_type, i64 *c_len, i64 *u_len, i64 *last_head, int decompress_type);
+
+struct hash_type {
+	const char *name;
+	int algo;	/* libgcrypt GCRY_MD_* */
+	int len;	/* Digest length stored in the archive */
+};
+extern const struct hash_type hash_types[];
+bool set_hash_type(rzip_control *control, const char *name);
+bool set_sync_mode(rzip_control *control, const char *name);
+bool set_stream0(rzip_control *control, const char *arg);
+bool set_preset_dict(rzip_control *control, const char *arg);
+bool set_rzip_table(rzip_control *control, const char *arg);
+bool map_reference(rzip_control *control);
+void unmap_reference(rzip_control *control);
+int zstd_level(int level);
+#define HASH_NAME	(hash_types[control->hash_type].name)
+#define HASH_ALGO	(hash_types[control->hash_type].algo)
+#define HASH_DIGEST_SIZE	(hash_types[control->hash_type].len)
 /* Failure when there is likely to be a meaningful error in perror */
 static inline void fatal(const rzip_control *control, unsigned int line, const char *file, const char *func, const char *format, ...)
 {
@@ -1731,9 +1731,46 @@ Predictor::~Predictor() {
   allocx(pcode, pcode_size, 0);  // free executable memory
 }
 
+#ifdef NOJIT
+// Without JIT code, the component types lrzip's ZPAQ methods 3, 4 and 5
+// build are compiled into predictn() and updaten(). The loops over the
+// components are unrolled with the types fixed, so only the arguments, which
+// depend on the block size, are still read from the header.
+static const U8 lrzip_comp5[]={ICM, ISSE, CM, ICM, ISSE, ISSE, ISSE, ISSE,
+  ISSE, ISSE, ISSE, MATCH, ICM, ISSE, ICM, ISSE, ICM, ISSE, MIX, MIX, MIX2,
+  SSE, MIX2};
+static const U8 lrzip_comp4[]={ICM, ISSE, ISSE, ISSE, ISSE, ISSE, MATCH, MIX};
+static const U8 lrzip_comp3[]={ICM, ISSE};
+
+// Does the COMP section hold the n component types in types?
+static bool sameTypes(const U8* cp, const U8* types, int n) {
+  if (cp[-1]!=n) return false;
+  for (int i=0; i<n; ++i) {
+    if (cp[0]!=types[i]) return false;
+    cp+=compsize[cp[0]];
+  }
+  return true;
+}
+#endif
+
 // Initialize the predictor with a new model in z
 void Predictor::init() {
 
+  // Pick the interpreted predictor
+  predictp=&Predictor::predict0;
+  updatep=&Predictor::update0;
+#ifdef NOJIT
+  if (sameTypes(&z.header[7], lrzip_comp5, sizeof(lrzip_comp5)))
+    predictp=&Predictor::predictn<sizeof(lrzip_comp5), lrzip_comp5>,
+    updatep=&Predictor::updaten<sizeof(lrzip_comp5), lrzip_comp5>;
+  else if (sameTypes(&z.header[7], lrzip_comp4, sizeof(lrzip_comp4)))
+    predictp=&Predictor::predictn<sizeof(lrzip_comp4), lrzip_comp4>,
+    updatep=&Predictor::updaten<sizeof(lrzip_comp4), lrzip_comp4>;
+  else if (sameTypes(&z.header[7], lrzip_comp3, sizeof(lrzip_comp3)))
+    predictp=&Predictor::predictn<sizeof(lrzip_comp3), lrzip_comp3>,
+    updatep=&Predictor::updaten<sizeof(lrzip_comp3), lrzip_comp3>;
+#endif
+
   // Clear old JIT code if any
   allocx(pcode, pcode_size, 0);
 
@@ -1862,20 +1899,23 @@ void Predictor::init() {
   }
 }
 
-// Return next bit prediction using interpreted COMP code
-int Predictor::predict0() {
+// Return next bit prediction using interpreted COMP code. With N>0 the
+// model is known to have the N component types in CFG.
+template <int N, const U8* CFG>
+int Predictor::predictn() {
   assert(initTables);
   assert(c8>=1 && c8<=255);
 
   // Predict next bit
-  int n=z.header[6];
+  const int n=N ? N : z.header[6];
   assert(n>0 && n<=255);
   const U8* cp=&z.header[7];
-  assert(cp[-1]==n);
+#pragma GCC unroll 32
   for (int i=0; i<n; ++i) {
     assert(cp>&z.header[0] && cp<&z.header[z.header.isize()-8]);
     Component& cr=comp[i];
-    switch(cp[0]) {
+    const int type=N ? CFG[i] : cp[0];
+    switch(type) {
       case CONS:  // c
         break;
       case CM:  // sizebits limit
@@ -1954,7 +1994,7 @@ int Predictor::predict0() {
       default:
         error("component predict not implemented");
     }
-    cp+=compsize[cp[0]];
+    cp+=compsize[type];
     assert(cp<&z.header[z.cend]);
     assert(p[i]>=-2048 && p[i]<2048);
   }
@@ -1963,7 +2003,8 @@ int Predictor::predict0() {
 }
 
 // Update model with decoded bit y (0...1)
-void Predictor::update0(int y) {
+template <int N, const U8* CFG>
+void Predictor::updaten(int y) {
   assert(initTables);
   assert(y==0 || y==1);
   assert(c8>=1 && c8<=255);
@@ -1971,12 +2012,13 @@ void Predictor::update0(int y) {
 
   // Update components
   const U8* cp=&z.header[7];
-  int n=z.header[6];
+  const int n=N ? N : z.header[6];
   assert(n>=1 && n<=255);
-  assert(cp[-1]==n);
+#pragma GCC unroll 32
   for (int i=0; i<n; ++i) {
     Component& cr=comp[i];
-    switch(cp[0]) {
+    const int type=N ? CFG[i] : cp[0];
+    switch(type) {
       case CONS:  // c
         break;
       case CM:  // sizebits limit
@@ -2057,7 +2099,7 @@ void Predictor::update0(int y) {
       default:
         assert(0);
     }
-    cp+=compsize[cp[0]];
+    cp+=compsize[type];
     assert(cp>=&z.header[7] && cp<&z.header[z.cend] 
            && cp<&z.header[z.header.isize()-8]);
   }
@@ -2077,6 +2119,15 @@ void Predictor::update0(int y) {
     hmap4=(hmap4&0x1f0)|(((hmap4&0xf)*2+y)&0xf);
 }
 
+// Any model
+int Predictor::predict0() {
+  return predictn<0, (const U8*)0>();
+}
+
+void Predictor::update0(int y) {
+  updaten<0, (const U8*)0>(y);
+}
+
 // Find cxt row in hash table ht. ht has rows of 16 indexed by the
 // low sizebits of cxt with element 0 having the next higher 8 bits for
 // collision detection. If not found after 3 adjacent tries, replace the
@@ -4607,7 +4658,7 @@ int Predictor::assemble_p() {
 // Use JIT code starting at pcode[0] if available, or else create it.
 int Predictor::predict() {
 #ifdef NOJIT
-  return predict0();
+  return (this->*predictp)();
 #else
   if (!pcode) {
     allocx(pcode, pcode_size, (z.cend*100+4096)&-4096);
@@ -4628,7 +4679,7 @@ int Predictor::predict() {
 // Use the JIT code starting at pcode[5].
 void Predictor::update(int y) {
 #ifdef NOJIT
-  update0(y);
+  (this->*updatep)(y);
 #else
   assert(pcode && pcode[5]);
   ((void(*)(Predictor*, int))&pcode[5])(this, y);
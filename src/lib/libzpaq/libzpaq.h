@@ -1147,6 +1147,10 @@ private:
   // Modeling support functions
   int predict0();       // default
   void update0(int y);  // default
+  template <int N, const U8* CFG> int predictn();     // for a fixed model
+  template <int N, const U8* CFG> void updaten(int y);
+  int (Predictor::*predictp)();      // predict0 or a predictn
+  void (Predictor::*updatep)(int);   // update0 or an updaten
   int dt2k[256];        // division table for match: dt2k[i] = 2^12/i
   int dt[1024];         // division table for cm: dt[i] = 2^16/(i+1.5)
   U16 squasht[4096];    // squash() lookup table
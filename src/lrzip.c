@@ -48,15 +48,22 @@
 #include <math.h>
 #include <utime.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
 
 #include "rzip.h"
 #include "runzip.h"
 #include "util.h"
 #include "stream.h"
+#include "archive.h"
+#include "lrzip_next.h"
 
 #include "LzmaDec.h" // decode LZMA header for get_info
+/* needed for CRC routines */
+#include "7zCrc.h"
 
-#define MAGIC_LEN (24)
+// progress flag
+bool progress_flag=false;
 
 static void release_hashes(rzip_control *control);
 
@@ -74,6 +81,198 @@ static i64 fdout_seekto(rzip_control *control, i64 pos)
 	return lseek(control->fd_out, pos, SEEK_SET);
 }
 
+#ifndef __APPLE__
+static bool has_token(const char *list, const char *token)
+{
+	size_t len = strlen(token);
+	const char *p;
+
+	for (p = list; (p = strstr(p, token)); p += len)
+		if ((p == list || p[-1] == ',' || p[-1] == ':') &&
+		    (p[len] == ',' || p[len] == ':' || !p[len]))
+			return true;
+	return false;
+}
+
+/* Directory of our cgroup in the cgroup v1 hierarchy of controller, or in
+ * the cgroup v2 one when controller is NULL. Found through the mount point
+ * and our path in /proc/self/cgroup. root is set to the mount point length */
+static bool cgroup_dir(const char *controller, char *dir, size_t len, size_t *root)
+{
+	char line[PATH_MAX + 256], mnt[PATH_MAX], mroot[PATH_MAX], fstype[32],
+	     opts[256], cgpath[PATH_MAX], *sep;
+	bool found = false;
+	size_t rlen;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/cgroup", "r")))
+		return false;
+	/* id:controllers:path, with no controllers in the v2 entry */
+	while (fgets(line, sizeof(line), f)) {
+		if (!(sep = strchr(line, ':')))
+			continue;
+		if (controller ? !has_token(sep + 1, controller) : strncmp(sep, "::", 2))
+			continue;
+		if (!(sep = strchr(sep + 1, ':')))
+			continue;
+		strncpy(cgpath, sep + 1, sizeof(cgpath) - 1);
+		cgpath[sizeof(cgpath) - 1] = '\0';
+		cgpath[strcspn(cgpath, "\n")] = '\0';
+		found = true;
+		break;
+	}
+	fclose(f);
+	if (!found || !(f = fopen("/proc/self/mountinfo", "r")))
+		return false;
+	found = false;
+	while (fgets(line, sizeof(line), f)) {
+		/* id parent dev root mount_point ... - fstype source options */
+		if (!(sep = strstr(line, " - ")) || sscanf(sep + 3, "%31s %*s %255s", fstype, opts) != 2 ||
+		    strcmp(fstype, controller ? "cgroup" : "cgroup2") ||
+		    (controller && !has_token(opts, controller)) ||
+		    sscanf(line, "%*s %*s %*s %4095s %4095s", mroot, mnt) != 2)
+			continue;
+		/* A container usually has its own cgroup mounted as the root */
+		rlen = strcmp(mroot, "/") && !strncmp(cgpath, mroot, strlen(mroot)) ? strlen(mroot) : 0;
+		*root = strlen(mnt);
+		found = snprintf(dir, len, "%s%s", mnt, strcmp(cgpath + rlen, "/") ? cgpath + rlen : "") < (int)len;
+		break;
+	}
+	fclose(f);
+	return found;
+}
+
+static bool read_cgroup_val(const char *dir, const char *name, i64 *val)
+{
+	char path[PATH_MAX + 32];
+	bool ret;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(f = fopen(path, "r")))
+		return false;
+	/* "max" means no limit and does not scan */
+	ret = fscanf(f, "%"PRId64, val) == 1;
+	fclose(f);
+	return ret;
+}
+
+/* Memory limit, usage and reclaimable page cache, for cgroup v2 and v1 */
+static const struct cgroup_mem {
+	const char *controller, *max, *current, *cache;
+} cgroup_mems[] = {
+	{ NULL, "memory.max", "memory.current", "inactive_file" },
+	{ "memory", "memory.limit_in_bytes", "memory.usage_in_bytes", "total_inactive_file" },
+};
+
+/* Tightest memory limit of our cgroup and its parents or, with headroom,
+ * the least room left under one of them, not counting page cache that can
+ * be reclaimed. -1 when no limit applies. */
+static i64 cgroup_ram(bool headroom)
+{
+	char dir[PATH_MAX], path[PATH_MAX + 32], line[256], *slash;
+	i64 best = -1, max, cur, cache;
+	size_t root, i, len;
+	FILE *f;
+
+	for (i = 0; i < sizeof(cgroup_mems) / sizeof(cgroup_mems[0]); i++) {
+		const struct cgroup_mem *m = &cgroup_mems[i];
+
+		if (!cgroup_dir(m->controller, dir, sizeof(dir), &root))
+			continue;
+		len = strlen(m->cache);
+		/* The root cgroup itself is never limited */
+		while (42) {
+			/* v1 shows no limit as a huge number */
+			if (read_cgroup_val(dir, m->max, &max) && max < (1ll << 60)) {
+				if (headroom && read_cgroup_val(dir, m->current, &cur)) {
+					snprintf(path, sizeof(path), "%s/memory.stat", dir);
+					if ((f = fopen(path, "r"))) {
+						while (fgets(line, sizeof(line), f))
+							if (!strncmp(line, m->cache, len) && line[len] == ' ' &&
+							    sscanf(line + len, "%"PRId64, &cache) == 1) {
+								cur -= cache;
+								break;
+							}
+						fclose(f);
+					}
+					max -= MAX(cur, 0);
+				}
+				if (best == -1 || max < best)
+					best = MAX(max, 0);
+			}
+			slash = strrchr(dir, '/');
+			if (!slash || (size_t)(slash - dir) <= root)
+				break;
+			*slash = '\0';
+		}
+	}
+	return best;
+}
+
+/* Tightest cgroup cpu quota of our cgroup and its parents in CPUs, rounded
+ * up, or -1 when there is none */
+static int cgroup_cpus(void)
+{
+	char dir[PATH_MAX], path[PATH_MAX + 32], *slash;
+	i64 quota, period;
+	int best = -1, cpus, v1;
+	size_t root;
+	FILE *f;
+
+	for (v1 = 0; v1 < 2; v1++) {
+		if (!cgroup_dir(v1 ? "cpu" : NULL, dir, sizeof(dir), &root))
+			continue;
+		while (42) {
+			bool got = false;
+
+			if (v1)
+				got = read_cgroup_val(dir, "cpu.cfs_quota_us", &quota) &&
+				      read_cgroup_val(dir, "cpu.cfs_period_us", &period);
+			else {
+				snprintf(path, sizeof(path), "%s/cpu.max", dir);
+				if ((f = fopen(path, "r"))) {
+					/* "max 100000" when unlimited */
+					got = fscanf(f, "%"PRId64" %"PRId64, &quota, &period) == 2;
+					fclose(f);
+				}
+			}
+			if (got && quota > 0 && period > 0) {
+				cpus = (quota + period - 1) / period;
+				if (best == -1 || cpus < best)
+					best = cpus;
+			}
+			slash = strrchr(dir, '/');
+			if (!slash || (size_t)(slash - dir) <= root)
+				break;
+			*slash = '\0';
+		}
+	}
+	return best;
+}
+#endif
+
+/* CPUs we can really use. The online ones, cut down to our affinity mask,
+ * which is also where a cpuset shows, and to any cgroup cpu quota, so that
+ * a container does not run more threads than it gets time for. */
+int get_processors(void)
+{
+	int cpus = PROCESSORS;
+#ifdef CPU_COUNT
+	cpu_set_t set;
+
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+		cpus = MIN(cpus, CPU_COUNT(&set));
+#endif
+#ifndef __APPLE__
+	int quota = cgroup_cpus();
+
+	if (quota > 0)
+		cpus = MIN(cpus, quota);
+#endif
+	return MAX(cpus, 1);
+}
+
 i64 get_ram(rzip_control *control)
 {
 #ifdef __APPLE__
@@ -106,12 +305,48 @@ i64 get_ram(rzip_control *control)
 			fatal_return(("Failed to close /proc/meminfo"), -1);
 		ramsize *= 1024;
 	}
+#endif
+#ifndef __APPLE__
+	/* In a container the cgroup limit is all the ram there is */
+	i64 limit = cgroup_ram(false);
+
+	if (limit > 0 && limit < ramsize)
+		ramsize = limit;
 #endif
 	if (ramsize <= 0)
 		fatal_return(("No memory or can't determine ram? Can't continue.\n"), -1);
 	return ramsize;
 }
 
+/* Ram that can still be taken now without pushing the system into swap or
+ * our cgroup into its limit. MemAvailable counts the page cache that can be
+ * reclaimed along with free pages. Never more than ramsize, which -m may
+ * have set, and ramsize itself where none of this can be read. */
+i64 get_avail_ram(rzip_control *control)
+{
+	i64 avail = -1;
+#ifndef __APPLE__
+	char aux[256];
+	FILE *meminfo;
+	i64 limit;
+
+	if ((meminfo = fopen("/proc/meminfo", "r"))) {
+		while (fgets(aux, sizeof(aux), meminfo))
+			if (sscanf(aux, "MemAvailable: %"PRId64" kB", &avail) == 1) {
+				avail *= 1024;
+				break;
+			}
+		fclose(meminfo);
+	}
+	limit = cgroup_ram(true);
+	if (limit >= 0 && (avail < 0 || limit < avail))
+		avail = limit;
+#endif
+	if (avail < 0)
+		return control->ramsize;
+	return MIN(avail, control->ramsize);
+}
+
 i64 nloops(i64 seconds, uchar *b1, uchar *b2)
 {
 	i64 nloops;
@@ -145,6 +380,19 @@ bool write_magic(rzip_control *control)
 		memcpy(&magic[6], &esize, 8);
 	}
 
+	/* --preset-dict size as a power of 2, 0 when blocks stand alone */
+	if (control->preset_dict)
+		magic[14] = __builtin_ctz(control->preset_dict);
+	/* Matches may point into a --reference file */
+	if (control->reference)
+		magic[15] |= MAGIC_REFERENCE;
+	/* Files of an --archive, listed in the file table */
+	if (control->nfiles)
+		magic[15] |= MAGIC_ARCHIVE;
+	/* Blocks in the order written, see MAGIC_STREAMED */
+	if (STREAMED)
+		magic[15] |= MAGIC_STREAMED;
+
 	magic[16] = 0;
 	if (FILTER_USED) {
 		// high order 5 bits for delta offset - 1, 0-255. Low order 3 bits for filter type 1-7
@@ -155,19 +403,20 @@ bool write_magic(rzip_control *control)
 		magic[16] += control->filter_flag;			// filter flag
 	}
 
-	/* save LZMA compression flags */
-	if (LZMA_COMPRESS) {
+	/* save LZMA compression flags, also when only --stream0 used LZMA */
+	if (LZMA_COMPRESS || control->lzma_prop_set) {
 		int i;
 		for (i = 0; i < 5; i++)
 			magic[i + 17] = (char)control->lzma_properties[i];
 	}
 
-	/* This is a flag that the archive contains an md5 sum at the end
-	 * which can be used as an integrity check instead of crc check.
-	 * crc is still stored for compatibility with 0.5 versions.
+	/* This is a flag that the archive contains an md5 sum, or whichever
+	 * hash type was chosen, at the end which can be used as an integrity
+	 * check instead of crc check. crc is still stored for compatibility
+	 * with 0.5 versions and readers that do not know the hash type.
 	 */
 	if (!NO_MD5)
-		magic[22] = 1;
+		magic[22] = control->hash_type;
 	if (ENCRYPT)
 		magic[23] = 1;
 
@@ -228,6 +477,20 @@ static bool get_magic(rzip_control *control, unsigned char *magic)
 			}
 		}
 	}
+	if (magic[14]) {
+		if (unlikely(magic[14] < __builtin_ctz(PRESET_DICT_MIN) || magic[14] > __builtin_ctz(PRESET_DICT_MAX)))
+			failure_return(("Unknown preset dictionary size 2^%d\n", magic[14]), false);
+		control->preset_dict = 1U << magic[14];
+	} else
+		control->preset_dict = 0;
+	if (unlikely(magic[15] & ~(MAGIC_REFERENCE | MAGIC_ARCHIVE | MAGIC_STREAMED)))
+		failure_return(("Unknown reference type %d\n", magic[15]), false);
+	control->ref_needed = magic[15] & MAGIC_REFERENCE;
+	if (magic[15] & MAGIC_STREAMED)
+		control->flags |= FLAG_STREAMED;
+	else
+		control->flags &= ~FLAG_STREAMED;
+
 	/* restore LZMA compression flags only if stored */
 	if ((int) magic[16+filter_offset]) {
 		for (i = 0; i < 5; i++)
@@ -241,9 +504,10 @@ static bool get_magic(rzip_control *control, unsigned char *magic)
 	/* Whether this archive contains md5 data at the end or not */
 	md5 = magic[21+filter_offset];
 	if (md5 && MD5_RELIABLE) {
-		if (md5 == 1)
+		if (md5 <= HASH_TYPE_MAX) {
 			control->flags |= FLAG_MD5;
-		else
+			control->hash_type = md5;
+		} else
 			print_verbose("Unknown hash, falling back to CRC\n");
 	}
 	encrypted = magic[22+filter_offset];
@@ -376,7 +640,10 @@ bool flush_tmpoutbuf(rzip_control *control)
 {
 	if (!TEST_ONLY) {
 		print_maxverbose("Dumping buffer to physical file.\n");
-		if (STDOUT) {
+		if (control->out_cb) {
+			if (unlikely(!control->out_cb(control->out_data, control->tmp_outbuf, control->out_len)))
+				failure_return(("Output callback failed in flush_tmpoutbuf\n"), false);
+		} else if (STDOUT) {
 			if (unlikely(!fwrite_stdout(control, control->tmp_outbuf, control->out_len)))
 				return false;
 		} else {
@@ -490,23 +757,26 @@ int open_tmpinfile(rzip_control *control)
 static bool read_tmpinmagic(rzip_control *control)
 {
 	char magic[MAGIC_LEN];
-	int i, tmpchar;
 
 	memset(magic, 0, sizeof(magic));
-	for (i = 0; i < 24; i++) {
-		tmpchar = getchar();
-		if (unlikely(tmpchar == EOF))
-			failure_return(("Reached end of file on STDIN prematurely on v05 magic read\n"), false);
-		magic[i] = (char)tmpchar;
+	if (control->in_buffer) {
+		if (unlikely(control->in_buffer_len < MAGIC_LEN))
+			failure_return(("Buffer too short to hold magic\n"), false);
+		memcpy(magic, control->in_buffer, MAGIC_LEN);
+		control->in_buffer_ofs = MAGIC_LEN;
+		return get_magic(control, (unsigned char *)magic);
 	}
+	if (unlikely(read_stdin(control, (uchar *)magic, MAGIC_LEN) != MAGIC_LEN))
+		failure_return(("Reached end of file on STDIN prematurely on v05 magic read\n"), false);
 	return get_magic(control, magic);
 }
 
 /* Read data from stdin into temporary inputfile */
 bool read_tmpinfile(rzip_control *control, int fd_in)
 {
+	uchar buf[65536];
 	FILE *tmpinfp;
-	int tmpchar;
+	i64 len;
 
 	if (fd_in == -1)
 		return false;
@@ -516,8 +786,12 @@ bool read_tmpinfile(rzip_control *control, int fd_in)
 	if (unlikely(tmpinfp == NULL))
 		fatal_return(("Failed to fdopen in tmpfile\n"), false);
 
-	while ((tmpchar = getchar()) != EOF)
-		fputc(tmpchar, tmpinfp);
+	while ((len = read_stdin(control, buf, sizeof(buf))) > 0) {
+		if (unlikely(fwrite(buf, 1, len, tmpinfp) != (size_t)len))
+			fatal_return(("Failed to write tmpfile in read_tmpinfile\n"), false);
+	}
+	if (unlikely(len < 0))
+		fatal_return(("Failed to read stdin in read_tmpinfile\n"), false);
 
 	fflush(tmpinfp);
 	rewind(tmpinfp);
@@ -531,6 +805,16 @@ static bool open_tmpoutbuf(rzip_control *control)
 	i64 maxlen = control->maxram;
 	void *buf;
 
+	/* Under --max-decompress-ram the buffer gets half the budget and a
+	 * chunk that outgrows it goes on through the output file. Output to
+	 * a callback has no file and has to fit */
+	if (control->unzip_ram && (DECOMPRESS || TEST_ONLY) && control->fd_out != -1)
+		maxlen = MIN(maxlen, control->unzip_ram / 2);
+	/* Nothing is gone back to in a --streamable archive, so it only needs
+	 * to be buffered for the writes */
+	if (STREAMED && !(DECOMPRESS || TEST_ONLY))
+		maxlen = STREAMED_OUTBUF;
+
 	while (42) {
 		round_to_page(&maxlen);
 		buf = malloc(maxlen);
@@ -566,6 +850,13 @@ void close_tmpoutbuf(rzip_control *control)
 static bool open_tmpinbuf(rzip_control *control)
 {
 	control->flags |= FLAG_TMP_INBUF;
+	if (control->in_buffer) {
+		/* The caller's buffer is used in place, read_fdin only has
+		 * to move in_len along it */
+		control->tmp_inbuf = (uchar *)control->in_buffer + control->in_buffer_ofs;
+		control->in_maxlen = control->in_buffer_len - control->in_buffer_ofs;
+		return true;
+	}
 	control->in_maxlen = control->maxram;
 	control->tmp_inbuf = malloc(control->maxram + control->page_size);
 	if (unlikely(!control->tmp_inbuf))
@@ -575,6 +866,10 @@ static bool open_tmpinbuf(rzip_control *control)
 
 void clear_tmpinbuf(rzip_control *control)
 {
+	if (control->in_buffer) {
+		control->tmp_inbuf += control->in_len;
+		control->in_maxlen -= control->in_len;
+	}
 	control->in_len = control->in_ofs = 0;
 }
 
@@ -591,6 +886,10 @@ bool clear_tmpinfile(rzip_control *control)
 void close_tmpinbuf(rzip_control *control)
 {
 	control->flags &= ~FLAG_TMP_INBUF;
+	if (control->in_buffer) {
+		control->tmp_inbuf = NULL;
+		return;
+	}
 	dealloc(control->tmp_inbuf);
 	if (!BITS32)
 		control->usable_ram = control->maxram += control->ramsize / 18;
@@ -683,57 +982,83 @@ static void release_hashes(rzip_control *control)
 	dealloc(control->hash);
 }
 
-bool get_header_info(rzip_control *control, int fd_in, uchar *ctype, i64 *c_len,
-		     i64 *u_len, i64 *last_head, int chunk_bytes)
+const char *ctype_name(uchar ctype)
+{
+	switch (ctype) {
+		case CTYPE_NONE:	return "none";
+		case CTYPE_BZIP2:	return "bzip2";
+		case CTYPE_LZO:		return "lzo";
+		case CTYPE_LZMA:	return "lzma";
+		case CTYPE_GZIP:	return "gzip";
+		case CTYPE_ZPAQ:	return "zpaq";
+		case CTYPE_ZSTD:	return "zstd";
+	}
+	return NULL;
+}
+
+/* The headers are read through a window on the archive, so headers that
+ * lie close together, like those of the small blocks at the start of each
+ * chunk, come in with a single pread instead of a seek and a read apiece */
+#define HEAD_WINDOW 65536
+
+struct head_window {
+	int fd;
+	i64 ofs, len;
+	uchar buf[HEAD_WINDOW];
+};
+
+static uchar *window_read(rzip_control *control, struct head_window *hw, i64 ofs, int len)
 {
-	uchar enc_head[25 + SALT_LEN];
+	if (ofs < hw->ofs || ofs + len > hw->ofs + hw->len) {
+		ssize_t ret = pread(hw->fd, hw->buf, HEAD_WINDOW, ofs);
+
+		if (unlikely(ret < len))
+			fatal_return(("Failed to read %d bytes at %lld in window_read\n", len, ofs), NULL);
+		hw->ofs = ofs;
+		hw->len = ret;
+	}
+	return hw->buf + (ofs - hw->ofs);
+}
+
+/* Read the block header at *ofs and leave *ofs just past it */
+static bool get_header_info(rzip_control *control, struct head_window *hw, i64 *ofs, uchar *ctype,
+			    i64 *c_len, i64 *u_len, i64 *last_head, int chunk_bytes)
+{
+	uchar enc_head[25 + SALT_LEN], *p;
+	int read_len, salt_len = ENCRYPT ? SALT_LEN : 0;
+
+	if (control->major_version == 0 && control->minor_version < 4)
+		read_len = 4;
+	else if (control->major_version == 0 && control->minor_version == 5)
+		read_len = 8;
+	else
+		read_len = chunk_bytes;
+	p = window_read(control, hw, *ofs, salt_len + 1 + read_len * 3);
+	if (unlikely(!p))
+		fatal_return(("Failed to read in get_header_info\n"), false);
+	*ofs += salt_len + 1 + read_len * 3;
+
 	if (ENCRYPT) {
 		// read in salt
 		// first 8 bytes, instead of chunk bytes and size
-		if (unlikely(read(fd_in, enc_head, SALT_LEN) != SALT_LEN))
-			fatal_return(("Failed to read encrypted header in get_header_info\n"), false);
+		memcpy(enc_head, p, SALT_LEN);
+		p += SALT_LEN;
 	}
-	if (unlikely(read(fd_in, ctype, 1) != 1))
-		fatal_return(("Failed to read in get_header_info\n"), false);
+	*ctype = *p++;
 
 	*c_len = *u_len = *last_head = 0;
-	if (control->major_version == 0 && control->minor_version < 4) {
-		u32 c_len32, u_len32, last_head32;
-
-		if (unlikely(read(fd_in, &c_len32, 4) != 4))
-			fatal_return(("Failed to read in get_header_info"), false);
-		if (unlikely(read(fd_in, &u_len32, 4) != 4))
-			fatal_return(("Failed to read in get_header_info"), false);
-		if (unlikely(read(fd_in, &last_head32, 4) != 4))
-			fatal_return(("Failed to read in get_header_info"), false);
-		c_len32 = le32toh(c_len32);
-		u_len32 = le32toh(u_len32);
-		last_head32 = le32toh(last_head32);
-		*c_len = c_len32;
-		*u_len = u_len32;
-		*last_head = last_head32;
-	} else {
-		int read_len;
-
-		if (control->major_version == 0 && control->minor_version == 5)
-			read_len = 8;
-		else
-			read_len = chunk_bytes;
-		if (unlikely(read(fd_in, c_len, read_len) != read_len))
-			fatal_return(("Failed to read in get_header_info"), false);
-		if (unlikely(read(fd_in, u_len, read_len) != read_len))
-			fatal_return(("Failed to read in get_header_info"), false);
-		if (unlikely(read(fd_in, last_head, read_len) != read_len))
-			fatal_return(("Failed to read_i64 in get_header_info"), false);
-		*c_len = le64toh(*c_len);
-		*u_len = le64toh(*u_len);
-		*last_head = le64toh(*last_head);
-		if (ENCRYPT) {
-			// decrypt header suppressing printing max verbose message
-			if (unlikely(!decrypt_header(control, enc_head, ctype, c_len, u_len, last_head, LRZ_VALIDATE)))
-				fatal_return(("Failed to decrypt header in get_header_info\n"), false);
-		}
+	memcpy(c_len, p, read_len);
+	memcpy(u_len, p + read_len, read_len);
+	memcpy(last_head, p + read_len * 2, read_len);
+	*c_len = le64toh(*c_len);
+	*u_len = le64toh(*u_len);
+	*last_head = le64toh(*last_head);
+	if (ENCRYPT) {
+		// decrypt header suppressing printing max verbose message
+		if (unlikely(!decrypt_header(control, enc_head, ctype, c_len, u_len, last_head, LRZ_VALIDATE)))
+			fatal_return(("Failed to decrypt header in get_header_info\n"), false);
 	}
+	*ctype &= CTYPE_MASK;
 	return true;
 }
 
@@ -753,19 +1078,91 @@ static double percentage(i64 num, i64 den)
 	return d_num / d_den;
 }
 
+/* Look for the chunk index --index leaves in front of the whole file hash
+ * and load it into control->index. Return the length it takes up in the
+ * archive, 0 when there is none */
+static i64 read_index(rzip_control *control, int fd_in, i64 infile_size)
+{
+	i64 end = infile_size - (HAS_MD5 ? HASH_DIGEST_SIZE : 0), trailer[3], chunks, len, tlen, i, *index;
+
+	if (ENCRYPT || end < MAGIC_LEN + INDEX_TRAILER + INDEX_ENTRY)
+		return 0;
+	if (unlikely(pread(fd_in, trailer, INDEX_TRAILER, end - INDEX_TRAILER) != INDEX_TRAILER))
+		fatal_return(("Failed to read chunk index in read_index\n"), -1);
+	if (memcmp(&trailer[2], INDEX_MAGIC, 8))
+		return 0;
+	chunks = le64toh(trailer[1]);
+	if (chunks < 1 || chunks > (end - MAGIC_LEN - INDEX_TRAILER) / INDEX_ENTRY)
+		failure_return(("Invalid chunk count %lld in index\n", chunks), -1);
+	len = chunks * INDEX_ENTRY + INDEX_TRAILER;
+	index = malloc(chunks * INDEX_ENTRY);
+	if (unlikely(!index))
+		fatal_return(("Failed to malloc chunk index in read_index\n"), -1);
+	if (unlikely(pread(fd_in, index, chunks * INDEX_ENTRY, end - len) != chunks * INDEX_ENTRY)) {
+		dealloc(index);
+		fatal_return(("Failed to read chunk index in read_index\n"), -1);
+	}
+	for (i = 0; i < chunks * 2; i++)
+		index[i] = le64toh(index[i]);
+	/* Offsets have to start at the first chunk and only ever go up */
+	for (i = 0; i < chunks; i++) {
+		if (unlikely(index[i * 2] < (i ? index[i * 2 - 2] + 1 : MAGIC_LEN) || index[i * 2] >= end - len ||
+			     index[i * 2 + 1] < (i ? index[i * 2 - 1] + 1 : 0) || index[i * 2 + 1] >= le64toh(trailer[0]))) {
+			dealloc(index);
+			failure_return(("Invalid entry for chunk %lld in index\n", i + 1), -1);
+		}
+	}
+	dealloc(control->index);
+	control->index = index;
+	control->index_chunks = chunks;
+	control->index_ulen = le64toh(trailer[0]);
+	print_maxverbose("Found index of %lld chunks\n", chunks);
+	/* An --archive keeps its file table in front of the index */
+	tlen = archive_load(control, fd_in, end - len);
+	if (unlikely(tlen == -1))
+		return -1;
+	return len + tlen;
+}
+
+/* Load the file table of an --archive into control->files */
+bool read_file_table(rzip_control *control, const char *name)
+{
+	i64 expected_size;
+	struct stat st;
+	bool ret = false;
+	int fd_in;
+
+	fd_in = open(name, O_RDONLY);
+	if (unlikely(fd_in == -1))
+		fatal_return(("Failed to open %s\n", name), false);
+	if (unlikely(fstat(fd_in, &st)))
+		fatal_goto(("Failed to fstat %s\n", name), out);
+	if (unlikely(!read_magic(control, fd_in, &expected_size)))
+		goto out;
+	if (unlikely(read_index(control, fd_in, st.st_size) == -1))
+		goto out;
+	dealloc(control->index);
+	control->index_chunks = 0;
+	ret = true;
+out:
+	close(fd_in);
+	return ret;
+}
+
 // If Decompressing or Testing, omit printing, just read file and see if valid
 // using construct if (INFO)
 // Encrypted files cannot be checked now
 bool get_fileinfo(rzip_control *control)
 {
-	i64 u_len, c_len, second_last, last_head, utotal = 0, ctotal = 0, ofs, stream_head[2];
-	i64 expected_size, infile_size, chunk_size = 0, chunk_total = 0;
+	i64 u_len, c_len, second_last, last_head, utotal = 0, ctotal = 0, ofs, head_end = 0, stream_head[2];
+	i64 expected_size, infile_size, data_end, chunk_size = 0, chunk_total = 0;
 	int header_length, stream = 0, chunk = 0;
 	char *tmp, *infilecopy = NULL;
 	char chunk_byte = 0;
 	long double cratio;
 	uchar ctype = 0;
-	uchar save_ctype = 255;
+	uchar save_ctype = 255, save_ctype0 = 255, *hp;
+	struct head_window *hw = NULL;
 	struct stat st;
 	int fd_in;
 	CLzmaProps p; // decode lzma header
@@ -798,17 +1195,30 @@ bool get_fileinfo(rzip_control *control)
 		if (unlikely(!get_hash(control, 0)))
 			return false;
 
+	/* Chunks end where the index or the hash begins */
+	data_end = read_index(control, fd_in, infile_size);
+	if (unlikely(data_end == -1))
+		goto error;
+	data_end = infile_size - (HAS_MD5 ? HASH_DIGEST_SIZE : 0) - data_end;
+
+	hw = malloc(sizeof(struct head_window));
+	if (unlikely(!hw))
+		fatal_goto(("Failed to malloc header window in get_fileinfo\n"), error);
+	hw->fd = fd_in;
+	hw->ofs = hw->len = 0;
+
 	if (control->major_version == 0 && control->minor_version > 4) {
-		if (unlikely(read(fd_in, &chunk_byte, 1) != 1))
+		if (unlikely(!(hp = window_read(control, hw, MAGIC_LEN, 2))))
 			fatal_goto(("Failed to read chunk_byte in get_fileinfo\n"), error);
+		chunk_byte = hp[0];
 		if (unlikely(chunk_byte < 1 || chunk_byte > 8))
 			failure_goto(("Invalid chunk bytes %d\n", chunk_byte), error);
 		if (control->major_version == 0 && control->minor_version > 5) {
-			if (unlikely(read(fd_in, &control->eof, 1) != 1))
-				fatal_goto(("Failed to read eof in get_fileinfo\n"), error);
+			control->eof = hp[1];
 			if (!ENCRYPT) {
-				if (unlikely(read(fd_in, &chunk_size, chunk_byte) != chunk_byte))
+				if (unlikely(!(hp = window_read(control, hw, MAGIC_LEN + 2, chunk_byte))))
 					fatal_goto(("Failed to read chunk_size in get_fileinfo\n"), error);
+				memcpy(&chunk_size, hp, chunk_byte);
 				chunk_size = le64toh(chunk_size);
 				if (unlikely(chunk_size < 0))
 					failure_goto(("Invalid chunk size %lld\n", chunk_size), error);
@@ -859,15 +1269,52 @@ next_chunk:
 		else
 			print_verbose("N/A Encrypted File\n");
 	}
-	while (stream < NUM_STREAMS) {
+	if (STREAMED) {
+		/* The blocks of both streams follow one another up to the
+		 * empty header that ends the chunk */
 		int block = 1;
 
-		second_last = 0;
-		if (unlikely(lseek(fd_in, stream_head[stream] + ofs, SEEK_SET) == -1))
-			fatal_goto(("Failed to seek to header data in get_fileinfo\n"), error);
+		if (INFO)
+			print_verbose("Block\tStream\tComp\tPercent\tSize\n");
+		head_end = ofs;
+		while (42) {
+			i64 head_off = head_end;
 
-		if (unlikely(!get_header_info(control, fd_in, &ctype, &c_len, &u_len, &last_head, chunk_byte)))
-			return false;
+			if (unlikely(!get_header_info(control, hw, &head_end, &ctype, &c_len, &u_len,
+					&last_head, chunk_byte)))
+				goto error;
+			if (!last_head)
+				break;
+			stream = last_head - 1;
+			if (unlikely(stream >= NUM_STREAMS || c_len < 0 || u_len < 0))
+				failure_goto(("Invalid block header, likely corrupted archive.\n"), error);
+			if (unlikely(head_end + c_len > data_end))
+				failure_goto(("Offset greater than archive size, likely corrupted/truncated archive.\n"), error);
+			if (unlikely(!ctype_name(ctype)))
+				failure_goto(("Unknown Compression Type: %d\n", ctype), error);
+			if (stream == 0) {
+				if (save_ctype0 == 255 || save_ctype0 == CTYPE_NONE)
+					save_ctype0 = ctype;
+			} else if (save_ctype == 255 || save_ctype == CTYPE_NONE)
+				save_ctype = ctype;
+			utotal += u_len;
+			ctotal += c_len;
+			if (INFO) {
+				print_verbose("%d\t%d\t%s\t%.1f%%\t%lld / %lld", block, stream, ctype_name(ctype),
+					      percentage(c_len, u_len), c_len, u_len);
+				print_maxverbose("\tOffset: %lld", head_off);
+				print_verbose("\n");
+			}
+			head_end += c_len;
+			block++;
+		}
+	} else while (stream < NUM_STREAMS) {
+		int block = 1;
+
+		second_last = 0;
+		head_end = stream_head[stream] + ofs;
+		if (unlikely(!get_header_info(control, hw, &head_end, &ctype, &c_len, &u_len, &last_head, chunk_byte)))
+			goto error;
 
 		if (INFO) {
 			print_verbose("Stream: %d\n", stream);
@@ -888,29 +1335,22 @@ next_chunk:
 					failure_goto(("Offset greater than archive size, likely corrupted/truncated archive.\n"), error);
 			}
 
-			if (unlikely((head_off = lseek(fd_in, last_head + ofs, SEEK_SET)) == -1))
-				fatal_goto(("Failed to seek to header data in get_fileinfo\n"), error);
-			if (unlikely(!get_header_info(control, fd_in, &ctype, &c_len, &u_len,
+			head_end = head_off = last_head + ofs;
+			if (unlikely(!get_header_info(control, hw, &head_end, &ctype, &c_len, &u_len,
 					&last_head, chunk_byte)))
-				return false;
+				goto error;
 			if (unlikely(last_head < 0 || c_len < 0 || u_len < 0))
 				failure_goto(("Entry negative, likely corrupted archive.\n"), error);
 			if (INFO) print_verbose("%d\t", block);
-			if (ctype == CTYPE_NONE) {
-				if (INFO) print_verbose("none");
-			} else if (ctype == CTYPE_BZIP2) {
-				if (INFO) print_verbose("bzip2");
-			} else if (ctype == CTYPE_LZO) {
-				if (INFO) print_verbose("lzo");
-			} else if (ctype == CTYPE_LZMA) {
-				if (INFO) print_verbose("lzma");
-			} else if (ctype == CTYPE_GZIP) {
-				if (INFO) print_verbose("gzip");
-			} else if (ctype == CTYPE_ZPAQ) {
-				if (INFO) print_verbose("zpaq");
-			} else
+			if (unlikely(!ctype_name(ctype)))
 				failure_goto(("Unknown Compression Type: %d\n", ctype), error);
-			if (save_ctype == 255)
+			if (INFO) print_verbose("%s", ctype_name(ctype));
+			/* The summary is taken from the literal stream, the match
+			 * stream may have had its own backend with --stream0 */
+			if (stream == 0) {
+				if (save_ctype0 == 255 || save_ctype0 == CTYPE_NONE)
+					save_ctype0 = ctype;
+			} else if (save_ctype == 255 || save_ctype == CTYPE_NONE)
 				save_ctype = ctype; /* need this for lzma when some chunks could have no compression
 						     * and info will show rzip + none on info display if last chunk
 						     * is not compressed. Adjust for all types in case it's used in
@@ -927,27 +1367,28 @@ next_chunk:
 		++stream;
 	}
 
-	if (unlikely((ofs = lseek(fd_in, c_len, SEEK_CUR)) == -1))
-		fatal_goto(("Failed to lseek c_len in get_fileinfo\n"), error);
+	ofs = head_end + c_len;
 
-	if (ofs >= infile_size - (HAS_MD5 ? MD5_DIGEST_SIZE : 0))
+	if (ofs >= data_end)
 		goto done;
 	else if (ENCRYPT)
-		if (ofs+header_length > infile_size)
+		if (ofs+header_length > data_end)
 			goto done;
 
 	/* Chunk byte entry */
 	if (control->major_version == 0 && control->minor_version > 4 && !ENCRYPT) {
-		if (unlikely(read(fd_in, &chunk_byte, 1) != 1))
+		if (unlikely(!(hp = window_read(control, hw, ofs, 2))))
 			fatal_goto(("Failed to read chunk_byte in get_fileinfo\n"), error);
+		chunk_byte = hp[0];
 		if (unlikely(chunk_byte < 1 || chunk_byte > 8))
 			failure_goto(("Invalid chunk bytes %d\n", chunk_byte), error);
 		ofs++;
 		if (control->major_version == 0 && control->minor_version > 5) {
-			if (unlikely(read(fd_in, &control->eof, 1) != 1))
-				fatal_goto(("Failed to read eof in get_fileinfo\n"), error);
-			if (unlikely(read(fd_in, &chunk_size, chunk_byte) != chunk_byte))
+			control->eof = hp[1];
+			if (unlikely(!(hp = window_read(control, hw, ofs + 1, chunk_byte))))
 				fatal_goto(("Failed to read chunk_size in get_fileinfo\n"), error);
+			chunk_size = 0;
+			memcpy(&chunk_size, hp, chunk_byte);
 			chunk_size = le64toh(chunk_size);
 			if (unlikely(chunk_size < 0))
 				failure_goto(("Invalid chunk size %lld\n", chunk_size), error);
@@ -990,6 +1431,9 @@ done:
 				control->major_version, control->minor_version, ENCRYPT ? "Encrypted " : "");
 
 		print_output("Compression: ");
+		/* Literals that never compressed, the match stream still did */
+		if ((save_ctype == 255 || save_ctype == CTYPE_NONE) && save_ctype0 != 255)
+			save_ctype = save_ctype0;
 		if (save_ctype == CTYPE_NONE)
 			print_output("rzip alone\n");
 		else if (save_ctype == CTYPE_BZIP2)
@@ -1007,8 +1451,16 @@ done:
 			print_output("rzip + gzip\n");
 		else if (save_ctype == CTYPE_ZPAQ)
 			print_output("rzip + zpaq\n");
+		else if (save_ctype == CTYPE_ZSTD)
+			print_output("rzip + zstd\n");
 		else
 			print_output("Dunno wtf\n");
+		if (save_ctype0 != 255 && save_ctype0 != CTYPE_NONE && save_ctype0 != save_ctype)
+			print_output("Match stream: %s\n", ctype_name(save_ctype0));
+		if (control->preset_dict)
+			print_output("LZMA blocks primed with the last %u bytes of their stream\n", control->preset_dict);
+		if (control->ref_needed)
+			print_output("Compressed against a reference file, decompress with --reference\n");
 
 		/* show filter used */
 		if (FILTER_USED) {
@@ -1034,23 +1486,25 @@ done:
 			print_output("Compressed file size: %llu\n", infile_size);
 			print_output("Compression ratio: Unavailable\n");
 		}
+		if (control->index_chunks)
+			print_output("Chunk index: %lld chunks\n", control->index_chunks);
+		if (control->nfiles)
+			archive_list(control);
 	} /* end if (INFO) */
 
 	if (HAS_MD5) {
-		unsigned char md5_stored[MD5_DIGEST_SIZE];
+		unsigned char md5_stored[MAX_DIGEST_SIZE];
 		int i;
 
 		if (INFO) {
-			if (unlikely(lseek(fd_in, -MD5_DIGEST_SIZE, SEEK_END) == -1))
-				fatal_return(("Failed to seek to md5 data in get_fileinfo.\n"), false);
-			if (unlikely(read(fd_in, md5_stored, MD5_DIGEST_SIZE) != MD5_DIGEST_SIZE))
-				fatal_return(("Failed to read md5 data in get_fileinfo.\n"), false);
+			if (unlikely(pread(fd_in, md5_stored, HASH_DIGEST_SIZE, infile_size - HASH_DIGEST_SIZE) != HASH_DIGEST_SIZE))
+				fatal_goto(("Failed to read md5 data in get_fileinfo.\n"), error);
 			if (ENCRYPT)
-				if (unlikely(!lrz_decrypt(control, md5_stored, MD5_DIGEST_SIZE, control->salt_pass, LRZ_DECRYPT)))
-					fatal_return(("Failure decrypting MD5 in get_fileinfo.\n"), false);
-			print_output("MD5 used for integrity testing\n");
-			print_output("MD5: ");
-			for (i = 0; i < MD5_DIGEST_SIZE; i++)
+				if (unlikely(!lrz_decrypt(control, md5_stored, HASH_DIGEST_SIZE, control->salt_pass, LRZ_DECRYPT)))
+					fatal_goto(("Failure decrypting %s in get_fileinfo.\n", HASH_NAME), error);
+			print_output("%s used for integrity testing\n", HASH_NAME);
+			print_output("%s: ", HASH_NAME);
+			for (i = 0; i < HASH_DIGEST_SIZE; i++)
 				print_output("%02x", md5_stored[i]);
 			print_output("\n");
 		}
@@ -1059,11 +1513,15 @@ done:
 	}
 
 out:
+	dealloc(hw);
+	dealloc(control->index);
+	control->index_chunks = 0;
 	if (unlikely(close(fd_in)))
 		fatal_return(("Failed to close fd_in in get_fileinfo\n"), false);
 	dealloc(control->outfile);
 	return true;
 error:
+	dealloc(hw);
 	return false;
 }
 
@@ -1095,7 +1553,7 @@ bool compress_file(rzip_control *control)
         	fd_in = open(control->infile, O_RDONLY);
 			if (unlikely(fd_in == -1))
 				fatal_return(("Failed to open %s\n", control->infile), false);
-	} else
+	} else if (!control->in_buffer && !control->in_cb)
 		fd_in = fileno(control->inFILE);
 
 	if (!STDOUT) {
@@ -1177,7 +1635,7 @@ bool compress_file(rzip_control *control)
 		goto error;
 	}
 
-	if (unlikely(close(fd_in))) {
+	if (unlikely(fd_in != -1 && close(fd_in))) {
 		fatal("Failed to close fd_in\n");
 		fd_in = -1;
 		goto error;
@@ -1202,6 +1660,21 @@ error:
 	return false;
 }
 
+/* Whether the magic header of name says it is an --archive */
+static bool is_archive(const char *name)
+{
+	uchar magic[MAGIC_LEN];
+	int fd = open(name, O_RDONLY);
+	bool ret;
+
+	if (fd == -1)
+		return false;
+	ret = pread(fd, magic, MAGIC_LEN, 0) == MAGIC_LEN && !memcmp(magic, "LRZI", 4) &&
+		(magic[15] & MAGIC_ARCHIVE);
+	close(fd);
+	return ret;
+}
+
 /*
   decompress one file from the command line
 */
@@ -1211,6 +1684,25 @@ bool decompress_file(rzip_control *control)
 	int fd_in, fd_out = -1, fd_hist = -1;
 	i64 expected_size = 0, free_space;
 	struct statvfs fbuf;
+	char *stream = NULL;
+	bool archive = false;
+
+	if (control->extract) {
+		bool done;
+
+		if (unlikely(STDIN || STDOUT || TEST_ONLY))
+			failure_return(("--extract needs an archive file and an output file\n"), false);
+		if (unlikely(!archive_find(control, control->infile, &done)))
+			return false;
+		if (done) {
+			print_progress("Output filename is: %s: [OK] - 0 bytes\n", control->outname);
+			free_archive(control);
+			return true;
+		}
+	}
+
+	if (control->range_len && (STDIN || STDOUT || TEST_ONLY))
+		failure_return(("--range needs an archive file and an output file\n"), false);
 
 	if ( !STDIN ) {
 		struct stat fdin_stat;
@@ -1220,9 +1712,21 @@ bool decompress_file(rzip_control *control)
 		else if (unlikely(!S_ISREG(fdin_stat.st_mode)))
 			failure("lrzip-next only works on regular FILES\n");
 		/* regardless, infilecopy has the input filename */
+		archive = !STDOUT && !TEST_ONLY && !control->range_len && is_archive(infilecopy);
 	}
 
-	if (!STDOUT && !TEST_ONLY) {
+	if (archive) {
+		/* The stream is decompressed next to where its files go, then
+		 * split into them */
+		const char *dir = control->outdir ? control->outdir : "";
+
+		if (unlikely(control->outname))
+			failure_return(("Use -O to choose where an archive is extracted\n"), false);
+		control->outfile = malloc(strlen(dir) + 24);
+		if (unlikely(!control->outfile))
+			fatal_return(("Failed to allocate outfile name\n"), false);
+		sprintf(control->outfile, "%s.lrzip-stream.XXXXXX", dir);
+	} else if (!STDOUT && !TEST_ONLY) {
 		/* if output name already set, use it */
 		if (control->outname)
 			control->outfile = strdup(control->outname);
@@ -1261,8 +1765,9 @@ bool decompress_file(rzip_control *control)
 	}
 
 	if (STDIN) {
-		fd_in = open_tmpinfile(control);
-		read_tmpinmagic(control);
+		fd_in = control->in_buffer ? -1 : open_tmpinfile(control);
+		if (unlikely(!read_tmpinmagic(control)))
+			return false;
 		if (ENCRYPT)
 			failure_return(("Cannot decompress encrypted file from STDIN\n"), false);
 		expected_size = control->st_size;
@@ -1276,7 +1781,17 @@ bool decompress_file(rzip_control *control)
 	}
 	control->fd_in = fd_in;
 
-	if (!(TEST_ONLY | STDOUT)) {
+	if (archive) {
+		fd_out = mkstemp(control->outfile);
+		if (unlikely(fd_out == -1))
+			fatal_return(("Failed to create %s\n", control->outfile), false);
+		/* Validation frees control->outfile */
+		stream = strdupa(control->outfile);
+		register_outfile(control, stream, true);
+		fd_hist = open(control->outfile, O_RDONLY);
+		if (unlikely(fd_hist == -1))
+			fatal_return(("Failed to open history file %s\n", control->outfile), false);
+	} else if (!(TEST_ONLY | STDOUT)) {
 		fd_out = open(control->outfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
 		if (FORCE_REPLACE && (-1 == fd_out) && (EEXIST == errno)) {
 			if (unlikely(unlink(control->outfile)))
@@ -1298,7 +1813,8 @@ bool decompress_file(rzip_control *control)
 			if (unlikely(!preserve_perms(control, fd_in, fd_out)))
 				return false;
 	} else {
-		fd_out = open_tmpoutfile(control);
+		/* Output to a callback has to fit in ram */
+		fd_out = control->out_cb ? -1 : open_tmpoutfile(control);
 		if (fd_out == -1) {
 			fd_hist = -1;
 		} else {
@@ -1311,6 +1827,9 @@ bool decompress_file(rzip_control *control)
 		}
 	}
 
+	control->fd_out = fd_out;
+	control->fd_hist = fd_hist;
+
 // check for STDOUT removed. In memory compression speedup. No memory leak.
 	if (unlikely(!open_tmpoutbuf(control)))
 		return false;
@@ -1339,13 +1858,11 @@ select a larger volume.\n",
 						false);
 		}
 	}
-	control->fd_out = fd_out;
-	control->fd_hist = fd_hist;
 
 	if (NO_MD5)
 		print_verbose("Not performing MD5 hash check\n");
 	if (HAS_MD5)
-		print_verbose("MD5 ");
+		print_verbose("%s ", HASH_NAME);
 	else
 		print_verbose("CRC32 ");
 	print_verbose("being used for integrity testing.\n");
@@ -1354,18 +1871,49 @@ select a larger volume.\n",
 		if (unlikely(!get_hash(control, 0)))
 			return false;
 
-	// vailidate file on decompression or test
-	if (STDIN)
-		print_err("Unable to validate a file from STDIN. To validate, check file directly.");
-	else {
-		print_progress("Validating file for consistency...");
-		if (unlikely((get_fileinfo(control)) == false))
-			failure_return(("File validation failed. Corrupt lrzip archive. Cannot continue\n"),false);
-	}
-	print_progress("Decompressing...");
+	if (control->ref_needed) {
+		if (unlikely(!control->reference))
+			failure_return(("Archive was compressed against a reference file, give the same one with --reference\n"), false);
+		if (unlikely(!map_reference(control)))
+			return false;
+	} else if (control->reference)
+		print_verbose("Archive was not compressed against a reference file, ignoring --reference\n");
+
+	if (control->range_len) {
+		struct stat st;
+
+		/* Only the chunks in range are read so the rest is not validated */
+		if (unlikely(fstat(fd_in, &st)))
+			fatal_return(("Failed to fstat %s\n", infilecopy), false);
+		if (unlikely(read_index(control, fd_in, st.st_size) < 1))
+			failure_return(("No chunk index in %s. Compress with --index to use --range\n", infilecopy), false);
+		print_progress("Extracting range...");
+		if (unlikely(runzip_range(control, fd_in, fd_out, fd_hist) < 0)) {
+			unmap_reference(control);
+			return false;
+		}
+		expected_size = control->range_len;
+		dealloc(control->index);
+		control->index_chunks = 0;
+	} else {
+		// vailidate file on decompression or test
+		if (STDIN) {
+			/* compress_buffer and lrz_stream callers have no file to check */
+			if (!control->in_buffer && !control->in_cb)
+				print_err("Unable to validate a file from STDIN. To validate, check file directly.");
+		} else {
+			print_progress("Validating file for consistency...");
+			if (unlikely((get_fileinfo(control)) == false))
+				failure_return(("File validation failed. Corrupt lrzip archive. Cannot continue\n"),false);
+		}
+		print_progress("Decompressing...");
 
-	if (unlikely(runzip_fd(control, fd_in, fd_out, fd_hist, expected_size) < 0))
-		return false;
+		if (unlikely(runzip_fd(control, fd_in, fd_out, fd_hist, expected_size) < 0)) {
+			unmap_reference(control);
+			return false;
+		}
+	}
+	unmap_reference(control);
 
 	if (STDOUT && !TMP_OUTBUF) {
 		if (unlikely(!dump_tmpoutfile(control, fd_out)))
@@ -1374,7 +1922,7 @@ select a larger volume.\n",
 
 	/* if we get here, no fatal_return(( errors during decompression */
 	print_progress("\r");
-	if (!(STDOUT | TEST_ONLY))
+	if (!(STDOUT | TEST_ONLY) && !archive)
 		print_progress("Output filename is: %s: ", control->outfile);
 	if (!expected_size)
 		expected_size = control->st_size;
@@ -1390,8 +1938,21 @@ select a larger volume.\n",
 		if (unlikely(close(fd_hist) || close(fd_out)))
 			fatal_return(("Failed to close files\n"), false);
 
-	if (unlikely(!STDIN && !STDOUT && !TEST_ONLY && !preserve_times(control, fd_in)))
+	if (archive) {
+		bool ret = archive_extract(control, stream);
+
+		register_outfile(control, NULL, false);
+		if (unlikely(unlink(stream)))
+			fatal_return(("Failed to unlink %s\n", stream), false);
+		free_archive(control);
+		if (unlikely(!ret))
+			return false;
+	} else if (unlikely(!STDIN && !STDOUT && !TEST_ONLY && !preserve_times(control, fd_in)))
 		return false;
+	if (control->extract) {
+		archive_attrs(control, control->outfile);
+		free_archive(control);
+	}
 
 	if ( !STDIN )
 		close(fd_in);
@@ -1407,6 +1968,442 @@ select a larger volume.\n",
 	return true;
 }
 
+/* Move an archive to the backend of the command line, see transcode_fd. The
+ * filter, block and --index options come from the command line too, the
+ * rest from the archive: its chunks and their streams, the hash, the file
+ * table of an --archive and whether it needs its --reference. Without -o or
+ * -O the archive is replaced once the new one is complete */
+bool transcode_file(rzip_control *control)
+{
+	char *tmp, *infilecopy;
+	uchar header[MAGIC_LEN], hash[MAX_DIGEST_SIZE];
+	i64 expected_size, index_len, total, ofs;
+	int fd_in, fd_out = -1;
+	rzip_control out;
+	struct stat st;
+	bool replace;
+
+	if (unlikely(STDIN || STDOUT))
+		failure_return(("--transcode needs an archive file and an output file\n"), false);
+	infilecopy = strdupa(control->infile);
+	fd_in = open(infilecopy, O_RDONLY);
+	if (unlikely(fd_in == -1))
+		fatal_return(("Failed to open %s\n", infilecopy), false);
+	if (unlikely(fstat(fd_in, &st)))
+		fatal_goto(("Failed to fstat %s\n", infilecopy), error);
+	control->fd_in = fd_in;
+
+	/* The new archive is set up as asked before the magic of this one
+	 * changes control. Each side has stream threads of its own */
+	memcpy(&out, control, sizeof(rzip_control));
+	out.sctx = NULL;
+
+	if (unlikely(!read_magic(control, fd_in, &expected_size)))
+		goto error;
+	if (unlikely(ENCRYPT))
+		failure_goto(("Cannot --transcode an encrypted archive\n"), error);
+	if (unlikely(control->major_version == 0 && control->minor_version < 6))
+		failure_goto(("Cannot --transcode an archive older than version 0.6\n"), error);
+	/* The offsets of the index are redone, the file table is kept */
+	index_len = read_index(control, fd_in, st.st_size);
+	if (unlikely(index_len == -1))
+		goto error;
+	dealloc(control->index);
+	control->index_chunks = 0;
+	if (index_len)
+		out.flags |= FLAG_INDEX;
+	out.files = control->files;
+	out.nfiles = control->nfiles;
+	out.flags &= ~(FLAG_MD5 | FLAG_HASH);
+	out.flags |= control->flags & FLAG_MD5;
+	out.hash_type = control->hash_type;
+	out.st_size = expected_size;
+	/* Matches still point into the same reference, only that there is
+	 * one goes in the magic */
+	out.reference = control->ref_needed ? infilecopy : NULL;
+
+	replace = !control->outname && !control->outdir;
+	if (control->outname)
+		control->outfile = strdup(control->outname);
+	else if (control->outdir) {
+		tmp = strrchr(infilecopy, '/');
+		tmp = tmp ? tmp + 1 : infilecopy;
+		control->outfile = malloc(strlen(control->outdir) + strlen(tmp) + 1);
+		if (control->outfile) {
+			strcpy(control->outfile, control->outdir);
+			strcat(control->outfile, tmp);
+		}
+	} else {
+		/* Written next to the archive it replaces */
+		control->outfile = malloc(strlen(infilecopy) + 8);
+		if (control->outfile)
+			sprintf(control->outfile, "%s.XXXXXX", infilecopy);
+	}
+	if (unlikely(!control->outfile))
+		fatal_goto(("Failed to allocate outfile name\n"), error);
+	if (unlikely(!replace && !strcmp(control->outfile, infilecopy))) {
+		control->flags |= FLAG_KEEP_BROKEN;
+		failure_goto(("Output and Input files are the same, leave out -o to replace it\n"), error);
+	}
+
+	if (replace)
+		fd_out = mkstemp(control->outfile);
+	else {
+		print_progress("Output filename is: %s\n", control->outfile);
+		fd_out = open(control->outfile, O_RDWR | O_CREAT | O_EXCL, 0666);
+		if (FORCE_REPLACE && (-1 == fd_out) && (EEXIST == errno)) {
+			if (unlikely(unlink(control->outfile)))
+				fatal_goto(("Failed to unlink an existing file: %s\n", control->outfile), error);
+			fd_out = open(control->outfile, O_RDWR | O_CREAT | O_EXCL, 0666);
+		}
+	}
+	if (unlikely(fd_out == -1)) {
+		/* We must ensure we don't delete a file that already
+		 * exists just because we tried to create a new one */
+		control->flags |= FLAG_KEEP_BROKEN;
+		fatal_goto(("Failed to create %s\n", control->outfile), error);
+	}
+	if (unlikely(!preserve_perms(control, fd_in, fd_out)))
+		goto error;
+	control->fd_out = out.fd_out = fd_out;
+	out.outfile = control->outfile;
+	init_mutex(control, &out.control_lock);
+	out.index_chunks = out.index_ulen = 0;
+
+	/* The magic goes in last, once the backend has set it */
+	memset(header, 0, sizeof(header));
+	if (unlikely(write(fd_out, header, sizeof(header)) != sizeof(header)))
+		fatal_goto(("Cannot write file header\n"), error);
+
+	print_progress("Transcoding...\r");
+	total = transcode_fd(control, &out, fd_in, st.st_size);
+	if (unlikely(total < 0))
+		goto error;
+
+	/* Only the file table, the old index and the hash may be left */
+	ofs = lseek(fd_in, 0, SEEK_CUR);
+	if (unlikely(ofs + index_len + (HAS_MD5 ? HASH_DIGEST_SIZE : 0) != st.st_size))
+		failure_goto(("Unexpected %lld bytes after the last chunk of %s\n",
+			      st.st_size - ofs - index_len, infilecopy), error);
+	if (out.flags & FLAG_INDEX) {
+		if (unlikely(!write_index(&out)))
+			goto error;
+		dealloc(out.index);
+	}
+	if (HAS_MD5) {
+		if (unlikely(pread(fd_in, hash, HASH_DIGEST_SIZE, st.st_size - HASH_DIGEST_SIZE) != HASH_DIGEST_SIZE))
+			fatal_goto(("Failed to read %s in transcode_file\n", HASH_NAME), error);
+		if (unlikely(write_1g(&out, hash, HASH_DIGEST_SIZE) != HASH_DIGEST_SIZE))
+			fatal_goto(("Failed to write %s in transcode_file\n", HASH_NAME), error);
+	}
+	if (unlikely(!write_magic(&out) || !preserve_times(control, fd_in)))
+		goto error;
+	if (unlikely(fstat(fd_out, &st)))
+		fatal_goto(("Failed to fstat %s\n", control->outfile), error);
+	if (unlikely(close(fd_out)))
+		fatal_goto(("Failed to close %s\n", control->outfile), error);
+	fd_out = -1;
+	close(fd_in);
+	fd_in = -1;
+
+	if (replace) {
+		if (unlikely(rename(control->outfile, infilecopy)))
+			fatal_goto(("Failed to replace %s\n", infilecopy), error);
+	} else if (!KEEP_FILES) {
+		if (unlikely(unlink(infilecopy)))
+			fatal_goto(("Failed to unlink %s\n", infilecopy), error);
+	}
+	print_progress("%s - transcoded %lld bytes to %lld bytes\n", infilecopy, total, (i64)st.st_size);
+
+	free_stream_ctx(&out);
+	free_archive(control);
+	dealloc(control->outfile);
+	return true;
+error:
+	if (fd_in != -1)
+		close(fd_in);
+	if (fd_out != -1)
+		close(fd_out);
+	return false;
+}
+
+/* Run compress_file or decompress_file over len bytes at buf instead of
+ * stdin, handing the output to out_cb as it is flushed instead of writing
+ * it to stdout. Nothing goes through a file, so the output of a chunk has
+ * to fit in ram. out_cb returns false to abort. */
+static bool run_buffer(rzip_control *control, const uchar *buf, i64 len,
+		       bool (*out_cb)(void *data, const uchar *buf, i64 len), void *data, bool decompress)
+{
+	rzip_control run;
+	bool ret;
+
+	if (unlikely(!buf || len < 0 || !out_cb))
+		failure_return(("Invalid buffer passed to %scompress_buffer\n", decompress ? "de" : ""), false);
+	/* Each call runs on a copy, as main does for each file, so what a run
+	 * changes in it does not leak into the next one. Only the stream
+	 * threads are kept in control for the next call. */
+	memcpy(&run, control, sizeof(rzip_control));
+	run.flags |= FLAG_STDIN | FLAG_STDOUT;
+	if (decompress)
+		run.flags |= FLAG_DECOMPRESS;
+	run.in_buffer = buf;
+	run.in_buffer_len = len;
+	run.in_buffer_ofs = 0;
+	run.out_cb = out_cb;
+	run.out_data = data;
+	ret = decompress ? decompress_file(&run) : compress_file(&run);
+	keep_stream_ctx(control, &run);
+	return ret;
+}
+
+bool compress_buffer(rzip_control *control, const uchar *buf, i64 len,
+		     bool (*out_cb)(void *data, const uchar *buf, i64 len), void *data)
+{
+	return run_buffer(control, buf, len, out_cb, data, false);
+}
+
+bool decompress_buffer(rzip_control *control, const uchar *buf, i64 len,
+		       bool (*out_cb)(void *data, const uchar *buf, i64 len), void *data)
+{
+	return run_buffer(control, buf, len, out_cb, data, true);
+}
+
+/* Bytes kept between the caller of an lrz_stream and its run, each way */
+#define STREAM_RING	(16 * 1024 * 1024)
+
+struct stream_ring {
+	uchar *buf;
+	i64 head, len;
+	bool closed;	/* Nothing more goes in */
+};
+
+/* compress_file or decompress_file running in a thread of its own, reading
+ * what lrz_stream_feed puts in the in ring and handing its output to the out
+ * ring for lrz_stream_read. Either side waits while its ring is full or
+ * empty, which is all the buffering there is. */
+struct lrz_stream {
+	rzip_control run;
+	rzip_control *control;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct stream_ring in, out;
+	i64 fed, taken;		/* Input bytes put in and read by the run */
+	i64 flush_at;		/* Input the pending flush ends a chunk at */
+	bool flush;
+	bool decompress;
+	bool done, ret;
+};
+
+/* Copy len bytes into r, waiting for room. Fails once r is closed */
+static bool ring_put(struct lrz_stream *ls, struct stream_ring *r, const uchar *buf, i64 len)
+{
+	rzip_control *control = ls->control;
+	i64 tail, n;
+
+	lock_mutex(control, &ls->lock);
+	while (len) {
+		while (r->len == STREAM_RING && !r->closed)
+			cond_wait(control, &ls->cond, &ls->lock);
+		if (unlikely(r->closed)) {
+			unlock_mutex(control, &ls->lock);
+			return false;
+		}
+		tail = (r->head + r->len) % STREAM_RING;
+		n = MIN(len, MIN(STREAM_RING - r->len, STREAM_RING - tail));
+		memcpy(r->buf + tail, buf, n);
+		r->len += n;
+		if (r == &ls->in)
+			ls->fed += n;
+		buf += n;
+		len -= n;
+		cond_broadcast(control, &ls->cond);
+	}
+	return unlock_mutex(control, &ls->lock);
+}
+
+/* Copy out what r holds, up to len, once it holds anything. A NULL buf
+ * drops it */
+static i64 ring_get(struct lrz_stream *ls, struct stream_ring *r, uchar *buf, i64 len)
+{
+	i64 n = MIN(len, MIN(r->len, STREAM_RING - r->head));
+
+	if (buf)
+		memcpy(buf, r->buf + r->head, n);
+	r->head = (r->head + n) % STREAM_RING;
+	r->len -= n;
+	cond_broadcast(ls->control, &ls->cond);
+	return n;
+}
+
+/* in_cb of the run. Returns 0 with chunk_end set where a flush was asked */
+static i64 stream_in(void *data, uchar *buf, i64 len, bool *chunk_end)
+{
+	struct lrz_stream *ls = data;
+	rzip_control *control = ls->control;
+	i64 n;
+
+	lock_mutex(control, &ls->lock);
+	while (!ls->in.len && !ls->in.closed && !(ls->flush && ls->taken == ls->flush_at))
+		cond_wait(control, &ls->cond, &ls->lock);
+	if (ls->flush && ls->taken == ls->flush_at) {
+		ls->flush = false;
+		if (chunk_end)
+			*chunk_end = true;
+		unlock_mutex(control, &ls->lock);
+		return 0;
+	}
+	if (ls->flush)
+		len = MIN(len, ls->flush_at - ls->taken);
+	n = ring_get(ls, &ls->in, buf, len);
+	ls->taken += n;
+	unlock_mutex(control, &ls->lock);
+	return n;
+}
+
+/* out_cb of the run */
+static bool stream_out(void *data, const uchar *buf, i64 len)
+{
+	return ring_put(data, &((struct lrz_stream *)data)->out, buf, len);
+}
+
+static void *stream_thread(void *data)
+{
+	struct lrz_stream *ls = data;
+	rzip_control *run = &ls->run;
+	bool ret;
+
+	ret = ls->decompress ? decompress_file(run) : compress_file(run);
+	lock_mutex(ls->control, &ls->lock);
+	ls->ret = ret;
+	ls->done = ls->in.closed = ls->out.closed = true;
+	cond_broadcast(ls->control, &ls->cond);
+	unlock_mutex(ls->control, &ls->lock);
+	return NULL;
+}
+
+static struct lrz_stream *stream_init(rzip_control *control, bool decompress)
+{
+	struct lrz_stream *ls = calloc(sizeof(struct lrz_stream), 1);
+
+	if (unlikely(!ls))
+		fatal_return(("Failed to calloc lrz_stream\n"), NULL);
+	ls->in.buf = malloc(STREAM_RING);
+	ls->out.buf = malloc(STREAM_RING);
+	if (unlikely(!ls->in.buf || !ls->out.buf))
+		fatal_goto(("Failed to malloc lrz_stream rings\n"), error);
+	if (unlikely(!init_mutex(control, &ls->lock)))
+		goto error;
+	pthread_cond_init(&ls->cond, NULL);
+	ls->control = control;
+	ls->decompress = decompress;
+
+	/* The run works on a copy as compress_buffer does */
+	memcpy(&ls->run, control, sizeof(rzip_control));
+	ls->run.flags |= FLAG_STDIN | FLAG_STDOUT;
+	if (decompress)
+		ls->run.flags |= FLAG_DECOMPRESS;
+	ls->run.in_cb = stream_in;
+	ls->run.in_data = ls;
+	ls->run.out_cb = stream_out;
+	ls->run.out_data = ls;
+	if (unlikely(!create_pthread(control, &ls->thread, NULL, stream_thread, ls))) {
+		pthread_mutex_destroy(&ls->lock);
+		pthread_cond_destroy(&ls->cond);
+		goto error;
+	}
+	return ls;
+error:
+	dealloc(ls->in.buf);
+	dealloc(ls->out.buf);
+	dealloc(ls);
+	return NULL;
+}
+
+struct lrz_stream *compress_stream_init(rzip_control *control)
+{
+	return stream_init(control, false);
+}
+
+struct lrz_stream *decompress_stream_init(rzip_control *control)
+{
+	return stream_init(control, true);
+}
+
+/* Hand len bytes of input to the run, waiting while the in ring is full.
+ * The run only makes room again as output is read, so the two are best
+ * driven from different threads. Fails once the run is over */
+bool lrz_stream_feed(struct lrz_stream *ls, const uchar *buf, i64 len)
+{
+	return ring_put(ls, &ls->in, buf, len);
+}
+
+/* End the chunk being compressed with the input fed so far, so its output
+ * can be read without waiting for more. Chunks cut short compress less
+ * well, and decompression has nothing to flush */
+bool lrz_stream_flush(struct lrz_stream *ls)
+{
+	rzip_control *control = ls->control;
+
+	if (ls->decompress)
+		return true;
+	lock_mutex(control, &ls->lock);
+	ls->flush_at = ls->fed;
+	ls->flush = ls->fed > ls->taken || ls->flush;
+	cond_broadcast(control, &ls->cond);
+	return unlock_mutex(control, &ls->lock);
+}
+
+/* No more input follows */
+bool lrz_stream_finish(struct lrz_stream *ls)
+{
+	rzip_control *control = ls->control;
+
+	lock_mutex(control, &ls->lock);
+	ls->in.closed = true;
+	cond_broadcast(control, &ls->cond);
+	return unlock_mutex(control, &ls->lock);
+}
+
+/* Read up to len bytes of output, waiting until there are some. Returns 0
+ * once the run is over and everything has been read, -1 if it failed */
+i64 lrz_stream_read(struct lrz_stream *ls, uchar *buf, i64 len)
+{
+	rzip_control *control = ls->control;
+	i64 n = 0;
+
+	lock_mutex(control, &ls->lock);
+	while (!ls->out.len && !ls->done)
+		cond_wait(control, &ls->cond, &ls->lock);
+	if (ls->out.len)
+		n = ring_get(ls, &ls->out, buf, len);
+	else if (!ls->ret)
+		n = -1;
+	unlock_mutex(control, &ls->lock);
+	return n;
+}
+
+/* Finish the input if that was not done, wait for the run and free ls.
+ * Output not read by now is dropped. Returns whether the run succeeded */
+bool lrz_stream_end(struct lrz_stream *ls)
+{
+	rzip_control *control = ls->control;
+	bool ret;
+
+	if (unlikely(!lrz_stream_finish(ls)))
+		return false;
+	while (lrz_stream_read(ls, NULL, STREAM_RING) > 0)
+		;
+	join_pthread(control, ls->thread, NULL);
+	ret = ls->ret;
+	keep_stream_ctx(control, &ls->run);
+	pthread_mutex_destroy(&ls->lock);
+	pthread_cond_destroy(&ls->cond);
+	dealloc(ls->in.buf);
+	dealloc(ls->out.buf);
+	dealloc(ls);
+	return ret;
+}
 
 bool initialise_control(rzip_control *control)
 {
@@ -1414,6 +2411,8 @@ bool initialise_control(rzip_control *control)
 	char localeptr[] = "./", *eptr; 	/* for environment */
 	size_t len;
 
+	/* The CRC table is filled in here for library callers too */
+	CrcGenerateTable();
 	memset(control, 0, sizeof(rzip_control));
 	control->msgout = stderr;
 	control->msgerr = stderr;
@@ -1426,8 +2425,11 @@ bool initialise_control(rzip_control *control)
 	control->dictSize = 0;			/* Dictionary Size for lzma. 0 means program decides */
 	control->ramsize = get_ram(control);	/* if something goes wrong, exit from get_ram */
 	control->threshold = 100;		/* default for no threshold limiting */
+	control->adaptive = ADAPTIVE_TARGET;
+	control->hash_type = HASH_TYPE_MD5;	/* hash stored for integrity testing */
+	control->sync_mode = SYNC_BACKGROUND;	/* start writeback after each block */
 	/* for testing single CPU */
-	control->threads = PROCESSORS;		/* get CPUs for LZMA */
+	control->threads = get_processors();	/* get CPUs for LZMA */
 	control->page_size = PAGE_SIZE;
 	control->nice_val = 19;
 
@@ -1471,3 +2473,88 @@ bool initialise_control(rzip_control *control)
 	}
 	return true;
 }
+
+/* Options that depend on the backend and level, as main sets them up */
+static void setup_method(rzip_control *control)
+{
+	/* lz4 testing is only for the slower backends */
+	if (ZLIB_COMPRESS || LZO_COMPRESS || NO_COMPRESS)
+		control->flags &= ~FLAG_THRESHOLD;
+	else
+		control->flags |= FLAG_THRESHOLD;
+	control->rzip_compression_level = control->compression_level;
+	control->dictSize = 0;
+	setup_overhead(control);
+	setup_ram(control);
+}
+
+rzip_control *lrzip_new(void)
+{
+	rzip_control *control = malloc(sizeof(rzip_control));
+
+	if (unlikely(!control))
+		return NULL;
+	if (unlikely(!initialise_control(control))) {
+		dealloc(control);
+		return NULL;
+	}
+	control->flags &= ~FLAG_SHOW_PROGRESS;
+	control->msgout = NULL;
+	setup_method(control);
+	return control;
+}
+
+void lrzip_free(rzip_control *control)
+{
+	if (!control)
+		return;
+	free_stream_ctx(control);
+	dealloc(control->tmpdir);
+	dealloc(control);
+}
+
+bool lrzip_set_method(rzip_control *control, const char *method, int level)
+{
+	static const struct {
+		const char *name;
+		i64 flag;
+	} methods[] = {
+		{ "lzma", 0 },
+		{ "zstd", FLAG_ZSTD_COMPRESS },
+		{ "zpaq", FLAG_ZPAQ_COMPRESS },
+		{ "bzip2", FLAG_BZIP2_COMPRESS },
+		{ "gzip", FLAG_ZLIB_COMPRESS },
+		{ "lzo", FLAG_LZO_COMPRESS },
+		{ "none", FLAG_NO_COMPRESS },
+	};
+	unsigned i;
+
+	if (unlikely(level < 1 || level > 9)) {
+		print_err("Level %d is not from 1 to 9\n", level);
+		return false;
+	}
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (!strcmp(method, methods[i].name))
+			break;
+	}
+	if (unlikely(i == sizeof(methods) / sizeof(methods[0]))) {
+		print_err("Unknown compression method %s\n", method);
+		return false;
+	}
+	control->flags &= ~FLAG_NOT_LZMA;
+	control->flags |= methods[i].flag;
+	control->compression_level = level;
+	setup_method(control);
+	return true;
+}
+
+bool lrzip_set_threads(rzip_control *control, int threads)
+{
+	if (unlikely(threads < 1)) {
+		print_err("Threads must be at least 1\n");
+		return false;
+	}
+	control->threads = threads;
+	setup_method(control);
+	return true;
+}
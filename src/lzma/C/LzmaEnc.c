@@ -329,6 +329,7 @@ typedef struct
   // BoolInt _maxMode;
 
   UInt64 nowPos64;
+  UInt32 primeLen; /* bytes in front of the input that only fill the dictionary */
   
   unsigned matchPriceCount;
   // unsigned alignPriceCount;
@@ -2202,6 +2203,7 @@ void LzmaEnc_Construct(CLzmaEnc *p)
 {
   RangeEnc_Construct(&p->rc);
   MatchFinder_Construct(&p->matchFinderBase);
+  p->primeLen = 0;
   
   #ifndef _7ZIP_ST
   MatchFinderMt_Construct(&p->matchFinderMt);
@@ -2265,6 +2267,8 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, UInt32 maxPackSize, UInt32 maxUnpa
   if (p->needInit)
   {
     p->matchFinder.Init(p->matchFinderObj);
+    if (p->primeLen)
+      p->matchFinder.Skip(p->matchFinderObj, p->primeLen);
     p->needInit = 0;
   }
 
@@ -2275,7 +2279,10 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, UInt32 maxPackSize, UInt32 maxUnpa
   nowPos32 = (UInt32)p->nowPos64;
   startPos32 = nowPos32;
 
-  if (p->nowPos64 == 0)
+  /* A primed stream has a previous byte, so its first literal is coded
+     like every other one, which is what the decoder does with a preset
+     dictionary */
+  if (p->nowPos64 == 0 && !p->primeLen)
   {
     unsigned numPairs;
     Byte curByte;
@@ -2942,7 +2949,7 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte
   if (res == SZ_OK)
   {
     res = LzmaEnc_Encode2(p, progress);
-    if (res == SZ_OK && p->nowPos64 != srcLen)
+    if (res == SZ_OK && p->nowPos64 + p->primeLen != srcLen)
       res = SZ_ERROR_FAIL;
   }
 
@@ -2974,3 +2981,27 @@ SRes LzmaEncode(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
   LzmaEnc_Destroy(p, alloc, allocBig);
   return res;
 }
+
+
+SRes LzmaEncodePrimed(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen, SizeT primeLen,
+    const CLzmaEncProps *props, Byte *propsEncoded, SizeT *propsSize, int writeEndMark,
+    ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig)
+{
+  CLzmaEnc *p = (CLzmaEnc *)LzmaEnc_Create(alloc);
+  SRes res;
+  if (!p)
+    return SZ_ERROR_MEM;
+
+  res = LzmaEnc_SetProps(p, props);
+  if (res == SZ_OK)
+  {
+    res = LzmaEnc_WriteProperties(p, propsEncoded, propsSize);
+    p->primeLen = (UInt32)primeLen;
+    if (res == SZ_OK)
+      res = LzmaEnc_MemEncode(p, dest, destLen, src - primeLen, srcLen + primeLen,
+          writeEndMark, progress, alloc, allocBig);
+  }
+
+  LzmaEnc_Destroy(p, alloc, allocBig);
+  return res;
+}
@@ -31,6 +31,24 @@ MY_STDAPI LzmaCompress(unsigned char *dest, size_t *destLen, const unsigned char
       NULL, &g_Alloc, &g_BigAlloc);
 }
 
+MY_STDAPI LzmaCompressPrimed(unsigned char *dest, size_t *destLen, const unsigned char *src, size_t srcLen,
+  size_t primeLen, unsigned char *outProps, size_t *outPropsSize,
+  int level, unsigned dictSize, int lc, int lp, int pb, int fb, int numThreads)
+{
+  CLzmaEncProps props;
+  LzmaEncProps_Init(&props);
+  props.level = level;
+  props.dictSize = dictSize;
+  props.lc = lc;
+  props.lp = lp;
+  props.pb = pb;
+  props.fb = fb;
+  props.numThreads = numThreads;
+
+  return LzmaEncodePrimed(dest, destLen, src, srcLen, primeLen, &props, outProps, outPropsSize, 0,
+      NULL, &g_Alloc, &g_BigAlloc);
+}
+
 
 MY_STDAPI LzmaUncompress(unsigned char *dest, size_t *destLen, const unsigned char *src, size_t *srcLen,
   const unsigned char *props, size_t propsSize)
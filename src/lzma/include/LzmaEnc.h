@@ -71,6 +71,13 @@ SRes LzmaEncode(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     const CLzmaEncProps *props, Byte *propsEncoded, SizeT *propsSize, int writeEndMark,
     ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
 
+/* As LzmaEncode, with the primeLen bytes in front of src loaded into the
+   dictionary first. They are not encoded. The decoder must be given the
+   same bytes as its dictionary before the start of the data */
+SRes LzmaEncodePrimed(Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen, SizeT primeLen,
+    const CLzmaEncProps *props, Byte *propsEncoded, SizeT *propsSize, int writeEndMark,
+    ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
+
 EXTERN_C_END
 
 #endif
@@ -104,6 +104,18 @@ MY_STDAPI LzmaCompress(unsigned char *dest, size_t *destLen, const unsigned char
   int numThreads /* 1 or 2, default = 2 */
   );
 
+/*
+LzmaCompressPrimed
+------------------
+As LzmaCompress, but the primeLen bytes in front of src are loaded into the
+dictionary first, so the data can refer back to them. The decoder has to
+preset its dictionary with the same bytes.
+*/
+
+MY_STDAPI LzmaCompressPrimed(unsigned char *dest, size_t *destLen, const unsigned char *src, size_t srcLen,
+  size_t primeLen, unsigned char *outProps, size_t *outPropsSize,
+  int level, unsigned dictSize, int lc, int lp, int pb, int fb, int numThreads);
+
 /*
 LzmaUncompress
 --------------
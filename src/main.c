@@ -57,18 +57,33 @@
 #include "lrzip_core.h"
 #include "util.h"
 #include "stream.h"
+#include "archive.h"
+#include "remote.h"
 #include <inttypes.h>
 
-/* needed for CRC routines */
-#include "7zCrc.h"
-
 #define MAX_PATH_LEN 4096
 
-// progress flag
-bool progress_flag=false;
-
 static rzip_control base_control, local_control, *control;
 
+/* --profile counters, fresh for each file */
+static struct lrz_stats profile;
+static bool profile_json;
+
+/* --jobs: files run at once, each by a worker with its own control. The
+ * threads and ram of the run are shared out as files start, and the stream
+ * threads of a worker go on to its next file */
+static struct batch {
+	int jobs;
+	char **files;
+	int nfiles, next, running;
+	int free_threads;
+	i64 free_ram;
+	bool failed;
+	pthread_mutex_t lock;
+	rzip_control *controls;
+	bool *busy;
+} batch;
+
 static void usage(bool compat)
 {
 	print_output("lrz%s version %s\n", compat ? "" : "ip-next", PACKAGE_VERSION);
@@ -84,14 +99,20 @@ static void usage(bool compat)
 	print_output("	-l, --lzo		lzo compression (ultra fast)\n");
 	print_output("	-n, --no-compress	no backend compression - prepare for other compressor\n");
 	print_output("	-z, --zpaq		zpaq compression (best, extreme compression, extremely slow)\n");
+	print_output("	-Z, --zstd		zstd compression (lzma class ratio, very fast decompression)\n");
 	if (compat) {
-		print_output("	-1 .. -9		set lzma/bzip2/gzip compression level (1-9, default 7)\n");
+		print_output("	-1 .. -9		set lzma/bzip2/gzip/zstd compression level (1-9, default 7)\n");
 		print_output("	--fast			alias for -1\n");
 		print_output("	--best			alias for -9\n");
 	}
 	if (!compat)
-		print_output("	-L, --level level	set lzma/bzip2/gzip compression level (1-9, default 7)\n");
-	print_output("	--dictsize		Set lzma Dictionary Size for LZMA ds=0 to 40 expressed as 2<<11, 3<<11, 2<<12, 3<<12...2<<31-1\n");
+		print_output("	-L, --level level	set lzma/bzip2/gzip/zstd compression level (1-9, default 7)\n");
+	print_output("	--dictsize		Set lzma Dictionary Size for LZMA ds=0 to 40 expressed as 2<<11, 3<<11, 2<<12, 3<<12...2<<31-1\n\t\t\t\t\
+Also sets the zstd window size\n");
+	print_output("	--stream0 method[:level] compress the match stream with its own method and level\n\t\t\t\t\
+method is rzip, lzo, gzip, bzip2, lzma, zpaq or zstd. Data stream keeps the options above\n");
+	print_output("	--preset-dict[=KB]	prime every LZMA block with the end of the block before it in its stream\n\t\t\t\t\
+from 64 to 4096KB in powers of 2 (default %d). Not for filtered data\n", PRESET_DICT_SIZE >> 10);
 	print_output("    Filtering Options:\n");
 	print_output("	--x86			Use x86 filter (for all compression modes)\n");
 	print_output("	--arm			Use ARM filter (for all compression modes)\n");
@@ -100,6 +121,7 @@ static void usage(bool compat)
 	print_output("	--sparc			Use SPARC filter (for all compression modes)\n");
 	print_output("	--ia64			Use IA64 filter (for all compression modes)\n");
 	print_output("	--delta	[1..32]		Use Delta filter (for all compression modes) (1 (default) -17, then multiples of 16 to 256)\n");
+	print_output("	--auto-filter		choose a filter for each block from executable headers, x86 code and record strides found in it\n");
 	print_output("    Additional Compression Options:\n");
 	if (compat)
 		print_output("	-c, --stdout		output to STDOUT\n");
@@ -109,6 +131,12 @@ static void usage(bool compat)
 	print_output("	-f, --force		force overwrite of any existing files\n");
 	if (compat)
 		print_output("	-k, --keep		don't delete source files on de/compression\n");
+	print_output("	--index			store a chunk index for --range extraction (not with -e)\n");
+	print_output("	--streamable		write blocks in order without going back, so -c output needs no buffer (not with -e)\n");
+	print_output("	--archive		put all the files and directories given in one archive, in place of lrztar\n\t\t\t\t\
+-o names it when there is more than one. Decompressing it extracts them, under -O if given\n");
+	print_output("	--transcode		recompress archives with the backend given, keeping what rzip found in them.\n\t\t\t\t\
+Each one is replaced unless -o or -O is given (not encrypted ones)\n");
 	print_output("	-K, --keep-broken	keep broken or damaged output files\n");
 	print_output("	-o, --outfile filename	specify the output file name and/or path\n");
 	print_output("	-O, --outdir directory	specify the output directory when -o is not used\n");
@@ -118,22 +146,38 @@ static void usage(bool compat)
 	print_output("	-m, --maxram size	Set maximum available ram in hundreds of MB\n\t\t\t\tOverrides detected amount of available ram. \
 Useful for testing\n");
 	print_output("	-R, --rzip-level level	Set independent RZIP Compression Level (1-9) for pre-processing (default=compression level)\n");
+	print_output("	--rzip-table mb[:freq[:chain]] override the rzip level's hash table size, sampling and chain length\n");
+	print_output("	--rzip-tune		grow or shrink the rzip hash table and chain length with how well the data matches\n");
+	print_output("	--adaptive[=pct]	choose zstd -1, the backend or no compression per block from an lz4 probe.\n\t\t\t\t\
+Blocks lz4 shrinks to pct %% or less (default %d) go to zstd -1\n", ADAPTIVE_TARGET);
 	print_output("	-T, --threshold [limit]	Disable LZ4 compressibility testing OR set limit to determine compressibiity (1-99)\n\t\t\t\t\
 Note: Since limit is optional, the short option must not have a space. e.g. -T75, not -T 75\n");
+	print_output("	--reference file	let matches point into file, e.g. the previous backup. Give it again to decompress\n");
+	print_output("	--ref-index file	keep the hash table of the --reference in file and load it from there next time.\n\t\t\t\t\
+The file is as large as the level's rzip hash table (64MB at -L7 to -L9) or an eighth of the reference if larger\n");
+	print_output("	--cdc			end rzip chunks where the content says so, so later chunks survive insertions\n");
+	print_output("	--long-range[=MB]	also keep sampled anchors over the whole window in a second hash table,\n\t\t\t\t\
+on disk under TMPDIR when large. Sized from the window by default. Best with -U\n");
 	print_output("	-U, --unlimited		Use unlimited window size beyond ramsize (potentially much slower)\n");
 	print_output("	-w, --window size	maximum compression window in hundreds of MB\n\t\t\t\t\
 default chosen by heuristic dependent on ram and chosen compression\n");
 	print_output("Decompression Options:\n----------------------\n");
 	print_output("	-d, --decompress	decompress\n");
 	print_output("	-e, -f -o -O		Same as Compression Options\n");
+	print_output("	--range start:len	extract len bytes from start using the --index chunk index\n");
+	print_output("	--extract name		extract only the file name from an --archive\n");
 	print_output("	-t, --test		test compressed file integrity\n");
+	print_output("	--max-decompress-ram MB	keep the output buffer and blocks decoding at once within MB of ram,\n\t\t\t\t\
+going through the output file and fewer threads when they do not fit\n");
 	if (compat)
 		print_output("	-C, --check		check integrity of file written on decompression\n");
 	else
 		print_output("	-c, -C, --check		check integrity of file written on decompression\n");
 	print_output("General Options:\n----------------\n");
 	print_output("	-h, -?, --help		show help\n");
-	print_output("	-H, --hash		display md5 hash integrity information\n");
+	print_output("	-H, --hash		display hash integrity information\n");
+	print_output("	--hash-type type	hash stored for integrity testing on compression\n\t\t\t\t\
+md5 (default), sha256 or blake2b\n");
 	print_output("	-i, --info		show compressed file information\n");
 	if (compat) {
 		print_output("	-L, --license		display software version and license\n");
@@ -141,6 +185,15 @@ default chosen by heuristic dependent on ram and chosen compression\n");
 	} else
 		print_output("	-q, --quiet		don't show compression progress\n");
 	print_output("	-p, --threads value	Set processor count to override number of threads\n");
+	print_output("	--jobs value		run up to value files at once, sharing the threads and ram between them\n");
+	print_output("	--remote host:port[,host:port...] compress or decompress blocks on these --worker machines.\n\t\t\t\t\
+-p sets how many blocks are out at once\n");
+	print_output("	--worker [host:]port	serve the backend of --remote runs until killed, a bare port on loopback only.\n\t\t\t\t\
+-p sets how many connections are served. Trusted networks only\n");
+	print_output("	--sync mode		when written data is pushed to disk: none, background (default),\n\t\t\t\t\
+drop (background and drop it from the page cache) or block (fsync every block)\n");
+	print_output("	--profile[=json]	show where the time went for each file: rzip, backends, checksum,\n\t\t\t\t\
+writes and waits, as a table or as one line of JSON\n");
 	print_output("	-r, --recursive		operate recursively on directories\n");
 	print_output("	-v[v%s], --verbose	Increase verbosity\n", compat ? "v" : "");
 	print_output("	-V, --version		display software version and license\n");
@@ -170,7 +223,8 @@ static void sighandler(int sig __UNUSED__)
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 	print_err("Interrupted\n");
-	fatal_exit(&local_control);
+	/* The outputs of --jobs are removed by batch_cleanup */
+	fatal_exit(batch.controls ? &base_control : &local_control);
 }
 
 static void show_summary(void)
@@ -207,18 +261,30 @@ static void show_summary(void)
 					(BZIP2_COMPRESS ? "BZIP2" :
 					(ZLIB_COMPRESS ? "GZIP\n" :	// No Threshold testing
 					(ZPAQ_COMPRESS ? "ZPAQ" :
-					(NO_COMPRESS ? "RZIP pre-processing only" : "wtf")))))));
+					(ZSTD_COMPRESS ? "ZSTD" :
+					(NO_COMPRESS ? "RZIP pre-processing only" : "wtf"))))))));
 			if (!LZO_COMPRESS && !ZLIB_COMPRESS)
 				print_verbose(". LZ4 Compressibility testing %s\n", (LZ4_TEST? "enabled" : "disabled"));
 			if (LZ4_TEST && control->threshold != 100)
 				print_verbose("Threshhold limit = %d\%\n", control->threshold);
+			if (ADAPTIVE)
+				print_verbose("Adaptive backend choice, zstd -1 at %d%% lz4 ratio or less\n", control->adaptive);
 			print_verbose("Compression level %d\n", control->compression_level);
 			print_verbose("RZIP Compression level %d\n", control->rzip_compression_level);
 			if (LZMA_COMPRESS)
 				print_verbose("Initial LZMA Dictionary Size: %"PRIu32"\n", control->dictSize );
+			if (ZSTD_COMPRESS)
+				print_verbose("ZSTD Compression Level: %d, ZSTD Window Size: %"PRIu32"\n",
+					       control->zstd_level, control->dictSize);
 			if (ZPAQ_COMPRESS)
 				print_verbose("ZPAQ Compression Level: %d, ZPAQ initial Block Size: %d\n",
 					       control->zpaq_level, control->zpaq_bs);
+			if (control->preset_dict)
+				print_verbose("LZMA blocks primed with %u bytes of preset dictionary\n", control->preset_dict);
+			if (control->stream0_ctype || control->stream0_level)
+				print_verbose("Match stream: %s, level %d\n",
+					       control->stream0_ctype ? ctype_name(control->stream0_ctype) : "main backend",
+					       control->stream0_level ? control->stream0_level : control->compression_level);
 			if (FILTER_USED) {
 				print_output("Filter Used: %s",
 					((control->filter_flag == FILTER_FLAG_X86) ? "x86" :
@@ -231,7 +297,8 @@ static void show_summary(void)
 				if (control->filter_flag == FILTER_FLAG_DELTA)
 					print_output(", offset - %d", control->delta);
 				print_output("\n");
-			}
+			} else if (AUTO_FILTER)
+				print_output("Filter Used: chosen for each block\n");
 			if (control->window)
 				print_verbose("Compression Window: %lld = %lldMB\n", control->window, control->window * 100ull);
 			/* show heuristically computed window size */
@@ -300,9 +367,258 @@ static struct option long_options[] = {
 	{"ia64",	no_argument,	0,	0},
 	{"delta",	optional_argument,	0,	0},
 	{"rzip-level",	required_argument,	0,	'R'},
+	{"hash-type",	required_argument,	0,	0},		/* 45 */
+	{"sync",	required_argument,	0,	0},
+	{"index",	no_argument,	0,	0},
+	{"range",	required_argument,	0,	0},
+	{"zstd",	no_argument,	0,	'Z'},
+	{"stream0",	required_argument,	0,	0},		/* 50 */
+	{"adaptive",	optional_argument,	0,	0},
+	{"preset-dict",	optional_argument,	0,	0},
+	{"profile",	optional_argument,	0,	0},
+	{"cdc",		no_argument,	0,	0},
+	{"reference",	required_argument,	0,	0},		/* 55 */
+	{"ref-index",	required_argument,	0,	0},
+	{"archive",	no_argument,	0,	0},
+	{"extract",	required_argument,	0,	0},
+	{"auto-filter",	no_argument,	0,	0},
+	{"long-range",	optional_argument,	0,	0},		/* 60 */
+	{"rzip-table",	required_argument,	0,	0},
+	{"rzip-tune",	no_argument,	0,	0},
+	{"max-decompress-ram",	required_argument,	0,	0},
+	{"streamable",	no_argument,	0,	0},
+	{"jobs",	required_argument,	0,	0},		/* 65 */
+	{"remote",	required_argument,	0,	0},
+	{"worker",	required_argument,	0,	0},
+	{"transcode",	no_argument,	0,	0},
 	{0,	0,	0,	0},
 };
 
+#define USECS(x)	((x) / 1000000.0)
+#define TV_USECS(tv)	((i64)(tv).tv_sec * 1000000 + (tv).tv_usec)
+
+/* Print str as a JSON string, escaping what JSON does not allow bare */
+static void print_json_string(rzip_control *control, const char *str)
+{
+	print_output("\"");
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			print_output("\\%c", c);
+		else if (c < 0x20)
+			print_output("\\u%04x", c);
+		else
+			print_output("%c", c);
+	}
+	print_output("\"");
+}
+
+/* Print the stage times of the last file from the stats it kept */
+static void show_profile(rzip_control *control, const char *name, double total_time,
+			 const struct rusage *ru_start)
+{
+	bool unzip = DECOMPRESS || TEST_ONLY;
+	struct lrz_stats s;
+	struct rusage ru;
+	i64 user, sys;
+	bool first = true;
+	int i;
+
+	sample_stats(control, &s);
+	getrusage(RUSAGE_SELF, &ru);
+	user = TV_USECS(ru.ru_utime) - TV_USECS(ru_start->ru_utime);
+	sys = TV_USECS(ru.ru_stime) - TV_USECS(ru_start->ru_stime);
+
+	if (profile_json) {
+		print_output("{\"file\":");
+		print_json_string(control, name);
+		print_output(",\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+			     "\"in_bytes\":%lld,\"out_bytes\":%lld,\"chunks\":%lld,"
+			     "\"rzip\":{\"bytes\":%lld,\"wall\":%.6f,\"cpu\":%.6f,\"inserts\":%lld,"
+			     "\"tag_hits\":%lld,\"tag_misses\":%lld,\"matches\":%lld,\"match_bytes\":%lld,"
+			     "\"literals\":%lld,\"literal_bytes\":%lld},"
+			     "\"cksum\":%.6f,\"write\":%.6f,"
+			     "\"wait\":{\"cksum\":%.6f,\"backend\":%.6f,\"writer\":%.6f,\"ram\":%.6f},"
+			     "\"ram_mapped\":%lld,\"threads\":[",
+			     total_time, USECS(user), USECS(sys),
+			     s.in_bytes, s.out_bytes, s.chunks,
+			     s.rzip_bytes, USECS(s.rzip_usecs), USECS(s.rzip_cpu_usecs), s.rzip.inserts,
+			     s.rzip.tag_hits, s.rzip.tag_misses, s.rzip.matches, s.rzip.match_bytes,
+			     s.rzip.literals, s.rzip.literal_bytes,
+			     USECS(s.cksum_usecs), USECS(s.write_usecs),
+			     USECS(s.cksum_wait_usecs), USECS(s.backend_wait_usecs),
+			     USECS(s.writer_wait_usecs), USECS(s.ram_wait_usecs), s.ram_mapped);
+		for (i = 0; i < STATS_THREADS; i++) {
+			if (!s.thread[i].blocks)
+				continue;
+			print_output("%s{\"slot\":%d,\"blocks\":%lld,\"in_bytes\":%lld,\"out_bytes\":%lld,"
+				     "\"wall\":%.6f,\"cpu\":%.6f}", first ? "" : ",", i, s.thread[i].blocks,
+				     s.thread[i].in_bytes, s.thread[i].out_bytes,
+				     USECS(s.thread[i].usecs), USECS(s.thread[i].cpu_usecs));
+			first = false;
+		}
+		print_output("]}\n");
+		return;
+	}
+
+	print_output("Profile of %s\n", name);
+	print_output("  Total      %9.3fs wall %9.3fs user %9.3fs sys\n", total_time, USECS(user), USECS(sys));
+	print_output("  Bytes      %lld in, %lld out in %lld chunks\n", s.in_bytes, s.out_bytes, s.chunks);
+	print_output("  %s      %9.3fs wall %9.3fs cpu for %lld bytes\n", unzip ? "runzip" : "rzip  ",
+		     USECS(s.rzip_usecs), USECS(s.rzip_cpu_usecs), s.rzip_bytes);
+	if (s.rzip.inserts)
+		print_output("               %lld inserts, %lld tag hits, %lld tag misses, %lld matches of %lld bytes, "
+			     "%lld literals of %lld bytes\n", s.rzip.inserts, s.rzip.tag_hits, s.rzip.tag_misses,
+			     s.rzip.matches, s.rzip.match_bytes, s.rzip.literals, s.rzip.literal_bytes);
+	print_output("  Checksum   %9.3fs\n", USECS(s.cksum_usecs));
+	print_output("  Write      %9.3fs\n", USECS(s.write_usecs));
+	print_output("  Waits      %9.3fs checksum %9.3fs backend %9.3fs writer %9.3fs ram\n",
+		     USECS(s.cksum_wait_usecs), USECS(s.backend_wait_usecs),
+		     USECS(s.writer_wait_usecs), USECS(s.ram_wait_usecs));
+	for (i = 0; i < STATS_THREADS; i++) {
+		if (!s.thread[i].blocks)
+			continue;
+		print_output("  Thread %-3d %9.3fs wall %9.3fs cpu for %lld blocks, %lld -> %lld bytes, %.2fMB/s\n",
+			     i, USECS(s.thread[i].usecs), USECS(s.thread[i].cpu_usecs), s.thread[i].blocks,
+			     s.thread[i].in_bytes, s.thread[i].out_bytes,
+			     s.thread[i].usecs ? (unzip ? s.thread[i].out_bytes : s.thread[i].in_bytes) / 1.048576 /
+			     s.thread[i].usecs : 0.0);
+	}
+	print_output("  Buffers    %lld bytes mapped\n", s.ram_mapped);
+}
+
+static void batch_add(const char *infile)
+{
+	char **files;
+
+	if (!(batch.nfiles % 64)) {
+		files = realloc(batch.files, (batch.nfiles + 64) * sizeof(char *));
+		if (unlikely(!files))
+			fatal("Failed to realloc file list in batch_add\n");
+		batch.files = files;
+	}
+	batch.files[batch.nfiles] = strdup(infile);
+	if (unlikely(!batch.files[batch.nfiles++]))
+		fatal("Failed to strdup file name in batch_add\n");
+}
+
+static void *batch_worker(void *data)
+{
+	rzip_control *job = data;
+	int w = job - batch.controls, threads, share;
+	struct stream_ctx *sctx = NULL;
+	bool ret;
+	i64 ram;
+
+	while (42) {
+		lock_mutex(control, &batch.lock);
+		if (batch.failed || batch.next == batch.nfiles) {
+			unlock_mutex(control, &batch.lock);
+			break;
+		}
+		/* What is free is split between this file and those the idle
+		 * workers will start next, so the last files get it all */
+		share = MIN(batch.nfiles - batch.next, batch.jobs - batch.running);
+		threads = MAX(1, batch.free_threads / share);
+		ram = batch.free_ram / share;
+		batch.free_threads -= threads;
+		batch.free_ram -= ram;
+		batch.running++;
+		memcpy(job, &base_control, sizeof(rzip_control));
+		job->infile = batch.files[batch.next++];
+		batch.busy[w] = true;
+		unlock_mutex(control, &batch.lock);
+
+		job->sctx = sctx;
+		job->threads = threads;
+		job->ramsize = ram;
+		setup_ram(job);
+		if (job->transcode)
+			ret = transcode_file(job);
+		else if (DECOMPRESS || TEST_ONLY)
+			ret = decompress_file(job);
+		else
+			ret = compress_file(job);
+		sctx = job->sctx;
+
+		lock_mutex(control, &batch.lock);
+		batch.busy[w] = false;
+		batch.free_threads += threads;
+		batch.free_ram += ram;
+		batch.running--;
+		if (unlikely(!ret))
+			batch.failed = true;
+		unlock_mutex(control, &batch.lock);
+	}
+	job->sctx = sctx;
+	free_stream_ctx(job);
+	return NULL;
+}
+
+/* A job that fails exits the whole run, taking the unfinished output of the
+ * others with it too */
+static void batch_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < batch.jobs; i++)
+		if (batch.busy[i])
+			remove_broken(&batch.controls[i]);
+}
+
+static bool run_batch(void)
+{
+	pthread_t *workers;
+	int i;
+
+	batch.jobs = MIN(batch.jobs, batch.nfiles);
+	batch.free_threads = control->threads;
+	batch.free_ram = control->ramsize;
+	print_verbose("Running %d files %d at a time\n", batch.nfiles, batch.jobs);
+
+	batch.controls = calloc(sizeof(rzip_control), batch.jobs);
+	batch.busy = calloc(sizeof(bool), batch.jobs);
+	workers = calloc(sizeof(pthread_t), batch.jobs);
+	if (unlikely(!batch.controls || !batch.busy || !workers))
+		fatal_return(("Failed to calloc jobs in run_batch\n"), false);
+	if (unlikely(!init_mutex(control, &batch.lock)))
+		return false;
+	atexit(batch_cleanup);
+	/* libgcrypt sets up its secure memory on first use, which the workers
+	 * would otherwise race to do when they all open their hash at once */
+	gcry_check_version(NULL);
+
+	for (i = 0; i < batch.jobs; i++)
+		if (unlikely(!create_pthread(control, &workers[i], NULL, batch_worker, &batch.controls[i])))
+			return false;
+	for (i = 0; i < batch.jobs; i++)
+		join_pthread(control, workers[i], NULL);
+	dealloc(workers);
+	for (i = 0; i < batch.nfiles; i++)
+		dealloc(batch.files[i]);
+	dealloc(batch.files);
+	return !batch.failed;
+}
+
+/* Print the time since start and return it in seconds */
+static double show_total_time(struct timeval *start)
+{
+	struct timeval end;
+	double total_time, seconds;
+	int hours, minutes;
+
+	gettimeofday(&end, NULL);
+	total_time = (end.tv_sec + (double)end.tv_usec / 1000000) -
+		      (start->tv_sec + (double)start->tv_usec / 1000000);
+	hours = (int)total_time / 3600;
+	minutes = (int)(total_time / 60) % 60;
+	seconds = total_time - hours * 3600 - minutes * 60;
+	if (!INFO)
+		print_progress("Total time: %02d:%02d:%05.2f\n", hours, minutes, seconds);
+	return total_time;
+}
+
 static void set_stdout(struct rzip_control *control)
 {
 	control->flags |= FLAG_STDOUT;
@@ -343,22 +659,23 @@ static void recurse_dirlist(char *indir, char **dirlist, int *entries)
 	closedir(dirp);
 }
 
-static const char *loptions = "bcCdDe::fghHiKlL:nN:o:O:p:PqrR:S:tT::Um:vVw:z?";
-static const char *coptions = "bcCde::fghHikKlLnN:o:O:p:PrR:S:tT::Um:vVw:z?123456789";
+static const char *loptions = "bcCdDe::fghHiKlL:nN:o:O:p:PqrR:S:tT::Um:vVw:zZ?";
+static const char *coptions = "bcCde::fghHikKlLnN:o:O:p:PrR:S:tT::Um:vVw:zZ?123456789";
 
 int main(int argc, char *argv[])
 {
 	bool lrzcat = false, compat = false, recurse = false;
 	bool options_file = false, conf_file_compression_set = false; /* for environment and tracking of compression setting */
-	struct timeval start_time, end_time;
+	struct timeval start_time;
+	struct rusage ru_start;
 	struct sigaction handler;
-	double seconds,total_time; // for timers
+	double total_time;
 	bool nice_set = false;
 	int c, i, ds, long_opt_index;
-	int hours,minutes;
 	extern int optind;
 	char *eptr, *av; /* for environment */
 	char *endptr = NULL;
+	const char *worker = NULL;
 
         control = &base_control;
 
@@ -379,9 +696,6 @@ int main(int argc, char *argv[])
 		long_options[11].name = "keep";
 	}
 
-	/* generate crc table */
-	CrcGenerateTable();
-
 	/* Get Preloaded Defaults from lrzip.conf
 	 * Look in ., $HOME/.lrzip/, /etc/lrzip.
 	 * If LRZIP=NOCONFIG is set, then ignore config
@@ -405,11 +719,12 @@ int main(int argc, char *argv[])
 		case 'l':
 		case 'n':
 		case 'z':
+		case 'Z':
 			/* If some compression was chosen in lrzip.conf, allow this one time
 			 * because conf_file_compression_set will be true
 			 */
 			if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
-				failure("Can only use one of -l, -b, -g, -z or -n\n");
+				failure("Can only use one of -l, -b, -g, -z, -Z or -n\n");
 			/* Select Compression Mode */
 			control->flags &= ~FLAG_NOT_LZMA; 		/* must clear all compressions first */
 			if (c == 'b')
@@ -422,6 +737,8 @@ int main(int argc, char *argv[])
 				control->flags |= FLAG_NO_COMPRESS;
 			else if (c == 'z')
 				control->flags |= FLAG_ZPAQ_COMPRESS;
+			else if (c == 'Z')
+				control->flags |= FLAG_ZSTD_COMPRESS;
 			/* now FLAG_NOT_LZMA will evaluate as true */
 			conf_file_compression_set = false;
 			break;
@@ -605,7 +922,7 @@ int main(int argc, char *argv[])
 			control->compression_level = c - '0';
 			break;
 		case 0:	/* these are long options without a short code */
-			if (FILTER_USED && long_opt_index >= 37 )
+			if (FILTER_USED && long_opt_index >= 37 && long_opt_index <= 43)
 				print_output("Filter already selected. %s filter ignored.\n", long_options[long_opt_index].name);
 			else {
 				switch(long_opt_index) {
@@ -620,8 +937,8 @@ int main(int argc, char *argv[])
 						 * 			2<<30, 3<<30
 						 * 			2<<31 - 1
 						 * Uses new lzma2 limited dictionary sizes */
-						if (!LZMA_COMPRESS)
-							print_err("--dictsize option only valid for LZMA compression. Ignorred.\n");
+						if (!LZMA_COMPRESS && !ZSTD_COMPRESS)
+							print_err("--dictsize option only valid for LZMA and ZSTD compression. Ignorred.\n");
 						ds = strtol(optarg, &endptr, 10);
 						if (*endptr)
 							failure("Extra characters after dictionary size: \'%s\'\n", endptr);
@@ -661,6 +978,108 @@ int main(int argc, char *argv[])
 						} else
 							control->delta = DEFAULT_DELTA;		// 1 is default
 						break;
+					case 45:
+						if (!set_hash_type(control, optarg))
+							failure("Hash type must be md5, sha256 or blake2b\n");
+						break;
+					case 46:
+						if (!set_sync_mode(control, optarg))
+							failure("Sync must be none, background, drop or block\n");
+						break;
+					case 47:
+						control->flags |= FLAG_INDEX;
+						break;
+					case 48:
+						control->range_start = strtoll(optarg, &endptr, 10);
+						if (*endptr != ':' || control->range_start < 0)
+							failure("Range must be START:LEN\n");
+						control->range_len = strtoll(endptr + 1, &endptr, 10);
+						if (*endptr || control->range_len < 1)
+							failure("Range must be START:LEN with LEN of at least 1\n");
+						/* Extracting part of an archive never removes it */
+						control->flags |= FLAG_DECOMPRESS | FLAG_KEEP_FILES;
+						break;
+					case 50:
+						if (!set_stream0(control, optarg))
+							failure("Stream0 must be rzip, lzo, gzip, bzip2, lzma, zpaq or zstd, optionally followed by :level 1-9\n");
+						break;
+					case 51:
+						if (optarg) {
+							i = strtol(optarg, &endptr, 10);
+							if (*endptr || i < 1 || i > 99)
+								failure("Adaptive target must be 1-99\n");
+							control->adaptive = i;
+						}
+						control->flags |= FLAG_ADAPTIVE;
+						break;
+					case 52:
+						if (!set_preset_dict(control, optarg))
+							failure("Preset dictionary must be a power of 2 from 64 to 4096KB\n");
+						break;
+					case 53:
+						if (optarg && strcmp(optarg, "json"))
+							failure("Profile output can only be json\n");
+						profile_json = optarg;
+						control->stats = &profile;
+						break;
+					case 54:
+						control->flags |= FLAG_CDC;
+						break;
+					case 55:
+						control->reference = optarg;
+						break;
+					case 56:
+						control->ref_index = optarg;
+						break;
+					case 57:
+						control->flags |= FLAG_ARCHIVE;
+						break;
+					case 58:
+						control->extract = optarg;
+						control->flags |= FLAG_DECOMPRESS | FLAG_KEEP_FILES;
+						break;
+					case 59:
+						control->flags |= FLAG_AUTO_FILTER;
+						break;
+					case 60:
+						if (optarg) {
+							control->long_range = strtoll(optarg, &endptr, 10);
+							if (*endptr || control->long_range < 1)
+								failure("Long range table size must be a number of MB\n");
+						}
+						control->flags |= FLAG_LONG_RANGE;
+						break;
+					case 61:
+						if (!set_rzip_table(control, optarg))
+							failure("Rzip table must be MB[:FREQ[:CHAIN]], up to 8192MB, 16 and 1024\n");
+						break;
+					case 62:
+						control->rzip_tune = true;
+						break;
+					case 63:
+						control->unzip_ram = strtoll(optarg, &endptr, 10);
+						if (*endptr || control->unzip_ram < 1)
+							failure("Max decompress ram must be a number of MB\n");
+						control->unzip_ram *= 1024 * 1024;
+						break;
+					case 64:
+						control->flags |= FLAG_STREAMED;
+						break;
+					case 65:
+						batch.jobs = strtol(optarg, &endptr, 10);
+						if (*endptr || batch.jobs < 1)
+							failure("Jobs must be a number of files to run at once\n");
+						break;
+					case 66:
+						if (!remote_add(control, optarg))
+							failure("Failed to add the --remote workers\n");
+						break;
+					case 67:
+						worker = optarg;
+						break;
+					case 68:
+						control->transcode = true;
+						break;
 				}	//switch
 			}	//if filter used
 		}	// main switch
@@ -669,12 +1088,19 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/* A worker only ever does the blocks of other runs */
+	if (worker) {
+		if (argc)
+			failure("--worker takes no files\n");
+		return run_worker(control, worker) ? 0 : -1;
+	}
+
 	/* if rzip compression level not set, make equal to compression level */
 	if (! control->rzip_compression_level )
 		control->rzip_compression_level = control->compression_level;
 
 	if (control->outname) {
-		if (argc > 1)
+		if (argc > 1 && !ARCHIVE)
 			failure("Cannot specify output filename with more than 1 file\n");
 		if (recurse)
 			failure("Cannot specify output filename with recursive\n");
@@ -698,6 +1124,63 @@ int main(int argc, char *argv[])
 		control->flags &= ~FLAG_UNLIMITED;
 	}
 
+	if (control->ref_index && !control->reference)
+		failure("--ref-index needs a --reference file\n");
+
+	if (AUTO_FILTER && FILTER_USED) {
+		print_err("Filter already selected, --auto-filter ignored.\n");
+		control->flags &= ~FLAG_AUTO_FILTER;
+	}
+	if (AUTO_FILTER && control->preset_dict)
+		failure("Cannot use --preset-dict with --auto-filter\n");
+
+	if (control->extract && control->range_len)
+		failure("Cannot use --extract and --range together\n");
+
+	if (control->transcode) {
+		if (DECOMPRESS || INFO || TEST_ONLY || ARCHIVE)
+			failure("--transcode cannot be used with -d, -t, -i or --archive\n");
+		if (ENCRYPT)
+			failure("Cannot encrypt with --transcode\n");
+	}
+
+	if (ARCHIVE && !(DECOMPRESS || INFO || TEST_ONLY)) {
+		if (argc < 1)
+			failure("--archive needs the files and directories to put in it\n");
+		if (recurse)
+			failure("Cannot use -r recursive with --archive, directories are archived whole\n");
+		if (ENCRYPT)
+			failure("Cannot encrypt an --archive, its file table is not encrypted\n");
+		if (control->outname && !strcmp(control->outname, "-"))
+			failure("An --archive has to be written to a file\n");
+		for (i = 0; i < argc; i++) {
+			if (unlikely(!archive_add(control, argv[i])))
+				failure("Failed to add %s to the archive\n", argv[i]);
+		}
+		if (!control->outname) {
+			/* Named after the one file or directory in it */
+			char *name = strdupa(argv[0]);
+			size_t len = strlen(name);
+
+			if (argc > 1)
+				failure("Give -o for an --archive of more than one file or directory\n");
+			while (len > 1 && name[len - 1] == '/')
+				name[--len] = '\0';
+			control->outname = malloc(len + strlen(control->suffix) + 1);
+			if (unlikely(!control->outname))
+				fatal("Failed to allocate outname\n");
+			strcpy(control->outname, name);
+			strcat(control->outname, control->suffix);
+		}
+		/* One archive, all the arguments are in it */
+		argc = 1;
+	}
+
+	if (UNLIMITED && CDC) {
+		print_err("Cannot have -U and --cdc, content defined chunking disabled.\n");
+		control->flags &= ~FLAG_CDC;
+	}
+
 	/* if any filter used, disable LZ4 testing or certain compression modes */
 	if ((control->flags & FLAG_THRESHOLD) && (FILTER_USED || ZLIB_COMPRESS || LZO_COMPRESS || NO_COMPRESS)) {
 		print_output("LZ4 Threshold testing disabled due to Filtering and/or Compression type (gzip, lzo, rzip).\n");
@@ -735,7 +1218,7 @@ int main(int argc, char *argv[])
 			infile = argv[i];
 		else if (!(i == 0 && STDIN))
 			break;
-		if (infile && !(DECOMPRESS || INFO || TEST_ONLY)) {
+		if (infile && !ARCHIVE && !(DECOMPRESS || INFO || TEST_ONLY)) {
 			/* check that input file exists, unless Decompressing or Test */
 			if ((strcmp(infile, "-") == 0))
 				control->flags |= FLAG_STDIN;
@@ -827,35 +1310,69 @@ recursion:
 		show_summary();
 
 		gettimeofday(&start_time, NULL);
+		if (control->stats) {
+			init_stats(control->stats);
+			getrusage(RUSAGE_SELF, &ru_start);
+		}
 
 		if (unlikely(STDIN && ENCRYPT && control->passphrase == NULL))
 			failure("Unable to work from STDIN while reading password. Use -e passphrase.\n");
 		if (unlikely(STDOUT && !(DECOMPRESS || INFO || TEST_ONLY) && ENCRYPT))
 			failure("Unable to encrypt while writing to STDOUT.\n");
+		if (unlikely(STREAMED && !(DECOMPRESS || INFO || TEST_ONLY) && ENCRYPT))
+			failure("Unable to encrypt a --streamable archive.\n");
+
+		/* Files for --jobs are gathered and run once all are known.
+		 * Stdio and a passphrase asked for can only be one at a time */
+		if (batch.jobs > 1 && !(STDIN || STDOUT || INFO || ARCHIVE || (ENCRYPT && !control->passphrase))) {
+			batch_add(infile);
+			if (recurse)
+				goto recursion;
+			continue;
+		}
 
 		memcpy(&local_control, &base_control, sizeof(rzip_control));
-		if (DECOMPRESS || TEST_ONLY) {
+		if (control->transcode) {
+			if (unlikely(!transcode_file(&local_control)))
+				return -1;
+		} else if (DECOMPRESS || TEST_ONLY) {
 			if (unlikely(!decompress_file(&local_control)))
 				return -1;
 		} else if (INFO) {
 			if (unlikely(!get_fileinfo(&local_control)))
 				return -1;
+		} else if (ARCHIVE) {
+			if (unlikely(!compress_archive(&local_control)))
+				return -1;
 		} else
 			if (unlikely(!compress_file(&local_control)))
 				return -1;
+		/* The next file reuses the stream threads of this one */
+		base_control.sctx = local_control.sctx;
 
-		/* compute total time */
-		gettimeofday(&end_time, NULL);
-		total_time = (end_time.tv_sec + (double)end_time.tv_usec / 1000000) -
-			      (start_time.tv_sec + (double)start_time.tv_usec / 1000000);
-		hours = (int)total_time / 3600;
-		minutes = (int)(total_time / 60) % 60;
-		seconds = total_time - hours * 3600 - minutes * 60;
-		if (!INFO)
-			print_progress("Total time: %02d:%02d:%05.2f\n", hours, minutes, seconds);
+		total_time = show_total_time(&start_time);
+		if (control->stats && !INFO)
+			show_profile(&local_control, STDIN ? "stdin" : local_control.infile, total_time, &ru_start);
 		if (recurse)
 			goto recursion;
 	}
 
+	free_stream_ctx(&local_control);
+	if (batch.nfiles) {
+		unsigned long progress = control->flags & FLAG_SHOW_PROGRESS;
+
+		/* Progress lines of files running side by side would mix */
+		control->flags &= ~FLAG_SHOW_PROGRESS;
+		if (control->stats) {
+			print_err("No --profile for files run with --jobs\n");
+			control->stats = NULL;
+		}
+		gettimeofday(&start_time, NULL);
+		if (unlikely(!run_batch()))
+			return -1;
+		control->flags |= progress;
+		show_total_time(&start_time);
+	}
+	free_remote(control);
 	return 0;
 }
@@ -0,0 +1,377 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* --worker and --remote: the backends of a run on other machines.
+ *
+ * A worker listens on a TCP port and forks a process for each connection,
+ * which takes blocks one after another and sends each back compressed or
+ * decompressed, see serve_block in stream.c. The rzip pass, the filters,
+ * encryption and the writing stay where the file is. A connection carries
+ * one block at a time, so a run keeps one open for each block it has out
+ * and opens new ones round the workers given in turn. A block that is not
+ * back by its deadline is given up on and done here. Nothing on the wire
+ * is authenticated or encrypted, so workers are for trusted networks. */
+
+/* Seconds a worker gets to answer a connection, and for any block on top
+ * of a second for every REMOTE_RATE bytes of it */
+#define REMOTE_CONNECT	10
+#define REMOTE_BASE	60
+#define REMOTE_RATE	(256 * 1024)
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "lrzip_core.h"
+#include "util.h"
+#include "stream.h"
+#include "remote.h"
+
+struct remote {
+	char **hosts;		// host:port of each worker
+	int nhosts;
+	int next_host;		// Worker the next connection is made to
+	int *idle;		// Open connections no block is using
+	int nidle, idle_alloc;
+	pthread_mutex_t lock;
+};
+
+/* Split host:port, [host]:port or a bare port into a copy of each part.
+ * host is NULL for a bare port */
+static bool split_addr(const char *addr, char **host, char **port)
+{
+	const char *colon = strrchr(addr, ':');
+
+	*host = *port = NULL;
+	if (!colon) {
+		*port = strdup(addr);
+		return *port != NULL;
+	}
+	if (*addr == '[' && colon > addr && colon[-1] == ']')
+		*host = strndup(addr + 1, colon - addr - 2);
+	else
+		*host = strndup(addr, colon - addr);
+	*port = strdup(colon + 1);
+	if (*host && *port && **port)
+		return true;
+	dealloc(*host);
+	dealloc(*port);
+	return false;
+}
+
+bool remote_add(rzip_control *control, const char *list)
+{
+	struct remote *r = control->remote;
+	char *copy, *addr, *save, *host, *port;
+	char **hosts;
+
+	if (!r) {
+		r = calloc(sizeof(struct remote), 1);
+		if (unlikely(!r || !init_mutex(control, &r->lock)))
+			fatal_return(("Failed to calloc remote workers in remote_add\n"), false);
+		control->remote = r;
+	}
+	copy = strdup(list);
+	if (unlikely(!copy))
+		fatal_return(("Failed to strdup remote workers in remote_add\n"), false);
+	for (addr = strtok_r(copy, ",", &save); addr; addr = strtok_r(NULL, ",", &save)) {
+		if (!split_addr(addr, &host, &port) || !host) {
+			dealloc(port);
+			dealloc(copy);
+			failure_return(("Worker %s must be given as host:port\n", addr), false);
+		}
+		dealloc(host);
+		dealloc(port);
+		hosts = realloc(r->hosts, sizeof(char *) * (r->nhosts + 1));
+		if (unlikely(!hosts)) {
+			dealloc(copy);
+			fatal_return(("Failed to realloc remote workers in remote_add\n"), false);
+		}
+		r->hosts = hosts;
+		r->hosts[r->nhosts] = strdup(addr);
+		if (unlikely(!r->hosts[r->nhosts++])) {
+			dealloc(copy);
+			fatal_return(("Failed to strdup remote worker in remote_add\n"), false);
+		}
+	}
+	dealloc(copy);
+	return true;
+}
+
+/* Wait on a socket until it is ready for events or the deadline passes.
+ * No deadline waits for ever */
+static bool remote_wait(int fd, short events, time_t deadline)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	time_t left;
+	int ret;
+
+	if (!deadline)
+		return true;
+	do {
+		left = deadline - time(NULL);
+		if (left <= 0)
+			return false;
+		ret = poll(&pfd, 1, MIN(left, 3600) * 1000);
+	} while (ret == -1 && errno == EINTR);
+	return ret > 0;
+}
+
+static bool connected(int fd)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	return remote_wait(fd, POLLOUT, time(NULL) + REMOTE_CONNECT) &&
+		!getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err;
+}
+
+static int connect_host(rzip_control *control, const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1, one = 1, ret;
+
+	if (unlikely(!split_addr(addr, &host, &port)))
+		return -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	dealloc(host);
+	dealloc(port);
+	if (ret) {
+		print_verbose("Unable to look up worker %s: %s\n", addr, gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		/* Connect without blocking so a host that never answers
+		 * is only waited for REMOTE_CONNECT seconds */
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    (errno == EINPROGRESS && connected(fd))) {
+			fcntl(fd, F_SETFL, 0);
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		print_verbose("Unable to connect to worker %s\n", addr);
+	else
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/* A connection for one block, an idle one or a new one to the next worker
+ * that answers. -1 when none does, and the block is done here instead */
+int remote_get(rzip_control *control)
+{
+	struct remote *r = control->remote;
+	int fd = -1, i, host;
+
+	lock_mutex(control, &r->lock);
+	if (r->nidle)
+		fd = r->idle[--r->nidle];
+	unlock_mutex(control, &r->lock);
+	for (i = 0; fd == -1 && i < r->nhosts; i++) {
+		lock_mutex(control, &r->lock);
+		host = r->next_host++ % r->nhosts;
+		unlock_mutex(control, &r->lock);
+		fd = connect_host(control, r->hosts[host]);
+	}
+	return fd;
+}
+
+/* Give a connection back for the next block, or close it when it went
+ * wrong part way through a block */
+void remote_put(rzip_control *control, int fd, bool ok)
+{
+	struct remote *r = control->remote;
+	int *idle;
+
+	if (!ok) {
+		close(fd);
+		return;
+	}
+	lock_mutex(control, &r->lock);
+	if (r->nidle == r->idle_alloc) {
+		idle = realloc(r->idle, sizeof(int) * (r->idle_alloc + 16));
+		if (unlikely(!idle)) {
+			unlock_mutex(control, &r->lock);
+			close(fd);
+			return;
+		}
+		r->idle = idle;
+		r->idle_alloc += 16;
+	}
+	r->idle[r->nidle++] = fd;
+	unlock_mutex(control, &r->lock);
+}
+
+void free_remote(rzip_control *control)
+{
+	struct remote *r = control->remote;
+	int i;
+
+	if (!r)
+		return;
+	for (i = 0; i < r->nidle; i++)
+		close(r->idle[i]);
+	for (i = 0; i < r->nhosts; i++)
+		dealloc(r->hosts[i]);
+	dealloc(r->hosts);
+	dealloc(r->idle);
+	pthread_mutex_destroy(&r->lock);
+	dealloc(control->remote);
+}
+
+/* When a block of len bytes has to be back by */
+time_t remote_deadline(i64 len)
+{
+	return time(NULL) + REMOTE_BASE + len / REMOTE_RATE;
+}
+
+/* Send or receive all of len bytes by the deadline. With a deadline the
+ * socket is never blocked on, so a worker that stalls part way through
+ * cannot hold the block up past it */
+bool remote_write(int fd, const void *buf, i64 len, time_t deadline)
+{
+	int flags = MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0);
+	const uchar *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (!remote_wait(fd, POLLOUT, deadline))
+			return false;
+		ret = send(fd, p, MIN(len, one_g), flags);
+		if (ret <= 0) {
+			if (ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool remote_read(int fd, void *buf, i64 len, time_t deadline)
+{
+	int flags = deadline ? MSG_DONTWAIT : 0;
+	uchar *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (!remote_wait(fd, POLLIN, deadline))
+			return false;
+		ret = recv(fd, p, MIN(len, one_g), flags);
+		if (ret <= 0) {
+			if (ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* Serve blocks on [host:]port until killed. Each connection gets a process
+ * of its own, up to one for each thread, and any more are turned away to be
+ * done by the run that sent them. A bare port is only listened on at
+ * 127.0.0.1 */
+bool run_worker(rzip_control *control, const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, conn, one = 1, ret, children = 0;
+	char *host, *port;
+	pid_t pid;
+
+	if (unlikely(!split_addr(addr, &host, &port)))
+		failure_return(("Worker address %s must be [host:]port\n", addr), false);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = host ? AF_UNSPEC : AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	dealloc(host);
+	dealloc(port);
+	if (unlikely(ret))
+		failure_return(("Unable to look up %s: %s\n", addr, gai_strerror(ret)), false);
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 64))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (unlikely(fd == -1))
+		fatal_return(("Unable to listen on %s\n", addr), false);
+
+	print_output("Worker listening on %s for up to %d connections\n", addr, control->threads);
+	while (42) {
+		conn = accept(fd, NULL, NULL);
+		if (conn == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fatal_return(("Failed to accept a connection in run_worker\n"), false);
+		}
+		while (children && waitpid(-1, NULL, WNOHANG) > 0)
+			children--;
+		if (children >= control->threads) {
+			print_verbose("Turning a connection away, %d are being served\n", children);
+			close(conn);
+			continue;
+		}
+		pid = fork();
+		if (!pid) {
+			close(fd);
+			setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			while (serve_block(control, conn))
+				;
+			close(conn);
+			exit(0);
+		}
+		if (unlikely(pid == -1))
+			print_err("Unable to fork for a connection: %s\n", strerror(errno));
+		else
+			children++;
+		close(conn);
+	}
+	return true;
+}
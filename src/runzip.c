@@ -41,15 +41,24 @@
 #endif
 
 #include "runzip.h"
+#include "rzip.h"
 #include "stream.h"
 #include "util.h"
 #include "lrzip_core.h"
 /* needed for CRC routines */
 #include "7zCrc.h"
 #include <gcrypt.h>
+#include <lzo/lzoconf.h>
 
 /* Work Function to compute md5 of a file stream */
-int md5_stream ( FILE *, uchar * );
+int md5_stream ( FILE *, uchar *, int, int );
+
+/* Decompressed data is checksummed by the same cksumthread as on
+ * compression, so that rebuilding the chunk and hashing it run side by
+ * side. Records are mostly small so they are gathered into ckbuf and
+ * handed over CKSUM_BUFSIZE at a time. */
+#define CKSUM_BUFSIZE (1024 * 1024 * 4)
+
 
 static inline uchar read_u8(rzip_control *control, void *ss, int stream, bool *err)
 {
@@ -127,12 +136,19 @@ static i64 seekto_fdin(rzip_control *control, i64 pos)
 
 static i64 seekto_fdinend(rzip_control *control)
 {
-	int tmpchar;
+	i64 ret;
 
 	if (!TMP_INBUF)
 		return lseek(control->fd_in, 0, SEEK_END);
-	while ((tmpchar = getchar()) != EOF) {
-		control->tmp_inbuf[control->in_len++] = (char)tmpchar;
+	if (control->in_buffer)
+		control->in_len = control->in_maxlen;
+	else {
+		/* One byte more than fits tells it is too much */
+		ret = read_stdin(control, control->tmp_inbuf + control->in_len,
+				 control->in_maxlen - control->in_len + 1);
+		if (unlikely(ret < 0))
+			fatal_return(("Failed to read stdin in seekto_fdinend\n"), -1);
+		control->in_len += ret;
 		if (unlikely(control->in_len > control->in_maxlen))
 			failure_return(("Trying to read greater than max_len\n"), -1);
 	}
@@ -140,6 +156,66 @@ static i64 seekto_fdinend(rzip_control *control)
 	return control->in_ofs;
 }
 
+/* Hand whatever has been gathered in ckbuf over to the cksumthread */
+static bool cksum_flush(rzip_control *control, uint32 *cksum)
+{
+	pthread_t thread;
+
+	if (!control->cklen)
+		return true;
+	/* Released by the cksumthread once it is done with control->checksum */
+	wait_cksum(control);
+	control->checksum.buf = control->ckbuf;
+	control->checksum.len = control->cklen;
+	control->checksum.cksum = HAS_MD5 ? NULL : cksum;
+	control->checksum.owned = true;
+	control->ckbuf = NULL;
+	control->cklen = 0;
+	if (unlikely(!create_pthread(control, &thread, NULL, cksumthread, control))) {
+		dealloc(control->checksum.buf);
+		cksem_post(control, &control->cksumsem);
+		return false;
+	}
+	return true;
+}
+
+static bool cksum_update(rzip_control *control, uint32 *cksum, uchar *buf, i64 len)
+{
+	i64 n;
+
+	/* Not worth the copy without a spare CPU */
+	if (control->threads < 2) {
+		cksum_block(control, HAS_MD5 ? NULL : cksum, buf, len);
+		return true;
+	}
+
+	while (len) {
+		if (!control->ckbuf) {
+			control->ckbuf = malloc(CKSUM_BUFSIZE);
+			if (unlikely(!control->ckbuf))
+				fatal_return(("Failed to malloc ckbuf in cksum_update\n"), false);
+		}
+		n = MIN(len, CKSUM_BUFSIZE - control->cklen);
+		memcpy(control->ckbuf + control->cklen, buf, n);
+		control->cklen += n;
+		buf += n;
+		len -= n;
+		if (control->cklen == CKSUM_BUFSIZE && unlikely(!cksum_flush(control, cksum)))
+			return false;
+	}
+	return true;
+}
+
+/* Wait till all the data passed to cksum_update has been checksummed */
+static bool cksum_wait(rzip_control *control, uint32 *cksum)
+{
+	if (unlikely(!cksum_flush(control, cksum)))
+		return false;
+	wait_cksum(control);
+	cksem_post(control, &control->cksumsem);
+	return true;
+}
+
 static i64 read_header(rzip_control *control, void *ss, uchar *head)
 {
 	bool err = false;
@@ -152,34 +228,29 @@ static i64 read_header(rzip_control *control, void *ss, uchar *head)
 
 static i64 unzip_literal(rzip_control *control, void *ss, i64 len, uint32 *cksum)
 {
-	i64 stream_read;
+	i64 n, total = 0;
 	uchar *buf;
 
 	if (unlikely(len < 0))
 		failure_return(("len %lld is negative in unzip_literal!\n",len), -1);
 
-	buf = (uchar *)malloc(len);
-	if (unlikely(!buf))
-		fatal_return(("Failed to malloc literal buffer of size %lld\n", len), -1);
+	/* Write the literal straight out of the stream buffer */
+	while (len) {
+		n = peek_stream(control, ss, 1, &buf, len);
+		if (unlikely(n == -1))
+			fatal_return(("Failed to read_stream in unzip_literal\n"), -1);
+		if (!n)
+			break;
 
-	stream_read = read_stream(control, ss, 1, buf, len);
-	if (unlikely(stream_read == -1 )) {
-		dealloc(buf);
-		fatal_return(("Failed to read_stream in unzip_literal\n"), -1);
-	}
+		if (unlikely(write_1g(control, buf, (size_t)n) != (ssize_t)n))
+			fatal_return(("Failed to write literal buffer of size %lld\n", n), -1);
 
-	if (unlikely(write_1g(control, buf, (size_t)stream_read) != (ssize_t)stream_read)) {
-		dealloc(buf);
-		fatal_return(("Failed to write literal buffer of size %lld\n", stream_read), -1);
+		if (unlikely(!cksum_update(control, cksum, buf, n)))
+			return -1;
+		len -= n;
+		total += n;
 	}
-
-	if (!HAS_MD5)
-		*cksum = CrcUpdate(*cksum, buf, stream_read);
-	if (!NO_MD5)
-		gcry_md_write(control->gcry_md5_handle, buf, stream_read);
-
-	dealloc(buf);
-	return stream_read;
+	return total;
 }
 
 static i64 read_fdhist(rzip_control *control, void *buf, i64 len)
@@ -194,15 +265,67 @@ static i64 read_fdhist(rzip_control *control, void *buf, i64 len)
 	return len;
 }
 
+/* Read len bytes of the output back from pos, with pread where it is a file
+ * so no seek is needed first */
+static i64 read_fdhist_at(rzip_control *control, void *buf, i64 len, i64 pos)
+{
+	uchar *offset_buf = buf;
+	i64 total = 0;
+	ssize_t ret;
+
+	if (TMP_OUTBUF) {
+		if (unlikely(seekto_fdhist(control, pos) == -1))
+			return -1;
+		return read_fdhist(control, buf, len);
+	}
+	while (len > 0) {
+		ret = pread(control->fd_hist, offset_buf, (size_t)MIN(len, one_g), pos + total);
+		if (unlikely(ret <= 0))
+			return ret;
+		len -= ret;
+		offset_buf += ret;
+		total += ret;
+	}
+	return total;
+}
+
+/* Copy a match that may overlap its own output. An overlapping match
+ * repeats the last offset bytes, so each copy can take twice as much as
+ * the one before. */
+static inline void copy_match(uchar *dst, i64 offset, i64 len)
+{
+	uchar *src = dst - offset;
+	i64 n;
+
+	while (len) {
+		n = MIN(len, dst - src);
+		memcpy(dst, src, n);
+		dst += n;
+		len -= n;
+	}
+}
+
+/* A match back past the start of the output is in the --reference file,
+ * with the output following on from its end */
+static i64 unzip_ref_match(rzip_control *control, i64 pos, i64 len, uint32 *cksum)
+{
+	if (unlikely(!control->ref_needed || pos < 0 || len > control->ref_len - pos))
+		failure_return(("Match outside the reference file, corrupt archive or wrong reference\n"), -1);
+	if (unlikely(write_1g(control, control->ref_buf + pos, len) != len))
+		fatal_return(("Failed to write %lld bytes in unzip_ref_match\n", len), -1);
+	if (unlikely(!cksum_update(control, cksum, control->ref_buf + pos, len)))
+		return -1;
+	return len;
+}
+
 static i64 unzip_match(rzip_control *control, void *ss, i64 len, uint32 *cksum, int chunk_bytes)
 {
-	i64 offset, n, total, cur_pos;
+	i64 offset, n, cur_pos;
 	uchar *buf, *off_buf;
 
 	if (unlikely(len < 0))
 		failure_return(("len %lld is negative in unzip_match!\n",len), -1);
 
-	total = 0;
 	cur_pos = seekcur_fdout(control);
 	if (unlikely(cur_pos == -1))
 		fatal_return(("Seek failed on out file in unzip_match.\n"), -1);
@@ -211,42 +334,47 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, uint32 *cksum,
 	offset = read_vchars(control, ss, 0, chunk_bytes);
 	if (unlikely(offset == -1))
 		return -1;
-	if (unlikely(seekto_fdhist(control, cur_pos - offset) == -1))
-		fatal_return(("Seek failed by %d from %d on history file in unzip_match\n",
-		      offset, cur_pos), -1);
-
-	buf = (uchar *)malloc(len);
-	if (unlikely(!buf))
-		fatal_return(("Failed to malloc match buffer of size %lld\n", len), -1);
-	off_buf = buf;
-
-	while (len) {
-		n = MIN(len, offset);
-		if (unlikely(n < 1))
-			fatal_return(("Failed fd history in unzip_match due to corrupt archive\n"), -1);
-
-		if (unlikely(read_fdhist(control, off_buf, (size_t)n) != (ssize_t)n)) {
-			dealloc(buf);
-			fatal_return(("Failed to read %d bytes in unzip_match\n", n), -1);
-		}
-		if (unlikely(write_1g(control, off_buf, (size_t)n) != (ssize_t)n)) {
-			dealloc(buf);
-			fatal_return(("Failed to write %d bytes in unzip_match\n", n), -1);
-		}
-
-		if (!HAS_MD5)
-			*cksum = CrcUpdate(*cksum, off_buf, n);
-		if (!NO_MD5)
-			gcry_md_write(control->gcry_md5_handle, off_buf, n);
-
-		len -= n;
-		off_buf += n;
-		total += n;
+	if (offset > cur_pos + control->ref_base)
+		return unzip_ref_match(control, control->ref_len + cur_pos + control->ref_base - offset, len, cksum);
+
+	/* While the output still fits in tmp_outbuf the history is all in
+	 * ram, so build the match in place rather than going through a
+	 * bounce buffer. Anything else takes the slow path below, which
+	 * also deals with tmp_outbuf overflowing. */
+	if (TMP_OUTBUF && offset > 0 && offset <= control->out_ofs &&
+	    control->out_ofs + len <= control->out_maxlen) {
+		off_buf = control->tmp_outbuf + control->out_ofs;
+		copy_match(off_buf, offset, len);
+		if (unlikely(!cksum_update(control, cksum, off_buf, len)))
+			return -1;
+		control->out_ofs += len;
+		if (likely(control->out_ofs > control->out_len))
+			control->out_len = control->out_ofs;
+		return len;
 	}
-
-	dealloc(buf);
-
-	return total;
+	/* Otherwise the bytes the match starts on are read back from the
+	 * output once and the rest rebuilt from them in ram, in a buffer kept
+	 * for the matches that follow, so each match is a single read and
+	 * write */
+	n = MIN(len, offset);
+	if (unlikely(n < 1))
+		fatal_return(("Failed fd history in unzip_match due to corrupt archive\n"), -1);
+	if (len > control->match_buflen) {
+		buf = realloc(control->match_buf, len);
+		if (unlikely(!buf))
+			fatal_return(("Failed to malloc match buffer of size %lld\n", len), -1);
+		control->match_buf = buf;
+		control->match_buflen = len;
+	}
+	buf = control->match_buf;
+	if (unlikely(read_fdhist_at(control, buf, n, cur_pos - offset) != n))
+		fatal_return(("Failed to read %lld bytes from %lld in unzip_match\n", n, cur_pos - offset), -1);
+	copy_match(buf + n, offset, len - n);
+	if (unlikely(write_1g(control, buf, len) != len))
+		fatal_return(("Failed to write %lld bytes in unzip_match\n", len), -1);
+	if (unlikely(!cksum_update(control, cksum, buf, len)))
+		return -1;
+	return len;
 }
 
 static void clear_rulist(rzip_control *control)
@@ -256,7 +384,6 @@ static void clear_rulist(rzip_control *control)
 		struct stream_info *sinfo = node->sinfo;
 
 		dealloc(sinfo->ucthreads);
-		dealloc(node->pthreads);
 		dealloc(sinfo->s);
 		dealloc(sinfo);
 		control->ruhead = node->prev;
@@ -320,7 +447,10 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	if (unlikely(ofs == -1))
 		fatal_return(("Failed to seek input file in runzip_fd\n"), -1);
 
-	if (fstat(fd_in, &st) || st.st_size - ofs == 0)
+	if (control->in_buffer) {
+		if (ofs == control->in_maxlen)
+			return 0;
+	} else if (fstat(fd_in, &st) || st.st_size - ofs == 0)
 		return 0;
 
 	ss = open_stream_in(control, fd_in, NUM_STREAMS, chunk_bytes);
@@ -363,11 +493,17 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 				prog_done = (double)(tally + total) / (double)divisor[divisor_index];
 				print_progress("%3d%%  %9.2f / %9.2f %s\r",
 						p, prog_done, prog_tsize, suffix[divisor_index] );
+				report_stats(control, p);
 				lasttime.tv_sec = curtime.tv_sec;
 			}
 		}
 	}
 
+	if (unlikely(!cksum_wait(control, &cksum))) {
+		close_stream_in(control, ss);
+		return -1;
+	}
+
 	if (!HAS_MD5) {
 		good_cksum = read_u32(control, ss, 0, &err);
 		if (unlikely(err)) {
@@ -396,20 +532,31 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
  */
 i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 expected_size)
 {
-	uchar md5_stored[MD5_DIGEST_SIZE];
+	uchar md5_stored[MAX_DIGEST_SIZE];
 	struct timeval start,end;
-	i64 total = 0, u;
+	i64 total = 0, u, chunk_start = 0, chunk_cpu = 0;
 	double tdiff;
 
 	if (!NO_MD5) {
-		gcry_md_open(&control->gcry_md5_handle, GCRY_MD_MD5, GCRY_MD_FLAG_SECURE);
+		gcry_md_open(&control->gcry_md5_handle, HASH_ALGO, GCRY_MD_FLAG_SECURE);
 		if ((unlikely(control->gcry_md5_handle == NULL)))
 			failure("Unable to set md5 handle in runzip_fd\n");
 	}
+	cksem_init(control, &control->cksumsem);
+	cksem_post(control, &control->cksumsem);
 	gettimeofday(&start,NULL);
+	control->ref_base = 0;
 
 	do {
+		if (control->stats) {
+			chunk_start = stats_usecs();
+			chunk_cpu = stats_cpu_usecs();
+		}
 		u = runzip_chunk(control, fd_in, expected_size, total);
+		if (control->stats && u > 0) {
+			stats_chunk(control, u, stats_usecs() - chunk_start, stats_cpu_usecs() - chunk_cpu);
+			stats_io(control, 0, u);
+		}
 		if (u < 1) {
 			if (u < 0 || total < expected_size) {
 				print_err("Failed to runzip_chunk in runzip_fd\n");
@@ -427,6 +574,8 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 				print_err("Failed to dump_tmpoutfile in runzip_fd\n");
 				return -1;
 			}
+			/* The temporary file starts again from the next chunk */
+			control->ref_base = total;
 		}
 		if (TMP_INBUF)
 			clear_tmpinbuf(control);
@@ -438,6 +587,11 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 		}
 	} while (total < expected_size || (!expected_size && !control->eof));
 
+	dealloc(control->match_buf);
+	control->match_buflen = 0;
+	if (unlikely(!close_streamin_threads(control)))
+		return -1;
+
 	gettimeofday(&end,NULL);
 	if (!ENCRYPT) {
 		tdiff = end.tv_sec - start.tv_sec;
@@ -450,36 +604,37 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 	if (!NO_MD5) {
 		int i,j;
 
-		memcpy(control->gcry_md5_resblock, gcry_md_read(control->gcry_md5_handle, GCRY_MD_MD5), MD5_DIGEST_SIZE);
+		memcpy(control->gcry_md5_resblock, gcry_md_read(control->gcry_md5_handle, HASH_ALGO), HASH_DIGEST_SIZE);
+		gcry_md_close(control->gcry_md5_handle);
 		if (HAS_MD5) {
 			i64 fdinend = seekto_fdinend(control);
 
 			if (unlikely(fdinend == -1))
 				failure_return(("Failed to seekto_fdinend in rzip_fd\n"), -1);
-			if (unlikely(seekto_fdin(control, fdinend - MD5_DIGEST_SIZE) == -1))
+			if (unlikely(seekto_fdin(control, fdinend - HASH_DIGEST_SIZE) == -1))
 				failure_return(("Failed to seekto_fdin in rzip_fd\n"), -1);
 
-			if (unlikely(read_1g(control, fd_in, md5_stored, MD5_DIGEST_SIZE) != MD5_DIGEST_SIZE))
+			if (unlikely(read_1g(control, fd_in, md5_stored, HASH_DIGEST_SIZE) != HASH_DIGEST_SIZE))
 				fatal_return(("Failed to read md5 data in runzip_fd\n"), -1);
 			if (ENCRYPT)
 				// pass decrypt flag
-				if (unlikely(!lrz_decrypt(control, md5_stored, MD5_DIGEST_SIZE, control->salt_pass, LRZ_DECRYPT)))
+				if (unlikely(!lrz_decrypt(control, md5_stored, HASH_DIGEST_SIZE, control->salt_pass, LRZ_DECRYPT)))
 					return -1;
-			for (i = 0; i < MD5_DIGEST_SIZE; i++)
+			for (i = 0; i < HASH_DIGEST_SIZE; i++)
 				if (md5_stored[i] != control->gcry_md5_resblock[i]) {
-					print_output("MD5 CHECK FAILED.\nStored:");
-					for (j = 0; j < MD5_DIGEST_SIZE; j++)
+					print_output("%s CHECK FAILED.\nStored:", HASH_NAME);
+					for (j = 0; j < HASH_DIGEST_SIZE; j++)
 						print_output("%02x", md5_stored[j]);
 					print_output("\nOutput file:");
-					for (j = 0; j < MD5_DIGEST_SIZE; j++)
+					for (j = 0; j < HASH_DIGEST_SIZE; j++)
 						print_output("%02x", control->gcry_md5_resblock[j]);
 					failure_return(("\n"), -1);
 				}
 		}
 
 		if (HASH_CHECK || MAX_VERBOSE) {
-			print_output("MD5: ");
-			for (i = 0; i < MD5_DIGEST_SIZE; i++)
+			print_output("%s: ", HASH_NAME);
+			for (i = 0; i < HASH_DIGEST_SIZE; i++)
 				print_output("%02x", control->gcry_md5_resblock[i]);
 			print_output("\n");
 		}
@@ -490,25 +645,25 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 
 			if (TMP_OUTBUF)
 				close_tmpoutbuf(control);
-			memcpy(md5_stored, control->gcry_md5_resblock, MD5_DIGEST_SIZE);
+			memcpy(md5_stored, control->gcry_md5_resblock, HASH_DIGEST_SIZE);
 			if (unlikely(seekto_fdhist(control, 0) == -1))
 				fatal_return(("Failed to seekto_fdhist in runzip_fd\n"), -1);
 			if (unlikely((md5_fstream = fdopen(fd_hist, "r")) == NULL))
 				fatal_return(("Failed to fdopen fd_hist in runzip_fd\n"), -1);
-			if (unlikely(md5_stream(md5_fstream, control->gcry_md5_resblock)))
+			if (unlikely(md5_stream(md5_fstream, control->gcry_md5_resblock, HASH_ALGO, HASH_DIGEST_SIZE)))
 				fatal_return(("Failed to md5_stream in runzip_fd\n"), -1);
 			/* We don't close the file here as it's closed in main */
-			for (i = 0; i < MD5_DIGEST_SIZE; i++)
+			for (i = 0; i < HASH_DIGEST_SIZE; i++)
 				if (md5_stored[i] != control->gcry_md5_resblock[i]) {
-					print_output("MD5 CHECK FAILED.\nStored:");
-					for (j = 0; j < MD5_DIGEST_SIZE; j++)
+					print_output("%s CHECK FAILED.\nStored:", HASH_NAME);
+					for (j = 0; j < HASH_DIGEST_SIZE; j++)
 						print_output("%02x", md5_stored[j]);
 					print_output("\nOutput file:");
-					for (j = 0; j < MD5_DIGEST_SIZE; j++)
+					for (j = 0; j < HASH_DIGEST_SIZE; j++)
 						print_output("%02x", control->gcry_md5_resblock[j]);
 					failure_return(("\n"), -1);
 				}
-			print_output("MD5 integrity of written file matches archive\n");
+			print_output("%s integrity of written file matches archive\n", HASH_NAME);
 			if (!HAS_MD5)
 				print_output("Note this lrzip archive did not have a stored md5 value.\n"
 				"The archive decompression was validated with crc32 and the md5 hash was "
@@ -519,15 +674,154 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 	return total;
 }
 
+/* Decompress only the chunks holding range_start to range_start + range_len,
+ * found through the trailing chunk index, then move the wanted bytes to the
+ * start of the output file. A chunk cannot be entered part way as matches
+ * reach back anywhere inside it, so every chunk touched is rebuilt whole.
+ * Return the number of bytes extracted */
+i64 runzip_range(rzip_control *control, int fd_in, int fd_out, int fd_hist)
+{
+	i64 *index = control->index, start = control->range_start, end, first, last, i;
+	i64 total = 0, done, u;
+	uchar *buf;
+
+	end = start + control->range_len;
+	if (unlikely(end > control->index_ulen))
+		failure_return(("Range %lld:%lld is beyond the %lld bytes in the archive\n",
+			start, control->range_len, control->index_ulen), -1);
+	for (first = control->index_chunks - 1; index[first * 2 + 1] > start; first--);
+	for (last = first; last + 1 < control->index_chunks && index[(last + 1) * 2 + 1] < end; last++);
+	print_verbose("Range %lld:%lld is in chunk %lld to %lld of %lld\n", start, control->range_len,
+		      first + 1, last + 1, control->index_chunks);
+
+	if (!NO_MD5) {
+		gcry_md_open(&control->gcry_md5_handle, HASH_ALGO, GCRY_MD_FLAG_SECURE);
+		if ((unlikely(control->gcry_md5_handle == NULL)))
+			failure_return(("Unable to set md5 handle in runzip_range\n"), -1);
+	}
+	cksem_init(control, &control->cksumsem);
+	cksem_post(control, &control->cksumsem);
+
+	if (unlikely(seekto_fdin(control, index[first * 2]) == -1))
+		fatal_return(("Failed to seek to chunk %lld in runzip_range\n", first + 1), -1);
+	/* Matches into a reference count from the start of the whole file */
+	control->ref_base = index[first * 2 + 1];
+	for (i = first; i <= last; i++) {
+		u = runzip_chunk(control, fd_in, end - index[first * 2 + 1], total);
+		if (unlikely(u < 1))
+			failure_return(("Failed to runzip_chunk in runzip_range\n"), -1);
+		total += u;
+		if (TMP_OUTBUF && unlikely(!flush_tmpoutbuf(control)))
+			failure_return(("Failed to flush_tmpoutbuf in runzip_range\n"), -1);
+	}
+	dealloc(control->match_buf);
+	control->match_buflen = 0;
+	if (unlikely(!close_streamin_threads(control)))
+		return -1;
+	if (!NO_MD5)
+		gcry_md_close(control->gcry_md5_handle);
+	if (HAS_MD5)
+		print_verbose("%s covers the whole file so it is not checked for a range\n", HASH_NAME);
+
+	buf = malloc(1 << 20);
+	if (unlikely(!buf))
+		fatal_return(("Failed to malloc range buffer\n"), -1);
+	start -= index[first * 2 + 1];
+	for (done = 0; done < control->range_len; done += u) {
+		u = MIN(control->range_len - done, 1 << 20);
+		if (unlikely(pread(fd_hist, buf, u, start + done) != u ||
+			     pwrite(fd_out, buf, u, done) != u)) {
+			dealloc(buf);
+			fatal_return(("Failed to move range to the start of the output file\n"), -1);
+		}
+	}
+	dealloc(buf);
+	if (unlikely(ftruncate(fd_out, control->range_len)))
+		fatal_return(("Failed to truncate output file to range length\n"), -1);
+	return control->range_len;
+}
+
+/* Recompress every block of an open archive with the backend of out, for
+ * --transcode. Each chunk is opened for reading as for decompression and its
+ * streams are written out again as they are, so the blocks decode in the
+ * threads of control while those of out encode them, and the rzip pass is
+ * never done again. Returns the bytes the chunks hold uncompressed */
+i64 transcode_fd(rzip_control *control, rzip_control *out, int fd_in, i64 infile_size)
+{
+	struct stream_info *sinfo_in, *sinfo_out;
+	struct node *head = NULL, *node;
+	i64 total = 0, n;
+	char chunk_bytes;
+	uchar *p;
+	int i;
+
+	if (out->flags & FLAG_LZO_COMPRESS && unlikely(lzo_init() != LZO_E_OK))
+		failure_return(("lzo_init() failed\n"), -1);
+	if (unlikely(!prepare_streamout_threads(out)))
+		return -1;
+	do {
+		print_maxverbose("Reading chunk_bytes at %lld\n", get_readseek(control, fd_in));
+		if (unlikely(read_1g(control, fd_in, &chunk_bytes, 1) != 1))
+			fatal_return(("Failed to read chunk_bytes size in transcode_fd\n"), -1);
+		if (unlikely(chunk_bytes < 1 || chunk_bytes > 8))
+			failure_return(("chunk_bytes %d is invalid in transcode_fd\n", chunk_bytes), -1);
+		sinfo_in = open_stream_in(control, fd_in, NUM_STREAMS, chunk_bytes);
+		if (unlikely(!sinfo_in))
+			failure_return(("Failed to open_stream_in in transcode_fd\n"), -1);
+
+		/* The chunk keeps its byte width, size and end of file flag */
+		out->eof = control->eof;
+		sinfo_out = open_stream_out(out, out->fd_out, NUM_STREAMS, sinfo_in->size, chunk_bytes);
+		if (unlikely(!sinfo_out))
+			failure_return(("Failed to open_stream_out in transcode_fd\n"), -1);
+		sinfo_out->size = sinfo_in->size;
+
+		for (i = 0; i < NUM_STREAMS; i++) {
+			while ((n = peek_stream(control, sinfo_in, i, &p, sinfo_out->bufsize)) > 0)
+				write_stream(out, sinfo_out, i, p, n);
+			if (unlikely(n == -1))
+				failure_return(("Failed to read stream %d in transcode_fd\n", i), -1);
+		}
+		total += sinfo_in->size;
+
+		if (unlikely(close_stream_in(control, sinfo_in)))
+			fatal_return(("Failed to close stream in transcode_fd\n"), -1);
+		clear_rulist(control);
+		if (unlikely(close_stream_out(out, sinfo_out)))
+			fatal_return(("Failed to flush/close streams in transcode_fd\n"), -1);
+		/* Released once the writer is done with it */
+		node = malloc(sizeof(struct node));
+		if (unlikely(!node))
+			fatal_return(("Failed to malloc struct node in transcode_fd\n"), -1);
+		node->data = sinfo_out;
+		node->prev = head;
+		head = node;
+
+		print_progress("%3d%%\r", (int)(100 * get_readseek(control, fd_in) / MAX(infile_size, 1)));
+	} while (!control->eof);
+
+	if (unlikely(!close_streamin_threads(control) || !close_streamout_threads(out)))
+		return -1;
+	while (head) {
+		node = head;
+		sinfo_out = node->data;
+		dealloc(sinfo_out->s);
+		dealloc(sinfo_out);
+		head = node->prev;
+		dealloc(node);
+	}
+	return total;
+}
+
 /* Work Function to compute an md5 from a file stream
  * Taken from the old md5.c file and updated to use gcrypt
  */
 
-/* Compute MD5 message digest for bytes read from STREAM.  The
-   resulting message digest number will be written into the 16 bytes
+/* Compute the ALGO message digest for bytes read from STREAM.  The
+   resulting message digest number will be written into the LEN bytes
    beginning at RESBLOCK.  */
 #define BLOCKSIZE 32768
-int md5_stream (FILE *stream, uchar *resblock)
+int md5_stream (FILE *stream, uchar *resblock, int algo, int len)
 {
 	gcry_md_hd_t gcry_md5_handle;
 	size_t sum;
@@ -536,7 +830,7 @@ int md5_stream (FILE *stream, uchar *resblock)
 	if (!buffer)
 		return 1;
 
-	gcry_md_open(&gcry_md5_handle, GCRY_MD_MD5, GCRY_MD_FLAG_SECURE);
+	gcry_md_open(&gcry_md5_handle, algo, GCRY_MD_FLAG_SECURE);
 
 	/* Iterate over full file contents.  */
 	while (1)
@@ -573,7 +867,7 @@ process_partial_block:
 		gcry_md_write(gcry_md5_handle, buffer, sum);
 
 	/* Construct result in desired memory.  */
-	memcpy(resblock, gcry_md_read(gcry_md5_handle, GCRY_MD_MD5), MD5_DIGEST_SIZE);
+	memcpy(resblock, gcry_md_read(gcry_md5_handle, algo), len);
 	gcry_md_close(gcry_md5_handle);
 	free (buffer);
 	return 0;
@@ -55,6 +55,7 @@
 #include "stream.h"
 #include "util.h"
 #include "lrzip_core.h"
+#include "archive.h"
 /* needed for CRC routines */
 #include "7zCrc.h"
 #include <gcrypt.h>
@@ -65,8 +66,12 @@
 
 #define CHUNK_MULTIPLE (100 * 1024 * 1024)
 #define CKSUM_CHUNK 1024*1024
+#define CKSUM_STRIDE (64 * 1024)
 #define GREAT_MATCH 1024
 #define MINIMUM_MATCH 31
+#define TAG_BLOCK (256 * 1024)
+#define TAG_BATCH 4096
+#define TAG_BATCH_MIN 256
 
 /* Hash table works as follows.  We start by throwing tags at every
  * offset into the table.  As it fills, we start eliminating tags
@@ -75,13 +80,38 @@
  * that on average, all parts of the file are covered by the hash, if
  * sparsely. */
 
-/* All zero means empty.  We might miss the first chunk this way. */
+/* Offset and tag as looked up by hash_search */
 struct hash_entry {
 	i64 offset;
 	tag t;
 };
 
-/* Levels control hashtable size and bzip2 level. */
+/* The match currently being extended by hash_search */
+struct current_match {
+	i64 p;
+	i64 ofs;
+	i64 len;
+};
+
+/* When the whole chunk is mapped, tag generation is split across threads.
+ * Each thread rolls the tag over its own block of the chunk and keeps only
+ * the offsets whose tags have at least initial_freq low bits set, since no
+ * other offset can ever be looked up or inserted in the hash table. The hash
+ * table itself is still only touched by hash_search so the output does not
+ * depend on the number of threads. */
+struct tag_block {
+	rzip_control *control;
+	struct rzip_state *st;
+	struct hash_entry *cands;	/* Candidate offsets and their tags */
+	i64 ncands;
+	i64 size;			/* Entries allocated in cands */
+	i64 start;			/* First offset of the block */
+	i64 end;			/* One past the last offset */
+	pthread_t thread;
+};
+
+/* Levels control hashtable size and bzip2 level. Each run works on a copy of
+ * its level, which --rzip-table, size_hash and --rzip-tune adjust. */
 static struct level {
 	unsigned long mb_used;
 	unsigned initial_freq;
@@ -94,11 +124,19 @@ static struct level {
 	{ 16, 4, 3 },
 	{ 32, 4, 4 },
 	{ 32, 2, 6 },
-	{ 64, 1, 16 }, /* More MB makes sense, but need bigger test files */
+	{ 64, 1, 16 }, /* Grown by size_hash for chunks that need more */
 	{ 64, 1, 32 },
 	{ 64, 1, 128 },
 };
 
+/* The high buffer windows start at this size and double each time the
+ * cache of them overflows */
+#define SB_HIGH_MIN	(1024 * 1024)
+#define SB_HIGH_MAX	(sizeof(long) > 4 ? 32 * 1024 * 1024 : 4 * 1024 * 1024)
+/* How much of the low buffer is read in ahead of the search, and how far
+ * behind the last match it is kept mapped in sliding mode */
+#define SB_AHEAD	(16 * 1024 * 1024)
+
 static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 {
 	i64 new_offset;
@@ -114,28 +152,103 @@ static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 	sb->buf_low = (uchar *)mmap(sb->buf_low, sb->size_low, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_low);
 	if (unlikely(sb->buf_low == MAP_FAILED))
 		failure("Failed to re mmap in remap_low_sb\n");
+	sb->advised = sb->dropped = new_offset;
+}
+
+/* Read the low buffer in ahead of the search so it does not stall on page
+ * faults. In sliding mode ram is short, so also unmap what lies well behind
+ * the last match; it is only looked at again through the high buffer or as
+ * a refault from the page cache. */
+static void advise_low_sb(rzip_control *control, struct rzip_state *st, struct sliding_buffer *sb)
+{
+	i64 start = sb->offset_search - sb->offset_low, end;
+
+	sb->advised = sb->offset_search + SB_AHEAD / 2;
+	if (STDIN)
+		return;
+	start -= (start + sb->map_lead) % control->page_size;
+	end = MIN(start + SB_AHEAD, sb->size_low);
+	if (end > start)
+		madvise(sb->buf_low + start, end - start, MADV_WILLNEED);
+
+	if (st->mmap_size >= st->chunk_size)
+		return;
+	end = st->last_match - SB_AHEAD - sb->offset_low;
+	end -= end % control->page_size;
+	start = sb->dropped - sb->offset_low;
+	if (end - start >= SB_AHEAD) {
+		madvise(sb->buf_low + start, end - start, MADV_DONTNEED);
+		sb->dropped = sb->offset_low + end;
+	}
 }
 
-static inline void remap_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
+static void map_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
 {
-	if (unlikely(munmap(sb->buf_high, sb->size_high)))
-		failure("Failed to munmap in remap_high_sb\n");
 	sb->size_high = sb->high_length; /* In case we shrunk it when we hit the end of the file */
-	sb->offset_high = p;
+	/* Start a little below p as matches are extended backwards too */
+	sb->offset_high = MAX(p - sb->high_length / 8, 0);
 	/* Make sure offset is rounded to page size of total offset */
 	sb->offset_high -= (sb->offset_high + sb->orig_offset) % control->page_size;
 	if (unlikely(sb->offset_high + sb->size_high > sb->orig_size))
 		sb->size_high = sb->orig_size - sb->offset_high;
-	sb->buf_high = (uchar *)mmap(sb->buf_high, sb->size_high, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_high);
+	sb->buf_high = (uchar *)mmap(NULL, sb->size_high, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_high);
 	if (unlikely(sb->buf_high == MAP_FAILED))
 		failure("Failed to re mmap in remap_high_sb\n");
 }
 
+/* Make the high buffer cover p. The previous high buffers are kept as a
+ * cache of windows, so offsets that keep coming back are found without
+ * a remap. When the cache overflows the oldest window goes and new ones
+ * are made larger. */
+static void remap_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
+{
+	struct sb_window cur = { sb->buf_high, sb->offset_high, sb->size_high };
+	int i;
+
+	for (i = 0; i < sb->nwindows; i++) {
+		if (p >= sb->windows[i].offset && p < sb->windows[i].offset + sb->windows[i].size)
+			break;
+	}
+	if (i < sb->nwindows) {
+		sb->buf_high = sb->windows[i].buf;
+		sb->offset_high = sb->windows[i].offset;
+		sb->size_high = sb->windows[i].size;
+		memmove(&sb->windows[1], &sb->windows[0], sizeof(struct sb_window) * i);
+		sb->windows[0] = cur;
+		return;
+	}
+
+	if (sb->nwindows == SB_WINDOWS) {
+		sb->nwindows--;
+		if (unlikely(munmap(sb->windows[sb->nwindows].buf, sb->windows[sb->nwindows].size)))
+			failure("Failed to munmap in remap_high_sb\n");
+		if (sb->high_length < (i64)SB_HIGH_MAX) {
+			sb->high_length *= 2;
+			print_maxverbose("Growing sliding mmap high buffer to %lld bytes\n", sb->high_length);
+		}
+	}
+	memmove(&sb->windows[1], &sb->windows[0], sizeof(struct sb_window) * sb->nwindows++);
+	sb->windows[0] = cur;
+	map_high_sb(control, sb, p);
+}
+
+static bool unmap_high_sb(struct sliding_buffer *sb)
+{
+	bool ret = !munmap(sb->buf_high, sb->size_high);
+
+	while (sb->nwindows) {
+		sb->nwindows--;
+		if (munmap(sb->windows[sb->nwindows].buf, sb->windows[sb->nwindows].size))
+			ret = false;
+	}
+	return ret;
+}
+
 /* We use a "sliding mmap" to effectively read more than we can fit into the
  * compression window. This is done by using a maximally sized lower mmap at
  * the beginning of the block which slides up once the hash search moves beyond
- * it, and a 64k mmap block that slides up and down as is required for any
- * offsets outside the range of the lower one. This is much slower than mmap
+ * it, and a cache of high mmap windows that are mapped as is required for
+ * any offsets outside the range of the lower one. This is much slower than mmap
  * but makes it possible to have unlimited sized compression windows.
  * We use a pointer to the function we actually want to use and only enable
  * the sliding mmap version if we need sliding mmap functionality as this is
@@ -198,29 +311,65 @@ static void sliding_mcpy(rzip_control *control, unsigned char *buf, i64 offset,
 	}
 }
 
-/* All put_u8/u32/vchars go to stream 0 */
-static inline void put_u8(rzip_control *control, void *ss, uchar b)
+/* The search is built twice from the functions taking a constant sliding,
+ * once for a chunk mapped whole and once for the sliding buffer, so that the
+ * common case has no indirect calls or window checks in it. The mode is set
+ * once per run, by do_mcpy becoming sliding_mcpy. */
+static inline bool sliding_mode(rzip_control *control)
 {
-	write_stream(control, ss, 0, &b, 1);
+	return control->do_mcpy == &sliding_mcpy;
 }
 
-static inline void put_u32(rzip_control *control, void *ss, uint32_t s)
+static __always_inline void mcpy(rzip_control *control, const bool sliding,
+				 unsigned char *buf, i64 offset, i64 len)
 {
-	s = htole32(s);
-	write_stream(control, ss, 0, (uchar *)&s, 4);
+	if (sliding)
+		sliding_mcpy(control, buf, offset, len);
+	else
+		single_mcpy(control, buf, offset, len);
+}
+
+/* Match and literal records are staged in st->recs and go to stream 0 in
+ * one copy when it fills, rather than a write_stream for every field */
+static void flush_recs(rzip_control *control, struct rzip_state *st)
+{
+	struct stream_info *sinfo = st->ss;
+	struct stream *s = &sinfo->s[0];
+
+	/* Straight into the stream buffer if it all fits, which it will
+	 * other than once per block */
+	if (likely(s->buflen + st->recs_len <= sinfo->bufsize)) {
+		memcpy(s->buf + s->buflen, st->recs, st->recs_len);
+		s->buflen += st->recs_len;
+	} else
+		write_stream(control, sinfo, 0, st->recs, st->recs_len);
+	st->recs_len = 0;
 }
 
-/* Put a variable length of bytes dependant on how big the chunk is */
-static void put_vchars(rzip_control *control, void *ss, i64 s, i64 length)
+/* Stage one record. The offset is stored whole, little endian, and only
+ * ofs_bytes of it kept */
+static inline void put_record(rzip_control *control, struct rzip_state *st,
+			      uchar head, i64 len, i64 ofs, int ofs_bytes)
 {
-	s = htole64(s);
-	write_stream(control, ss, 0, (uchar *)&s, length);
+	uchar *rec;
+	uint16_t l16;
+	uint64_t o64;
+
+	if (unlikely(st->recs_len > RECS_SIZE - REC_MAX))
+		flush_recs(control, st);
+	rec = st->recs + st->recs_len;
+	l16 = htole16(len);
+	o64 = htole64(ofs);
+	rec[0] = head;
+	memcpy(rec + 1, &l16, 2);
+	memcpy(rec + 3, &o64, 8);
+	st->recs_len += 3 + ofs_bytes;
 }
 
-static void put_header(rzip_control *control, void *ss, uchar head, i64 len)
+static inline void put_u32(rzip_control *control, void *ss, uint32_t s)
 {
-	put_u8(control, ss, head);
-	put_vchars(control, ss, len, 2);
+	s = htole32(s);
+	write_stream(control, ss, 0, (uchar *)&s, 4);
 }
 
 static inline void put_match(rzip_control *control, struct rzip_state *st,
@@ -233,8 +382,7 @@ static inline void put_match(rzip_control *control, struct rzip_state *st,
 			n = 0xFFFF;
 
 		ofs = (p - offset);
-		put_header(control, st->ss, 1, n);
-		put_vchars(control, st->ss, ofs, st->chunk_bytes);
+		put_record(control, st, 1, n, ofs, st->chunk_bytes);
 		st->stats.matches++;
 		st->stats.match_bytes += n;
 		len -= n;
@@ -244,26 +392,29 @@ static inline void put_match(rzip_control *control, struct rzip_state *st,
 }
 
 /* write some data to a stream mmap encoded. Return -1 on failure */
-static inline void write_sbstream(rzip_control *control, void *ss, int stream,
-				 i64 p, i64 len)
+static __always_inline void write_sbstream(rzip_control *control, void *ss, int stream,
+					  i64 p, i64 len, const bool sliding)
 {
 	struct stream_info *sinfo = ss;
 
 	while (len) {
-		i64 n = MIN(sinfo->bufsize - sinfo->s[stream].buflen, len);
+		i64 n;
 
-		control->do_mcpy(control, sinfo->s[stream].buf + sinfo->s[stream].buflen, p, n);
+		/* Only flushed once more data follows, as in write_stream */
+		if (sinfo->s[stream].buflen == sinfo->bufsize)
+			flush_buffer(control, sinfo, stream);
+
+		n = MIN(sinfo->bufsize - sinfo->s[stream].buflen, len);
+		mcpy(control, sliding, sinfo->s[stream].buf + sinfo->s[stream].buflen, p, n);
 
 		sinfo->s[stream].buflen += n;
 		p += n;
 		len -= n;
-
-		if (sinfo->s[stream].buflen == sinfo->bufsize)
-			flush_buffer(control, sinfo, stream);
 	}
 }
 
-static void put_literal(rzip_control *control, struct rzip_state *st, i64 last, i64 p)
+static __always_inline void put_literal(rzip_control *control, struct rzip_state *st,
+					i64 last, i64 p, const bool sliding)
 {
 	do {
 		i64 len = p - last;
@@ -274,18 +425,55 @@ static void put_literal(rzip_control *control, struct rzip_state *st, i64 last,
 		st->stats.literals++;
 		st->stats.literal_bytes += len;
 
-		put_header(control, st->ss, 0, len);
+		put_record(control, st, 0, len, 0, 0);
 
 		if (len)
-			write_sbstream(control, st->ss, 1, last, len);
+			write_sbstream(control, st->ss, 1, last, len, sliding);
 		last += len;
 	} while (p > last);
 }
 
-/* Could give false positive on offset 0.  Who cares. */
-static inline bool empty_hash(struct hash_entry *he)
+/* The hash table is an array of 64 bit slots, each holding an offset in the
+ * high bits and as many low bits of its tag as will fit below it. Only the low
+ * bits of a tag are used for bucket selection and cleaning so truncating it
+ * only costs the odd extra false positive in find_best_match, while halving
+ * the size of each entry doubles the number of them for a given mb_used and
+ * puts 8 consecutive buckets in every cache line for linear probing.
+ * All zero means empty.  We might miss the first chunk this way. */
+static inline bool empty_hash(hash_slot s)
+{
+	return !s;
+}
+
+static inline tag slot_tag(struct rzip_state *st, hash_slot s)
+{
+	return s & st->slot_tag_mask;
+}
+
+static inline i64 slot_offset(struct rzip_state *st, hash_slot s)
+{
+	return s >> st->slot_tag_bits;
+}
+
+static inline hash_slot make_slot(struct rzip_state *st, tag t, i64 offset)
+{
+	return ((hash_slot)offset << st->slot_tag_bits) | (t & st->slot_tag_mask);
+}
+
+/* The bits offsets into size bytes don't need, left for the tag */
+static int tag_bits_for(i64 size)
 {
-	return !(he->offset | he->t);
+	int bits = 1;
+
+	while (size >> bits > 0)
+		bits++;
+	return 64 - bits;
+}
+
+static void init_slot_bits(struct rzip_state *st)
+{
+	st->slot_tag_bits = tag_bits_for(st->chunk_size);
+	st->slot_tag_mask = ((hash_slot)1 << st->slot_tag_bits) - 1;
 }
 
 static i64 primary_hash(struct rzip_state *st, tag t)
@@ -322,16 +510,17 @@ static inline bool lesser_bitness(tag a, tag b)
 static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 {
 	i64 h, victim_h = 0, round = 0;
-	/* If we need to kill one, this will be it. */
-	static i64 victim_round = 0;
-	struct hash_entry *he;
+	hash_slot *he;
 
+	t &= st->slot_tag_mask;
 	h = primary_hash(st, t);
 	he = &st->hash_table[h];
-	while (!empty_hash(he)) {
+	while (!empty_hash(*he)) {
+		tag he_t = slot_tag(st, *he);
+
 		/* If this due for cleaning anyway, just replace it:
 		   rehashing might move it behind tag_clean_ptr. */
-		if (minimum_bitness(st, he->t)) {
+		if (minimum_bitness(st, he_t)) {
 			st->hash_count--;
 			break;
 		}
@@ -339,24 +528,24 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 		   jump over it: it will be cleaned before us, and
 		   noone would then find us in the hash table.  Rehash
 		   it, then take its place. */
-		if (lesser_bitness(he->t, t)) {
-			insert_hash(st, he->t,
-				    he->offset);
+		if (lesser_bitness(he_t, t)) {
+			insert_hash(st, he_t,
+				    slot_offset(st, *he));
 			break;
 		}
 
 		/* If we have lots of identical patterns, we end up
 		   with lots of the same hash number.  Discard random. */
-		if (he->t == t) {
-			if (round == victim_round)
+		if (he_t == t) {
+			/* If we need to kill one, this will be it. */
+			if (round == st->victim_round)
 				victim_h = h;
 			if (++round == st->level->max_chain_len) {
 				h = victim_h;
 				he = &st->hash_table[h];
 				st->hash_count--;
-				victim_round++;
-				if (victim_round == st->level->max_chain_len)
-					victim_round = 0;
+				if (++st->victim_round == st->level->max_chain_len)
+					st->victim_round = 0;
 				break;
 			}
 		}
@@ -366,15 +555,14 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 		he = &st->hash_table[h];
 	}
 
-	he->t = t;
-	he->offset = offset;
+	*he = make_slot(st, t, offset);
 }
 
 /* Eliminate one hash entry with minimum number of lower bits set.
    Returns tag requirement for any new entries. */
 static inline tag clean_one_from_hash(rzip_control *control, struct rzip_state *st)
 {
-	struct hash_entry *he;
+	hash_slot *he;
 	tag better_than_min;
 
 again:
@@ -384,11 +572,10 @@ again:
 
 	for (; st->tag_clean_ptr < (1U << st->hash_bits); st->tag_clean_ptr++) {
 		he = &st->hash_table[st->tag_clean_ptr];
-		if (empty_hash(he))
+		if (empty_hash(*he))
 			continue;
-		if ((he->t & better_than_min) != better_than_min) {
-			he->offset = 0;
-			he->t = 0;
+		if ((slot_tag(st, *he) & better_than_min) != better_than_min) {
+			*he = 0;
 			st->hash_count--;
 			return better_than_min;
 		}
@@ -446,96 +633,304 @@ static tag sliding_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
 	return ret;
 }
 
+/* Count how many of the len bytes at a and b match, comparing a word at a
+ * time. The first differing byte is found from the lowest set bit of the
+ * xor of the words on little endian and the highest on big endian. */
+static inline i64 match_fwd(const uchar *a, const uchar *b, i64 len)
+{
+	i64 n = 0;
+
+	while (n + 8 <= len) {
+		uint64_t x, y;
+
+		memcpy(&x, a + n, 8);
+		memcpy(&y, b + n, 8);
+		if (x != y) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+			return n + (__builtin_ctzll(x ^ y) >> 3);
+#else
+			return n + (__builtin_clzll(x ^ y) >> 3);
+#endif
+		}
+		n += 8;
+	}
+	while (n < len && a[n] == b[n])
+		n++;
+	return n;
+}
+
+/* As match_fwd but counting backwards through the bytes before a and b */
+static inline i64 match_rev(const uchar *a, const uchar *b, i64 len)
+{
+	i64 n = 0;
+
+	while (n + 8 <= len) {
+		uint64_t x, y;
+
+		memcpy(&x, a - n - 8, 8);
+		memcpy(&y, b - n - 8, 8);
+		if (x != y) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+			return n + (__builtin_clzll(x ^ y) >> 3);
+#else
+			return n + (__builtin_ctzll(x ^ y) >> 3);
+#endif
+		}
+		n += 8;
+	}
+	while (n < len && a[-n - 1] == b[-n - 1])
+		n++;
+	return n;
+}
+
 static i64
 single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 		 i64 end, i64 *rev)
 {
-	i64 p, len;
+	uchar *buf = control->sb.buf_low;
+	i64 len;
 
 	if (op >= p0)
 		return 0;
 
-	p = p0;
-	while (p < end && control->sb.buf_low[p] == control->sb.buf_low[op]) {
-		p++;
-		op++;
-	}
-	len = p - p0;
-	p = p0;
-	op -= len;
-
+	len = match_fwd(buf + p0, buf + op, end - p0);
 	end = MAX(0, st->last_match);
-
-	while (p > end && op > 0 && control->sb.buf_low[op - 1] == control->sb.buf_low[p - 1]) {
-		op--;
-		p--;
-	}
-
-	len += *rev = p0 - p;
+	len += *rev = match_rev(buf + p0, buf + op, MIN(p0 - end, op));
 	if (len < MINIMUM_MATCH)
 		return 0;
 
 	return len;
 }
 
+static inline bool in_low_sb(struct sliding_buffer *sb, i64 p)
+{
+	return (p >= sb->offset_low && p < sb->offset_low + sb->size_low);
+}
+
+/* Two offsets can only be compared in place while one of them is in the low
+ * buffer, since looking up the other may remap the high buffer. Otherwise we
+ * fall back to comparing a byte at a time. */
+static i64 sliding_match_fwd(rzip_control *control, i64 p, i64 op, i64 len)
+{
+	struct sliding_buffer *sb = &control->sb;
+	i64 n = 0;
+
+	while (n < len) {
+		i64 a = p + n, b = op + n, m, k;
+		uchar *pb;
+
+		if (!in_low_sb(sb, a)) {
+			if (!in_low_sb(sb, b)) {
+				if (*sliding_get_sb(control, a) != *sliding_get_sb(control, b))
+					break;
+				n++;
+				continue;
+			}
+			b = a;
+			a = op + n;
+		}
+		pb = sliding_get_sb(control, b);
+		m = MIN(len - n, MIN(sliding_get_sb_range(control, a), sliding_get_sb_range(control, b)));
+		k = match_fwd(sb->buf_low + a - sb->offset_low, pb, m);
+		n += k;
+		if (k < m)
+			break;
+	}
+	return n;
+}
+
+/* As sliding_match_fwd but counting backwards from the bytes before p and op */
+static i64 sliding_match_rev(rzip_control *control, i64 p, i64 op, i64 len)
+{
+	struct sliding_buffer *sb = &control->sb;
+	i64 n = 0;
+
+	while (n < len) {
+		i64 a = p - n - 1, b = op - n - 1, m, k;
+		uchar *pb;
+
+		if (!in_low_sb(sb, a)) {
+			if (!in_low_sb(sb, b)) {
+				if (*sliding_get_sb(control, a) != *sliding_get_sb(control, b))
+					break;
+				n++;
+				continue;
+			}
+			b = a;
+			a = op - n - 1;
+		}
+		pb = sliding_get_sb(control, b);
+		m = MIN(len - n, a - sb->offset_low + 1);
+		if (in_low_sb(sb, b))
+			m = MIN(m, b - sb->offset_low + 1);
+		else
+			m = MIN(m, b - sb->offset_high + 1);
+		k = match_rev(sb->buf_low + a - sb->offset_low + 1, pb + 1, m);
+		n += k;
+		if (k < m)
+			break;
+	}
+	return n;
+}
+
 static i64
 sliding_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 		  i64 end, i64 *rev)
 {
-	i64 p, len;
+	i64 len;
 
 	if (op >= p0)
 		return 0;
 
-	p = p0;
-	while (p < end && *sliding_get_sb(control, p) == *sliding_get_sb(control, op)) {
-		p++;
-		op++;
-	}
-	len = p - p0;
-	p = p0;
-	op -= len;
-
+	len = sliding_match_fwd(control, p0, op, end - p0);
 	end = MAX(0, st->last_match);
+	len += *rev = sliding_match_rev(control, p0, op, MIN(p0 - end, op));
+	if (len < MINIMUM_MATCH)
+		return 0;
 
-	while (p > end && op > 0 && *sliding_get_sb(control, op - 1) == *sliding_get_sb(control, p - 1)) {
-		op--;
-		p--;
-	}
+	return len;
+}
+
+/* As single_match_len with op in the reference file instead of the chunk */
+static i64
+ref_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
+	      i64 end, i64 *rev)
+{
+	uchar *buf = control->sb.buf_low, *ref = control->ref_buf;
+	i64 len;
 
-	len += *rev = p0 - p;
+	len = match_fwd(buf + p0, ref + op, MIN(end - p0, control->ref_len - op));
+	end = MAX(0, st->last_match);
+	len += *rev = match_rev(buf + p0, ref + op, MIN(p0 - end, op));
 	if (len < MINIMUM_MATCH)
 		return 0;
 
 	return len;
 }
 
-static inline i64
+/* Look for a longer match in the --reference file. A match into it is
+ * written as going back past the start of the output, by the reference
+ * length further than the start, which the offset is made to come out as.
+ * Only done when the whole chunk is mapped. */
+static void
+find_ref_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
+	       i64 end, i64 *offset, i64 *reverse, i64 *length)
+{
+	struct rzip_state *ref = st->ref;
+	hash_slot *he;
+	i64 rev = 0, h;
+
+	t &= ref->slot_tag_mask;
+	h = primary_hash(ref, t);
+	he = &ref->hash_table[h];
+	while (!empty_hash(*he)) {
+		i64 mlen;
+
+		if (t == slot_tag(ref, *he)) {
+			i64 he_offset = slot_offset(ref, *he);
+
+			mlen = ref_match_len(control, st, p, he_offset, end, &rev);
+			if (mlen) {
+				if (mlen > *length) {
+					*length = mlen;
+					*offset = he_offset - rev - control->ref_len - control->sb.orig_offset;
+					*reverse = rev;
+				}
+				st->stats.tag_hits++;
+			} else
+				st->stats.tag_misses++;
+		}
+
+		h++;
+		h &= ((1 << ref->hash_bits) - 1);
+		he = &ref->hash_table[h];
+	}
+}
+
+/* Whether t is an anchor that may be in the --long-range table. Anchors are
+ * kept with their far_shift low bits, which are all set, shifted out so the
+ * bits left spread them over the buckets */
+static inline bool far_wanted(struct rzip_state *st, tag t)
+{
+	tag low = ((tag)1 << st->far_shift) - 1;
+
+	return (t & low) == low &&
+		((t >> st->far_shift) & st->far->minimum_tag_mask) == st->far->minimum_tag_mask;
+}
+
+/* Look for a longer match among the sparse anchors of the --long-range
+ * table, which cover the whole chunk however full the dense table gets */
+static __always_inline void
+find_far_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
+	       i64 end, i64 *offset, i64 *reverse, i64 *length, const bool sliding)
+{
+	struct rzip_state *far = st->far;
+	hash_slot *he;
+	i64 rev = 0, h;
+
+	t = (t >> st->far_shift) & far->slot_tag_mask;
+	h = primary_hash(far, t);
+	he = &far->hash_table[h];
+	while (!empty_hash(*he)) {
+		i64 mlen;
+
+		if (t == slot_tag(far, *he)) {
+			i64 he_offset = slot_offset(far, *he);
+
+			if (sliding)
+				mlen = sliding_match_len(control, st, p, he_offset, end, &rev);
+			else
+				mlen = single_match_len(control, st, p, he_offset, end, &rev);
+			if (mlen) {
+				if (mlen > *length) {
+					*length = mlen;
+					*offset = he_offset - rev;
+					*reverse = rev;
+				}
+				st->stats.tag_hits++;
+			} else
+				st->stats.tag_misses++;
+		}
+
+		h++;
+		h &= ((1 << far->hash_bits) - 1);
+		he = &far->hash_table[h];
+	}
+}
+
+static __always_inline i64
 find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
-		i64 end, i64 *offset, i64 *reverse)
+		i64 end, i64 *offset, i64 *reverse, const bool sliding)
 {
-	struct hash_entry *he;
+	hash_slot *he;
 	i64 length = 0;
 	i64 rev;
 	i64 h;
+	tag full;
 
 	rev = 0;
 	*reverse = 0;
+	full = t;
+	t &= st->slot_tag_mask;
 
 	/* Could optimise: if lesser goodness, can stop search.  But
 	 * chains are usually short anyway. */
 	h = primary_hash(st, t);
 	he = &st->hash_table[h];
-	while (!empty_hash(he)) {
+	while (!empty_hash(*he)) {
 		i64 mlen;
 
-		if (t == he->t) {
-			mlen = control->match_len(control, st, p, he->offset, end,
-						  &rev);
+		if (t == slot_tag(st, *he)) {
+			i64 he_offset = slot_offset(st, *he);
+
+			if (sliding)
+				mlen = sliding_match_len(control, st, p, he_offset, end, &rev);
+			else
+				mlen = single_match_len(control, st, p, he_offset, end, &rev);
 			if (mlen) {
 				if (mlen > length) {
 					length = mlen;
-					(*offset) = he->offset - rev;
+					(*offset) = he_offset - rev;
 					(*reverse) = rev;
 				}
 				st->stats.tag_hits++;
@@ -548,22 +943,27 @@ find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
 		he = &st->hash_table[h];
 	}
 
+	if (st->far && far_wanted(st, full))
+		find_far_match(control, st, full, p, end, offset, reverse, &length, sliding);
+	if (!sliding && st->ref)
+		find_ref_match(control, st, full, p, end, offset, reverse, &length);
+
 	return length;
 }
 
 static void show_distrib(rzip_control *control, struct rzip_state *st)
 {
-	struct hash_entry *he;
+	hash_slot *he;
 	i64 primary = 0;
 	i64 total = 0;
 	i64 i;
 
 	for (i = 0; i < (1U << st->hash_bits); i++) {
 		he = &st->hash_table[i];
-		if (empty_hash(he))
+		if (empty_hash(*he))
 			continue;
 		total++;
-		if (primary_hash(st, he->t) == i)
+		if (primary_hash(st, slot_tag(st, *he)) == i)
 			primary++;
 	}
 
@@ -578,17 +978,36 @@ static void show_distrib(rzip_control *control, struct rzip_state *st)
 	}
 }
 
-/* Perform all checksumming in a separate thread to speed up the hash search. */
-static void *cksumthread(void *data)
+/* CRC and MD5 in cache sized steps so that the MD5 reads data the CRC has
+ * only just brought in. No CRC is kept without cksum, as on decompressing an
+ * archive that has a hash */
+void cksum_block(rzip_control *control, uint32_t *cksum, uchar *buf, i64 len)
+{
+	i64 n, start = stats_start(control);
+
+	while (len) {
+		n = MIN(len, CKSUM_STRIDE);
+		if (cksum)
+			*cksum = CrcUpdate(*cksum, buf, n);
+		if (!NO_MD5)
+			gcry_md_write(control->gcry_md5_handle, buf, n);
+		buf += n;
+		len -= n;
+	}
+	stats_since(control, cksum_usecs, start);
+}
+
+/* Perform all checksumming in a separate thread to speed up the hash search,
+ * or the rebuilding of a chunk on decompression. */
+void *cksumthread(void *data)
 {
 	rzip_control *control = (rzip_control *)data;
 
 	pthread_detach(pthread_self());
 
-	*control->checksum.cksum = CrcUpdate(*control->checksum.cksum, control->checksum.buf, control->checksum.len);
-	if (!NO_MD5)
-		gcry_md_write(control->gcry_md5_handle, control->checksum.buf, control->checksum.len);
-	dealloc(control->checksum.buf);
+	cksum_block(control, control->checksum.cksum, control->checksum.buf, control->checksum.len);
+	if (control->checksum.owned)
+		dealloc(control->checksum.buf);
 	cksem_post(control, &control->cksumsem);
 	return NULL;
 }
@@ -600,57 +1019,477 @@ static inline void cksum_update(rzip_control *control)
 	create_pthread(control, &thread, NULL, cksumthread, control);
 }
 
-static inline void hash_search(rzip_control *control, struct rzip_state *st,
-			       double pct_base, double pct_multiple)
+/* Hand len bytes from cksum_limit over to the cksumthread */
+static void cksum_queue(rzip_control *control, struct rzip_state *st,
+			i64 *cksum_limit, i64 len)
+{
+	/* We lock the mutex here and unlock it in the
+	 * cksumthread. This lock protects all the data in
+	 * control->checksum.
+	 */
+	wait_cksum(control);
+	control->checksum.len = len;
+	/* With the whole chunk mapped the data cannot move under us, so
+	 * checksum it where it is */
+	control->checksum.owned = sliding_mode(control);
+	if (!control->checksum.owned)
+		control->checksum.buf = control->sb.buf_low + *cksum_limit;
+	else {
+		control->checksum.buf = malloc(control->checksum.len);
+		if (unlikely(!control->checksum.buf))
+			failure("Failed to malloc ckbuf in hash_search\n");
+		control->do_mcpy(control, control->checksum.buf, *cksum_limit, control->checksum.len);
+	}
+	control->checksum.cksum = &st->cksum;
+	*cksum_limit += control->checksum.len;
+	cksum_update(control);
+}
+
+/* Whether a tag has enough low bits set to be in the hash table, or in the
+ * --long-range one or the one of the reference */
+static inline bool tag_wanted(struct rzip_state *st, tag t)
+{
+	if ((t & st->minimum_tag_mask) == st->minimum_tag_mask)
+		return true;
+	if (st->far && far_wanted(st, t))
+		return true;
+	return st->ref && (t & st->ref->minimum_tag_mask) == st->ref->minimum_tag_mask;
+}
+
+/* Look up and insert the tag at offset p, emitting the current match once it
+ * can grow no further. Returns true if a match was written. */
+static __always_inline bool search_tag(rzip_control *control, struct rzip_state *st,
+				       struct current_match *current, tag *tag_mask,
+				       tag t, i64 p, i64 end, const bool sliding)
+{
+	i64 reverse, mlen, offset = 0;
+
+	mlen = find_best_match(control, st, t, p, end, &offset, &reverse, sliding);
+
+	/* Only insert occasionally into hash. */
+	if ((t & *tag_mask) == *tag_mask) {
+		st->stats.inserts++;
+		st->hash_count++;
+		insert_hash(st, t, p);
+		if (st->hash_count > st->hash_limit)
+			*tag_mask = clean_one_from_hash(control, st);
+	}
+	if (st->far && far_wanted(st, t) && ((t >> st->far_shift) & st->far_mask) == st->far_mask) {
+		st->far->hash_count++;
+		insert_hash(st->far, t >> st->far_shift, p);
+		if (st->far->hash_count > st->far->hash_limit)
+			st->far_mask = clean_one_from_hash(control, st->far);
+	}
+
+	if (mlen > current->len) {
+		current->p = p - reverse;
+		current->len = mlen;
+		current->ofs = offset;
+	}
+
+	if ((current->len >= GREAT_MATCH || p >= current->p + MINIMUM_MATCH)
+	    && current->len >= MINIMUM_MATCH) {
+		if (st->last_match < current->p)
+			put_literal(control, st, st->last_match, current->p, sliding);
+		put_match(control, st, current->p, current->ofs, current->len);
+		st->last_match = current->p + current->len;
+		current->p = st->last_match;
+		current->len = 0;
+		return true;
+	}
+	return false;
+}
+
+/* Generate the tags for n offsets from p in one go, working directly on the
+ * low buffer when all the bytes they cover lie inside it, as they always do
+ * when the chunk is mapped whole. */
+static __always_inline void fill_tags(rzip_control *control, struct rzip_state *st,
+				      i64 p, i64 n, tag *tags, const bool sliding)
 {
-	i64 cksum_limit = 0, p, end, cksum_chunks, cksum_remains, i;
-	tag t = 0, tag_mask = (1 << st->level->initial_freq) - 1;
 	struct sliding_buffer *sb = &control->sb;
-	int lastpct = 0, last_chunkpct = 0;
-	struct {
-		i64 p;
-		i64 ofs;
-		i64 len;
-	} current;
+	i64 i;
 
-	if (st->hash_table)
-		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
-	else {
-		i64 hashsize = st->level->mb_used *
-				(1024 * 1024 / sizeof(st->hash_table[0]));
-		for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++);
+	if (!sliding || likely(p >= sb->offset_low &&
+			       p + n + MINIMUM_MATCH - 1 <= sb->offset_low + sb->size_low)) {
+		const uchar *buf = sb->buf_low + (p - sb->offset_low);
+		tag t = 0;
+
+		for (i = 0; i < MINIMUM_MATCH; i++)
+			t ^= st->hash_index[buf[i]];
+		tags[0] = t;
+		for (i = 1; i < n; i++) {
+			t ^= st->hash_index[buf[i - 1]] ^ st->hash_index[buf[i + MINIMUM_MATCH - 1]];
+			tags[i] = t;
+		}
+		return;
+	}
 
-		print_maxverbose("hashsize = %lld.  bits = %lld. %luMB\n",
-				 hashsize, st->hash_bits, st->level->mb_used);
+	tags[0] = sliding_full_tag(control, st, p);
+	for (i = 1; i < n; i++) {
+		tags[i] = tags[i - 1];
+		sliding_next_tag(control, st, p + i, &tags[i]);
+	}
+}
 
-		/* 66% full at max. */
-		st->hash_limit = (1 << st->hash_bits) / 3 * 2;
-		st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
-		if (unlikely(!st->hash_table))
-			failure("Failed to allocate hash table in hash_search\n");
+/* A match can end behind the offset it was written at, in which case the
+ * search carries on from the end of the match. Search the offsets from there
+ * up to and including p again, as the tagthreads only generate them once. */
+static __always_inline void search_behind(rzip_control *control, struct rzip_state *st,
+					  struct current_match *current, tag *tag_mask,
+					  i64 p, i64 end, const bool sliding)
+{
+	i64 q = st->last_match, batch_start = 0, batch_end = 0;
+	tag tags[TAG_BATCH_MIN];
+
+	while (q < p) {
+		tag t;
+
+		if (++q >= batch_end || q < batch_start) {
+			batch_start = q;
+			batch_end = MIN(q + TAG_BATCH_MIN, p + 1);
+			fill_tags(control, st, q, batch_end - q, tags, sliding);
+		}
+		t = tags[q - batch_start];
+		if (!tag_wanted(st, t))
+			continue;
+		if (search_tag(control, st, current, tag_mask, t, q, end, sliding))
+			q = st->last_match;
 	}
+}
 
-	st->minimum_tag_mask = tag_mask;
-	st->tag_clean_ptr = 0;
-	st->cksum = 0;
+/* Levels 7 and up grow their table to hold every tag of the chunk their
+ * initial_freq lets in, without cleaning, up to a share of usable_ram. It is
+ * kept a power of 2 and never below the level's own size */
+#define HASH_RAM_SHARE	16
+#define HASH_MAX_BITS	30
+
+static void size_hash(rzip_control *control, struct rzip_state *st)
+{
+	struct level *level = st->level;
+	i64 want, budget, mb = level->mb_used;
+
+	if (control->hash_mb || control->rzip_compression_level < 7)
+		return;
+	want = ((st->chunk_size >> level->initial_freq) / 2 * 3 * (i64)sizeof(hash_slot)) >> 20;
+	budget = MIN(control->usable_ram / HASH_RAM_SHARE, (i64)sizeof(hash_slot) << HASH_MAX_BITS) >> 20;
+	while (mb * 2 <= MIN(want, budget))
+		mb *= 2;
+	if (mb != (i64)level->mb_used)
+		print_verbose("Growing rzip hash table to %lldMB for the chunk size\n", mb);
+	level->mb_used = mb;
+}
+
+/* Move the entries of the hash table to one of 1 << bits slots. Those of the
+ * fewest low bits are dropped where a smaller one has no room for them. */
+static bool resize_hash(rzip_control *control, struct rzip_state *st, int bits)
+{
+	hash_slot *old = st->hash_table;
+	i64 i, old_slots = 1LL << st->hash_bits;
+
+	st->hash_table = calloc(sizeof(st->hash_table[0]), 1LL << bits);
+	if (unlikely(!st->hash_table)) {
+		st->hash_table = old;
+		print_maxverbose("No ram to resize rzip hash table to %lldMB\n",
+				 ((i64)sizeof(hash_slot) << bits) >> 20);
+		return false;
+	}
+	st->hash_bits = bits;
+	st->hash_limit = (1 << st->hash_bits) / 3 * 2;
 	st->hash_count = 0;
+	st->tag_clean_ptr = 0;
+	for (i = 0; i < old_slots; i++) {
+		if (empty_hash(old[i]))
+			continue;
+		st->hash_count++;
+		insert_hash(st, slot_tag(st, old[i]), slot_offset(st, old[i]));
+		while (st->hash_count > st->hash_limit)
+			clean_one_from_hash(control, st);
+	}
+	dealloc(old);
+	st->level->mb_used = ((i64)sizeof(hash_slot) << bits) >> 20;
+	return true;
+}
 
-	p = 0;
-	end = st->chunk_size - MINIMUM_MATCH;
-	st->last_match = p;
-	current.len = 0;
-	current.p = p;
-	current.ofs = 0;
+/* --rzip-tune: every TUNE_STEP of the chunk, look at how much of what was
+ * searched since the last look went into matches. Well matching data gets
+ * longer chains and, once the table has had to be cleaned, a larger table
+ * within the share size_hash would give it. Data that barely matches gets
+ * shorter chains and, once the table is less than a sixth full, a smaller
+ * one, as searching it is then mostly wasted. */
+#define TUNE_STEP(chunk)	MAX((chunk) / 16, 8 * 1024 * 1024)
+#define TUNE_RICH		4	/* Match bytes above 1/4 of those searched */
+#define TUNE_POOR		32	/* and below 1/32 */
+#define TUNE_MAX_CHAIN		1024
+
+static void start_tune(struct rzip_state *st)
+{
+	st->tune_from = 0;
+	st->tune_at = TUNE_STEP(st->chunk_size);
+	st->tune_stats = st->stats;
+}
+
+static void tune_search(rzip_control *control, struct rzip_state *st, tag *tag_mask, i64 p)
+{
+	struct level *level = st->level;
+	i64 searched = p - st->tune_from, matched;
+	tag initial_mask = (1 << level->initial_freq) - 1;
+	int max_bits = HASH_MAX_BITS;
+	unsigned chain = level->max_chain_len;
+
+	matched = st->stats.match_bytes - st->tune_stats.match_bytes;
+	if (!control->hash_mb)
+		while (max_bits > 20 && ((i64)sizeof(hash_slot) << max_bits) > control->usable_ram / HASH_RAM_SHARE)
+			max_bits--;
+
+	if (matched > searched / TUNE_RICH) {
+		level->max_chain_len = MIN(chain * 2, TUNE_MAX_CHAIN);
+		if (st->minimum_tag_mask != initial_mask && st->hash_bits < max_bits &&
+		    resize_hash(control, st, st->hash_bits + 1)) {
+			/* There is room again for the tags cleaning turned away */
+			st->minimum_tag_mask = *tag_mask = initial_mask;
+			print_maxverbose("Tuned rzip hash table up to %luMB\n", level->mb_used);
+		}
+	} else if (matched < searched / TUNE_POOR) {
+		level->max_chain_len = MAX(chain / 2, 1);
+		if (st->hash_bits > 20 && st->hash_count < st->hash_limit / 4 &&
+		    resize_hash(control, st, st->hash_bits - 1))
+			print_maxverbose("Tuned rzip hash table down to %luMB\n", level->mb_used);
+	}
+	if (level->max_chain_len != chain) {
+		print_maxverbose("Tuned rzip chain length from %u to %u at %lld\n",
+				 chain, level->max_chain_len, p);
+		st->victim_round = 0;
+	}
+
+	st->tune_from = p;
+	st->tune_at = p + TUNE_STEP(st->chunk_size);
+	st->tune_stats = st->stats;
+}
+
+static void *tagthread(void *data)
+{
+	struct tag_block *tb = (struct tag_block *)data;
+	rzip_control *control = tb->control;
+	struct rzip_state *st = tb->st;
+	tag t, mask = (1 << st->level->initial_freq) - 1;
+	i64 p = tb->start;
+
+	tb->ncands = 0;
+	t = single_full_tag(control, st, p);
+	while (42) {
+		if ((t & mask) == mask) {
+			if (unlikely(tb->ncands == tb->size)) {
+				struct hash_entry *cands;
+
+				cands = realloc(tb->cands, sizeof(*cands) * tb->size * 2);
+				if (unlikely(!cands))
+					return (void *)1;
+				tb->cands = cands;
+				tb->size *= 2;
+			}
+			tb->cands[tb->ncands].offset = p;
+			tb->cands[tb->ncands++].t = t;
+		}
+		if (++p == tb->end)
+			break;
+		single_next_tag(control, st, p, &t);
+	}
+	return NULL;
+}
+
+static void start_tag_block(rzip_control *control, struct tag_block *tb, i64 block, i64 end)
+{
+	tb->start = 1 + block * TAG_BLOCK;
+	tb->end = MIN(tb->start + TAG_BLOCK, end + 1);
+	if (unlikely(!create_pthread(control, &tb->thread, NULL, tagthread, tb)))
+		failure("Failed to create tagthread in hash_search\n");
+}
 
-	if (likely(end > 0))
-		t = control->full_tag(control, st, p);
+/* Search offsets 1 to end using tags generated by tagthreads, working through
+ * the blocks in order so that matches are found exactly as in the single
+ * threaded search. Only rolling the tags runs in parallel, the lookups and
+ * inserts into the hash table stay on this thread, so the match finding
+ * itself does not scale with threads. A match that ends behind the offset it
+ * was found at has the offsets it skipped searched again by search_behind,
+ * or the output would depend on the thread count. */
+static void threaded_hash_search(rzip_control *control, struct rzip_state *st,
+				 struct current_match *current, tag *tag_mask,
+				 i64 *cksum_limit, i64 end,
+				 double pct_base, double pct_multiple)
+{
+	i64 nblocks = (end + TAG_BLOCK - 1) / TAG_BLOCK, i, j;
+	int nthreads = MIN(control->threads, nblocks), lastpct = 0;
+	struct tag_block *tb;
+
+	print_maxverbose("Generating rzip tags with %d threads\n", nthreads);
+	tb = calloc(sizeof(*tb), nthreads);
+	if (unlikely(!tb))
+		failure("Failed to calloc tag blocks in hash_search\n");
+	for (i = 0; i < nthreads; i++) {
+		tb[i].control = control;
+		tb[i].st = st;
+		tb[i].size = (TAG_BLOCK >> st->level->initial_freq) * 2;
+		tb[i].cands = malloc(sizeof(tb[i].cands[0]) * tb[i].size);
+		if (unlikely(!tb[i].cands))
+			failure("Failed to malloc tag candidates in hash_search\n");
+		start_tag_block(control, &tb[i], i, end);
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		struct tag_block *b = &tb[i % nthreads];
+		void *thr_return;
+		int pct;
+
+		if (unlikely(!join_pthread(control, b->thread, &thr_return) || !!thr_return))
+			failure("Failed to generate tags in hash_search\n");
+
+		for (j = 0; j < b->ncands; j++) {
+			i64 p = b->cands[j].offset;
+			tag t = b->cands[j].t;
+
+			/* Skip over anything already covered by a match */
+			if (p <= st->last_match)
+				continue;
+			if (!tag_wanted(st, t))
+				continue;
+			if (search_tag(control, st, current, tag_mask, t, p, end, false) &&
+			    st->last_match < p)
+				search_behind(control, st, current, tag_mask, p, end, false);
+		}
+
+		if (b->end > *cksum_limit)
+			cksum_queue(control, st, cksum_limit, b->end - *cksum_limit);
+		if (b->end >= st->tune_at)
+			tune_search(control, st, tag_mask, b->end);
+
+		pct = pct_base + (pct_multiple * (100.0 * b->end) / st->chunk_size);
+		if (pct != lastpct) {
+			if (!STDIN || st->stdin_eof)
+				print_progress("Total: %2d%%  ", pct);
+			print_progress("Chunk: %2d%%\r", (int)(b->end * 100 / end));
+			report_stats(control, pct);
+			lastpct = pct;
+		}
+
+		if (i + nthreads < nblocks)
+			start_tag_block(control, b, i + nthreads, end);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		dealloc(tb[i].cands);
+	dealloc(tb);
+}
+
+/* --long-range keeps a second hash table of anchors sampled across the whole
+ * chunk, one in 1 << n offsets with n fixed per chunk so that they all fit.
+ * The dense table gets sparser everywhere as the chunk grows past what it
+ * holds, while the anchors still find a match in anything seen before.
+ * Without a size the table is sized for an anchor every LONG_SPACING bytes.
+ * One larger than a quarter of maxram is kept in a file under TMPDIR for
+ * the kernel to page, otherwise it is anonymous memory. */
+#define LONG_SPACING	256
+#define LONG_MIN_SHIFT	4	/* At least this many more tag bits than the dense table */
+#define LONG_MAX_BITS	30
+
+static void open_long_range(rzip_control *control, struct rzip_state *st)
+{
+	struct rzip_state *far;
+	i64 slots, len;
+	void *map;
+
+	far = calloc(sizeof(*far), 1);
+	if (unlikely(!far))
+		failure("Failed to allocate long range state in open_long_range\n");
+	far->level = st->level;
+	far->table_fd = -1;
+	if (control->long_range)
+		slots = control->long_range * 1024 * 1024 / sizeof(hash_slot);
+	else
+		slots = st->chunk_size / LONG_SPACING / 2 * 3;
+	for (far->hash_bits = 10; (1LL << far->hash_bits) < slots && far->hash_bits < LONG_MAX_BITS;
+	     far->hash_bits++);
+	far->hash_limit = (1LL << far->hash_bits) / 3 * 2;
+	len = (i64)sizeof(hash_slot) << far->hash_bits;
+
+	if (len > control->maxram / 4) {
+		char *name;
+
+		if (unlikely(asprintf(&name, "%slrzipfar.XXXXXX", control->tmpdir) == -1))
+			failure("Failed to allocate long range table name\n");
+		far->table_fd = mkstemp(name);
+		if (unlikely(far->table_fd == -1))
+			failure("Failed to create long range table %s\n", name);
+		unlink(name);
+		dealloc(name);
+		if (unlikely(ftruncate(far->table_fd, len)))
+			failure("Failed to size long range table to %lld bytes\n", len);
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, far->table_fd, 0);
+	} else
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (unlikely(map == MAP_FAILED))
+		failure("Failed to map long range table of %lld bytes\n", len);
+	far->hash_table = map;
+	far->table_map = map;
+	far->table_map_len = len;
+	print_verbose("Long range hash table of %lldMB %s\n", len >> 20,
+		      far->table_fd == -1 ? "in ram" : "on disk");
+	st->far = far;
+}
+
+/* Empty the table for the next chunk and pick the sampling that fits it */
+static void reset_long_range(rzip_control *control, struct rzip_state *st)
+{
+	struct rzip_state *far = st->far;
+	int bits = st->level->initial_freq + LONG_MIN_SHIFT;
+
+	if (far->hash_count) {
+		if (far->table_fd != -1) {
+			if (unlikely(ftruncate(far->table_fd, 0) ||
+				     ftruncate(far->table_fd, far->table_map_len)))
+				failure("Failed to clear long range table\n");
+		} else
+			madvise(far->table_map, far->table_map_len, MADV_DONTNEED);
+	}
+	while (st->chunk_size >> bits > far->hash_limit)
+		bits++;
+	far->chunk_size = st->chunk_size;
+	init_slot_bits(far);
+	st->far_shift = bits;
+	far->minimum_tag_mask = st->far_mask = 0;
+	far->tag_clean_ptr = 0;
+	far->victim_round = 0;
+	far->hash_count = 0;
+	print_maxverbose("Long range anchors every 1 in %lld offsets\n", 1LL << bits);
+}
+
+static void close_long_range(struct rzip_state *st)
+{
+	munmap(st->far->table_map, st->far->table_map_len);
+	if (st->far->table_fd != -1)
+		close(st->far->table_fd);
+	dealloc(st->far);
+}
+
+/* Search offsets 1 to end one after another, in the mode sliding says */
+static __always_inline void search_chunk(rzip_control *control, struct rzip_state *st,
+					 struct current_match *current, tag *tag_mask,
+					 i64 *cksum_limit, i64 end,
+					 double pct_base, double pct_multiple, const bool sliding)
+{
+	i64 p = 0, batch_start = 0, batch_end = 0, batch_len = TAG_BATCH_MIN;
+	struct sliding_buffer *sb = &control->sb;
+	int lastpct = 0, last_chunkpct = 0;
+	tag tags[TAG_BATCH];
 
 	while (p < end) {
-		i64 reverse, mlen, offset;
+		tag t;
 
 		sb->offset_search = ++p;
-		if (unlikely(sb->offset_search > sb->offset_low + sb->size_low))
+		if (sliding && unlikely(sb->offset_search > sb->offset_low + sb->size_low))
 			remap_low_sb(control, &control->sb);
+		if (unlikely(p >= sb->advised))
+			advise_low_sb(control, st, sb);
 
 		if (unlikely(p % 128 == 0 && st->chunk_size)) {
 			i64 chunk_pct;
@@ -662,72 +1501,135 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 				if (!STDIN || st->stdin_eof)
 					print_progress("Total: %2d%%  ", pct);
 				print_progress("Chunk: %2d%%\r", chunk_pct);
-				/* lrzip library callback code removed */
+				report_stats(control, pct);
 				lastpct = pct;
 				last_chunkpct = chunk_pct;
 			}
 		}
 
-		control->next_tag(control, st, p, &t);
+		/* Tags are generated in batches, starting small after each
+		 * match since the next match may well skip most of them. A
+		 * match can also end behind the search position. */
+		if (p < batch_start || p >= batch_end) {
+			batch_start = p;
+			batch_end = MIN(p + batch_len, end + 1);
+			fill_tags(control, st, p, batch_end - p, tags, sliding);
+			batch_len = MIN(batch_len * 2, TAG_BATCH);
+		}
+		t = tags[p - batch_start];
 
 		/* Don't look for a match if there are no tags with
 		   this number of bits in the hash table. */
-		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+		if (!tag_wanted(st, t))
 			continue;
 
-		offset = 0;
-		mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
-
-		/* Only insert occasionally into hash. */
-		if ((t & tag_mask) == tag_mask) {
-			st->stats.inserts++;
-			st->hash_count++;
-			insert_hash(st, t, p);
-			if (st->hash_count > st->hash_limit)
-				tag_mask = clean_one_from_hash(control, st);
+		if (search_tag(control, st, current, tag_mask, t, p, end, sliding)) {
+			p = st->last_match;
+			if (p < batch_start || p >= batch_end)
+				batch_len = TAG_BATCH_MIN;
 		}
 
-		if (mlen > current.len) {
-			current.p = p - reverse;
-			current.len = mlen;
-			current.ofs = offset;
-		}
+		/* Hand over what has been searched in large steps, each one
+		 * costs the cksumthread a thread creation */
+		if (p >= *cksum_limit + CKSUM_CHUNK)
+			cksum_queue(control, st, cksum_limit, p - *cksum_limit);
+		if (unlikely(p >= st->tune_at))
+			tune_search(control, st, tag_mask, p);
+	}
+}
 
-		if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH)
-		    && current.len >= MINIMUM_MATCH) {
-			if (st->last_match < current.p)
-				put_literal(control, st, st->last_match, current.p);
-			put_match(control, st, current.p, current.ofs, current.len);
-			st->last_match = current.p + current.len;
-			current.p = p = st->last_match;
-			current.len = 0;
-			t = control->full_tag(control, st, p);
-		}
+static void search_single(rzip_control *control, struct rzip_state *st,
+			  struct current_match *current, tag *tag_mask,
+			  i64 *cksum_limit, i64 end, double pct_base, double pct_multiple)
+{
+	search_chunk(control, st, current, tag_mask, cksum_limit, end,
+		     pct_base, pct_multiple, false);
+}
 
-		if (p > cksum_limit) {
-			/* We lock the mutex here and unlock it in the
-			 * cksumthread. This lock protects all the data in
-			 * control->checksum.
-			 */
-			cksem_wait(control, &control->cksumsem);
-			control->checksum.len = MIN(st->chunk_size - p, control->page_size);
-			control->checksum.buf = malloc(control->checksum.len);
-			if (unlikely(!control->checksum.buf))
-				failure("Failed to malloc ckbuf in hash_search\n");
-			control->do_mcpy(control, control->checksum.buf, cksum_limit, control->checksum.len);
-			control->checksum.cksum = &st->cksum;
-			cksum_limit += control->checksum.len;
-			cksum_update(control);
-		}
+static void search_sliding(rzip_control *control, struct rzip_state *st,
+			   struct current_match *current, tag *tag_mask,
+			   i64 *cksum_limit, i64 end, double pct_base, double pct_multiple)
+{
+	search_chunk(control, st, current, tag_mask, cksum_limit, end,
+		     pct_base, pct_multiple, true);
+}
+
+static inline void hash_search(rzip_control *control, struct rzip_state *st,
+			       double pct_base, double pct_multiple)
+{
+	i64 cksum_limit = 0, end, cksum_chunks, cksum_remains, i;
+	tag tag_mask = (1 << st->level->initial_freq) - 1;
+	bool sliding = sliding_mode(control);
+	struct current_match current;
+
+	if (st->hash_table)
+		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
+	else {
+		i64 hashsize;
+
+		size_hash(control, st);
+		hashsize = st->level->mb_used *
+				(1024 * 1024 / sizeof(st->hash_table[0]));
+		for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++);
+
+		print_maxverbose("hashsize = %lld.  bits = %lld. %luMB\n",
+				 hashsize, st->hash_bits, st->level->mb_used);
+
+		/* 66% full at max. */
+		st->hash_limit = (1 << st->hash_bits) / 3 * 2;
+		st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
+		if (unlikely(!st->hash_table))
+			failure("Failed to allocate hash table in hash_search\n");
 	}
 
+	init_slot_bits(st);
+	st->minimum_tag_mask = tag_mask;
+	st->tag_clean_ptr = 0;
+	st->cksum = 0;
+	st->hash_count = 0;
+	if (control->rzip_tune)
+		start_tune(st);
+	else
+		st->tune_at = st->chunk_size;
+
+	if (LONG_RANGE) {
+		if (!st->far)
+			open_long_range(control, st);
+		reset_long_range(control, st);
+	}
+
+	end = st->chunk_size - MINIMUM_MATCH;
+	st->last_match = 0;
+	current.len = 0;
+	current.p = 0;
+	current.ofs = 0;
+
+	/* Tags can only be generated in parallel when the whole chunk is
+	 * mapped, as the sliding buffer is remapped on access */
+	if (sliding)
+		search_sliding(control, st, &current, &tag_mask, &cksum_limit, end,
+			       pct_base, pct_multiple);
+	else if (control->threads > 1 && end > TAG_BLOCK)
+		threaded_hash_search(control, st, &current, &tag_mask, &cksum_limit, end,
+				     pct_base, pct_multiple);
+	else
+		search_single(control, st, &current, &tag_mask, &cksum_limit, end,
+			      pct_base, pct_multiple);
+
 	if (MAX_VERBOSE)
 		show_distrib(control, st);
+	if (st->far)
+		print_maxverbose("Long range hash table holds %lld anchors\n", st->far->hash_count);
 
 	if (st->last_match < st->chunk_size)
-		put_literal(control, st, st->last_match, st->chunk_size);
+		put_literal(control, st, st->last_match, st->chunk_size, sliding);
 
-	if (st->chunk_size > cksum_limit) {
+	if (st->chunk_size > cksum_limit && !sliding) {
+		wait_cksum(control);
+		cksum_block(control, &st->cksum, control->sb.buf_low + cksum_limit,
+			    st->chunk_size - cksum_limit);
+		cksem_post(control, &control->cksumsem);
+	} else if (st->chunk_size > cksum_limit) {
 		i64 cksum_len = control->maxram;
 		void *buf;
 
@@ -745,7 +1647,7 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 
 		/* Compute checksum. If the entire chunk is longer than maxram,
 		 * do it "per-partes" */
-		cksem_wait(control, &control->cksumsem);
+		wait_cksum(control);
 		control->checksum.buf = buf;
 		control->checksum.len = st->chunk_size - cksum_limit;
 		cksum_chunks = control->checksum.len / cksum_len;
@@ -754,33 +1656,226 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 		for (i = 0; i < cksum_chunks; i++) {
 			control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_len);
 			cksum_limit += cksum_len;
-			st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_len);
-			if (!NO_MD5)
-				gcry_md_write(control->gcry_md5_handle, control->checksum.buf, cksum_len);
+			cksum_block(control, &st->cksum, control->checksum.buf, cksum_len);
 		}
 		/* Process end of the checksum buffer */
 		control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_remains);
-		st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_remains);
-		if (!NO_MD5)
-			gcry_md_write(control->gcry_md5_handle, control->checksum.buf, cksum_remains);
+		cksum_block(control, &st->cksum, control->checksum.buf, cksum_remains);
 		dealloc(control->checksum.buf);
 		cksem_post(control, &control->cksumsem);
 	} else {
-		cksem_wait(control, &control->cksumsem);
+		wait_cksum(control);
 		cksem_post(control, &control->cksumsem);
 	}
 
-	put_literal(control, st, 0, 0);
+	put_literal(control, st, 0, 0, false);
+	flush_recs(control, st);
 	put_u32(control, st->ss, st->cksum);
 }
 
 
+/* The same for every run, from a generator of its own. random() carried on
+ * from wherever the last run in the process left it, so the same input
+ * compressed differently each time */
 static inline void init_hash_indexes(struct rzip_state *st)
 {
+	uint64_t x = 0x6c727a69702d6e78ULL;
 	int i;
 
-	for (i = 0; i < 256; i++)
-		st->hash_index[i] = ((random() << 16) ^ random());
+	for (i = 0; i < 256; i++) {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		st->hash_index[i] = (x * 0x2545f4914f6cdd1dULL) >> 17;
+	}
+}
+
+/* Fill a hash table of its own with the tags of the --reference file, the
+ * same way hash_search fills the one of a chunk. It is sized for the
+ * reference, up to a quarter of maxram, so a big one is not covered only
+ * sparsely. Chunks look matches up in it but never add to it. */
+static void seed_reference(rzip_control *control, struct rzip_state *st)
+{
+	i64 hashsize, p, len = control->ref_len;
+	uchar *buf = control->ref_buf;
+	struct rzip_state *ref;
+	tag t = 0, tag_mask;
+	int i;
+
+	ref = calloc(sizeof(*ref), 1);
+	if (unlikely(!ref))
+		failure("Failed to allocate reference state in seed_reference\n");
+	ref->level = st->level;
+	memcpy(ref->hash_index, st->hash_index, sizeof(st->hash_index));
+	hashsize = st->level->mb_used * (1024 * 1024 / sizeof(ref->hash_table[0]));
+	hashsize = MAX(hashsize, MIN(len / 64, control->maxram / 4 / (i64)sizeof(ref->hash_table[0])));
+	for (ref->hash_bits = 0; (1LL << ref->hash_bits) < hashsize && ref->hash_bits < 30; ref->hash_bits++);
+	ref->hash_limit = (1LL << ref->hash_bits) / 3 * 2;
+	ref->hash_table = calloc(sizeof(ref->hash_table[0]), 1LL << ref->hash_bits);
+	if (unlikely(!ref->hash_table))
+		failure("Failed to allocate reference hash table in seed_reference\n");
+	ref->chunk_size = len;
+	init_slot_bits(ref);
+	tag_mask = ref->minimum_tag_mask = (1 << st->level->initial_freq) - 1;
+	print_maxverbose("Seeding reference hash table of %lldMB\n",
+			 (i64)(sizeof(ref->hash_table[0]) << ref->hash_bits) >> 20);
+
+	for (i = 0; i < MINIMUM_MATCH; i++)
+		t ^= ref->hash_index[buf[i]];
+	for (p = 0; p + MINIMUM_MATCH <= len; p++) {
+		if (p)
+			t ^= ref->hash_index[buf[p - 1]] ^ ref->hash_index[buf[p + MINIMUM_MATCH - 1]];
+		if ((t & tag_mask) == tag_mask) {
+			ref->hash_count++;
+			insert_hash(ref, t, p);
+			if (ref->hash_count > ref->hash_limit)
+				tag_mask = clean_one_from_hash(control, ref);
+		}
+	}
+	print_verbose("Reference hash table holds %lld tags\n", ref->hash_count);
+	st->ref = ref;
+}
+
+/* A --ref-index sidecar holds the reference hash table as seed_reference
+ * left it, after a header saying which reference it was made from and the
+ * hash_index its tags were made with. The table starts a page in so it is
+ * used straight from the mmap of the file. */
+#define REF_INDEX_MAGIC		"LRZREFIX"
+#define REF_INDEX_VERSION	1
+#define REF_INDEX_ENDIAN	0x01020304
+#define REF_INDEX_HEADER	4096
+
+struct ref_index_header {
+	char magic[8];
+	u32 version;
+	u32 endian;		/* REF_INDEX_ENDIAN as it was written */
+	i64 ref_len;
+	i64 ref_mtime;
+	i64 ref_mtime_nsec;
+	i64 hash_count;
+	tag minimum_tag_mask;
+	char hash_bits;
+	char slot_tag_bits;
+	tag hash_index[256];
+};
+
+/* Use the sidecar if it was made from the reference as it is now. Returns
+ * false when the table has to be built instead */
+static bool load_ref_index(rzip_control *control, struct rzip_state *st)
+{
+	struct ref_index_header hdr;
+	struct stat rs, is;
+	struct rzip_state *ref;
+	i64 len;
+	uchar *map;
+	int fd;
+
+	fd = open(control->ref_index, O_RDONLY);
+	if (fd == -1) {
+		print_verbose("No reference index %s yet, it will be made\n", control->ref_index);
+		return false;
+	}
+	if (unlikely(stat(control->reference, &rs) || fstat(fd, &is) ||
+		     pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))) {
+		close(fd);
+		return false;
+	}
+	/* The slot layout has to be the one init_slot_bits gives the length it
+	 * was made for, anything else is not a shift count to trust */
+	if (memcmp(hdr.magic, REF_INDEX_MAGIC, 8) || hdr.version != REF_INDEX_VERSION ||
+	    hdr.endian != REF_INDEX_ENDIAN || hdr.hash_bits < 1 || hdr.hash_bits > HASH_MAX_BITS ||
+	    hdr.ref_len < 0 || hdr.slot_tag_bits != tag_bits_for(hdr.ref_len) ||
+	    is.st_size != (len = REF_INDEX_HEADER + ((i64)sizeof(hash_slot) << hdr.hash_bits))) {
+		close(fd);
+		print_output("%s is not a reference index, it will be made again\n", control->ref_index);
+		return false;
+	}
+	if (hdr.ref_len != control->ref_len || hdr.ref_mtime != rs.st_mtim.tv_sec ||
+	    hdr.ref_mtime_nsec != rs.st_mtim.tv_nsec) {
+		close(fd);
+		print_verbose("Reference %s changed since %s was made, making it again\n",
+			      control->reference, control->ref_index);
+		return false;
+	}
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (unlikely(map == MAP_FAILED))
+		return false;
+
+	ref = calloc(sizeof(*ref), 1);
+	if (unlikely(!ref))
+		failure("Failed to allocate reference state in load_ref_index\n");
+	ref->level = st->level;
+	ref->hash_bits = hdr.hash_bits;
+	ref->hash_count = hdr.hash_count;
+	ref->minimum_tag_mask = hdr.minimum_tag_mask;
+	ref->slot_tag_bits = hdr.slot_tag_bits;
+	ref->slot_tag_mask = ((hash_slot)1 << ref->slot_tag_bits) - 1;
+	ref->chunk_size = control->ref_len;
+	ref->hash_table = (hash_slot *)(map + REF_INDEX_HEADER);
+	ref->table_map = map;
+	ref->table_map_len = len;
+	/* Chunk tags have to be made the same way to be looked up in it */
+	memcpy(st->hash_index, hdr.hash_index, sizeof(st->hash_index));
+	memcpy(ref->hash_index, hdr.hash_index, sizeof(ref->hash_index));
+	print_verbose("Loaded reference index %s of %lld tags\n", control->ref_index, ref->hash_count);
+	st->ref = ref;
+	return true;
+}
+
+/* Save the table seed_reference built, through a temporary file so a
+ * sidecar is never seen half written. Failing only costs the next run the
+ * rebuild. */
+static void save_ref_index(rzip_control *control, struct rzip_state *ref)
+{
+	struct ref_index_header hdr;
+	char *tmpname;
+	struct stat rs;
+	bool ok;
+	int fd;
+
+	if (unlikely(stat(control->reference, &rs)))
+		return;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, REF_INDEX_MAGIC, 8);
+	hdr.version = REF_INDEX_VERSION;
+	hdr.endian = REF_INDEX_ENDIAN;
+	hdr.ref_len = control->ref_len;
+	hdr.ref_mtime = rs.st_mtim.tv_sec;
+	hdr.ref_mtime_nsec = rs.st_mtim.tv_nsec;
+	hdr.hash_count = ref->hash_count;
+	hdr.minimum_tag_mask = ref->minimum_tag_mask;
+	hdr.hash_bits = ref->hash_bits;
+	hdr.slot_tag_bits = ref->slot_tag_bits;
+	memcpy(hdr.hash_index, ref->hash_index, sizeof(hdr.hash_index));
+
+	if (unlikely(asprintf(&tmpname, "%s.XXXXXX", control->ref_index) == -1))
+		return;
+	fd = mkstemp(tmpname);
+	if (unlikely(fd == -1)) {
+		print_err("Unable to create reference index %s\n", control->ref_index);
+		dealloc(tmpname);
+		return;
+	}
+	ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+	if (ok) {
+		uchar *buf = (uchar *)ref->hash_table;
+		i64 len = (i64)sizeof(hash_slot) << ref->hash_bits, done, n;
+
+		for (done = 0; ok && done < len; done += n) {
+			n = pwrite(fd, buf + done, MIN(len - done, one_g), REF_INDEX_HEADER + done);
+			ok = n > 0;
+		}
+	}
+	if (close(fd))
+		ok = false;
+	if (likely(ok && !rename(tmpname, control->ref_index)))
+		print_verbose("Saved reference index %s\n", control->ref_index);
+	else {
+		print_err("Failed to write reference index %s\n", control->ref_index);
+		unlink(tmpname);
+	}
+	dealloc(tmpname);
 }
 
 #if !defined(__linux)
@@ -806,6 +1901,179 @@ static inline void *fake_mremap(void *old_address, size_t old_size, size_t new_s
 }
 #endif
 
+/* Stdin is read by its own thread into a ring of slices, so whatever is
+ * feeding us keeps running while we search and compress the chunk already
+ * read, instead of blocking on a full pipe. mmap_stdin copies out of the
+ * ring. If the ring cannot be allocated stdin is read directly as before.
+ * The ring lives in the control for one run only, so each run starts with
+ * a fresh one. */
+#define STDIN_SLICE	(16 * 1024 * 1024)
+#define STDIN_SLICES	4
+
+struct stdin_ahead {
+	bool eof;		/* Reader has hit the end, no more slices */
+	int err;		/* errno of a failed read */
+	uchar *buf;		/* NULL when stdin is read directly */
+	i64 len[STDIN_SLICES];	/* Bytes in each filled slice */
+	int head;		/* Slice being copied out */
+	int filled;		/* Slices filled and not yet copied out */
+	i64 ofs;		/* Bytes already copied out of the head slice */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *stdin_ahead_thread(void *data)
+{
+	rzip_control *control = data;
+	struct stdin_ahead *ahead = control->ahead;
+	int fd = fileno(control->inFILE), slice;
+	ssize_t ret = 0;
+	uchar *buf;
+	i64 len;
+
+	while (42) {
+		lock_mutex(control, &ahead->lock);
+		while (ahead->filled == STDIN_SLICES)
+			cond_wait(control, &ahead->cond, &ahead->lock);
+		slice = (ahead->head + ahead->filled) % STDIN_SLICES;
+		unlock_mutex(control, &ahead->lock);
+
+		buf = ahead->buf + (i64)slice * STDIN_SLICE;
+		for (len = 0; len < STDIN_SLICE; len += ret) {
+			ret = read(fd, buf + len, STDIN_SLICE - len);
+			if (ret <= 0)
+				break;
+		}
+
+		lock_mutex(control, &ahead->lock);
+		if (len) {
+			ahead->len[slice] = len;
+			ahead->filled++;
+		}
+		if (ret <= 0) {
+			ahead->eof = true;
+			if (ret < 0)
+				ahead->err = errno;
+		}
+		cond_broadcast(control, &ahead->cond);
+		unlock_mutex(control, &ahead->lock);
+		if (ret <= 0)
+			break;
+	}
+	return NULL;
+}
+
+static void start_stdin_ahead(rzip_control *control)
+{
+	struct stdin_ahead *ahead = calloc(sizeof(struct stdin_ahead), 1);
+
+	if (unlikely(!ahead || !init_mutex(control, &ahead->lock)))
+		failure("Failed to calloc stdin read ahead in start_stdin_ahead\n");
+	pthread_cond_init(&ahead->cond, NULL);
+	control->ahead = ahead;
+	ahead->buf = malloc((i64)STDIN_SLICE * STDIN_SLICES);
+	if (unlikely(!ahead->buf)) {
+		print_maxverbose("Unable to allocate stdin read ahead buffer, reading directly\n");
+		return;
+	}
+	if (unlikely(!create_pthread(control, &ahead->thread, NULL, stdin_ahead_thread, control)))
+		failure("Failed to create stdin read ahead thread\n");
+}
+
+/* Behaves like read() on stdin, only from the ring */
+static ssize_t read_stdin_ahead(rzip_control *control, uchar *buf, i64 len)
+{
+	struct stdin_ahead *ahead = control->ahead;
+	int slice;
+	i64 n;
+
+	lock_mutex(control, &ahead->lock);
+	while (!ahead->filled && !ahead->eof)
+		cond_wait(control, &ahead->cond, &ahead->lock);
+	if (!ahead->filled) {
+		unlock_mutex(control, &ahead->lock);
+		errno = ahead->err;
+		return ahead->err ? -1 : 0;
+	}
+	slice = ahead->head;
+	unlock_mutex(control, &ahead->lock);
+
+	/* The reader does not touch a slice until it is copied out */
+	n = MIN(len, ahead->len[slice] - ahead->ofs);
+	memcpy(buf, ahead->buf + (i64)slice * STDIN_SLICE + ahead->ofs, n);
+	ahead->ofs += n;
+	if (ahead->ofs == ahead->len[slice]) {
+		lock_mutex(control, &ahead->lock);
+		ahead->ofs = 0;
+		ahead->head = (slice + 1) % STDIN_SLICES;
+		ahead->filled--;
+		cond_broadcast(control, &ahead->cond);
+		unlock_mutex(control, &ahead->lock);
+	}
+	return n;
+}
+
+/* The reader exits by itself once it reaches the end of stdin */
+static void stop_stdin_ahead(rzip_control *control)
+{
+	struct stdin_ahead *ahead = control->ahead;
+
+	if (!ahead)
+		return;
+	if (ahead->buf) {
+		join_pthread(control, ahead->thread, NULL);
+		dealloc(ahead->buf);
+	}
+	pthread_mutex_destroy(&ahead->lock);
+	pthread_cond_destroy(&ahead->cond);
+	dealloc(control->ahead);
+}
+
+/* Content defined chunking ends a chunk where a gear hash of the data says
+ * so, within a band below the largest chunk, instead of at a fixed size.
+ * An insertion or deletion then only changes the chunk it lands in and the
+ * later chunks come out the same, which keeps a dedup store or incremental
+ * upload of successive archives small. The band and the hash mask only
+ * depend on max_chunk so the same options cut the same data the same way. */
+#define CDC_BAND_MAX	(64 * 1024 * 1024)
+#define CDC_WARMUP	64	/* Bytes it takes the gear hash to forget */
+#define cdc_band(control)	MIN((control)->max_chunk / 8, CDC_BAND_MAX)
+
+static i64 cdc_cut(rzip_control *control, const uchar *buf, i64 len)
+{
+	i64 band = cdc_band(control), p;
+	uint64_t gear[256], seed = 0x6c727a6970636463ULL, mask, h = 0;
+	int bits = 0, i;
+
+	band = MIN(band, len / 2);
+	if (band < CDC_WARMUP * 2)
+		return len;
+	/* Expect a cut every band / 8 bytes so one is nearly always found */
+	while ((band / 8) >> (bits + 1))
+		bits++;
+	mask = ~0ULL << (64 - bits);
+	/* splitmix64 from a fixed seed, the table must never change */
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+	for (p = len - band - CDC_WARMUP; p < len - band; p++)
+		h = (h << 1) + gear[buf[p]];
+	for (; p < len; p++) {
+		h = (h << 1) + gear[buf[p]];
+		if (!(h & mask)) {
+			print_maxverbose("Content defined cut at %lld of %lld\n", p + 1, len);
+			return p + 1;
+		}
+	}
+	print_maxverbose("No content defined cut found, chunk stays at %lld\n", len);
+	return len;
+}
+
 /* stdin is not file backed so we have to emulate the mmap by mapping
  * anonymous ram and reading stdin into it. It means the maximum ram
  * we can use will be less but we will already have determined this in
@@ -815,16 +2083,47 @@ static inline void mmap_stdin(rzip_control *control, uchar *buf,
 {
 	i64 len = st->chunk_size;
 	uchar *offset_buf = buf;
+	bool chunk_end = false;
 	ssize_t ret;
 	i64 total;
 
+	/* An lrz_stream buffers its input itself */
+	if (!control->ahead && !control->in_cb)
+		start_stdin_ahead(control);
 	total = 0;
+	if (st->carry_len) {
+		/* What was read past the last cut starts this chunk. It was
+		 * counted in st_size then */
+		memcpy(buf, st->carry, st->carry_len);
+		offset_buf += st->carry_len;
+		len -= st->carry_len;
+		total = st->carry_len;
+		control->st_size -= st->carry_len;
+		st->carry_len = 0;
+	}
 	while (len > 0) {
 		ret = MIN(len, one_g);
-		ret = read(fileno(control->inFILE), offset_buf, (size_t)ret);
+		if (control->in_cb)
+			ret = control->in_cb(control->in_data, offset_buf, ret, &chunk_end);
+		else if (control->ahead->buf)
+			ret = read_stdin_ahead(control, offset_buf, ret);
+		else
+			ret = read(fileno(control->inFILE), offset_buf, (size_t)ret);
 		if (unlikely(ret < 0))
 			failure("Failed to read in mmap_stdin\n");
 		total += ret;
+		if (chunk_end) {
+			/* lrz_stream_flush ends the chunk with what came so far */
+			chunk_end = false;
+			if (!total)
+				continue;
+			print_maxverbose("Flushing chunk at %lld\n", total);
+			buf = (uchar *)mremap(buf, st->chunk_size, total, 0);
+			if (unlikely(buf == MAP_FAILED))
+				failure("Failed to remap to smaller buf in mmap_stdin\n");
+			st->mmap_size = st->chunk_size = total;
+			break;
+		}
 		if (ret == 0) {
 			/* Should be EOF */
 			print_maxverbose("Shrinking chunk to %lld\n", total);
@@ -845,6 +2144,23 @@ static inline void mmap_stdin(rzip_control *control, uchar *buf,
 		offset_buf += ret;
 		len -= ret;
 	}
+	if (CDC && len <= 0) {
+		i64 cut = cdc_cut(control, buf, total);
+
+		if (cut < total) {
+			st->carry_len = total - cut;
+			if (!st->carry) {
+				st->carry = malloc(cdc_band(control));
+				if (unlikely(!st->carry))
+					failure("Failed to malloc carry buffer in mmap_stdin\n");
+			}
+			memcpy(st->carry, buf + cut, st->carry_len);
+			buf = (uchar *)mremap(buf, st->chunk_size, cut, 0);
+			if (unlikely(buf == MAP_FAILED))
+				failure("Failed to remap to smaller buf in mmap_stdin\n");
+			st->mmap_size = st->chunk_size = total = cut;
+		}
+	}
 	control->st_size += total;
 }
 
@@ -854,15 +2170,18 @@ init_sliding_mmap(rzip_control *control, struct rzip_state *st, int fd_in,
 {
 	struct sliding_buffer *sb = &control->sb;
 
-	/* Initialise the high buffer. One page size is fastest to manipulate */
+	/* Initialise the high buffer with a single page. Later windows are
+	 * mapped at high_length */
 	if (!STDIN) {
-		sb->high_length = control->page_size;
-		sb->buf_high = (uchar *)mmap(NULL, sb->high_length, PROT_READ, MAP_SHARED, fd_in, offset);
+		sb->high_length = SB_HIGH_MIN;
+		sb->buf_high = (uchar *)mmap(NULL, control->page_size, PROT_READ, MAP_SHARED, fd_in, offset - sb->map_lead);
 		if (unlikely(sb->buf_high == MAP_FAILED))
 			failure("Unable to mmap buf_high in init_sliding_mmap\n");
-		sb->size_high = sb->high_length;
+		sb->size_high = control->page_size;
 		sb->offset_high = 0;
+		sb->nwindows = 0;
 	}
+	sb->advised = sb->dropped = 0;
 	sb->offset_low = 0;
 	sb->offset_search = 0;
 	sb->size_low = st->mmap_size;
@@ -899,12 +2218,12 @@ rzip_chunk(rzip_control *control, struct rzip_state *st, int fd_in, int fd_out,
 	hash_search(control, st, pct_base, pct_multiple);
 
 	/* unmap buffer before closing and reallocating streams */
-	if (unlikely(munmap(sb->buf_low, sb->size_low))) {
+	if (unlikely(!control->in_buffer && munmap(sb->buf_low - sb->map_lead, sb->size_low + sb->map_lead))) {
 		close_stream_out(control, st->ss);
 		failure("Failed to munmap in rzip_chunk\n");
 	}
 	if (!STDIN) {
-		if (unlikely(munmap(sb->buf_high, sb->size_high))) {
+		if (unlikely(!unmap_high_sb(sb))) {
 			close_stream_out(control, st->ss);
 			failure("Failed to munmap in rzip_chunk\n");
 		}
@@ -931,6 +2250,48 @@ static void clear_sslist(struct rzip_state *st)
 	}
 }
 
+/* Write the chunk index recorded by the writer thread so --range can seek
+ * straight to the chunks it needs. It goes before the whole file hash so
+ * readers that do not know about it still find the hash at the very end.
+ * The file table of an --archive goes in front of it */
+bool write_index(rzip_control *control)
+{
+	i64 i, len = control->index_chunks * INDEX_ENTRY + INDEX_TRAILER;
+	uchar *buf, *p;
+
+	if (ENCRYPT) {
+		print_verbose("Chunk index not stored in encrypted archives\n");
+		return true;
+	}
+	if (control->nfiles) {
+		i64 tlen;
+
+		buf = archive_table(control, &tlen);
+		if (unlikely(!buf))
+			return false;
+		if (unlikely(write_1g(control, buf, tlen) != tlen)) {
+			dealloc(buf);
+			fatal_return(("Failed to write file table\n"), false);
+		}
+		dealloc(buf);
+	}
+	p = buf = malloc(len);
+	if (unlikely(!buf))
+		fatal_return(("Failed to malloc chunk index\n"), false);
+	for (i = 0; i < control->index_chunks * 2; i++, p += 8)
+		*(i64 *)p = htole64(control->index[i]);
+	*(i64 *)p = htole64(control->index_ulen);
+	*(i64 *)(p + 8) = htole64(control->index_chunks);
+	memcpy(p + 16, INDEX_MAGIC, 8);
+	print_maxverbose("Writing index of %lld chunks\n", control->index_chunks);
+	if (unlikely(write_1g(control, buf, len) != len)) {
+		dealloc(buf);
+		fatal_return(("Failed to write chunk index\n"), false);
+	}
+	dealloc(buf);
+	return true;
+}
+
 /* compress a whole file chunks at a time */
 void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 {
@@ -943,7 +2304,7 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	 * If file size < compression window, can't do
 	 */
 	struct timeval current, start, last;
-	i64 len = 0, last_chunk = 0;
+	i64 len = 0, last_chunk = 0, chunk_start = 0, chunk_cpu = 0;
 	int pass = 0, passes, j;
 	double chunkmbs, tdiff;
 	struct rzip_state *st;
@@ -952,10 +2313,12 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	i64 free_space;
 
 	init_mutex(control, &control->control_lock);
+	control->index_chunks = control->index_ulen = 0;
+	sb->map_lead = 0;
 	if (!NO_MD5) {
-		gcry_md_open(&control->gcry_md5_handle, GCRY_MD_MD5, GCRY_MD_FLAG_SECURE);
+		gcry_md_open(&control->gcry_md5_handle, HASH_ALGO, GCRY_MD_FLAG_SECURE);
 		if (unlikely(control->gcry_md5_handle == NULL))
-			failure("Cannot create MD5 Handle in rzip_fd\n");
+			failure("Cannot create %s Handle in rzip_fd\n", HASH_NAME);
 	}
 	cksem_init(control, &control->cksumsem);
 	cksem_post(control, &control->cksumsem);
@@ -971,7 +2334,9 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		}
 	}
 
-	if (unlikely(fstat(fd_in, &s))) {
+	if (control->in_buffer || control->in_cb)
+		memset(&s, 0, sizeof(s));
+	else if (unlikely(fstat(fd_in, &s))) {
 		dealloc(st);
 		failure("Failed to stat fd_in in rzip_fd\n");
 	}
@@ -1020,6 +2385,9 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	control->max_mmap = MIN(control->max_mmap, control->max_chunk);
 	if (control->max_chunk < control->st_size)
 		round_to_page(&control->max_chunk);
+	/* Content defined cuts need the whole chunk mapped to look at */
+	if (CDC)
+		control->max_chunk = MIN(control->max_chunk, control->max_mmap);
 
 	if (!STDIN)
 		st->chunk_size = MIN(control->max_chunk, len);
@@ -1028,12 +2396,35 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	if (st->chunk_size < len)
 		round_to_page(&st->chunk_size);
 
-	st->level = &levels[control->rzip_compression_level];
+	st->level = malloc(sizeof(*st->level));
+	if (unlikely(!st->level)) {
+		dealloc(st);
+		failure("Failed to allocate rzip level in rzip_fd\n");
+	}
+	*st->level = levels[control->rzip_compression_level];
+	if (control->hash_mb)
+		st->level->mb_used = control->hash_mb;
+	if (control->hash_freq)
+		st->level->initial_freq = control->hash_freq;
+	if (control->chain_len)
+		st->level->max_chain_len = control->chain_len;
 	st->fd_in = fd_in;
 	st->fd_out = fd_out;
 	st->stdin_eof = 0;
 
 	init_hash_indexes(st);
+	if (control->reference) {
+		if (unlikely(!map_reference(control))) {
+			dealloc(st);
+			failure("Failed to map reference file in rzip_fd\n");
+		}
+		if (control->ref_len >= MINIMUM_MATCH &&
+		    !(control->ref_index && load_ref_index(control, st))) {
+			seed_reference(control, st);
+			if (control->ref_index)
+				save_ref_index(control, st->ref);
+		}
+	}
 
 	passes = 0;
 
@@ -1043,13 +2434,10 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 
 	prepare_streamout_threads(control);
 	control->do_mcpy = single_mcpy;
-	control->next_tag = &single_next_tag;
-	control->full_tag = &single_full_tag;
-	control->match_len = &single_match_len;
 
 	while (!pass || len > 0 || (STDIN && !st->stdin_eof)) {
 		double pct_base, pct_multiple;
-		i64 offset = s.st_size - len;
+		i64 offset = s.st_size - len, span;
 		int bits = 8;
 
 		st->chunk_size = control->max_chunk;
@@ -1063,7 +2451,17 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		}
 
 retry:
-		if (STDIN) {
+		if (control->in_buffer) {
+			/* compress_buffer works on the caller's buffer in place */
+			st->chunk_size = st->mmap_size = MIN(st->mmap_size, control->in_buffer_len - control->in_buffer_ofs);
+			sb->buf_low = (uchar *)control->in_buffer + control->in_buffer_ofs;
+			if (CDC && st->chunk_size < control->in_buffer_len - control->in_buffer_ofs)
+				st->chunk_size = st->mmap_size = cdc_cut(control, sb->buf_low, st->chunk_size);
+			control->in_buffer_ofs += st->chunk_size;
+			control->st_size += st->chunk_size;
+			if (control->in_buffer_ofs == control->in_buffer_len)
+				control->eof = st->stdin_eof = 1;
+		} else if (STDIN) {
 			/* NOTE the buf is saved here for STDIN mode */
 			sb->buf_low = mmap(NULL, st->mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 			/* Better to shrink the window to the largest size that works than fail */
@@ -1087,8 +2485,13 @@ retry:
 			st->chunk_size = st->mmap_size;
 			mmap_stdin(control, sb->buf_low, st);
 		} else {
-			/* NOTE The buf is saved here for !STDIN mode */
-			sb->buf_low = (uchar *)mmap(sb->buf_low, st->mmap_size, PROT_READ, MAP_SHARED, fd_in, offset);
+			/* NOTE The buf is saved here for !STDIN mode. Content
+			 * defined chunks start anywhere so map from the page
+			 * before */
+			uchar *map = sb->buf_low - sb->map_lead;
+
+			sb->map_lead = offset % control->page_size;
+			sb->buf_low = (uchar *)mmap(map, st->mmap_size + sb->map_lead, PROT_READ, MAP_SHARED, fd_in, offset - sb->map_lead);
 			if (sb->buf_low == MAP_FAILED) {
 				if (unlikely(errno != ENOMEM)) {
 					close_streamout_threads(control);
@@ -1106,12 +2509,17 @@ retry:
 				}
 				goto retry;
 			}
+			sb->buf_low += sb->map_lead;
+			if (CDC) {
+				st->chunk_size = MIN(st->chunk_size, st->mmap_size);
+				if (st->chunk_size < len)
+					st->chunk_size = cdc_cut(control, sb->buf_low, st->chunk_size);
+			}
 			if (st->mmap_size < st->chunk_size) {
 				print_maxverbose("Enabling sliding mmap mode and using mmap of %lld bytes with window of %lld bytes\n", st->mmap_size, st->chunk_size);
 				control->do_mcpy = &sliding_mcpy;
-				control->next_tag = &sliding_next_tag;
-				control->full_tag = &sliding_full_tag;
-				control->match_len = &sliding_match_len;
+				if (st->ref)
+					print_verbose("Chunk cannot be mapped whole, so it is not matched against the reference\n");
 			}
 		}
 		print_maxverbose("Succeeded in testing %lld sized mmap for rzip pre-processing\n", st->mmap_size);
@@ -1135,7 +2543,11 @@ retry:
 		 * optimal byte width entries. When working with stdin we
 		 * won't know in advance how big it is so it will always be
 		 * rounded up to the window size. */
-		while (st->chunk_size >> bits > 0)
+		span = st->chunk_size;
+		/* Matches into the reference go back past the start */
+		if (st->ref && !sliding_mode(control))
+			span += offset + control->ref_len;
+		while (span >> bits > 0)
 			bits++;
 		st->chunk_bytes = bits / 8;
 		if (bits % 8)
@@ -1181,7 +2593,16 @@ retry:
 
 		if (st->chunk_size == len)
 			control->eof = 1;
+		if (control->stats) {
+			chunk_start = stats_usecs();
+			chunk_cpu = stats_cpu_usecs();
+		}
 		rzip_chunk(control, st, fd_in, fd_out, offset, pct_base, pct_multiple);
+		if (control->stats) {
+			stats_chunk(control, st->chunk_size, stats_usecs() - chunk_start,
+				    stats_cpu_usecs() - chunk_cpu);
+			stats_io(control, st->chunk_size, 0);
+		}
 
 		/* st->chunk_size may be shrunk in rzip_chunk */
 		last_chunk = st->chunk_size;
@@ -1201,22 +2622,31 @@ retry:
 		failure("Failed to close_streamout_threads in rzip_fd\n");
 	}
 
+	if (INDEX) {
+		if (unlikely(!write_index(control))) {
+			dealloc(st);
+			failure("Failed to write_index in rzip_fd\n");
+		}
+		dealloc(control->index);
+		control->index_alloc = 0;
+	}
+
 	if (!NO_MD5) {
 		/* Temporary workaround till someone fixes apple md5 */
-		memcpy(control->gcry_md5_resblock, gcry_md_read(control->gcry_md5_handle, GCRY_MD_MD5), MD5_DIGEST_SIZE);
+		memcpy(control->gcry_md5_resblock, gcry_md_read(control->gcry_md5_handle, HASH_ALGO), HASH_DIGEST_SIZE);
 		if (HASH_CHECK || MAX_VERBOSE) {
-			print_output("MD5: ");
-			for (j = 0; j < MD5_DIGEST_SIZE; j++)
+			print_output("%s: ", HASH_NAME);
+			for (j = 0; j < HASH_DIGEST_SIZE; j++)
 				print_output("%02x", control->gcry_md5_resblock[j]);
 			print_output("\n");
 		}
-		/* When encrypting data, we encrypt the MD5 value as well */
+		/* When encrypting data, we encrypt the hash value as well */
 		if (ENCRYPT)
-			if (unlikely(!lrz_encrypt(control, control->gcry_md5_resblock, MD5_DIGEST_SIZE, control->salt_pass))) {
+			if (unlikely(!lrz_encrypt(control, control->gcry_md5_resblock, HASH_DIGEST_SIZE, control->salt_pass))) {
 				dealloc(st);
 				failure("Failed to lrz_encrypt in rzip_fd\n");
 			}
-		if (unlikely(write_1g(control, control->gcry_md5_resblock, MD5_DIGEST_SIZE) != MD5_DIGEST_SIZE)) {
+		if (unlikely(write_1g(control, control->gcry_md5_resblock, HASH_DIGEST_SIZE) != HASH_DIGEST_SIZE)) {
 			dealloc(st);
 			failure("Failed to write md5 in rzip_fd\n");
 		}
@@ -1229,6 +2659,8 @@ retry:
 		}
 	}
 
+	if (STDIN)
+		stop_stdin_ahead(control);
 	gettimeofday(&current, NULL);
 	if (STDIN)
 		s.st_size = control->st_size;
@@ -1248,6 +2680,8 @@ retry:
 	print_maxverbose("inserts=%u match %.3f\n",
 	       (unsigned int)st->stats.inserts,
 	       (1.0 + st->stats.match_bytes) / st->stats.literal_bytes);
+	if (control->stats)
+		stats_rzip(control, &st->stats);
 
 	if (!STDIN)
 		print_progress("%s - ", control->infile);
@@ -1256,6 +2690,19 @@ retry:
 
 	clear_sslist(st);
 	gcry_md_close(control->gcry_md5_handle);
+	if (st->carry)
+		dealloc(st->carry);
+	if (st->far)
+		close_long_range(st);
+	if (st->ref) {
+		if (st->ref->table_map)
+			munmap(st->ref->table_map, st->ref->table_map_len);
+		else
+			dealloc(st->ref->hash_table);
+		dealloc(st->ref);
+	}
+	unmap_reference(control);
+	dealloc(st->level);
 	dealloc(st);
 }
 
@@ -1264,6 +2711,7 @@ void rzip_control_free(rzip_control *control)
 	if (!control)
 		return;
 
+	free_stream_ctx(control);
 	dealloc(control->tmpdir);
 	dealloc(control->outname);
 	dealloc(control->outdir);
@@ -37,9 +37,16 @@
 # include <unistd.h>
 #endif
 #include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #include <pthread.h>
 #include <bzlib.h>
 #include <zlib.h>
+#include <zstd.h>
+#include <zstd_errors.h>
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
 #include <lz4.h>
@@ -54,20 +61,29 @@
 #ifdef HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
+#ifdef HAVE_LINUX_MEMPOLICY_H
+# include <sched.h>
+# include <sys/syscall.h>
+# include <linux/mempolicy.h>
+#endif
 
 /* LZMA C Wrapper */
 #include "LzmaLib.h"
+#include "LzmaDec.h"
+#include "Alloc.h"
 
 #include "util.h"
 #include "lrzip_core.h"
+#include "remote.h"
 #include <math.h>
 
 #include "Bra.h"	//Filters
 #include "Delta.h"	//Delta Filter
 
 #define STREAM_BUFSIZE (1024 * 1024 * 10)
+#define MIN_SIZE (ENCRYPT ? CBC_LEN : 0)
 
-static struct compress_thread {
+struct compress_thread {
 	uchar *s_buf;	/* Uncompressed buffer -> Compressed buffer */
 	uchar c_type;	/* Compression type */
 	i64 s_len;	/* Data length uncompressed */
@@ -75,8 +91,19 @@ static struct compress_thread {
 	cksem_t cksem;  /* This thread's semaphore */
 	struct stream_info *sinfo;
 	int streamno;
-	uchar salt[SALT_LEN];
-} *cthreads;
+	int level;	/* Backend compression level for this block */
+	int lz4_pct;	/* lz4_compresses verdict, -1 until tested */
+	char *lz4_buf;	/* lz4_compresses scratch, kept for the next block */
+	bool chunk_end;	/* Last block of the chunk */
+	bool ready;	/* Compressed and waiting for the writer */
+	int sub_blocks;	/* s_buf holds this many blocks encoded apart, or 0 */
+	i64 *sub_len;	/* c_len and s_len of each of the sub_blocks */
+	uchar *prime;	/* --preset-dict, the end of the stream before s_buf */
+	i64 prime_len;
+	uchar *salt;	/* Block salt of each block in s_buf, already encrypted */
+	uchar filter;	/* FILTER_FLAG_* the literals were run through, or 0 */
+	unsigned delta;	/* distance of FILTER_FLAG_DELTA */
+};
 
 typedef struct stream_thread_struct {
 	int i;		/* this is the current thread */
@@ -84,13 +111,76 @@ typedef struct stream_thread_struct {
 	struct stream_info *sinfo;
 } stream_thread_struct;
 
-static int output_thread;
-static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
-
-static unsigned save_threads = 0;	// need for multiple chunks to restore thread count
-static i64 limit = 0;			// save for open_stream_out
-static i64 stream_bufsize = 0;		// save for open_stream_out
+struct pool_job {
+	void *(*func)(void *);
+	void *data;
+};
+
+/* Persistent backend workers. Buffers are queued in the order they are
+ * handed out and taken by the first idle worker, so no thread is created
+ * per buffer. There are as many workers as buffer slots, which means a
+ * queued job never waits behind one blocked on output order. */
+struct thread_pool {
+	pthread_t *workers;
+	int nworkers;
+	struct pool_job *jobs;	/* Ring of nworkers queued jobs */
+	int head, queued;
+	bool quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Ram admission for the backends. open_stream_out sets the budget from the
+ * ram actually available and each compthread reserves control->overhead
+ * from it while it compresses, waiting while it is used up. A job is always
+ * let through when none is running, so one larger than the budget still
+ * runs, just alone. */
+struct ram_budget {
+	i64 budget;
+	i64 reserved;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* Buffers given back by the threads of a context, see alloc_buf */
+#define BUF_CACHE_MAX	32
+
+struct buf_cache {
+	uchar *free[BUF_CACHE_MAX];	/* oldest first */
+	int nfree;
+	i64 mapped;			/* Bytes of every buffer mapped, cached or not */
+	pthread_mutex_t lock;
+};
+
+/* What the stream threads of a run share. Each control has its own, made by
+ * the first run and kept by the later ones, so runs on different controls do
+ * not get in each other's way while runs on the same control reuse its
+ * workers and buffers instead of starting them again. */
+struct stream_ctx {
+	rzip_control *control;	/* Of the current run, for the workers' errors */
+	struct compress_thread *cthreads;
+	int next_thread;	/* Slot clear_buffer hands out next */
+	int output_thread;
+	pthread_mutex_t output_lock;
+	pthread_cond_t output_cond;
+
+	/* LZMA blocks being read while they decode */
+	pthread_mutex_t ring_lock;
+	pthread_cond_t ring_cond;
+
+	pthread_t writer_thread;
+	bool writer_quit;
+
+	struct thread_pool pool;
+	struct ram_budget ram;
+	struct buf_cache bufs;
+
+	unsigned save_threads;	// need for multiple chunks to restore thread count
+	i64 limit;		// save for open_stream_out
+	i64 stream_bufsize;	// save for open_stream_out
+	unsigned lzma_parts;	// threads per backend job ram allows
+};
 
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex)
 {
@@ -113,14 +203,14 @@ bool lock_mutex(rzip_control *control, pthread_mutex_t *mutex)
 	return true;
 }
 
-static bool cond_wait(rzip_control *control, pthread_cond_t *cond, pthread_mutex_t *mutex)
+bool cond_wait(rzip_control *control, pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
 	if (unlikely(pthread_cond_wait(cond, mutex)))
 		fatal_return(("Failed to pthread_cond_wait\n"), false);
 	return true;
 }
 
-static bool cond_broadcast(rzip_control *control, pthread_cond_t *cond)
+bool cond_broadcast(rzip_control *control, pthread_cond_t *cond)
 {
 	if (unlikely(pthread_cond_broadcast(cond)))
 		fatal_return(("Failed to pthread_cond_broadcast\n"), false);
@@ -149,10 +239,525 @@ bool join_pthread(rzip_control *control, pthread_t th, void **thread_return)
 	return true;
 }
 
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#define MAX_NUMA_NODES	((int)sizeof(unsigned long) * 8)
+
+/* NUMA nodes with CPUs we may run on. The job in compression slot i runs on
+ * node i % nodes and has its data moved there first, so the backends go
+ * through local memory while every node still gets work. This is the
+ * machine's topology, probed once and only read after that, so it is kept
+ * for the process rather than in each stream context. */
+static struct numa_info {
+	int nodes;		/* 0 until probed, 1 when there is nothing to do */
+	int id[MAX_NUMA_NODES];
+	cpu_set_t cpus[MAX_NUMA_NODES];
+	cpu_set_t allowed;	/* What the process may run on, for idle workers */
+	pthread_mutex_t lock;
+} numa = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Parse a kernel cpu or node list such as 0-3,8-11 */
+static bool read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096], *p = buf;
+	long lo, hi;
+	bool ret;
+	FILE *f;
+
+	CPU_ZERO(set);
+	if (!(f = fopen(path, "r")))
+		return false;
+	ret = fgets(buf, sizeof(buf), f) != NULL;
+	fclose(f);
+	while (ret && *p >= '0' && *p <= '9') {
+		lo = hi = strtol(p, &p, 10);
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (*p == ',')
+			p++;
+	}
+	return ret;
+}
+
+static void probe_numa(rzip_control *control)
+{
+	cpu_set_t nodes, allowed;
+	char path[64];
+	int n, found = 0;
+
+	/* Runs on other controls may probe at the same time */
+	lock_mutex(control, &numa.lock);
+	if (numa.nodes)
+		goto out;
+	if (!read_cpulist("/sys/devices/system/node/online", &nodes) || CPU_COUNT(&nodes) < 2 ||
+	    sched_getaffinity(0, sizeof(allowed), &allowed))
+		goto out;
+	numa.allowed = allowed;
+	for (n = 0; n < MAX_NUMA_NODES; n++) {
+		if (!CPU_ISSET(n, &nodes))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		if (!read_cpulist(path, &numa.cpus[found]))
+			continue;
+		CPU_AND(&numa.cpus[found], &numa.cpus[found], &allowed);
+		if (CPU_COUNT(&numa.cpus[found]))
+			numa.id[found++] = n;
+	}
+	if (found > 1)
+		print_maxverbose("Spreading compression threads over %d NUMA nodes\n", found);
+out:
+	if (!numa.nodes)
+		numa.nodes = MAX(found, 1);
+	unlock_mutex(control, &numa.lock);
+}
+
+/* Move this worker to the node of the job in slot, and the job's data with
+ * it. Only the backends that search their input are worth the data move */
+static void numa_place(rzip_control *control, struct compress_thread *cti, int slot)
+{
+	int node = slot % numa.nodes;
+	unsigned long mask = 1UL << numa.id[node];
+	uintptr_t start, end, page = control->page_size;
+
+	if (numa.nodes < 2)
+		return;
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa.cpus[node]);
+	if (!LZMA_COMPRESS && !ZPAQ_COMPRESS && !ZSTD_COMPRESS)
+		return;
+	/* Whole pages only, the ends may belong to other allocations */
+	start = ((uintptr_t)cti->s_buf + page - 1) & ~(page - 1);
+	end = ((uintptr_t)cti->s_buf + cti->s_len) & ~(page - 1);
+	if (end > start)
+		syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+/* A worker that is done with its job may run anywhere again, so the next
+ * job, which may not be placed at all, is not held to the last one's node */
+static void numa_idle(void)
+{
+	if (numa.nodes > 1)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa.allowed);
+}
+
+/* Drop the node numa_place preferred for a buffer going back to the cache,
+ * as whoever takes it next may work on another node or none */
+static void numa_unbind(uchar *map, i64 len)
+{
+	if (numa.nodes > 1)
+		syscall(SYS_mbind, map, len, MPOL_DEFAULT, NULL, 0, 0);
+}
+#else
+#define probe_numa(control)	do { } while (0)
+#define numa_place(control, cti, slot)	do { } while (0)
+#define numa_idle()	do { } while (0)
+#define numa_unbind(map, len)	do { } while (0)
+#endif
+
+static void *pool_worker(void *data)
+{
+	struct stream_ctx *sc = data;
+	rzip_control *control;
+	struct pool_job job;
+
+	while (42) {
+		control = sc->control;
+		lock_mutex(control, &sc->pool.lock);
+		while (!sc->pool.queued && !sc->pool.quit)
+			cond_wait(control, &sc->pool.cond, &sc->pool.lock);
+		/* Drain anything still queued before quitting */
+		if (!sc->pool.queued) {
+			unlock_mutex(control, &sc->pool.lock);
+			break;
+		}
+		job = sc->pool.jobs[sc->pool.head];
+		if (++sc->pool.head == sc->pool.nworkers)
+			sc->pool.head = 0;
+		sc->pool.queued--;
+		cond_broadcast(control, &sc->pool.cond);
+		unlock_mutex(control, &sc->pool.lock);
+
+		job.func(job.data);
+		numa_idle();
+	}
+	return NULL;
+}
+
+static bool stop_pool(rzip_control *control)
+{
+	struct stream_ctx *sc = control->sctx;
+	int i;
+
+	if (!sc->pool.nworkers)
+		return true;
+	lock_mutex(control, &sc->pool.lock);
+	sc->pool.quit = true;
+	cond_broadcast(control, &sc->pool.cond);
+	unlock_mutex(control, &sc->pool.lock);
+
+	for (i = 0; i < sc->pool.nworkers; i++) {
+		if (unlikely(!join_pthread(control, sc->pool.workers[i], NULL)))
+			return false;
+	}
+	dealloc(sc->pool.workers);
+	dealloc(sc->pool.jobs);
+	sc->pool.nworkers = sc->pool.head = sc->pool.queued = 0;
+	sc->pool.quit = false;
+	return true;
+}
+
+
+/* Make sure at least n workers are running */
+static bool start_pool(rzip_control *control, int n)
+{
+	struct stream_ctx *sc = control->sctx;
+	int i;
+
+	probe_numa(control);
+	if (sc->pool.nworkers >= n)
+		return true;
+	if (unlikely(!stop_pool(control)))
+		return false;
+
+	sc->pool.workers = calloc(sizeof(pthread_t), n);
+	sc->pool.jobs = calloc(sizeof(struct pool_job), n);
+	if (unlikely(!sc->pool.workers || !sc->pool.jobs)) {
+		dealloc(sc->pool.workers);
+		dealloc(sc->pool.jobs);
+		fatal_return(("Unable to calloc thread pool in start_pool\n"), false);
+	}
+	for (i = 0; i < n; i++) {
+		if (unlikely(!create_pthread(control, &sc->pool.workers[i], NULL, pool_worker, sc))) {
+			/* Let the ones already started exit */
+			sc->pool.nworkers = i;
+			stop_pool(control);
+			return false;
+		}
+	}
+	sc->pool.nworkers = n;
+	return true;
+}
+
+/* Queue func(data) to be run by the next idle worker */
+static bool pool_submit(rzip_control *control, void *(*func)(void *), void *data)
+{
+	struct stream_ctx *sc = control->sctx;
+	int tail;
+
+	if (unlikely(!lock_mutex(control, &sc->pool.lock)))
+		return false;
+	while (sc->pool.queued == sc->pool.nworkers)
+		cond_wait(control, &sc->pool.cond, &sc->pool.lock);
+	tail = sc->pool.head + sc->pool.queued;
+	if (tail >= sc->pool.nworkers)
+		tail -= sc->pool.nworkers;
+	sc->pool.jobs[tail].func = func;
+	sc->pool.jobs[tail].data = data;
+	sc->pool.queued++;
+	cond_broadcast(control, &sc->pool.cond);
+	return unlock_mutex(control, &sc->pool.lock);
+}
+
+/* Stream, backend and writer buffers are handed from one to the next and
+ * freed at the end, block after block, in only a few different sizes. They
+ * are kept in the stream context of the control rather than given back to
+ * the system so the next block does not pay for mapping, faulting in and
+ * zeroing them again. The usable size of each buffer is stored in the
+ * cacheline in front of it. */
+#define BUF_HDR		64
+#define HUGE_PAGE	(2 * 1024 * 1024)
+#define BUF_SIZE(buf)	(*(i64 *)((buf) - BUF_HDR))
+
+static uchar *map_buf(rzip_control *control, i64 len)
+{
+	size_t map_len = round_up_page(control, len + BUF_HDR), slack = 0;
+	uchar *map;
+
+	/* Align large buffers so transparent huge pages can back them */
+	if (map_len >= HUGE_PAGE)
+		slack = HUGE_PAGE;
+	map = mmap(NULL, map_len + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(map == MAP_FAILED))
+		return NULL;
+	if (slack) {
+		size_t head = -(uintptr_t)map & (HUGE_PAGE - 1);
+
+		if (head)
+			munmap(map, head);
+		if (slack - head)
+			munmap(map + head + map_len, slack - head);
+		map += head;
+#ifdef MADV_HUGEPAGE
+		madvise(map, map_len, MADV_HUGEPAGE);
+#endif
+	}
+	*(i64 *)map = map_len - BUF_HDR;
+	return map + BUF_HDR;
+}
+
+/* Called with bufs->lock held when there is a cache to account it to */
+static void unmap_buf(struct buf_cache *bufs, uchar *buf)
+{
+	if (bufs)
+		bufs->mapped -= BUF_SIZE(buf) + BUF_HDR;
+	munmap(buf - BUF_HDR, BUF_SIZE(buf) + BUF_HDR);
+}
+
+/* Take the smallest cached buffer of at least len bytes that wastes no more
+ * than a quarter of itself, otherwise map a new one */
+static uchar *alloc_buf(rzip_control *control, i64 len)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct buf_cache *bufs;
+	uchar *buf = NULL;
+	int i, best = -1;
+
+	if (unlikely(!sc))
+		return map_buf(control, len);
+	bufs = &sc->bufs;
+	lock_mutex(control, &bufs->lock);
+	for (i = 0; i < bufs->nfree; i++) {
+		i64 size = BUF_SIZE(bufs->free[i]);
+
+		if (size >= len && size - len <= len / 4 &&
+		    (best == -1 || size < BUF_SIZE(bufs->free[best])))
+			best = i;
+	}
+	if (best != -1) {
+		buf = bufs->free[best];
+		bufs->nfree--;
+		memmove(bufs->free + best, bufs->free + best + 1, sizeof(uchar *) * (bufs->nfree - best));
+	}
+	unlock_mutex(control, &bufs->lock);
+	if (!buf) {
+		buf = map_buf(control, len);
+		if (buf) {
+			lock_mutex(control, &bufs->lock);
+			bufs->mapped += BUF_SIZE(buf) + BUF_HDR;
+			unlock_mutex(control, &bufs->lock);
+		}
+	}
+	return buf;
+}
+
+/* Every worker of the context can hold a stream and a backend buffer, keep
+ * about that many and let the oldest go when there are more. A buffer given
+ * back after its context has gone is unmapped */
+static void put_buf(rzip_control *control, uchar *buf)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct buf_cache *bufs;
+	int keep;
+
+	if (!buf)
+		return;
+	if (unlikely(!sc)) {
+		unmap_buf(NULL, buf);
+		return;
+	}
+	numa_unbind(buf - BUF_HDR, BUF_SIZE(buf) + BUF_HDR);
+	bufs = &sc->bufs;
+	keep = MIN(sc->pool.nworkers * 2 + 2, BUF_CACHE_MAX);
+	lock_mutex(control, &bufs->lock);
+	while (bufs->nfree >= keep) {
+		unmap_buf(bufs, bufs->free[0]);
+		bufs->nfree--;
+		memmove(bufs->free, bufs->free + 1, sizeof(uchar *) * bufs->nfree);
+	}
+	bufs->free[bufs->nfree++] = buf;
+	unlock_mutex(control, &bufs->lock);
+}
+
+#define free_buf(control, buf) do { \
+	put_buf(control, buf); \
+	buf = NULL; \
+} while (0)
+
+static void drain_bufs(rzip_control *control)
+{
+	struct buf_cache *bufs = &control->sctx->bufs;
+
+	lock_mutex(control, &bufs->lock);
+	while (bufs->nfree)
+		unmap_buf(bufs, bufs->free[--bufs->nfree]);
+	unlock_mutex(control, &bufs->lock);
+}
+
+i64 stats_usecs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (i64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* CPU time of the calling thread */
+i64 stats_cpu_usecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return 0;
+	return (i64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void init_stats(struct lrz_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_init(&stats->lock, NULL);
+}
+
+/* Copy the counters to out along with the queue and ram figures of now.
+ * They are copied one by one, as copying the whole would copy the lock
+ * while it is held. The lock of out is left zeroed and is not for use */
+void sample_stats(rzip_control *control, struct lrz_stats *out)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct lrz_stats *stats = control->stats;
+
+	memset(out, 0, sizeof(*out));
+	lock_mutex(control, &stats->lock);
+	out->in_bytes = stats->in_bytes;
+	out->out_bytes = stats->out_bytes;
+	out->chunks = stats->chunks;
+	out->rzip_bytes = stats->rzip_bytes;
+	out->rzip_usecs = stats->rzip_usecs;
+	out->rzip_cpu_usecs = stats->rzip_cpu_usecs;
+	out->chunk_usecs = stats->chunk_usecs;
+	out->cksum_usecs = stats->cksum_usecs;
+	out->write_usecs = stats->write_usecs;
+	out->cksum_wait_usecs = stats->cksum_wait_usecs;
+	out->backend_wait_usecs = stats->backend_wait_usecs;
+	out->writer_wait_usecs = stats->writer_wait_usecs;
+	out->ram_wait_usecs = stats->ram_wait_usecs;
+	memcpy(out->thread, stats->thread, sizeof(out->thread));
+	out->rzip = stats->rzip;
+	out->pct = stats->pct;
+	unlock_mutex(control, &stats->lock);
+	if (sc) {
+		lock_mutex(control, &sc->pool.lock);
+		out->queued = sc->pool.queued;
+		unlock_mutex(control, &sc->pool.lock);
+		lock_mutex(control, &sc->ram.lock);
+		out->running = sc->ram.running;
+		out->ram_budget = sc->ram.budget;
+		out->ram_reserved = sc->ram.reserved;
+		unlock_mutex(control, &sc->ram.lock);
+		lock_mutex(control, &sc->bufs.lock);
+		out->ram_mapped = sc->bufs.mapped;
+		unlock_mutex(control, &sc->bufs.lock);
+	}
+}
+
+void stats_add(rzip_control *control, i64 *counter, i64 val)
+{
+	lock_mutex(control, &control->stats->lock);
+	*counter += val;
+	unlock_mutex(control, &control->stats->lock);
+}
+
+void stats_io(rzip_control *control, i64 in, i64 out)
+{
+	struct lrz_stats *stats = control->stats;
+
+	lock_mutex(control, &stats->lock);
+	stats->in_bytes += in;
+	stats->out_bytes += out;
+	unlock_mutex(control, &stats->lock);
+}
+
+void stats_chunk(rzip_control *control, i64 len, i64 usecs, i64 cpu_usecs)
+{
+	struct lrz_stats *stats = control->stats;
+
+	lock_mutex(control, &stats->lock);
+	stats->chunks++;
+	stats->rzip_bytes += len;
+	stats->rzip_usecs += usecs;
+	stats->rzip_cpu_usecs += cpu_usecs;
+	stats->chunk_usecs = usecs;
+	unlock_mutex(control, &stats->lock);
+}
+
+void stats_rzip(rzip_control *control, const struct rzip_counts *counts)
+{
+	struct rzip_counts *sum = &control->stats->rzip;
+
+	lock_mutex(control, &control->stats->lock);
+	sum->inserts += counts->inserts;
+	sum->literals += counts->literals;
+	sum->literal_bytes += counts->literal_bytes;
+	sum->matches += counts->matches;
+	sum->match_bytes += counts->match_bytes;
+	sum->tag_hits += counts->tag_hits;
+	sum->tag_misses += counts->tag_misses;
+	unlock_mutex(control, &control->stats->lock);
+}
+
+/* Where a backend job started, in wall and thread CPU time */
+struct stats_mark {
+	i64 usecs;
+	i64 cpu_usecs;
+};
+
+static void mark_stats(rzip_control *control, struct stats_mark *mark)
+{
+	if (control->stats) {
+		mark->usecs = stats_usecs();
+		mark->cpu_usecs = stats_cpu_usecs();
+	}
+}
+
+static void stats_block(rzip_control *control, int slot, i64 in, i64 out, const struct stats_mark *start)
+{
+	struct lrz_stats *stats = control->stats;
+	i64 usecs = stats_usecs() - start->usecs, cpu_usecs = stats_cpu_usecs() - start->cpu_usecs;
+
+	slot %= STATS_THREADS;
+	lock_mutex(control, &stats->lock);
+	stats->thread[slot].blocks++;
+	stats->thread[slot].in_bytes += in;
+	stats->thread[slot].out_bytes += out;
+	stats->thread[slot].usecs += usecs;
+	stats->thread[slot].cpu_usecs += cpu_usecs;
+	unlock_mutex(control, &stats->lock);
+}
+
+/* Take the checksum semaphore, counting the time it was held elsewhere */
+void wait_cksum(rzip_control *control)
+{
+	i64 start = stats_start(control);
+
+	cksem_wait(control, &control->cksumsem);
+	stats_since(control, cksum_wait_usecs, start);
+}
+
+/* Hand the caller a snapshot at each progress update */
+void report_stats(rzip_control *control, int pct)
+{
+	struct lrz_stats snap;
+
+	if (!control->stats)
+		return;
+	lock_mutex(control, &control->stats->lock);
+	control->stats->pct = pct;
+	unlock_mutex(control, &control->stats->lock);
+	if (!control->stats_cb)
+		return;
+	sample_stats(control, &snap);
+	control->stats_cb(control->stats_data, &snap);
+}
+
 /* just to keep things clean, declare function here
  * but move body to the end since it's a work function
 */
-static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len);
+static int lz4_compresses(rzip_control *control, struct compress_thread *cthread);
+static int block_compresses(rzip_control *control, struct compress_thread *cthread);
+static bool zpaq_split_buf(rzip_control *control, struct compress_thread *cthread, int current_thread,
+			   char *method);
+static void *writethread(void *data);
 
 /*
   ***** COMPRESSION FUNCTIONS *****
@@ -168,25 +773,18 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 {
 	i64 c_len, c_size;
 	uchar *c_buf;
-	int zpaq_ease, zpaq_type, compressibility;
+	int zpaq_level, zpaq_bs, zpaq_ease, zpaq_type, compressibility;
 	char method[10]; /* level, block size, ease of compression, type */
 
 	/* if we're testing compressibility */
 	if (LZ4_TEST) {
-		if (!(compressibility=lz4_compresses(control, cthread->s_buf, cthread->s_len)))
+		if (!(compressibility = block_compresses(control, cthread)))
 			return 0;
 	} /* else set compressibility to a neutral value */
 	else
 		compressibility = 50;	/* midpoint */
 
 
-	c_size = round_up_page(control, cthread->s_len + 10000);
-	c_buf = malloc(c_size);
-	if (!c_buf) {
-		print_err("Unable to allocate c_buf in zpaq_compress_buf\n");
-		return -1;
-	}
-
 	c_len = 0;
         /* Compression level can be 1 to 5, zpaq version 7.15 */
 	/* Levels 1 and 2 produce worse results and are omitted */
@@ -194,10 +792,25 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (zpaq_ease < 25) zpaq_ease = 25;		/* too low a value fails */
 	zpaq_type = 0;					/* default, binary data */
 
-	sprintf(method,"%d%d,%d,%d",control->zpaq_level,control->zpaq_bs,zpaq_ease,zpaq_type);
+	/* Same choice as setup_overhead makes for the level, with the block
+	 * size of a stream given zpaq by --stream0 alone left at 64MB */
+	zpaq_level = cthread->level / 4 + 3;
+	zpaq_bs = control->zpaq_bs ? control->zpaq_bs : 6;
+
+	sprintf(method,"%d%d,%d,%d",zpaq_level,zpaq_bs,zpaq_ease,zpaq_type);
 
 	print_verbose("Starting zpaq backend compression thread %d...\nZPAQ: Method selected: %s: level=%d, bs=%d, easy=%d, type=%d\n",
-		       current_thread, method, control->zpaq_level, control->zpaq_bs, zpaq_ease, zpaq_type);
+		       current_thread, method, zpaq_level, zpaq_bs, zpaq_ease, zpaq_type);
+
+	if (zpaq_split_buf(control, cthread, current_thread, method))
+		return 0;
+
+	c_size = round_up_page(control, cthread->s_len + 10000);
+	c_buf = alloc_buf(control, c_size);
+	if (!c_buf) {
+		print_err("Unable to allocate c_buf in zpaq_compress_buf\n");
+		return -1;
+	}
 
         zpaq_compress(c_buf, &c_len, cthread->s_buf, cthread->s_len, &method[0],
 			control->msgout, SHOW_PROGRESS ? true: false, current_thread);
@@ -205,12 +818,12 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (unlikely(c_len >= cthread->c_len)) {
 		print_maxverbose("Incompressible block\n");
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = c_len;
-	dealloc(cthread->s_buf);
+	free_buf(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_ZPAQ;
 	return 0;
@@ -223,11 +836,11 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 	uchar *c_buf;
 
 	if (LZ4_TEST) {
-		if (!lz4_compresses(control, cthread->s_buf, cthread->s_len))
+		if (!block_compresses(control, cthread))
 			return 0;
 	}
 
-	c_buf = malloc(dlen);
+	c_buf = alloc_buf(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in bzip2_compress_buf\n");
 		return -1;
@@ -235,7 +848,7 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 
 	bzip2_ret = BZ2_bzBuffToBuffCompress((char *)c_buf, &dlen,
 		(char *)cthread->s_buf, cthread->s_len,
-		control->compression_level, 0, control->compression_level * 10);
+		cthread->level, 0, cthread->level * 10);
 
 	/* if compressed data is bigger then original data leave as
 	 * CTYPE_NONE */
@@ -243,12 +856,12 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 	if (bzip2_ret == BZ_OUTBUFF_FULL) {
 		print_maxverbose("Incompressible block\n");
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		return 0;
 	}
 
 	if (unlikely(bzip2_ret != BZ_OK)) {
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		print_maxverbose("BZ2 compress failed\n");
 		return -1;
 	}
@@ -256,12 +869,12 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 	if (unlikely(dlen >= cthread->c_len)) {
 		print_maxverbose("Incompressible block\n");
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	free_buf(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_BZIP2;
 	return 0;
@@ -273,14 +886,14 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	uchar *c_buf;
 	int gzip_ret;
 
-	c_buf = malloc(dlen);
+	c_buf = alloc_buf(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in gzip_compress_buf\n");
 		return -1;
 	}
 
 	gzip_ret = compress2(c_buf, &dlen, cthread->s_buf, cthread->s_len,
-		control->compression_level);
+		cthread->level);
 
 	/* if compressed data is bigger then original data leave as
 	 * CTYPE_NONE */
@@ -288,12 +901,12 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (gzip_ret == Z_BUF_ERROR) {
 		print_maxverbose("Incompressible block\n");
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		return 0;
 	}
 
 	if (unlikely(gzip_ret != Z_OK)) {
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		print_maxverbose("compress2 failed\n");
 		return -1;
 	}
@@ -301,127 +914,627 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (unlikely((i64)dlen >= cthread->c_len)) {
 		print_maxverbose("Incompressible block\n");
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	free_buf(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_GZIP;
 	return 0;
 }
 
-static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthread, int current_thread)
+static void reserve_ram(rzip_control *control, i64 size)
 {
-	unsigned char lzma_properties[5]; /* lzma properties, encoded */
-	int lzma_level, lzma_ret;
-	size_t prop_size = 5; /* return value for lzma_properties */
-	uchar *c_buf;
-	size_t dlen;
+	struct stream_ctx *sc = control->sctx;
+	i64 start = stats_start(control);
+
+	lock_mutex(control, &sc->ram.lock);
+	while (sc->ram.running && sc->ram.reserved + size > sc->ram.budget)
+		cond_wait(control, &sc->ram.cond, &sc->ram.lock);
+	sc->ram.reserved += size;
+	sc->ram.running++;
+	unlock_mutex(control, &sc->ram.lock);
+	stats_since(control, ram_wait_usecs, start);
+}
 
-	if (LZ4_TEST) {
-		if (!lz4_compresses(control, cthread->s_buf, cthread->s_len))
-			return 0;
-	}
+static void release_ram(rzip_control *control, i64 size)
+{
+	struct stream_ctx *sc = control->sctx;
+	lock_mutex(control, &sc->ram.lock);
+	sc->ram.reserved -= size;
+	sc->ram.running--;
+	cond_broadcast(control, &sc->ram.cond);
+	unlock_mutex(control, &sc->ram.lock);
+}
 
-	print_maxverbose("Starting lzma back end compression thread %d...\n", current_thread);
-retry:
-	dlen = round_up_page(control, cthread->s_len * 1.02); // add 2% for lzma overhead to prevent memory overrun
-	c_buf = malloc(dlen);
-	if (!c_buf) {
-		print_err("Unable to allocate c_buf in lzma_compress_buf\n");
-		return -1;
-	}
-	/* pass absolute dictionary size and compression level */
-	lzma_ret = LzmaCompress(c_buf, &dlen, cthread->s_buf,
-		(size_t)cthread->s_len, lzma_properties, &prop_size,
-				control->compression_level,
-				control->dictSize, /* dict size. 0 = set default, otherwise control->dictSize */
-				-1, -1, -1, -1, /* lc, lp, pb, fb */
-				-1);
-				/* LZMA spec has threads = 1 or 2 only. */
-	if (lzma_ret != SZ_OK) {
-		switch (lzma_ret) {
-			case SZ_ERROR_MEM:
-				break;
-			case SZ_ERROR_PARAM:
-				print_err("LZMA Parameter ERROR: %d. This should not happen.\n", SZ_ERROR_PARAM);
-				break;
-			case SZ_ERROR_OUTPUT_EOF:
-				print_maxverbose("Harmless LZMA Output Buffer Overflow error: %d. Incompressible block.\n", SZ_ERROR_OUTPUT_EOF);
-				break;
-			case SZ_ERROR_THREAD:
-				print_err("LZMA Multi Thread ERROR: %d. This should not happen.\n", SZ_ERROR_THREAD);
-				break;
-			default:
-				print_err("Unidentified LZMA ERROR: %d. This should not happen.\n", lzma_ret);
-				break;
-		}
-		/* can pass -1 if not compressible! Thanks Lasse Collin */
-		dealloc(c_buf);
-		if (lzma_ret == SZ_ERROR_MEM) {
-			if (lzma_level > 1) {
-				lzma_level--;
-				print_verbose("LZMA Warning: %d. Can't allocate enough RAM for compression window, trying smaller.\n", SZ_ERROR_MEM);
-				goto retry;
-			}
-			/* lzma compress can be fragile on 32 bit. If it fails,
-			 * fall back to bzip2 compression so the block doesn't
-			 * remain uncompressed */
-			print_verbose("Unable to allocate enough RAM for any sized compression window, falling back to bzip2 compression.\n");
-			return bzip2_compress_buf(control, cthread);
-		} else if (lzma_ret == SZ_ERROR_OUTPUT_EOF)
-			return 0;
-		return -1;
+/* Take up to max more backend slots, each of size ram, if CPUs and ram are
+ * free right now. Never waits. Returns how many were taken, to be handed
+ * back with release_ram */
+static int reserve_idle(rzip_control *control, int max, i64 size)
+{
+	struct stream_ctx *sc = control->sctx;
+	int n;
+
+	lock_mutex(control, &sc->ram.lock);
+	for (n = 0; n < max && sc->ram.running + n < control->threads &&
+	     sc->ram.reserved + size <= sc->ram.budget; n++)
+		sc->ram.reserved += size;
+	sc->ram.running += n;
+	unlock_mutex(control, &sc->ram.lock);
+	return n;
+}
+
+/* ZPAQ blocks are only split when every part gets at least this much data */
+#define ZPAQ_PART_MIN	STREAM_BUFSIZE
+
+struct zpaq_part {
+	pthread_t thread;
+	uchar *s_buf, *c_buf;
+	i64 s_len, c_len;
+	char *method;
+	FILE *msgout;
+	bool progress;
+	int thread_no;
+};
+
+static void *zpaq_part_thread(void *data)
+{
+	struct zpaq_part *part = data;
+
+	part->c_len = 0;
+	zpaq_compress(part->c_buf, &part->c_len, part->s_buf, part->s_len, (uchar *)part->method,
+		      part->msgout, part->progress, part->thread_no);
+	return NULL;
+}
+
+/* ZPAQ models every byte on one thread, so a big block, like the last one
+ * of a chunk or any block once ram has cut the thread count, can keep one
+ * CPU busy for a very long time. Encode it as several ZPAQ streams at once
+ * on the backend slots left idle instead, each written out as a block of its
+ * own like lzma_split_buf does, so they also decode in parallel. The block's
+ * own ram reservation covers the parts' input, but every part builds a ZPAQ
+ * model of its own, so each slot taken is charged control->overhead as the
+ * zstd workers are. A block --x86 or --delta has run over is never split,
+ * the decoder unfilters each part on its own. Returns true when the block
+ * has been dealt with */
+static bool zpaq_split_buf(rzip_control *control, struct compress_thread *cthread, int current_thread,
+			   char *method)
+{
+	struct zpaq_part *part = NULL;
+	int idle, parts, started, i;
+	i64 part_len, cap, c_len = 0;
+	uchar *c_buf = NULL;
+	bool ret = false;
+
+	/* The decoder would unfilter each part on its own */
+	if (cthread->filter)
+		return false;
+	idle = reserve_idle(control, MIN(cthread->s_len / ZPAQ_PART_MIN, control->threads) - 1,
+			    control->overhead);
+	if (!idle)
+		return false;
+	parts = idle + 1;
+
+	part_len = (cthread->s_len + parts - 1) / parts;
+	cap = round_up_page(control, part_len + 10000);
+	part = calloc(parts, sizeof(struct zpaq_part));
+	c_buf = alloc_buf(control, cap * parts);
+	if (unlikely(!part || !c_buf))
+		goto out;
+
+	print_maxverbose("Thread %d encoding %lld bytes as %d zpaq parts\n", current_thread, cthread->s_len, parts);
+	for (i = 0; i < parts; i++) {
+		part[i].s_buf = cthread->s_buf + part_len * i;
+		part[i].s_len = MIN(part_len, cthread->s_len - part_len * i);
+		part[i].c_buf = c_buf + cap * i;
+		part[i].method = method;
+		part[i].msgout = control->msgout;
+		part[i].thread_no = current_thread;
 	}
+	/* Only the part encoded on this thread shows progress */
+	part[parts - 1].progress = SHOW_PROGRESS ? true : false;
+
+	for (started = 0; started < parts - 1; started++)
+		if (unlikely(!create_pthread(control, &part[started].thread, NULL, zpaq_part_thread, &part[started])))
+			break;
+	zpaq_part_thread(&part[parts - 1]);
+	for (i = 0; i < started; i++)
+		join_pthread(control, part[i].thread, NULL);
+	if (unlikely(started < parts - 1))
+		goto out;
 
-	if (unlikely((i64)dlen >= cthread->c_len)) {
-		/* Incompressible, leave as CTYPE_NONE */
+	for (i = 0; i < parts; i++)
+		c_len += part[i].c_len;
+	ret = true;
+	if (c_len >= cthread->c_len) {
 		print_maxverbose("Incompressible block\n");
-		dealloc(c_buf);
-		return 0;
+		goto out;
 	}
 
-	/* Make sure multiple threads don't race on writing lzma_properties */
-	lock_mutex(control, &control->control_lock);
-	if (!control->lzma_prop_set) {
-		memcpy(control->lzma_properties, lzma_properties, 5);
-		control->lzma_prop_set = true;
-		/* Reset the magic written flag so we write it again if we
-		 * get lzma properties and haven't written them yet. */
-		if (TMP_OUTBUF)
-			control->magic_written = 0;
+	cthread->sub_len = malloc(sizeof(i64) * 2 * parts);
+	if (unlikely(!cthread->sub_len)) {
+		ret = false;
+		goto out;
+	}
+	/* Close the gaps between the parts so they can be written in turn */
+	for (c_len = 0, i = 0; i < parts; i++) {
+		memmove(c_buf + c_len, part[i].c_buf, part[i].c_len);
+		c_len += part[i].c_len;
+		cthread->sub_len[i * 2] = part[i].c_len;
+		cthread->sub_len[i * 2 + 1] = part[i].s_len;
 	}
-	unlock_mutex(control, &control->control_lock);
 
-	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	cthread->sub_blocks = parts;
+	cthread->c_len = c_len;
+	free_buf(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
-	cthread->c_type = CTYPE_LZMA;
-	return 0;
+	cthread->c_type = CTYPE_ZPAQ;
+	c_buf = NULL;
+out:
+	for (i = 0; i < idle; i++)
+		release_ram(control, control->overhead);
+	free_buf(control, c_buf);
+	dealloc(part);
+	return ret;
 }
 
-static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthread)
+/* zstd workers only get a job each when the block is this big */
+#define ZSTD_JOB_MIN	STREAM_BUFSIZE
+
+static int zstd_compress_buf(rzip_control *control, struct compress_thread *cthread, int current_thread)
 {
-	lzo_uint in_len = cthread->s_len;
-	lzo_uint dlen = round_up_page(control, in_len + in_len / 16 + 64 + 3);
-	lzo_bytep wrkmem;
-	uchar *c_buf;
-	int ret = -1;
+	size_t dlen = round_up_page(control, cthread->s_len), zstd_ret;
+	ZSTD_bounds window = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+	int window_log = window.lowerBound, workers = 0, ret = 0, i;
+	uchar *c_buf = NULL;
+	ZSTD_CCtx *cctx;
 
-	wrkmem = (lzo_bytep) calloc(1, LZO1X_1_MEM_COMPRESS);
-	if (unlikely(wrkmem == NULL)) {
-		print_maxverbose("Failed to malloc wkmem\n");
-		return ret;
+	if (LZ4_TEST) {
+		if (!block_compresses(control, cthread))
+			return 0;
 	}
 
-	c_buf = malloc(dlen);
-	if (!c_buf) {
-		print_err("Unable to allocate c_buf in lzo_compress_buf");
-		goto out_free;
+	cctx = ZSTD_createCCtx();
+	if (unlikely(!cctx)) {
+		print_err("Unable to create zstd context in zstd_compress_buf\n");
+		return -1;
 	}
-
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zstd_level(cthread->level));
+	/* No dictionary size is set when zstd only has stream 0 */
+	if (control->dictSize) {
+		while (window_log < window.upperBound && ((i64)1 << window_log) < control->dictSize)
+			window_log++;
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log);
+	}
+	/* Matches further back than rzip's minimum are mostly gone by now,
+	 * but the highest levels can still afford to look for them */
+	if (cthread->level >= 8)
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+
+	/* Spread a block over the CPUs no other block is using, such as while
+	 * the last block of a chunk is compressed alone */
+	if (cthread->s_len >= ZSTD_JOB_MIN * 2) {
+		workers = reserve_idle(control, MIN(cthread->s_len / ZSTD_JOB_MIN, control->threads) - 1,
+				       control->overhead);
+		if (workers && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers + 1))) {
+			print_maxverbose("This libzstd cannot use threads\n");
+			for (i = 0; i < workers; i++)
+				release_ram(control, control->overhead);
+			workers = 0;
+		} else if (workers) {
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize,
+					       MAX(cthread->s_len / (workers + 1), ZSTD_JOB_MIN));
+			print_maxverbose("Thread %d compressing with %d zstd workers\n", current_thread, workers + 1);
+		}
+	}
+
+	c_buf = alloc_buf(control, dlen);
+	if (!c_buf) {
+		print_err("Unable to allocate c_buf in zstd_compress_buf\n");
+		ret = -1;
+		goto out;
+	}
+
+	zstd_ret = ZSTD_compress2(cctx, c_buf, dlen, cthread->s_buf, cthread->s_len);
+	if (ZSTD_isError(zstd_ret)) {
+		if (ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall) {
+			print_maxverbose("Incompressible block\n");
+			/* Incompressible, leave as CTYPE_NONE */
+		} else {
+			print_maxverbose("zstd compress failed: %s\n", ZSTD_getErrorName(zstd_ret));
+			ret = -1;
+		}
+		goto out;
+	}
+
+	if (unlikely((i64)zstd_ret >= cthread->c_len)) {
+		print_maxverbose("Incompressible block\n");
+		/* Incompressible, leave as CTYPE_NONE */
+		goto out;
+	}
+
+	cthread->c_len = zstd_ret;
+	free_buf(control, cthread->s_buf);
+	cthread->s_buf = c_buf;
+	cthread->c_type = CTYPE_ZSTD;
+	c_buf = NULL;
+out:
+	for (i = 0; i < workers; i++)
+		release_ram(control, control->overhead);
+	free_buf(control, c_buf);
+	ZSTD_freeCCtx(cctx);
+	return ret;
+}
+
+/* Blocks are only split when every part gets at least this much data */
+#define LZMA_PART_MIN	STREAM_BUFSIZE
+/* Smallest dictionary that the lack of ram will make us use */
+#define LZMA_DICT_MIN	(1 << 24)
+/* Backend jobs the lack of ram should still leave room for, as the thread
+ * search of old kept */
+#define MIN_JOBS	4
+
+/* With --preset-dict every LZMA block starts with the end of the data before
+ * it in its stream as dictionary. Both sides keep that from the blocks in
+ * turn, whatever they were compressed with. The literals are left alone
+ * when filtered, as the filter changes them in the backend thread after
+ * the end was taken */
+static bool primed_stream(rzip_control *control, int streamno)
+{
+	return control->preset_dict && !(FILTER_USED && streamno == 1);
+}
+
+/* Keep the last preset_dict bytes of a stream with buf added to it */
+static bool keep_tail(rzip_control *control, struct stream *s, const uchar *buf, i64 len)
+{
+	i64 size = control->preset_dict, keep;
+
+	if (!s->tail) {
+		s->tail = alloc_buf(control, size);
+		if (unlikely(!s->tail))
+			fatal_return(("Unable to malloc preset dictionary of %lld bytes\n", size), false);
+	}
+	if (len >= size) {
+		memcpy(s->tail, buf + len - size, size);
+		s->tail_len = size;
+		return true;
+	}
+	keep = MIN(s->tail_len, size - len);
+	memmove(s->tail, s->tail + s->tail_len - keep, keep);
+	memcpy(s->tail + keep, buf, len);
+	s->tail_len = keep + len;
+	return true;
+}
+
+struct lzma_part {
+	pthread_t thread;
+	rzip_control *control;
+	uchar *s_buf, *c_buf;
+	size_t s_len, c_len;
+	size_t prime_len;	/* Bytes in front of s_buf to prime with */
+	u32 dictSize;
+	int level;
+	uchar lzma_properties[5];
+	int lzma_ret;
+};
+
+static void *lzma_part_thread(void *data)
+{
+	struct lzma_part *part = data;
+	size_t prop_size = 5;
+
+	part->lzma_ret = LzmaCompressPrimed(part->c_buf, &part->c_len, part->s_buf, part->s_len,
+				      part->prime_len, part->lzma_properties, &prop_size,
+				      part->level, part->dictSize,
+				      -1, -1, -1, -1, 2);
+	return NULL;
+}
+
+/* Largest LZMA friendly dictionary, no larger than the one set, whose
+ * encoder fits in ram_size going by the setup_overhead sum */
+static u32 lzma_fit_dict(rzip_control *control, i64 ram_size)
+{
+	i64 dict = (ram_size - (6 * 1024 * 1024) - 16384) * 2 / 23;
+	int n;
+
+	dict = MIN(dict, (i64)control->dictSize);
+	for (n = 30; n >= 11; n--) {
+		if (((i64)3 << n) <= dict)
+			return (u32)3 << n;
+		if (((i64)2 << n) <= dict)
+			return (u32)2 << n;
+	}
+	return 0;
+}
+
+/* Overhead of one backend job at the smallest dictionary or zpaq block size
+ * open_stream_out will shrink to */
+static i64 min_overhead(rzip_control *control)
+{
+	i64 overhead = control->overhead, ret;
+	u32 dict = control->dictSize;
+	int bs = control->zpaq_bs;
+
+	if (LZMA_COMPRESS)
+		control->dictSize = MIN(LZMA_DICT_MIN, dict);
+	else if (ZPAQ_COMPRESS)
+		control->zpaq_bs = MIN(5, bs);
+	setup_overhead(control);
+	ret = control->overhead;
+	control->dictSize = dict;
+	control->zpaq_bs = bs;
+	control->overhead = overhead;
+	return ret;
+}
+
+/* Encode a block as several independent parts at once, each written out as
+ * a block of its own, so the archive format does not change. Only done when
+ * RAM held the thread count below what was asked for. The parts trade some
+ * dictionary size for the idle CPUs. The block is read from src, which has
+ * cthread->prime_len bytes of preset dictionary in front of it, and later
+ * parts are primed from the ones before. A block --x86 or --delta has run
+ * over is never split, since it was filtered whole and the decoder unfilters
+ * each part on its own. Returns 1 when the block should be encoded whole
+ * instead. */
+static bool lzma_split_buf(rzip_control *control, struct compress_thread *cthread, int current_thread,
+			   const uchar *src)
+{
+	struct stream_ctx *sc = control->sctx;
+	bool primed = primed_stream(control, cthread->streamno);
+	struct lzma_part *part;
+	int parts, started, i;
+	bool ret = false;
+	i64 part_len, cap, c_len = 0;
+	u32 dict = 0;
+	uchar *c_buf;
+
+	/* The decoder would unfilter each part on its own */
+	if (cthread->filter)
+		return false;
+	for (parts = MIN(sc->lzma_parts, cthread->s_len / LZMA_PART_MIN); parts > 1; parts--) {
+		dict = lzma_fit_dict(control, control->overhead / parts);
+		if (dict >= LZMA_DICT_MIN)
+			break;
+	}
+	if (parts < 2)
+		return false;
+
+	part_len = (cthread->s_len + parts - 1) / parts;
+	cap = round_up_page(control, part_len * 1.02);
+	part = calloc(parts, sizeof(struct lzma_part));
+	c_buf = alloc_buf(control, cap * parts);
+	if (unlikely(!part || !c_buf))
+		goto out;
+
+	print_maxverbose("Thread %d encoding %lld bytes as %d parts with dictionary %u\n",
+			 current_thread, cthread->s_len, parts, dict);
+	for (i = 0; i < parts; i++) {
+		part[i].control = control;
+		part[i].s_buf = (uchar *)src + part_len * i;
+		if (primed)
+			part[i].prime_len = MIN(control->preset_dict, cthread->prime_len + part_len * i);
+		part[i].s_len = MIN(part_len, cthread->s_len - part_len * i);
+		part[i].c_buf = c_buf + cap * i;
+		part[i].c_len = cap;
+		part[i].dictSize = dict;
+		part[i].level = cthread->level;
+	}
+
+	/* The last part is encoded here while the others run alongside */
+	for (started = 0; started < parts - 1; started++)
+		if (unlikely(!create_pthread(control, &part[started].thread, NULL, lzma_part_thread, &part[started])))
+			break;
+	lzma_part_thread(&part[parts - 1]);
+	for (i = 0; i < started; i++)
+		join_pthread(control, part[i].thread, NULL);
+	if (unlikely(started < parts - 1))
+		goto out;
+
+	for (i = 0; i < parts; i++) {
+		if (part[i].lzma_ret == SZ_ERROR_OUTPUT_EOF) {
+			print_maxverbose("Incompressible block\n");
+			ret = true;
+			goto out;
+		}
+		/* Anything else is left for the whole block encoder to report */
+		if (part[i].lzma_ret != SZ_OK || (i64)part[i].c_len < MIN_SIZE)
+			goto out;
+		c_len += part[i].c_len;
+	}
+	if (c_len >= cthread->c_len) {
+		print_maxverbose("Incompressible block\n");
+		ret = true;
+		goto out;
+	}
+
+	cthread->sub_len = malloc(sizeof(i64) * 2 * parts);
+	if (unlikely(!cthread->sub_len))
+		goto out;
+	/* Close the gaps between the parts so they can be written in turn */
+	for (c_len = 0, i = 0; i < parts; i++) {
+		memmove(c_buf + c_len, part[i].c_buf, part[i].c_len);
+		c_len += part[i].c_len;
+		cthread->sub_len[i * 2] = part[i].c_len;
+		cthread->sub_len[i * 2 + 1] = part[i].s_len;
+	}
+
+	lock_mutex(control, &control->control_lock);
+	if (!control->lzma_prop_set) {
+		/* Store the dictionary size a whole block would have used.
+		 * Decoding works with any dictionary at least as large as the
+		 * part's, and this is what -i should report */
+		memcpy(control->lzma_properties, part[0].lzma_properties, 5);
+		for (i = 0; i < 4; i++)
+			control->lzma_properties[1 + i] = (uchar)(control->dictSize >> (8 * i));
+		control->lzma_prop_set = true;
+		if (TMP_OUTBUF)
+			control->magic_written = 0;
+	}
+	unlock_mutex(control, &control->control_lock);
+
+	cthread->sub_blocks = parts;
+	cthread->c_len = c_len;
+	free_buf(control, cthread->s_buf);
+	cthread->s_buf = c_buf;
+	cthread->c_type = CTYPE_LZMA;
+	c_buf = NULL;
+	ret = true;
+out:
+	free_buf(control, c_buf);
+	dealloc(part);
+	return ret;
+}
+
+/* Put a block behind its preset dictionary so the encoder reads them as one */
+static uchar *join_prime(rzip_control *control, struct compress_thread *cthread)
+{
+	uchar *joined = alloc_buf(control, cthread->prime_len + cthread->s_len);
+
+	if (unlikely(!joined)) {
+		print_err("Unable to allocate primed buffer in lzma_compress_buf\n");
+		return NULL;
+	}
+	memcpy(joined, cthread->prime, cthread->prime_len);
+	memcpy(joined + cthread->prime_len, cthread->s_buf, cthread->s_len);
+	return joined;
+}
+
+/* The first LZMA block to be done sets the properties the magic header
+ * stores */
+static void keep_lzma_props(rzip_control *control, const uchar *lzma_properties)
+{
+	/* Make sure multiple threads don't race on writing lzma_properties */
+	lock_mutex(control, &control->control_lock);
+	if (!control->lzma_prop_set) {
+		memcpy(control->lzma_properties, lzma_properties, 5);
+		control->lzma_prop_set = true;
+		/* Reset the magic written flag so we write it again if we
+		 * get lzma properties and haven't written them yet. */
+		if (TMP_OUTBUF)
+			control->magic_written = 0;
+	}
+	unlock_mutex(control, &control->control_lock);
+}
+
+static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthread, int current_thread)
+{
+	struct stream_ctx *sc = control->sctx;
+	unsigned char lzma_properties[5]; /* lzma properties, encoded */
+	int lzma_level, lzma_ret, ret = 0;
+	size_t prop_size = 5; /* return value for lzma_properties */
+	uchar *c_buf, *joined = NULL;
+	const uchar *src = cthread->s_buf;
+	size_t dlen;
+
+	if (LZ4_TEST) {
+		if (!block_compresses(control, cthread))
+			return 0;
+	}
+
+	print_maxverbose("Starting lzma back end compression thread %d...\n", current_thread);
+	/* A primed block cannot be encoded without its dictionary, as the
+	 * decoder will use it */
+	if (cthread->prime_len) {
+		joined = join_prime(control, cthread);
+		if (unlikely(!joined))
+			return -1;
+		src = joined + cthread->prime_len;
+	}
+	if (sc->lzma_parts > 1 && lzma_split_buf(control, cthread, current_thread, src))
+		goto out;
+retry:
+	dlen = round_up_page(control, cthread->s_len * 1.02); // add 2% for lzma overhead to prevent memory overrun
+	c_buf = alloc_buf(control, dlen);
+	if (!c_buf) {
+		print_err("Unable to allocate c_buf in lzma_compress_buf\n");
+		ret = -1;
+		goto out;
+	}
+	/* pass absolute dictionary size and compression level */
+	lzma_ret = LzmaCompressPrimed(c_buf, &dlen, src,
+		(size_t)cthread->s_len, cthread->prime_len, lzma_properties, &prop_size,
+				cthread->level,
+				control->dictSize, /* dict size. 0 = set default, otherwise control->dictSize */
+				-1, -1, -1, -1, /* lc, lp, pb, fb */
+				2);
+				/* 2 threads runs the LzFindMt match finder alongside the
+				 * encoder. Only the bt match finders of levels 5 and up
+				 * have one, lower levels quietly stay single threaded */
+	if (lzma_ret != SZ_OK) {
+		switch (lzma_ret) {
+			case SZ_ERROR_MEM:
+				break;
+			case SZ_ERROR_PARAM:
+				print_err("LZMA Parameter ERROR: %d. This should not happen.\n", SZ_ERROR_PARAM);
+				break;
+			case SZ_ERROR_OUTPUT_EOF:
+				print_maxverbose("Harmless LZMA Output Buffer Overflow error: %d. Incompressible block.\n", SZ_ERROR_OUTPUT_EOF);
+				break;
+			case SZ_ERROR_THREAD:
+				print_err("LZMA Multi Thread ERROR: %d. This should not happen.\n", SZ_ERROR_THREAD);
+				break;
+			default:
+				print_err("Unidentified LZMA ERROR: %d. This should not happen.\n", lzma_ret);
+				break;
+		}
+		/* can pass -1 if not compressible! Thanks Lasse Collin */
+		free_buf(control, c_buf);
+		if (lzma_ret == SZ_ERROR_MEM) {
+			if (lzma_level > 1) {
+				lzma_level--;
+				print_verbose("LZMA Warning: %d. Can't allocate enough RAM for compression window, trying smaller.\n", SZ_ERROR_MEM);
+				goto retry;
+			}
+			/* lzma compress can be fragile on 32 bit. If it fails,
+			 * fall back to bzip2 compression so the block doesn't
+			 * remain uncompressed */
+			print_verbose("Unable to allocate enough RAM for any sized compression window, falling back to bzip2 compression.\n");
+			ret = bzip2_compress_buf(control, cthread);
+		} else if (lzma_ret != SZ_ERROR_OUTPUT_EOF)
+			ret = -1;
+		goto out;
+	}
+
+	if (unlikely((i64)dlen >= cthread->c_len)) {
+		/* Incompressible, leave as CTYPE_NONE */
+		print_maxverbose("Incompressible block\n");
+		free_buf(control, c_buf);
+		goto out;
+	}
+
+	keep_lzma_props(control, lzma_properties);
+
+	cthread->c_len = dlen;
+	free_buf(control, cthread->s_buf);
+	cthread->s_buf = c_buf;
+	cthread->c_type = CTYPE_LZMA;
+out:
+	free_buf(control, joined);
+	return ret;
+}
+
+static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthread)
+{
+	lzo_uint in_len = cthread->s_len;
+	lzo_uint dlen = round_up_page(control, in_len + in_len / 16 + 64 + 3);
+	lzo_bytep wrkmem;
+	uchar *c_buf;
+	int ret = -1;
+
+	wrkmem = (lzo_bytep) calloc(1, LZO1X_1_MEM_COMPRESS);
+	if (unlikely(wrkmem == NULL)) {
+		print_maxverbose("Failed to malloc wkmem\n");
+		return ret;
+	}
+
+	c_buf = alloc_buf(control, dlen);
+	if (!c_buf) {
+		print_err("Unable to allocate c_buf in lzo_compress_buf");
+		goto out_free;
+	}
+
 	/* lzo1x_1_compress does not return anything but LZO_OK so we ignore
 	 * the return value */
 	lzo1x_1_compress(cthread->s_buf, in_len, c_buf, &dlen, wrkmem);
@@ -430,12 +1543,12 @@ static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthre
 	if (dlen >= in_len){
 		/* Incompressible, leave as CTYPE_NONE */
 		print_maxverbose("Incompressible block\n");
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 		goto out_free;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	free_buf(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_LZO;
 out_free:
@@ -457,7 +1570,7 @@ static int zpaq_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	int ret = 0;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, dlen));
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %ld bytes for decompression\n", dlen);
 		ret = -1;
@@ -472,10 +1585,10 @@ static int zpaq_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		print_err("Inconsistent length after decompression. Got %ld bytes, expected %lld\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		free_buf(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -488,7 +1601,7 @@ static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, dlen));
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %d bytes for decompression\n", dlen);
 		ret = -1;
@@ -506,10 +1619,10 @@ static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 		print_err("Inconsistent length after decompression. Got %d bytes, expected %lld\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		free_buf(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -522,7 +1635,7 @@ static int gzip_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, dlen));
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %ld bytes for decompression\n", dlen);
 		ret = -1;
@@ -540,35 +1653,34 @@ static int gzip_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		print_err("Inconsistent length after decompression. Got %ld bytes, expected %lld\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		free_buf(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
 }
 
-static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucthread)
+static int zstd_decompress_buf(rzip_control *control, struct uncomp_thread *ucthread)
 {
-	size_t dlen = ucthread->u_len;
-	int ret = 0, lzmaerr;
+	size_t dlen;
+	int ret = 0;
 	uchar *c_buf;
-	SizeT c_len = ucthread->c_len;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, ucthread->u_len));
 	if (unlikely(!ucthread->s_buf)) {
-		print_err("Failed to allocate %lld bytes for decompression\n", (i64)dlen);
+		print_err("Failed to allocate %lld bytes for decompression\n", ucthread->u_len);
 		ret = -1;
 		goto out;
 	}
 
-	/* With LZMA SDK 4.63 we pass control->lzma_properties
-	 * which is needed for proper uncompress */
-	lzmaerr = LzmaUncompress(ucthread->s_buf, &dlen, c_buf, &c_len, control->lzma_properties, 5);
-	if (unlikely(lzmaerr)) {
-		print_err("Failed to decompress buffer - lzmaerr=%d\n", lzmaerr);
+	/* The whole block is decoded at once so no window has to be kept
+	 * apart from the output, however large the encoder chose it */
+	dlen = ZSTD_decompress(ucthread->s_buf, ucthread->u_len, c_buf, ucthread->c_len);
+	if (unlikely(ZSTD_isError(dlen))) {
+		print_err("Failed to decompress buffer - %s\n", ZSTD_getErrorName(dlen));
 		ret = -1;
 		goto out;
 	}
@@ -577,80 +1689,358 @@ static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucth
 		print_err("Inconsistent length after decompression. Got %lld bytes, expected %lld\n", (i64)dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		free_buf(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
 }
 
-static int lzo_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_thread *ucthread)
+static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucthread)
 {
-	lzo_uint dlen = ucthread->u_len;
-	int ret = 0, lzerr;
+	size_t dlen = ucthread->u_len;
+	int ret = 0, lzmaerr;
 	uchar *c_buf;
+	SizeT c_len = ucthread->c_len;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, dlen));
 	if (unlikely(!ucthread->s_buf)) {
-		print_err("Failed to allocate %lu bytes for decompression\n", (unsigned long)dlen);
+		print_err("Failed to allocate %lld bytes for decompression\n", (i64)dlen);
 		ret = -1;
 		goto out;
 	}
 
-	lzerr = lzo1x_decompress_safe((uchar*)c_buf, ucthread->c_len, (uchar*)ucthread->s_buf, &dlen, NULL);
-	if (unlikely(lzerr != LZO_E_OK)) {
-		print_err("Failed to decompress buffer - lzerr=%d\n", lzerr);
+	/* With LZMA SDK 4.63 we pass control->lzma_properties
+	 * which is needed for proper uncompress */
+	lzmaerr = LzmaUncompress(ucthread->s_buf, &dlen, c_buf, &c_len, control->lzma_properties, 5);
+	if (unlikely(lzmaerr)) {
+		print_err("Failed to decompress buffer - lzmaerr=%d\n", lzmaerr);
 		ret = -1;
 		goto out;
 	}
 
 	if (unlikely((i64)dlen != ucthread->u_len)) {
-		print_err("Inconsistent length after decompression. Got %lu bytes, expected %lld\n", (unsigned long)dlen, ucthread->u_len);
+		print_err("Inconsistent length after decompression. Got %lld bytes, expected %lld\n", (i64)dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		free_buf(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		free_buf(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
 }
 
-/* WORK FUNCTIONS */
-
-/* Look at whether we're writing to a ram location or physical files and write
- * the data accordingly. */
-ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret)
+/* Ram the blocks being decoded may take between them. That is the ram
+ * available when the chunk was opened, or under --max-decompress-ram what
+ * the output buffer leaves of the budget. At least one block of each stream
+ * is always decoded whatever its size, so a small budget just means fewer
+ * threads at a time */
+static i64 unzip_budget(rzip_control *control)
 {
-	if (!TMP_OUTBUF)
-		return write(control->fd_out, offset_buf, (size_t)ret);
-
-	if (unlikely(control->out_ofs + ret > control->out_maxlen)) {
-		/* The data won't fit in a temporary output buffer so we have
-		 * to fall back to temporary files. */
-		print_verbose("Unable to decompress entirely in ram, will use physical files\n");
-		if (unlikely(control->fd_out == -1))
-			failure("Was unable to decompress entirely in ram and no temporary file creation was possible\n");
-		if (unlikely(!write_fdout(control, control->tmp_outbuf, control->out_len))) {
-			print_err("Unable to write_fdout tmpoutbuf in put_fdout\n");
-			return -1;
-		}
-		close_tmpoutbuf(control);
-		if (unlikely(!write_fdout(control, offset_buf, ret))) {
-			print_err("Unable to write_fdout offset_buf in put_fdout\n");
-			return -1;
-		}
-		return ret;
-	}
-	memcpy(control->tmp_outbuf + control->out_ofs, offset_buf, ret);
-	control->out_ofs += ret;
-	if (likely(control->out_ofs > control->out_len))
-		control->out_len = control->out_ofs;
-	return ret;
+	if (!control->unzip_ram)
+		return control->sctx->ram.budget;
+	if (TMP_OUTBUF)
+		return MAX(control->unzip_ram - control->out_maxlen, 0);
+	return control->unzip_ram;
+}
+
+/* Most bytes decoded between two handovers to the reader */
+#define LZMA_STEP	(1024 * 1024)
+
+/* Ring for a streamed LZMA block. Only the dictionary is needed behind the
+ * decoder, so a block larger than it does not need its full size. A preset
+ * dictionary goes in front of the block */
+static i64 lzma_ring_len(rzip_control *control, i64 u_len, int streamno)
+{
+	i64 dict_size = control->lzma_properties[1] | control->lzma_properties[2] << 8 |
+		control->lzma_properties[3] << 16 | (i64)control->lzma_properties[4] << 24;
+	i64 pre = primed_stream(control, streamno) ? control->preset_dict : 0;
+
+	return MIN(u_len + pre, MAX(MAX(dict_size, LZMA_STEP), pre));
+}
+
+/* Add a decompressed block, in up to two pieces, to the end of its stream
+ * for the next one, once the block before has done the same. Blocks of other
+ * types decode in parallel and only wait here */
+static bool pass_tail(rzip_control *control, struct stream *s, struct uncomp_thread *ucthread,
+		      const uchar *buf, i64 len, const uchar *buf2, i64 len2)
+{
+	struct stream_ctx *sc = control->sctx;
+	bool ret;
+
+	lock_mutex(control, &sc->ring_lock);
+	while (s->tails != ucthread->seq)
+		cond_wait(control, &sc->ring_cond, &sc->ring_lock);
+	unlock_mutex(control, &sc->ring_lock);
+
+	ret = keep_tail(control, s, buf, len) && keep_tail(control, s, buf2, len2);
+
+	lock_mutex(control, &sc->ring_lock);
+	s->tails++;
+	cond_broadcast(control, &sc->ring_cond);
+	unlock_mutex(control, &sc->ring_lock);
+	return ret;
+}
+
+/* Decode an LZMA block straight into its ring, which is the decoder's own
+ * dictionary, while fill_buffer hands what is done to the reader. The thread
+ * is handed over before the first byte is decoded, after which failures are
+ * passed on through the ring. Returns -1 only if it could not be started */
+static int lzma_stream_buf(rzip_control *control, struct stream_info *sinfo, struct uncomp_thread *ucthread,
+			   const struct stats_mark *stats_start)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct stream *s = &sinfo->s[ucthread->streamno];
+	bool primed = primed_stream(control, ucthread->streamno);
+	i64 produced = 0, room, c_pos = 0, end, len, wrapped;
+	uchar *c_buf = ucthread->s_buf;
+	ELzmaStatus status;
+	SizeT in_len, start;
+	bool failed = false;
+	CLzmaDec dec;
+	int lzmaerr;
+
+	LzmaDec_Construct(&dec);
+	lzmaerr = LzmaDec_AllocateProbs(&dec, control->lzma_properties, LZMA_PROPS_SIZE, &g_Alloc);
+	if (unlikely(lzmaerr)) {
+		print_err("Failed to allocate LZMA decoder - lzmaerr=%d\n", lzmaerr);
+		return -1;
+	}
+	dec.dic = alloc_buf(control, ucthread->ring_len);
+	if (unlikely(!dec.dic)) {
+		print_err("Failed to allocate %lld bytes for decompression\n", ucthread->ring_len);
+		LzmaDec_FreeProbs(&dec, &g_Alloc);
+		return -1;
+	}
+	dec.dicBufSize = ucthread->ring_len;
+	LzmaDec_Init(&dec);
+
+	ucthread->s_buf = dec.dic;
+	ucthread->ring_pre = ucthread->produced = ucthread->consumed = 0;
+	ucthread->done = ucthread->abandon = false;
+	ucthread->failed = false;
+	cksem_post(control, &ucthread->cksem);
+
+	if (primed) {
+		/* The block before is done with the end of the stream once it
+		 * has passed its own end on */
+		lock_mutex(control, &sc->ring_lock);
+		while (s->tails != ucthread->seq)
+			cond_wait(control, &sc->ring_cond, &sc->ring_lock);
+		unlock_mutex(control, &sc->ring_lock);
+		if (s->tail_len) {
+			/* Decode as if the dictionary had come before */
+			memcpy(dec.dic, s->tail, s->tail_len);
+			dec.dicPos = produced = s->tail_len;
+			dec.checkDicSize = dec.prop.dicSize;
+		}
+		lock_mutex(control, &sc->ring_lock);
+		ucthread->ring_pre = ucthread->produced = ucthread->consumed = produced;
+		unlock_mutex(control, &sc->ring_lock);
+	}
+	end = ucthread->ring_pre + ucthread->u_len;
+
+	while (produced < end) {
+		lock_mutex(control, &sc->ring_lock);
+		while (!ucthread->abandon && produced - ucthread->consumed == ucthread->ring_len)
+			cond_wait(control, &sc->ring_cond, &sc->ring_lock);
+		room = ucthread->ring_len - (produced - ucthread->consumed);
+		unlock_mutex(control, &sc->ring_lock);
+		if (unlikely(ucthread->abandon))
+			break;
+
+		if (dec.dicPos == dec.dicBufSize)
+			dec.dicPos = 0;
+		room = MIN(room, (i64)(dec.dicBufSize - dec.dicPos));
+		room = MIN(room, LZMA_STEP);
+		room = MIN(room, end - produced);
+		start = dec.dicPos;
+		in_len = ucthread->c_len - c_pos;
+		lzmaerr = LzmaDec_DecodeToDic(&dec, start + room, c_buf + c_pos, &in_len, LZMA_FINISH_ANY, &status);
+		c_pos += in_len;
+		if (unlikely(lzmaerr)) {
+			print_err("Failed to decompress buffer - lzmaerr=%d\n", lzmaerr);
+			failed = true;
+			break;
+		}
+		if (unlikely(dec.dicPos == start)) {
+			print_err("Inconsistent length after decompression. Got %lld bytes, expected %lld\n",
+				  produced - ucthread->ring_pre, ucthread->u_len);
+			failed = true;
+			break;
+		}
+		produced += dec.dicPos - start;
+
+		lock_mutex(control, &sc->ring_lock);
+		ucthread->produced = produced;
+		cond_broadcast(control, &sc->ring_cond);
+		unlock_mutex(control, &sc->ring_lock);
+	}
+	free_buf(control, c_buf);
+	LzmaDec_FreeProbs(&dec, &g_Alloc);
+
+	/* The block ends at dicPos in the ring and may have wrapped round */
+	if (primed) {
+		len = MIN(produced - ucthread->ring_pre, MIN(produced, ucthread->ring_len));
+		wrapped = len - MIN(len, (i64)dec.dicPos);
+		if (unlikely(!pass_tail(control, s, ucthread, dec.dic + dec.dicBufSize - wrapped, wrapped,
+					dec.dic + dec.dicPos - (len - wrapped), len - wrapped)))
+			failed = true;
+	}
+	/* The run may be over as soon as the block is done */
+	if (control->stats && !failed)
+		stats_block(control, ucthread - sinfo->ucthreads, ucthread->c_len, ucthread->u_len, stats_start);
+
+	lock_mutex(control, &sc->ring_lock);
+	ucthread->failed = failed;
+	ucthread->done = true;
+	cond_broadcast(control, &sc->ring_cond);
+	unlock_mutex(control, &sc->ring_lock);
+	return 0;
+}
+
+/* Wait for the decoder of a streamed block to finish and give its slot back */
+static bool end_ring(rzip_control *control, struct stream *s)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct uncomp_thread *ucthread = s->ring;
+	bool failed;
+
+	lock_mutex(control, &sc->ring_lock);
+	ucthread->abandon = true;
+	cond_broadcast(control, &sc->ring_cond);
+	while (!ucthread->done)
+		cond_wait(control, &sc->ring_cond, &sc->ring_lock);
+	unlock_mutex(control, &sc->ring_lock);
+
+	failed = ucthread->failed || ucthread->consumed != ucthread->ring_pre + ucthread->u_len;
+	free_buf(control, ucthread->s_buf);
+	ucthread->ring_len = 0;
+	ucthread->busy = 0;
+	s->ring = NULL;
+	s->buf = NULL;
+	s->buflen = s->bufp = 0;
+	return !failed;
+}
+
+/* Give back what the reader has finished with and point it at the next part
+ * of the streamed block. Returns 1 when there is more to read, 0 when the
+ * block is done with and -1 on failure */
+static int next_window(rzip_control *control, struct stream *s)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct uncomp_thread *ucthread = s->ring;
+	i64 pos, start = stats_start(control);
+
+	lock_mutex(control, &sc->ring_lock);
+	ucthread->consumed += s->buflen;
+	cond_broadcast(control, &sc->ring_cond);
+	while (!ucthread->done && ucthread->produced == ucthread->consumed)
+		cond_wait(control, &sc->ring_cond, &sc->ring_lock);
+	stats_since(control, backend_wait_usecs, start);
+	if (ucthread->produced > ucthread->consumed) {
+		pos = ucthread->consumed % ucthread->ring_len;
+		s->buf = ucthread->s_buf + pos;
+		s->buflen = MIN(ucthread->produced - ucthread->consumed, ucthread->ring_len - pos);
+		s->bufp = 0;
+		unlock_mutex(control, &sc->ring_lock);
+		return 1;
+	}
+	unlock_mutex(control, &sc->ring_lock);
+
+	if (unlikely(!end_ring(control, s)))
+		failure_return(("Failed to decompress LZMA block in stream\n"), -1);
+	return 0;
+}
+
+static int lzo_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_thread *ucthread)
+{
+	lzo_uint dlen = ucthread->u_len;
+	int ret = 0, lzerr;
+	uchar *c_buf;
+
+	c_buf = ucthread->s_buf;
+	ucthread->s_buf = alloc_buf(control, round_up_page(control, dlen));
+	if (unlikely(!ucthread->s_buf)) {
+		print_err("Failed to allocate %lu bytes for decompression\n", (unsigned long)dlen);
+		ret = -1;
+		goto out;
+	}
+
+	lzerr = lzo1x_decompress_safe((uchar*)c_buf, ucthread->c_len, (uchar*)ucthread->s_buf, &dlen, NULL);
+	if (unlikely(lzerr != LZO_E_OK)) {
+		print_err("Failed to decompress buffer - lzerr=%d\n", lzerr);
+		ret = -1;
+		goto out;
+	}
+
+	if (unlikely((i64)dlen != ucthread->u_len)) {
+		print_err("Inconsistent length after decompression. Got %lu bytes, expected %lld\n", (unsigned long)dlen, ucthread->u_len);
+		ret = -1;
+	} else
+		free_buf(control, c_buf);
+out:
+	if (ret == -1) {
+		free_buf(control, ucthread->s_buf);
+		ucthread->s_buf = c_buf;
+	}
+	return ret;
+}
+
+/* WORK FUNCTIONS */
+
+/* Look at whether we're writing to a ram location or physical files and write
+ * the data accordingly. */
+ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret)
+{
+	if (!TMP_OUTBUF)
+		return write(control->fd_out, offset_buf, (size_t)ret);
+
+	/* A --streamable archive is only ever appended to, so the buffer goes
+	 * out whenever it fills */
+	if (STREAMED && !(DECOMPRESS || TEST_ONLY)) {
+		/* out_maxlen allows for a page more than was allocated */
+		i64 n, left = ret, size = control->out_maxlen - control->page_size;
+
+		while (left) {
+			if (control->out_ofs == size && unlikely(!flush_tmpoutbuf(control)))
+				return -1;
+			n = MIN(left, size - control->out_ofs);
+			memcpy(control->tmp_outbuf + control->out_ofs, offset_buf, n);
+			control->out_len = control->out_ofs += n;
+			offset_buf = (uchar *)offset_buf + n;
+			left -= n;
+		}
+		return ret;
+	}
+
+	if (unlikely(control->out_ofs + ret > control->out_maxlen)) {
+		/* The data won't fit in a temporary output buffer so we have
+		 * to fall back to temporary files. */
+		print_verbose("Unable to decompress entirely in ram, will use physical files\n");
+		if (unlikely(control->fd_out == -1))
+			failure("Was unable to decompress entirely in ram and no temporary file creation was possible\n");
+		if (unlikely(!write_fdout(control, control->tmp_outbuf, control->out_len))) {
+			print_err("Unable to write_fdout tmpoutbuf in put_fdout\n");
+			return -1;
+		}
+		close_tmpoutbuf(control);
+		if (unlikely(!write_fdout(control, offset_buf, ret))) {
+			print_err("Unable to write_fdout offset_buf in put_fdout\n");
+			return -1;
+		}
+		return ret;
+	}
+	memcpy(control->tmp_outbuf + control->out_ofs, offset_buf, ret);
+	control->out_ofs += ret;
+	if (likely(control->out_ofs > control->out_len))
+		control->out_len = control->out_ofs;
+	return ret;
 }
 
 /* This is a custom version of write() which writes in 1GB chunks to avoid
@@ -659,8 +2049,8 @@ ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret)
 ssize_t write_1g(rzip_control *control, void *buf, i64 len)
 {
 	uchar *offset_buf = buf;
+	i64 total, start = stats_start(control);
 	ssize_t ret;
-	i64 total;
 
 	total = 0;
 	while (len > 0) {
@@ -672,23 +2062,50 @@ ssize_t write_1g(rzip_control *control, void *buf, i64 len)
 		offset_buf += ret;
 		total += ret;
 	}
+	stats_since(control, write_usecs, start);
 	return total;
 }
 
-/* Should be called only if we know the buffer will be large enough, otherwise
- * we must dump_stdin first */
-static bool read_fdin(struct rzip_control *control, i64 len)
+/* Read up to len bytes of stdin, or of the lrz_stream input in its place.
+ * Returns fewer only at the end of the input, and -1 on error. Should be
+ * called only if we know the buffer will be large enough, otherwise we must
+ * dump_stdin first */
+i64 read_stdin(rzip_control *control, uchar *buf, i64 len)
 {
+	i64 ret, total = 0;
 	int tmpchar;
-	i64 i;
 
-	for (i = 0; i < len; i++) {
-		tmpchar = getchar();
-		if (unlikely(tmpchar == EOF))
-			failure_return(("Reached end of file on STDIN prematurely on read_fdin, asked for %lld got %lld\n",
-				len, i), false);
-		control->tmp_inbuf[control->in_ofs + i] = (char)tmpchar;
+	if (control->in_cb) {
+		while (total < len) {
+			ret = control->in_cb(control->in_data, buf + total, len - total, NULL);
+			if (unlikely(ret < 0))
+				return -1;
+			if (!ret)
+				break;
+			total += ret;
+		}
+		return total;
+	}
+	while (total < len && (tmpchar = getchar()) != EOF)
+		buf[total++] = (char)tmpchar;
+	return total;
+}
+
+static bool read_fdin(struct rzip_control *control, i64 len)
+{
+	i64 got;
+
+	if (control->in_buffer) {
+		if (unlikely(control->in_ofs + len > control->in_maxlen))
+			failure_return(("Reached end of buffer prematurely on read_fdin, asked for %lld got %lld\n",
+				len, control->in_maxlen - control->in_ofs), false);
+		control->in_len = control->in_ofs + len;
+		return true;
 	}
+	got = read_stdin(control, control->tmp_inbuf + control->in_ofs, len);
+	if (unlikely(got != len))
+		failure_return(("Reached end of file on STDIN prematurely on read_fdin, asked for %lld got %lld\n",
+			len, got), false);
 	control->in_len = control->in_ofs + len;
 	return true;
 }
@@ -696,6 +2113,8 @@ static bool read_fdin(struct rzip_control *control, i64 len)
 /* Dump STDIN into a temporary file */
 static int dump_stdin(rzip_control *control)
 {
+	if (unlikely(control->in_buffer))
+		failure_return(("Tried to read beyond the end of the buffer\n"), -1);
 	if (unlikely(!write_fdin(control)))
 		return -1;
 	if (unlikely(!read_tmpinfile(control, control->fd_in)))
@@ -779,6 +2198,98 @@ static inline int write_val(rzip_control *control, i64 v, int len)
 	return write_buf(control, (uchar *)&v, len);
 }
 
+static inline uchar *put_val(uchar *p, i64 v, int len)
+{
+	v = htole64(v);
+	memcpy(p, &v, len);
+	return p + len;
+}
+
+static inline i64 get_val(const uchar *p, int len)
+{
+	i64 v = 0;
+
+	memcpy(&v, p, len);
+	return le64toh(v);
+}
+
+/* Write a block header and its data with a single writev where we are
+ * writing straight to the file */
+static int write_block_buf(rzip_control *control, uchar *head, i64 head_len, uchar *p, i64 len)
+{
+	struct iovec iov[2];
+	ssize_t ret;
+	i64 start;
+
+	if (TMP_OUTBUF) {
+		if (unlikely(write_buf(control, head, head_len)))
+			return -1;
+		return write_buf(control, p, len);
+	}
+	start = stats_start(control);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = p;
+	iov[1].iov_len = len;
+	while (iov[0].iov_len || iov[1].iov_len) {
+		ret = writev(control->fd_out, iov, 2);
+		if (unlikely(ret <= 0)) {
+			print_err("Write of length %lld failed - %s\n", (i64)(iov[0].iov_len + iov[1].iov_len),
+				  strerror(errno));
+			return -1;
+		}
+		if ((size_t)ret < iov[0].iov_len) {
+			iov[0].iov_base = (uchar *)iov[0].iov_base + ret;
+			iov[0].iov_len -= ret;
+			continue;
+		}
+		ret -= iov[0].iov_len;
+		iov[0].iov_len = 0;
+		iov[1].iov_base = (uchar *)iov[1].iov_base + ret;
+		iov[1].iov_len -= ret;
+	}
+	stats_since(control, write_usecs, start);
+	return 0;
+}
+
+/* Push what has been written towards the disk as set by --sync. Dirty
+ * pages are ram the backends could use, but waiting for them after every
+ * block is very slow on network filesystems, so by default writeback is
+ * only started. */
+static void write_back(rzip_control *control, int fd)
+{
+	i64 end;
+
+	if (TMP_OUTBUF || control->sync_mode == SYNC_NONE)
+		return;
+	if (control->sync_mode == SYNC_BLOCK) {
+		fsync(fd);
+		return;
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	if (control->sync_mode != SYNC_DROP)
+		return;
+	end = lseek(fd, 0, SEEK_CUR);
+	if (unlikely(end < control->sync_prev))
+		control->sync_prev = control->sync_drop = 0;	/* A new file */
+	/* The previous block has had its writeback running for a whole
+	 * block, wait for it to finish then drop it */
+	if (control->sync_prev > control->sync_drop) {
+#ifdef SYNC_FILE_RANGE_WRITE
+		sync_file_range(fd, control->sync_drop, control->sync_prev - control->sync_drop,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		fdatasync(fd);
+#endif
+		posix_fadvise(fd, control->sync_drop, control->sync_prev - control->sync_drop, POSIX_FADV_DONTNEED);
+		control->sync_drop = control->sync_prev;
+	}
+	control->sync_prev = end;
+}
+
 static int read_buf(rzip_control *control, int f, uchar *p, i64 len)
 {
 	ssize_t ret;
@@ -873,6 +2384,35 @@ fd_seek:
 	return fd_seekto(control, sinfo, spos, pos);
 }
 
+/* Read len bytes at pos within the streams, and from a file as many more
+ * up to max as come in the same pread. Returns how many were read or -1.
+ * The in and out buffers have nothing to gain so give exactly len */
+static i64 read_ahead(rzip_control *control, struct stream_info *sinfo, i64 pos, uchar *p, i64 len, i64 max)
+{
+	i64 spos = pos + sinfo->initial_pos, got = 0;
+	ssize_t ret;
+
+	if ((TMP_INBUF && sinfo->fd == control->fd_in) || (TMP_OUTBUF && sinfo->fd == control->fd_out)) {
+		if (unlikely(read_seekto(control, sinfo, pos) || read_buf(control, sinfo->fd, p, len)))
+			return -1;
+		return len;
+	}
+	while (got < len) {
+		ret = pread(sinfo->fd, p + got, (size_t)MIN(max - got, one_g), spos + got);
+		if (unlikely(ret <= 0)) {
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret == -1)
+				print_err("Read of length %lld failed - %s\n", len - got, strerror(errno));
+			else
+				print_err("Partial read!? asked for %lld bytes but got %lld\n", len, got);
+			return -1;
+		}
+		got += ret;
+	}
+	return got;
+}
+
 static i64 get_seek(rzip_control *control, int fd)
 {
 	i64 ret;
@@ -897,11 +2437,81 @@ i64 get_readseek(rzip_control *control, int fd)
 	return ret;
 }
 
+/* The stream threads of control, made by its first run */
+static struct stream_ctx *stream_ctx(rzip_control *control)
+{
+	struct stream_ctx *sc = control->sctx;
+
+	if (!sc) {
+		sc = calloc(sizeof(struct stream_ctx), 1);
+		if (unlikely(!sc))
+			fatal_return(("Unable to calloc stream context\n"), NULL);
+		if (unlikely(!init_mutex(control, &sc->output_lock) || !init_mutex(control, &sc->ring_lock) ||
+			     !init_mutex(control, &sc->pool.lock) || !init_mutex(control, &sc->ram.lock) ||
+			     !init_mutex(control, &sc->bufs.lock))) {
+			dealloc(sc);
+			return NULL;
+		}
+		pthread_cond_init(&sc->output_cond, NULL);
+		pthread_cond_init(&sc->ring_cond, NULL);
+		pthread_cond_init(&sc->pool.cond, NULL);
+		pthread_cond_init(&sc->ram.cond, NULL);
+		control->sctx = sc;
+	}
+	sc->control = control;
+	return sc;
+}
+
+/* Take back the stream threads of a run made on a copy of control, so that
+ * they no longer point at the copy once it is gone */
+void keep_stream_ctx(rzip_control *control, rzip_control *run)
+{
+	control->sctx = run->sctx;
+	if (control->sctx)
+		control->sctx->control = control;
+}
+
+/* Stop the workers the runs on control kept and give back their buffers */
+bool free_stream_ctx(rzip_control *control)
+{
+	struct stream_ctx *sc = control->sctx;
+	bool ret;
+
+	if (!sc)
+		return true;
+	sc->control = control;
+	ret = stop_pool(control);
+	drain_bufs(control);
+	pthread_mutex_destroy(&sc->output_lock);
+	pthread_mutex_destroy(&sc->ring_lock);
+	pthread_mutex_destroy(&sc->pool.lock);
+	pthread_mutex_destroy(&sc->ram.lock);
+	pthread_mutex_destroy(&sc->bufs.lock);
+	pthread_cond_destroy(&sc->output_cond);
+	pthread_cond_destroy(&sc->ring_cond);
+	pthread_cond_destroy(&sc->pool.cond);
+	pthread_cond_destroy(&sc->ram.cond);
+	dealloc(control->sctx);
+	return ret;
+}
+
 bool prepare_streamout_threads(rzip_control *control)
 {
-	pthread_t *threads;
+	struct stream_ctx *sc = stream_ctx(control);
 	int i;
 
+	if (unlikely(!sc))
+		return false;
+	/* Nothing of the last run's limits or ram may carry over into this
+	 * one, or the same input would not compress the same. They are worked
+	 * out again for this run's chunks */
+	sc->save_threads = 0;
+	sc->limit = sc->stream_bufsize = 0;
+	sc->lzma_parts = 1;
+	sc->next_thread = sc->output_thread = 0;
+	sc->ram.budget = sc->ram.reserved = 0;
+	sc->ram.running = 0;
+
 	/* As we serialise the generation of threads during the rzip
 	 * pre-processing stage, it's faster to have one more thread available
 	 * to keep all CPUs busy. There is no point splitting up the chunks
@@ -910,19 +2520,22 @@ bool prepare_streamout_threads(rzip_control *control)
 		++control->threads;
 	if (NO_COMPRESS)
 		control->threads = 1;
-	threads = control->pthreads = calloc(sizeof(pthread_t), control->threads);
-	if (unlikely(!threads))
-		fatal_return(("Unable to calloc threads in prepare_streamout_threads\n"), false);
-
-	cthreads = calloc(sizeof(struct compress_thread), control->threads);
-	if (unlikely(!cthreads)) {
-		dealloc(threads);
+	sc->cthreads = calloc(sizeof(struct compress_thread), control->threads);
+	if (unlikely(!sc->cthreads))
 		fatal_return(("Unable to calloc cthreads in prepare_streamout_threads\n"), false);
-	}
 
 	for (i = 0; i < control->threads; i++) {
-		cksem_init(control, &cthreads[i].cksem);
-		cksem_post(control, &cthreads[i].cksem);
+		cksem_init(control, &sc->cthreads[i].cksem);
+		cksem_post(control, &sc->cthreads[i].cksem);
+	}
+	if (unlikely(!start_pool(control, control->threads))) {
+		dealloc(sc->cthreads);
+		return false;
+	}
+	if (unlikely(!create_pthread(control, &sc->writer_thread, NULL, writethread, control))) {
+		stop_pool(control);
+		dealloc(sc->cthreads);
+		return false;
 	}
 	return true;
 }
@@ -930,18 +2543,35 @@ bool prepare_streamout_threads(rzip_control *control)
 
 bool close_streamout_threads(rzip_control *control)
 {
-	int i, close_thread = output_thread;
+	struct stream_ctx *sc = control->sctx;
+	int i, close_thread = sc->output_thread;
 
 	/* Wait for the threads in the correct order in case they end up
 	 * serialised */
 	for (i = 0; i < control->threads; i++) {
-		cksem_wait(control, &cthreads[close_thread].cksem);
+		cksem_wait(control, &sc->cthreads[close_thread].cksem);
 
 		if (++close_thread == control->threads)
 			close_thread = 0;
 	}
-	dealloc(cthreads);
-	dealloc(control->pthreads);
+	lock_mutex(control, &sc->output_lock);
+	sc->writer_quit = true;
+	cond_broadcast(control, &sc->output_cond);
+	unlock_mutex(control, &sc->output_lock);
+	if (unlikely(!join_pthread(control, sc->writer_thread, NULL)))
+		return false;
+	sc->writer_quit = false;
+	for (i = 0; i < control->threads; i++)
+		dealloc(sc->cthreads[i].lz4_buf);
+	dealloc(sc->cthreads);
+	/* The workers and free buffers are kept for the next run */
+	return true;
+}
+
+/* All decompression threads are idle once the last chunk is read. They are
+ * kept for the next run like the compression ones */
+bool close_streamin_threads(rzip_control *control __UNUSED__)
+{
 	return true;
 }
 
@@ -949,6 +2579,7 @@ bool close_streamout_threads(rzip_control *control)
    compression level and algorithm */
 void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_limit, char cbytes)
 {
+	struct stream_ctx *sc = control->sctx;
 	struct stream_info *sinfo;
 	i64 testsize;	// limit made static to prevent recurring tests of memory;
 	uchar *testmalloc;
@@ -959,11 +2590,13 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 		return NULL;
 	if (chunk_limit < control->page_size)
 		chunk_limit = control->page_size;
-	sinfo->bufsize = sinfo->size = limit = chunk_limit;
+	sinfo->bufsize = sinfo->size = sc->limit = chunk_limit;
 
 	sinfo->chunk_bytes = cbytes;
 	sinfo->num_streams = n;
 	sinfo->fd = f;
+	/* The writer may only get to this chunk after the next has begun */
+	sinfo->eof = control->eof;
 
 	sinfo->s = calloc(sizeof(struct stream), n);
 	if (unlikely(!sinfo->s)) {
@@ -981,102 +2614,82 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 	else
 		testbufs = 2;
 
-	/* Reduce threads one by one and then reduce dictionary size
-	* This block only has to be done once since memory never
-	* changes, chunk sizes are the same. */
-
-	if (save_threads == 0) {
-		save_threads = control->threads;		// save threads for loops
-		limit = control->usable_ram/testbufs;		// this is max chunk limit based on ram and compression window
-		bool overhead_set = false;
-		int thread_limit = control->threads >= 4 ? 4 : control->threads;	// control thread loop
-		int exponent = 40;				// highest possible value for dictsize spec
-		if (LZMA_COMPRESS) {
-			u32 save_dictSize = control->dictSize;	// save dictionary
-			u32 DICTSIZEMIN = (1 << 24);		// minimum dictionary size (16MB)
-retry_lzma:
-			control->dictSize = save_dictSize;	// start over
-			do {
-				for (control->threads = save_threads; control->threads >= thread_limit; control->threads--) {
-					if (limit >= (control->overhead * control->threads / testbufs)) {
-						overhead_set = true;			// got it!
-						break;
-					}
-				}	// thread loop
-				if (overhead_set == true)
-					break;
-				else {
-					/* make dictionary LZMA friendly (from LzmaEnc)
-					 * using reduced set of dictionary sizes
-					 * 2^n, 3^n, 2^n+1, 3^n+1...
-					*/
-					for ( ; exponent >= 0; exponent-- ) {
-						if (!(exponent % 2)) {
-							control->dictSize = ((u32)3 << ((exponent-1) / 2 + 11));
-							break;
-						}
-						else
-						{
-							control->dictSize = ((u32)2 << (exponent / 2 + 11));
-							break;
-						}
-					}
-					exponent--;
-					if (exponent < 0)				// Just to be proper. Should never happen. NEVER!
-						failure_return(("Unexpected Fatal Error in open_stream_out dictSize. Cannot continue.\n"), false);
-				}
-				setup_overhead(control);				// recompute overhead
-			} while (control->dictSize > DICTSIZEMIN);			// dictionary size loop
-			if (!overhead_set && thread_limit > 1) {			// try again and lower thread_limit
-				thread_limit--;
-				goto retry_lzma;
-			}
-			if (control->dictSize != save_dictSize)
+	/* The chunk buffers and the backend jobs share the ram actually
+	 * available. The buffers are sized first, but leave enough for
+	 * MIN_JOBS jobs at the smallest dictionary or zpaq block size, and the
+	 * dictionary or block size is then shrunk only as far as it takes for
+	 * that many jobs to fit in what is left. How many more run at once is
+	 * left to reserve_ram. This block only has to be done once since chunk
+	 * sizes are the same. */
+	if (sc->save_threads == 0) {
+		i64 avail = get_avail_ram(control), room = MIN(control->usable_ram, avail), budget;
+		int jobs, min_jobs = MIN(MIN_JOBS, control->threads);
+
+		sc->save_threads = control->threads;
+		if (!NO_COMPRESS)
+			room -= min_overhead(control) * min_jobs;
+		sc->limit = MIN(MAX(room, 0) / testbufs, chunk_limit);
+		if (BITS32)
+			sc->limit = MIN(sc->limit, one_g);
+		budget = MAX(MIN(control->usable_ram, avail - sc->limit * testbufs), 0);
+		if (LZMA_COMPRESS && control->overhead * min_jobs > budget) {
+			u32 dict = MAX(lzma_fit_dict(control, budget / min_jobs), MIN(LZMA_DICT_MIN, control->dictSize));
+
+			if (dict < control->dictSize) {
+				control->dictSize = dict;
+				setup_overhead(control);
 				print_verbose("Dictionary Size reduced to %ld\n", control->dictSize);
-		} else if (ZPAQ_COMPRESS) {
-			/* compute max possible block size */
+			}
+		} else if (ZPAQ_COMPRESS && control->overhead * min_jobs > budget) {
 			int save_bs = control->zpaq_bs;
-retry_zpaq:
-			for (control->zpaq_bs = save_bs; control->zpaq_bs > 4; control->zpaq_bs--) {
+
+			while (control->overhead * min_jobs > budget && control->zpaq_bs > 5) {
+				control->zpaq_bs--;
 				setup_overhead(control);
-				for (control->threads = save_threads; control->threads > thread_limit; control->threads--) {
-					if (limit >= control->overhead * control->threads) {
-						overhead_set = true;
-						break;
-					}
-				} // thread loop
-				if (overhead_set == true)
-					break;
-			}	// block size loop
-			if (!overhead_set && thread_limit > 1) {			// try again and lower thread_limit
-				thread_limit--;
-				goto retry_zpaq;
 			}
 			if (control->zpaq_bs != save_bs)
 				print_verbose("ZPAQ Block Size reduced to %d\n", control->zpaq_bs);
 		}
 
-		if (control->threads != save_threads)
-			print_verbose("Threads reduced to %d\n", control->threads);
+		/* The magic of a --streamable archive goes out with the
+		 * first block, before the backends would have set the LZMA
+		 * properties. lc=3, lp=0, pb=2 are always used, and the
+		 * largest dictionary a block may have decodes the others */
+		if (STREAMED && !control->lzma_prop_set &&
+		    (LZMA_COMPRESS || control->stream0_ctype == CTYPE_LZMA)) {
+			u32 dict = control->dictSize ? control->dictSize : 1 << 26;
+
+			control->lzma_properties[0] = 93;
+			for (i = 0; i < 4; i++)
+				control->lzma_properties[1 + i] = (uchar)(dict >> (8 * i));
+			control->lzma_prop_set = true;
+		}
 
 		print_verbose("Per Thread Memory Overhead is %ld\n", control->overhead);
 
-		save_threads = control->threads;			// preserve thread count. Important
-
-		if (BITS32) {
-			limit = MIN(limit, one_g);
-			if (limit + (control->overhead * control->threads) > one_g)
-				limit = one_g - (control->overhead * control->threads);
+		jobs = control->threads;
+		sc->lzma_parts = 1;
+		if (!NO_COMPRESS && control->overhead)
+			jobs = MAX(1, MIN(budget / control->overhead, control->threads));
+		if (jobs < control->threads) {
+			print_verbose("Ram allows %d of %d threads to compress at once\n", jobs, control->threads);
+			/* Let each LZMA job encode its blocks in parts on the
+			 * CPUs left idle */
+			if (LZMA_COMPRESS)
+				sc->lzma_parts = control->threads / jobs;
 		}
+		sc->ram.budget = budget;
+
+		if (BITS32 && sc->limit + (control->overhead * jobs) > one_g)
+			sc->limit = one_g - (control->overhead * jobs);
 		/* Use a nominal minimum size should we fail all previous shrinking */
-		limit = MAX(limit, STREAM_BUFSIZE);
-		limit = MIN(control->usable_ram/testbufs, chunk_limit);
+		sc->limit = MAX(sc->limit, MIN(STREAM_BUFSIZE, chunk_limit));
 retest_malloc:
-		testsize = limit + (control->overhead * control->threads);
+		testsize = sc->limit + (control->overhead * jobs);
 		testmalloc = malloc(testsize);
 		if (!testmalloc) {
-			limit = limit / 10 * 9;
-			if (limit < 100000000) {
+			sc->limit = sc->limit / 10 * 9;
+			if (sc->limit < 100000000) {
 				/* If we can't even allocate 100MB then we'll never
 				 * succeed */
 				print_err("Unable to allocate enough memory for operation\n");
@@ -1087,35 +2700,35 @@ retest_malloc:
 			goto retest_malloc;
 		}
 		if (!NO_COMPRESS) {
-			char *testmalloc2 = malloc(limit);
+			char *testmalloc2 = malloc(sc->limit);
 
 			if (!testmalloc2) {
 				dealloc(testmalloc);
-				limit = limit / 10 * 9;
+				sc->limit = sc->limit / 10 * 9;
 				goto retest_malloc;
 			}
 			dealloc(testmalloc2);
 		}
 		dealloc(testmalloc);
 		print_maxverbose("Succeeded in testing %lld sized malloc for back end compression\n", testsize);
-		stream_bufsize = MIN(limit, MAX((limit + control->threads - 1) / control->threads,
+		sc->stream_bufsize = MIN(sc->limit, MAX((sc->limit + control->threads - 1) / control->threads,
 					STREAM_BUFSIZE));
 		if (control->threads > 1)
 			print_maxverbose("Using up to %d threads to compress up to %lld bytes each.\n",
-				control->threads, stream_bufsize);
+				control->threads, sc->stream_bufsize);
 		else
 			print_maxverbose("Using only 1 thread to compress up to %lld bytes\n",
-				stream_bufsize);
+				sc->stream_bufsize);
 	} // end -- determine limit
 
-	control->threads = save_threads;				// restore threads. This is important!
+	control->threads = sc->save_threads;				// restore threads. This is important!
 
 	/* Make the bufsize no smaller than STREAM_BUFSIZE. Round up the
 	 * bufsize to fit X threads into it */
-	sinfo->bufsize = stream_bufsize;
+	sinfo->bufsize = sc->stream_bufsize;
 
 	for (i = 0; i < n; i++) {
-		sinfo->s[i].buf = calloc(sinfo->bufsize , 1);
+		sinfo->s[i].buf = alloc_buf(control, sinfo->bufsize);
 		if (unlikely(!sinfo->s[i].buf)) {
 			fatal("Unable to malloc buffer of size %lld in open_stream_out\n", sinfo->bufsize);
 			dealloc(sinfo->s);
@@ -1127,6 +2740,50 @@ retest_malloc:
 	return (void *)sinfo;
 }
 
+/* Find the blocks of each stream of a --streamable chunk by reading through
+ * its headers, up to the empty one that ends it */
+static bool scan_streamed(rzip_control *control, struct stream_info *sinfo)
+{
+	int header_length = 1 + sinfo->chunk_bytes * 3, i;
+	i64 pos = 0, c_len, u_len, tag;
+	struct stream *s;
+	uchar c_type;
+
+	while (42) {
+		if (unlikely(read_seekto(control, sinfo, pos) || read_u8(control, sinfo->fd, &c_type) ||
+			     read_val(control, sinfo->fd, &c_len, sinfo->chunk_bytes) ||
+			     read_val(control, sinfo->fd, &u_len, sinfo->chunk_bytes) ||
+			     read_val(control, sinfo->fd, &tag, sinfo->chunk_bytes)))
+			fatal_return(("Failed to read block header at %lld in scan_streamed\n", pos), false);
+		c_len = le64toh(c_len);
+		u_len = le64toh(u_len);
+		tag = le64toh(tag);
+		if (!tag)
+			break;
+		if (unlikely(tag > sinfo->num_streams || c_len < 0 || u_len < 0))
+			failure_return(("Invalid block header at %lld, corrupt archive\n", pos), false);
+		s = &sinfo->s[tag - 1];
+		if (!(s->nheads % 64)) {
+			i64 *heads = realloc(s->heads, (s->nheads + 64) * sizeof(i64));
+
+			if (unlikely(!heads))
+				fatal_return(("Failed to realloc heads in scan_streamed\n"), false);
+			s->heads = heads;
+		}
+		s->heads[s->nheads++] = pos;
+		pos += header_length + c_len;
+	}
+	sinfo->total_read += header_length;
+
+	for (i = 0; i < sinfo->num_streams; i++) {
+		s = &sinfo->s[i];
+		if (unlikely(!s->nheads))
+			failure_return(("No blocks for stream %d, corrupt archive\n", i), false);
+		s->last_head = s->heads[0];
+		print_maxverbose("Stream %d has %lld blocks\n", i, s->nheads);
+	}
+	return true;
+}
 
 /* prepare a set of n streams for reading on file descriptor f */
 void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
@@ -1134,7 +2791,6 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	struct uncomp_thread *ucthreads;
 	struct stream_info *sinfo;
 	int total_threads, i;
-	pthread_t *threads;
 	i64 header_length;
 
 	sinfo = calloc(sizeof(struct stream_info), 1);
@@ -1147,16 +2803,18 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		total_threads = control->threads + 2;
 	else
 		total_threads = control->threads + 1;
-	threads = control->pthreads = calloc(sizeof(pthread_t), total_threads);
-	if (unlikely(!threads))
+	if (unlikely(!stream_ctx(control) || !start_pool(control, total_threads))) {
+		dealloc(sinfo);
 		return NULL;
+	}
 
 	sinfo->ucthreads = ucthreads = calloc(sizeof(struct uncomp_thread), total_threads);
 	if (unlikely(!ucthreads)) {
 		dealloc(sinfo);
-		dealloc(threads);
 		fatal_return(("Unable to calloc ucthreads in open_stream_in\n"), NULL);
 	}
+	for (i = 0; i < total_threads; i++)
+		cksem_init(control, &ucthreads[i].cksem);
 
 	sinfo->num_streams = n;
 	sinfo->fd = f;
@@ -1165,13 +2823,13 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	sinfo->s = calloc(sizeof(struct stream), n);
 	if (unlikely(!sinfo->s)) {
 		dealloc(sinfo);
-		dealloc(threads);
 		dealloc(ucthreads);
 		return NULL;
 	}
 
 	sinfo->s[0].total_threads = 1;
 	sinfo->s[1].total_threads = total_threads - 1;
+	control->sctx->ram.budget = MIN(control->maxram, get_avail_ram(control));
 
 	if (control->major_version == 0 && control->minor_version > 5) {
 		/* Read in flag that tells us if there are more chunks after
@@ -1210,6 +2868,8 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		sinfo->s[i].base_thread = i;
 		sinfo->s[i].uthread_no = sinfo->s[i].base_thread;
 		sinfo->s[i].unext_thread = sinfo->s[i].base_thread;
+		if (STREAMED)
+			continue;
 
 		if (unlikely(ENCRYPT && read_buf(control, f, enc_head, SALT_LEN)))
 			goto failed;
@@ -1283,78 +2943,974 @@ again:
 			goto failed;
 		}
 	}
+	if (STREAMED && unlikely(!scan_streamed(control, sinfo)))
+		goto failed;
 
 	return (void *)sinfo;
 
 failed:
+	for (i = 0; i < n; i++)
+		dealloc(sinfo->s[i].heads);
 	dealloc(sinfo->s);
 	dealloc(sinfo);
-	dealloc(threads);
 	dealloc(ucthreads);
 	return NULL;
 }
 
-#define MIN_SIZE (ENCRYPT ? CBC_LEN : 0)
+/* Once the final data has all been written to the block header, we go back
+ * and write SALT_LEN bytes of salt before it, and encrypt the header in place
+ * by reading what has been written, encrypting it, and writing back over it.
+ * This is very convoluted depending on whether a last_head value is written
+ * to this block or not. See the callers of this function */
+static bool rewrite_encrypted(rzip_control *control, struct stream_info *sinfo, i64 ofs)
+{
+	uchar *buf, *head;
+	i64 cur_ofs;
+
+	cur_ofs = get_seek(control, sinfo->fd) - sinfo->initial_pos;
+	if (unlikely(cur_ofs == -1))
+		return false;
+	head = malloc(25 + SALT_LEN);
+	if (unlikely(!head))
+		fatal_return(("Failed to malloc head in rewrite_encrypted\n"), false);
+	buf = head + SALT_LEN;
+	if (unlikely(!get_rand(control, head, SALT_LEN)))
+		goto error;
+	if (unlikely(seekto(control, sinfo, ofs - SALT_LEN)))
+		failure_goto(("Failed to seekto buf ofs in rewrite_encrypted\n"), error);
+	if (unlikely(write_buf(control, head, SALT_LEN)))
+		failure_goto(("Failed to write_buf head in rewrite_encrypted\n"), error);
+	if (unlikely(read_buf(control, sinfo->fd, buf, 25)))
+		failure_goto(("Failed to read_buf buf in rewrite_encrypted\n"), error);
+
+	if (unlikely(!lrz_encrypt(control, buf, 25, head)))
+		goto error;
+
+	if (unlikely(seekto(control, sinfo, ofs)))
+		failure_goto(("Failed to seek back to ofs in rewrite_encrypted\n"), error);
+	if (unlikely(write_buf(control, buf, 25)))
+		failure_goto(("Failed to write_buf encrypted buf in rewrite_encrypted\n"), error);
+	dealloc(head);
+	seekto(control, sinfo, cur_ofs);
+	return true;
+error:
+	dealloc(head);
+	return false;
+}
+
+/* Remember where a chunk starts for the trailing index. The writer thread
+ * sees chunks in order so the uncompressed offset is a running total */
+static bool index_chunk(rzip_control *control, i64 c_ofs, i64 u_len)
+{
+	if (control->index_chunks == control->index_alloc) {
+		i64 alloc = MAX(control->index_alloc * 2, 16), *index;
+
+		index = realloc(control->index, alloc * 2 * sizeof(i64));
+		if (unlikely(!index))
+			fatal_return(("Failed to realloc chunk index\n"), false);
+		control->index = index;
+		control->index_alloc = alloc;
+	}
+	control->index[control->index_chunks * 2] = c_ofs;
+	control->index[control->index_chunks * 2 + 1] = control->index_ulen;
+	control->index_chunks++;
+	control->index_ulen += u_len;
+	return true;
+}
+
+/* Delta distances a --auto-filter block can have, BLOCK_DELTA up */
+static const uchar delta_strides[] = { 1, 2, 3, 4, 6, 8, 12, 16, 32 };
+
+/* The high nibble of the c_type of a block for its filter */
+static uchar block_filter(struct compress_thread *cti)
+{
+	unsigned i;
+
+	if (cti->filter != FILTER_FLAG_DELTA)
+		return cti->filter;
+	for (i = 0; delta_strides[i] != cti->delta; i++)
+		;
+	return BLOCK_DELTA + i;
+}
+
+/* Write out one compressed block. Only ever called from the writer thread,
+ * which owns the output file and the stream positions. */
+static bool write_block(rzip_control *control, int current_thread)
+{
+	struct stream_ctx *sc = control->sctx;
+	struct compress_thread *cti = &sc->cthreads[current_thread];
+	struct stream_info *ctis = cti->sinfo;
+	uchar head[SALT_LEN + 1 + 8 * 3 + SALT_LEN], *p, *buf;
+	i64 padded_len, c_len, u_len, written = 0;
+	int write_len, i;
+
+	/* Need to be big enough to fill one CBC_LEN */
+	if (ENCRYPT)
+		write_len = 8;
+	else
+		write_len = ctis->chunk_bytes;
+
+	if (!ctis->chunks++) {
+		int j;
+
+		if (TMP_OUTBUF) {
+			lock_mutex(control, &control->control_lock);
+			if (!control->magic_written)
+				write_magic(control);
+			unlock_mutex(control, &control->control_lock);
+
+			if (unlikely(!flush_tmpoutbuf(control))) {
+				print_err("Failed to flush_tmpoutbuf in compthread\n");
+				goto error;
+			}
+		}
+
+		print_maxverbose("Writing initial chunk bytes value %d at %lld\n",
+				 ctis->chunk_bytes, get_seek(control, ctis->fd));
+		if (INDEX && unlikely(!index_chunk(control, get_seek(control, ctis->fd), ctis->size)))
+			goto error;
+		/* Write chunk bytes of this block */
+		write_u8(control, ctis->chunk_bytes);
+
+		/* Write whether this is the last chunk, followed by the size
+		 * of this chunk */
+		print_maxverbose("Writing EOF flag as %d\n", ctis->eof);
+		write_u8(control, ctis->eof);
+		if (!ENCRYPT)
+			write_val(control, ctis->size, ctis->chunk_bytes);
+
+		/* First chunk of this stream, write headers */
+		ctis->initial_pos = get_seek(control, ctis->fd);
+		if (unlikely(ctis->initial_pos == -1))
+			goto error;
+
+		print_maxverbose("Writing initial header at %lld\n", ctis->initial_pos);
+		for (j = 0; j < ctis->num_streams && !STREAMED; j++) {
+			/* If encrypting, we leave SALT_LEN room to write in salt
+			* later */
+			if (ENCRYPT) {
+				if (unlikely(write_val(control, 0, SALT_LEN)))
+					fatal_goto(("Failed to write_buf blank salt in compthread %d\n", current_thread), error);
+				ctis->cur_pos += SALT_LEN;
+			}
+			ctis->s[j].last_head = ctis->cur_pos + 1 + (write_len * 2);
+			write_u8(control, CTYPE_NONE);
+			write_val(control, 0, write_len);
+			write_val(control, 0, write_len);
+			write_val(control, 0, write_len);
+			ctis->cur_pos += 1 + (write_len * 3);
+		}
+	}
+
+	/* A block encoded in parts goes out as that many blocks in a row */
+	buf = cti->s_buf;
+	for (i = 0; i < MAX(cti->sub_blocks, 1); i++) {
+		if (cti->sub_blocks) {
+			c_len = cti->sub_len[i * 2];
+			u_len = cti->sub_len[i * 2 + 1];
+		} else {
+			c_len = cti->c_len;
+			u_len = cti->s_len;
+		}
+		padded_len = MAX(c_len, MIN_SIZE);
+
+		/* --streamable leaves the block before alone, its reader
+		 * finds the next one by reading on */
+		if (!STREAMED) {
+			print_maxverbose("Compthread %d seeking to %lld to store length %d\n", current_thread, ctis->s[cti->streamno].last_head, write_len);
+
+			if (unlikely(seekto(control, ctis, ctis->s[cti->streamno].last_head)))
+				fatal_goto(("Failed to seekto in compthread %d\n", current_thread), error);
+
+			if (unlikely(write_val(control, ctis->cur_pos, write_len)))
+				fatal_goto(("Failed to write_val cur_pos in compthread %d\n", current_thread), error);
+
+			if (ENCRYPT)
+				rewrite_encrypted(control, ctis, ctis->s[cti->streamno].last_head - 17);
+
+			ctis->s[cti->streamno].last_head = ctis->cur_pos + 1 + (write_len * 2) + (ENCRYPT ? SALT_LEN : 0);
+
+			print_maxverbose("Compthread %d seeking to %lld to write header\n", current_thread, ctis->cur_pos);
+
+			if (unlikely(seekto(control, ctis, ctis->cur_pos)))
+				fatal_goto(("Failed to seekto cur_pos in compthread %d\n", current_thread), error);
+		}
+
+		print_maxverbose("Thread %d writing %lld compressed bytes from stream %d\n", current_thread, padded_len, cti->streamno);
+
+		/* The header, block salt and data all go out in one write */
+		p = head;
+		if (ENCRYPT) {
+			p = put_val(p, 0, SALT_LEN);
+			ctis->cur_pos += SALT_LEN;
+			ctis->s[cti->streamno].last_headofs = ctis->cur_pos;
+		}
+		/* We store the actual c_len even though we might pad it out */
+		*p++ = cti->c_type | (AUTO_FILTER ? block_filter(cti) << 4 : 0);
+		p = put_val(p, c_len, write_len);
+		p = put_val(p, u_len, write_len);
+		p = put_val(p, STREAMED ? cti->streamno + 1 : 0, write_len);
+		ctis->cur_pos += 1 + (write_len * 3);
+
+		if (ENCRYPT) {
+			memcpy(p, cti->salt + i * SALT_LEN, SALT_LEN);
+			p += SALT_LEN;
+			ctis->cur_pos += SALT_LEN;
+		}
+
+		print_maxverbose("Compthread %d writing data at %lld\n", current_thread, ctis->cur_pos);
+
+		if (unlikely(write_block_buf(control, head, p - head, buf, padded_len)))
+			fatal_goto(("Failed to write block in compthread %d\n", current_thread), error);
+
+		ctis->cur_pos += padded_len;
+		buf += padded_len;
+		written += p - head + padded_len;
+	}
+	/* The empty header that ends a --streamable chunk */
+	if (STREAMED && cti->chunk_end) {
+		p = head;
+		*p++ = CTYPE_NONE;
+		memset(p, 0, write_len * 3);
+		p += write_len * 3;
+		if (unlikely(write_buf(control, head, p - head)))
+			fatal_goto(("Failed to write chunk end in compthread %d\n", current_thread), error);
+		ctis->cur_pos += p - head;
+		written += p - head;
+	}
+	if (control->stats)
+		stats_io(control, 0, written);
+	write_back(control, ctis->fd);
+	free_buf(control, cti->s_buf);
+	dealloc(cti->sub_len);
+	dealloc(cti->salt);
+	cti->sub_blocks = 0;
+
+	/* Last two compressed blocks do not have an offset written to them
+	 * so we have to go back and encrypt them now. Doing it here in the
+	 * writer means the next chunk need not wait for us. */
+	if (ENCRYPT && cti->chunk_end) {
+		int j;
+
+		for (j = 0; j < ctis->num_streams; j++)
+			if (unlikely(!rewrite_encrypted(control, ctis, ctis->s[j].last_headofs)))
+				goto error;
+	}
+	return true;
+error:
+	free_buf(control, cti->s_buf);
+	dealloc(cti->sub_len);
+	dealloc(cti->salt);
+	cti->sub_blocks = 0;
+	return false;
+}
+
+/* Write compressed blocks strictly in the order they were handed out.
+ * The slots in cthreads serve as the reorder buffer: a block that is
+ * finished early waits in its slot while its worker moves on. */
+static void *writethread(void *data)
+{
+	rzip_control *control = data;
+	struct stream_ctx *sc = control->sctx;
+	struct compress_thread *cti;
+	i64 start;
+
+	while (42) {
+		start = stats_start(control);
+		lock_mutex(control, &sc->output_lock);
+		cti = &sc->cthreads[sc->output_thread];
+		while (!cti->ready && !sc->writer_quit)
+			cond_wait(control, &sc->output_cond, &sc->output_lock);
+		unlock_mutex(control, &sc->output_lock);
+		if (!cti->ready)
+			break;
+		cti->ready = false;
+		stats_since(control, writer_wait_usecs, start);
+
+		if (unlikely(!write_block(control, sc->output_thread)))
+			failure("Failed to write_block in writethread\n");
+
+		lock_mutex(control, &sc->output_lock);
+		if (++sc->output_thread == control->threads)
+			sc->output_thread = 0;
+		cond_broadcast(control, &sc->output_cond);
+		unlock_mutex(control, &sc->output_lock);
+
+		cksem_post(control, &cti->cksem);
+	}
+	return NULL;
+}
+
+/* Order 0 entropy in bits per byte of ADAPTIVE_SAMPLES slices spread over
+ * the buffer. lz4 finds no matches in data that is merely skewed, like
+ * samples or tables, while an entropy coder still gains on them */
+#define ADAPTIVE_SAMPLES	16
+#define ADAPTIVE_SLICE		4096
+#define ADAPTIVE_ENTROPY	7.5
+
+static double sample_entropy(uchar *buf, i64 len)
+{
+	i64 count[256] = { 0 }, total = 0, stride, ofs;
+	double bits = 0;
+	int i, j;
+
+	stride = len / ADAPTIVE_SAMPLES;
+	for (i = 0; i < ADAPTIVE_SAMPLES; i++) {
+		uchar *p = buf + i * stride;
+		i64 n = MIN(ADAPTIVE_SLICE, len - i * stride);
+
+		for (ofs = 0; ofs < n; ofs++)
+			count[p[ofs]]++;
+		total += n;
+	}
+	for (j = 0; j < 256; j++) {
+		if (count[j]) {
+			double p = (double)count[j] / total;
+
+			bits -= p * log2(p);
+		}
+	}
+	return bits;
+}
+
+/* --adaptive. Pick the cheapest backend likely to do the job for this one
+ * block from the lz4 verdict: blocks lz4 already shrinks below the target
+ * go to zstd at level 1, blocks it can't shrink and that look random are
+ * stored, and only what remains gets the backend asked for */
+static uchar adaptive_ctype(rzip_control *control, struct compress_thread *cthread, uchar ctype)
+{
+	int pct = block_compresses(control, cthread);
+
+	if (!pct) {
+		double entropy = sample_entropy(cthread->s_buf, cthread->s_len);
+
+		print_maxverbose("Adaptive: lz4 failed, entropy %.2f bits per byte\n", entropy);
+		if (entropy >= ADAPTIVE_ENTROPY)
+			return CTYPE_NONE;
+		/* Let the backend try it anyway, as a hard block */
+		cthread->lz4_pct = MAX(control->threshold, 1);
+		return ctype;
+	}
+	if (pct <= control->adaptive) {
+		print_maxverbose("Adaptive: lz4 ratio %d%%, block sent to zstd level 1\n", pct);
+		cthread->level = 1;
+		return CTYPE_ZSTD;
+	}
+	return ctype;
+}
+
+/* Filters run over the literals of a block on its backend thread, so they
+ * never hold up the rzip thread. A single filter chosen for the whole file is
+ * kept in the magic header. With --auto-filter each block gets its own,
+ * kept in the high nibble of the c_type of its block header instead */
+static const char *filter_name(unsigned filter)
+{
+	static const char *names[] = { "no", "x86", "ARM", "ARMT", "PPC", "SPARC", "IA64", "Delta" };
+
+	return filter < 8 ? names[filter] : "wtf";
+}
+
+#define DELTA_VECTOR	16
+
+/* Delta_Encode from a zeroed state: every byte less the one dist before it.
+ * Working backwards a vector only reads bytes that are not changed yet, and
+ * loading those first lets the compiler vectorise the subtraction */
+static void delta_encode(uchar *buf, i64 len, unsigned dist)
+{
+	uchar prev[DELTA_VECTOR];
+	i64 end = len;
+	int i;
+
+	for (; end - DELTA_VECTOR >= dist; end -= DELTA_VECTOR) {
+		memcpy(prev, buf + end - DELTA_VECTOR - dist, DELTA_VECTOR);
+		for (i = 0; i < DELTA_VECTOR; i++)
+			buf[end - DELTA_VECTOR + i] -= prev[i];
+	}
+	while (end-- > dist)
+		buf[end] -= buf[end - dist];
+}
+
+/* Delta_Decode from a zeroed state. Once dist is at least a vector, each
+ * vector only reads bytes that are already decoded */
+static void delta_decode(uchar *buf, i64 len, unsigned dist)
+{
+	uchar prev[DELTA_VECTOR];
+	i64 start = dist;
+	int i;
+
+	if (dist >= DELTA_VECTOR) {
+		for (; start + DELTA_VECTOR <= len; start += DELTA_VECTOR) {
+			memcpy(prev, buf + start - dist, DELTA_VECTOR);
+			for (i = 0; i < DELTA_VECTOR; i++)
+				buf[start + i] += prev[i];
+		}
+	}
+	for (; start < len; start++)
+		buf[start] += buf[start - dist];
+}
+
+/* Run filter over buf, encoding before compression or decoding after */
+static void filter_buf(unsigned filter, unsigned delta, uchar *buf, i64 len, int encoding)
+{
+	UInt32 x86State;
+
+	switch (filter) {
+		case FILTER_FLAG_X86:
+			x86_Convert_Init(x86State);
+			x86_Convert(buf, len, 0, &x86State, encoding);
+			break;
+		case FILTER_FLAG_ARM:
+			ARM_Convert(buf, len, 0, encoding);
+			break;
+		case FILTER_FLAG_ARMT:
+			ARMT_Convert(buf, len, 0, encoding);
+			break;
+		case FILTER_FLAG_PPC:
+			PPC_Convert(buf, len, 0, encoding);
+			break;
+		case FILTER_FLAG_SPARC:
+			SPARC_Convert(buf, len, 0, encoding);
+			break;
+		case FILTER_FLAG_IA64:
+			IA64_Convert(buf, len, 0, encoding);
+			break;
+		case FILTER_FLAG_DELTA:
+			if (encoding)
+				delta_encode(buf, len, delta);
+			else
+				delta_decode(buf, len, delta);
+			break;
+	}
+}
+
+static u32 get32(const uchar *p, bool be)
+{
+	return be ? (u32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] :
+		    (u32)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* The filter for the machine of the first ELF, PE or Mach-O header in buf,
+ * 0 when there is none or there is no filter for its machine */
+static uchar exec_filter(const uchar *buf, i64 len)
+{
+	static const char *macho[] = { "\xfe\xed\xfa\xce", "\xfe\xed\xfa\xcf", "\xce\xfa\xed\xfe", "\xcf\xfa\xed\xfe" };
+	const uchar *p;
+	int i;
+
+	p = memmem(buf, len, "\x7f" "ELF", 4);
+	if (p && buf + len - p >= 20) {
+		bool be = p[5] == 2;
+
+		switch (be ? p[18] << 8 | p[19] : p[19] << 8 | p[18]) {
+			case 3: case 62:		// EM_386, EM_X86_64
+				return FILTER_FLAG_X86;
+			case 40:			// EM_ARM
+				return FILTER_FLAG_ARM;
+			case 20: case 21:		// EM_PPC, EM_PPC64, the filter is big endian
+				return be ? FILTER_FLAG_PPC : 0;
+			case 2: case 18: case 43:	// EM_SPARC, EM_SPARC32PLUS, EM_SPARCV9
+				return FILTER_FLAG_SPARC;
+			case 50:			// EM_IA_64
+				return FILTER_FLAG_IA64;
+		}
+		return 0;
+	}
+	p = memmem(buf, len, "PE\0\0", 4);
+	if (p && buf + len - p >= 6) {
+		switch (p[4] | p[5] << 8) {
+			case 0x14c: case 0x8664:	// i386, AMD64
+				return FILTER_FLAG_X86;
+			case 0x1c0:			// ARM
+				return FILTER_FLAG_ARM;
+			case 0x1c2: case 0x1c4:		// Thumb, ARMv7 Thumb-2
+				return FILTER_FLAG_ARMT;
+			case 0x200:			// IA64
+				return FILTER_FLAG_IA64;
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		p = memmem(buf, len, macho[i], 4);
+		if (p && buf + len - p >= 8) {
+			switch (get32(p + 4, i < 2) & 0xffffff) {
+				case 7:			// CPU_TYPE_X86, CPU_TYPE_X86_64
+					return FILTER_FLAG_X86;
+				case 12:		// CPU_TYPE_ARM
+					return FILTER_FLAG_ARM;
+				case 18:		// CPU_TYPE_POWERPC
+					return i < 2 ? FILTER_FLAG_PPC : 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/* x86 code is full of near calls and jumps, E8 and E9, whose 32 bit offset
+ * is small so its top byte is 00 or FF. Random data has them at about 1 in
+ * 16384 bytes, code at more than 1 in 512 */
+#define X86_CALL_RATE	512
+
+static bool x86_code(const uchar *buf, i64 len)
+{
+	i64 i, calls = 0;
+
+	for (i = 0; i < len - 4; i++)
+		calls += ((buf[i] & 0xfe) == 0xe8) & ((uchar)(buf[i + 4] + 1) < 2);
+	return calls * X86_CALL_RATE > len;
+}
+
+/* Numbers in fixed size records, samples, time series and column pages,
+ * differ little from the same field of the record before. Delta at the
+ * record size leaves mostly small values, so it is the stride whose deltas
+ * have the least order 0 entropy over DELTA_SAMPLES slices of the block, if
+ * that saves at least DELTA_GAIN of the entropy of the bytes themselves */
+#define DELTA_SAMPLES	8
+#define DELTA_SLICE	8192
+#define DELTA_GAIN	0.125
+
+static double order0_bits(const i64 *count, i64 total)
+{
+	double bits = 0;
+	int j;
+
+	if (!total)
+		return 8;
+	for (j = 0; j < 256; j++) {
+		if (count[j]) {
+			double p = (double)count[j] / total;
+
+			bits -= p * log2(p);
+		}
+	}
+	return bits;
+}
+
+static double delta_entropy(const uchar *buf, i64 len, unsigned dist)
+{
+	i64 count[256] = { 0 }, total = 0, stride, ofs;
+	int i;
+
+	stride = len / DELTA_SAMPLES;
+	for (i = 0; i < DELTA_SAMPLES; i++) {
+		const uchar *p = buf + i * stride;
+		i64 n = MIN(DELTA_SLICE, len - i * stride);
+
+		if (dist) {
+			for (ofs = dist; ofs < n; ofs++)
+				count[(uchar)(p[ofs] - p[ofs - dist])]++;
+		} else {
+			for (ofs = 0; ofs < n; ofs++)
+				count[p[ofs]]++;
+		}
+		total += MAX(n - (i64)dist, 0);
+	}
+	return order0_bits(count, total);
+}
+
+/* Entropy of the same slices once filter has run over a copy of each */
+static double filter_entropy(const uchar *buf, i64 len, unsigned filter)
+{
+	i64 count[256] = { 0 }, total = 0, stride, ofs;
+	uchar *slice;
+	int i;
+
+	slice = malloc(DELTA_SLICE);
+	if (unlikely(!slice))
+		return 8;
+	stride = len / DELTA_SAMPLES;
+	for (i = 0; i < DELTA_SAMPLES; i++) {
+		i64 n = MIN(DELTA_SLICE, len - i * stride);
+
+		memcpy(slice, buf + i * stride, n);
+		filter_buf(filter, 0, slice, n, 1);
+		for (ofs = 0; ofs < n; ofs++)
+			count[slice[ofs]]++;
+		total += n;
+	}
+	free(slice);
+	return order0_bits(count, total);
+}
+
+/* The index in delta_strides of the delta for buf, or -1 for none */
+static int delta_stride(const uchar *buf, i64 len)
+{
+	double best = delta_entropy(buf, len, 0) * (1 - DELTA_GAIN), bits;
+	int i, stride = -1;
+
+	for (i = 0; i < (int)sizeof(delta_strides); i++) {
+		bits = delta_entropy(buf, len, delta_strides[i]);
+		if (bits < best) {
+			best = bits;
+			stride = i;
+		}
+	}
+	return stride;
+}
+
+/* --auto-filter: choose a filter for the literals of a block from what they
+ * look like. The filter of an executable header, or x86 where there are as
+ * many calls as code has, is only a candidate. Records of numbers can have
+ * as many E8 and E9 bytes, and code can carry tables of numbers, so the best
+ * delta stride is always looked for too, and the candidate is only used when
+ * the slices come out with less entropy through it than as they are or
+ * through that delta */
+static void auto_filter(struct compress_thread *cti)
+{
+	unsigned filter = exec_filter(cti->s_buf, cti->s_len);
+	int stride = delta_stride(cti->s_buf, cti->s_len);
+
+	if (!filter && x86_code(cti->s_buf, cti->s_len))
+		filter = FILTER_FLAG_X86;
+	if (filter && filter_entropy(cti->s_buf, cti->s_len, filter) <
+	    delta_entropy(cti->s_buf, cti->s_len, stride < 0 ? 0 : delta_strides[stride])) {
+		cti->filter = filter;
+		return;
+	}
+	if (stride >= 0) {
+		cti->filter = FILTER_FLAG_DELTA;
+		cti->delta = delta_strides[stride];
+	}
+}
+
+/* Backend of a stream. The match stream can have its own, --stream0, and
+ * everything else goes to the one chosen with -b -g -l -n -z -Z or --lzma */
+static uchar stream_ctype(rzip_control *control, int streamno)
+{
+	if (streamno == 0 && control->stream0_ctype)
+		return control->stream0_ctype;
+	if (NO_COMPRESS)
+		return CTYPE_NONE;
+	if (LZO_COMPRESS)
+		return CTYPE_LZO;
+	if (BZIP2_COMPRESS)
+		return CTYPE_BZIP2;
+	if (ZLIB_COMPRESS)
+		return CTYPE_GZIP;
+	if (ZPAQ_COMPRESS)
+		return CTYPE_ZPAQ;
+	if (ZSTD_COMPRESS)
+		return CTYPE_ZSTD;
+	return CTYPE_LZMA;
+}
+
+/* Encrypt the block, or each of its sub_blocks, under a salt of its own
+ * here in the worker so the writer only has the headers left to do */
+static bool encrypt_blocks(rzip_control *control, struct compress_thread *cti)
+{
+	int i, blocks = MAX(cti->sub_blocks, 1);
+	uchar *buf = cti->s_buf;
+	i64 padded_len;
+
+	cti->salt = malloc(SALT_LEN * blocks);
+	if (unlikely(!cti->salt))
+		fatal_return(("Failed to malloc block salts in encrypt_blocks\n"), false);
+	for (i = 0; i < blocks; i++) {
+		padded_len = MAX(cti->sub_blocks ? cti->sub_len[i * 2] : cti->c_len, MIN_SIZE);
+		if (unlikely(!get_rand(control, cti->salt + i * SALT_LEN, SALT_LEN)))
+			return false;
+		if (unlikely(!lrz_encrypt(control, buf, padded_len, cti->salt + i * SALT_LEN)))
+			return false;
+		buf += padded_len;
+	}
+	return true;
+}
+
+static int backend_compress(rzip_control *control, struct compress_thread *cti, uchar ctype, int current_thread)
+{
+	switch (ctype) {
+		case CTYPE_LZMA:
+			return lzma_compress_buf(control, cti, current_thread);
+		case CTYPE_LZO:
+			return lzo_compress_buf(control, cti);
+		case CTYPE_BZIP2:
+			return bzip2_compress_buf(control, cti);
+		case CTYPE_GZIP:
+			return gzip_compress_buf(control, cti);
+		case CTYPE_ZPAQ:
+			return zpaq_compress_buf(control, cti, current_thread);
+		case CTYPE_ZSTD:
+			return zstd_compress_buf(control, cti, current_thread);
+		default:
+			failure_return(("Dunno wtf compression to use!\n"), -1);
+	}
+}
+
+/* Decode a block held whole, which is any but an LZMA one read through its
+ * ring */
+static int backend_decompress(rzip_control *control, struct uncomp_thread *uci, int current_thread)
+{
+	switch (uci->c_type) {
+		case CTYPE_LZMA:
+			return lzma_decompress_buf(control, uci);
+		case CTYPE_LZO:
+			return lzo_decompress_buf(control, uci);
+		case CTYPE_BZIP2:
+			return bzip2_decompress_buf(control, uci);
+		case CTYPE_GZIP:
+			return gzip_decompress_buf(control, uci);
+		case CTYPE_ZPAQ:
+			return zpaq_decompress_buf(control, uci, current_thread);
+		case CTYPE_ZSTD:
+			return zstd_decompress_buf(control, uci);
+		default:
+			failure_return(("Dunno wtf decompression type to use!\n"), -1);
+	}
+}
+
+/* --remote block requests. The head is followed by the preset dictionary
+ * and the data, and the reply head by the data when there is any:
+ *   0 magic, 4 op, 5 c_type, 6 level, 7 lz4 verdict or -1, 8 REMOTE_LZ4_TEST,
+ *   9 zpaq block size, 10 lzma properties, 16 dictionary size,
+ *   20 preset dictionary size, 24 prime length, 32 length, 40 u_len
+ * Reply:
+ *   0 failed, 1 c_type, 2 lzma properties set, 3 lzma properties, 8 length
+ */
+#define REMOTE_MAGIC		"LRZW"
+#define REMOTE_REQ		48
+#define REMOTE_REPLY		16
+#define REMOTE_COMPRESS		1
+#define REMOTE_DECOMPRESS	2
+#define REMOTE_LZ4_TEST		1
+
+/* Not sent out are LZO blocks, which are done faster than they travel, and
+ * LZMA ones on decompression, which are read as they decode */
+static bool remote_ctype(rzip_control *control, uchar ctype)
+{
+	if (!control->remote || ctype == CTYPE_NONE || ctype == CTYPE_LZO)
+		return false;
+	return !((DECOMPRESS || TEST_ONLY) && ctype == CTYPE_LZMA);
+}
+
+/* Have a worker compress the block. Returns false when none can, leaving
+ * the block as it was to be compressed here */
+static bool remote_compress(rzip_control *control, struct compress_thread *cti, uchar ctype, int current_thread)
+{
+	uchar head[REMOTE_REQ] = { 0 }, reply[REMOTE_REPLY];
+	uchar *c_buf;
+	time_t deadline;
+	i64 c_len;
+	int fd;
+
+	if (!remote_ctype(control, ctype))
+		return false;
+	/* Tested here as the backend would, which then needs no sending */
+	if (LZ4_TEST && ctype != CTYPE_GZIP && !block_compresses(control, cti))
+		return true;
+	fd = remote_get(control);
+	if (fd == -1)
+		return false;
+
+	memcpy(head, REMOTE_MAGIC, 4);
+	head[4] = REMOTE_COMPRESS;
+	head[5] = ctype;
+	head[6] = cti->level;
+	head[7] = cti->lz4_pct;
+	head[8] = LZ4_TEST ? REMOTE_LZ4_TEST : 0;
+	head[9] = control->zpaq_bs;
+	put_val(head + 16, control->dictSize, 4);
+	put_val(head + 20, primed_stream(control, cti->streamno) ? control->preset_dict : 0, 4);
+	put_val(head + 24, cti->prime_len, 8);
+	put_val(head + 32, cti->s_len, 8);
+	print_maxverbose("Thread %d sending %lld bytes to a worker\n", current_thread, cti->s_len);
+	deadline = remote_deadline(cti->prime_len + cti->s_len);
+	if (!remote_write(fd, head, REMOTE_REQ, deadline) || !remote_write(fd, cti->prime, cti->prime_len, deadline) ||
+	    !remote_write(fd, cti->s_buf, cti->s_len, deadline) || !remote_read(fd, reply, REMOTE_REPLY, deadline))
+		goto lost;
+	if (reply[0]) {
+		print_verbose("A worker failed to compress a block, compressing it here\n");
+		remote_put(control, fd, true);
+		return false;
+	}
+	if (reply[1] != CTYPE_NONE) {
+		c_len = get_val(reply + 8, 8);
+		if (unlikely(c_len <= 0 || c_len >= cti->c_len))
+			goto lost;
+		c_buf = alloc_buf(control, c_len);
+		if (unlikely(!c_buf))
+			goto lost;
+		if (!remote_read(fd, c_buf, c_len, deadline)) {
+			free_buf(control, c_buf);
+			goto lost;
+		}
+		cti->c_len = c_len;
+		free_buf(control, cti->s_buf);
+		cti->s_buf = c_buf;
+		cti->c_type = reply[1];
+		if (reply[2])
+			keep_lzma_props(control, reply + 3);
+	}
+	remote_put(control, fd, true);
+	return true;
+lost:
+	print_err("Lost a worker or it timed out part way through a block, compressing it here\n");
+	remote_put(control, fd, false);
+	return false;
+}
 
-/* Once the final data has all been written to the block header, we go back
- * and write SALT_LEN bytes of salt before it, and encrypt the header in place
- * by reading what has been written, encrypting it, and writing back over it.
- * This is very convoluted depending on whether a last_head value is written
- * to this block or not. See the callers of this function */
-static bool rewrite_encrypted(rzip_control *control, struct stream_info *sinfo, i64 ofs)
+/* Have a worker decode the block. Returns false when none can, or it is not
+ * one to send out */
+static bool remote_decompress(rzip_control *control, struct uncomp_thread *uci)
 {
-	uchar *buf, *head;
-	i64 cur_ofs;
+	uchar head[REMOTE_REQ] = { 0 }, reply[REMOTE_REPLY];
+	uchar *u_buf;
+	time_t deadline;
+	int fd;
 
-	cur_ofs = get_seek(control, sinfo->fd) - sinfo->initial_pos;
-	if (unlikely(cur_ofs == -1))
+	if (!remote_ctype(control, uci->c_type))
+		return false;
+	fd = remote_get(control);
+	if (fd == -1)
 		return false;
-	head = malloc(25 + SALT_LEN);
-	if (unlikely(!head))
-		fatal_return(("Failed to malloc head in rewrite_encrypted\n"), false);
-	buf = head + SALT_LEN;
-	if (unlikely(!get_rand(control, head, SALT_LEN)))
-		goto error;
-	if (unlikely(seekto(control, sinfo, ofs - SALT_LEN)))
-		failure_goto(("Failed to seekto buf ofs in rewrite_encrypted\n"), error);
-	if (unlikely(write_buf(control, head, SALT_LEN)))
-		failure_goto(("Failed to write_buf head in rewrite_encrypted\n"), error);
-	if (unlikely(read_buf(control, sinfo->fd, buf, 25)))
-		failure_goto(("Failed to read_buf buf in rewrite_encrypted\n"), error);
-
-	if (unlikely(!lrz_encrypt(control, buf, 25, head)))
-		goto error;
 
-	if (unlikely(seekto(control, sinfo, ofs)))
-		failure_goto(("Failed to seek back to ofs in rewrite_encrypted\n"), error);
-	if (unlikely(write_buf(control, buf, 25)))
-		failure_goto(("Failed to write_buf encrypted buf in rewrite_encrypted\n"), error);
-	dealloc(head);
-	seekto(control, sinfo, cur_ofs);
+	memcpy(head, REMOTE_MAGIC, 4);
+	head[4] = REMOTE_DECOMPRESS;
+	head[5] = uci->c_type;
+	memcpy(head + 10, control->lzma_properties, 5);
+	put_val(head + 32, uci->c_len, 8);
+	put_val(head + 40, uci->u_len, 8);
+	print_maxverbose("Sending %lld bytes to a worker to decompress\n", uci->c_len);
+	deadline = remote_deadline(uci->u_len);
+	if (!remote_write(fd, head, REMOTE_REQ, deadline) || !remote_write(fd, uci->s_buf, uci->c_len, deadline) ||
+	    !remote_read(fd, reply, REMOTE_REPLY, deadline))
+		goto lost;
+	if (reply[0] || get_val(reply + 8, 8) != uci->u_len) {
+		print_verbose("A worker failed to decompress a block, decompressing it here\n");
+		remote_put(control, fd, !reply[0]);
+		return false;
+	}
+	u_buf = alloc_buf(control, round_up_page(control, uci->u_len));
+	if (unlikely(!u_buf))
+		goto lost;
+	if (!remote_read(fd, u_buf, uci->u_len, deadline)) {
+		free_buf(control, u_buf);
+		goto lost;
+	}
+	free_buf(control, uci->s_buf);
+	uci->s_buf = u_buf;
+	remote_put(control, fd, true);
 	return true;
-error:
-	dealloc(head);
+lost:
+	print_err("Lost a worker or it timed out part way through a block, decompressing it here\n");
+	remote_put(control, fd, false);
 	return false;
 }
 
+/* --worker: take one block from fd, run it through the backend and send it
+ * back. Blocks are done on one thread, as they would be on a machine with
+ * a thread for each, so they come out the same as they would here. Returns
+ * false once the other end hangs up */
+bool serve_block(rzip_control *control, int fd)
+{
+	uchar head[REMOTE_REQ], reply[REMOTE_REPLY] = { 0 };
+	struct compress_thread cti;
+	struct uncomp_thread uci;
+	uchar *out = NULL;
+	i64 len, prime_len, u_len, out_len;
+	time_t deadline;
+	bool ok;
+	int ret;
+
+	/* An idle connection waits as long as it takes for its next block */
+	if (!remote_read(fd, head, REMOTE_REQ, 0))
+		return false;
+	if (unlikely(memcmp(head, REMOTE_MAGIC, 4)))
+		failure_return(("Not a block request in serve_block\n"), false);
+	if (unlikely(!stream_ctx(control)))
+		return false;
+	control->threads = 1;
+	control->flags &= ~(FLAG_THRESHOLD | FLAG_SHOW_PROGRESS);
+	if (head[8] & REMOTE_LZ4_TEST)
+		control->flags |= FLAG_THRESHOLD;
+	control->zpaq_bs = head[9];
+	memcpy(control->lzma_properties, head + 10, 5);
+	control->lzma_prop_set = false;
+	control->dictSize = get_val(head + 16, 4);
+	control->preset_dict = get_val(head + 20, 4);
+	len = get_val(head + 32, 8);
+	prime_len = get_val(head + 24, 8);
+	u_len = get_val(head + 40, 8);
+	/* The lengths decide what is allocated here, so none may be more than
+	 * this machine's ram, whatever the other end says. The process of the
+	 * connection exits on failure, which drops it */
+	if (unlikely(len < 1 || len > control->ramsize || prime_len < 0 || prime_len > control->ramsize - len ||
+		     (head[4] == REMOTE_DECOMPRESS && (u_len < 1 || u_len > control->ramsize))))
+		failure_return(("Bad block request in serve_block\n"), false);
+
+	if (head[4] == REMOTE_COMPRESS) {
+		memset(&cti, 0, sizeof(cti));
+		cti.c_type = CTYPE_NONE;
+		cti.level = head[6];
+		cti.lz4_pct = (signed char)head[7];
+		cti.prime_len = prime_len;
+		cti.s_len = cti.c_len = len;
+		if (cti.prime_len) {
+			cti.prime = alloc_buf(control, cti.prime_len);
+			if (unlikely(!cti.prime))
+				fatal_return(("Unable to malloc preset dictionary in serve_block\n"), false);
+		}
+		cti.s_buf = alloc_buf(control, MAX(len, MIN_SIZE));
+		if (unlikely(!cti.s_buf))
+			fatal_return(("Unable to malloc %lld byte block in serve_block\n", len), false);
+		deadline = remote_deadline(prime_len + len);
+		if (!remote_read(fd, cti.prime, cti.prime_len, deadline) || !remote_read(fd, cti.s_buf, len, deadline)) {
+			free_buf(control, cti.prime);
+			free_buf(control, cti.s_buf);
+			return false;
+		}
+		ret = backend_compress(control, &cti, head[5], 0);
+		free_buf(control, cti.prime);
+		dealloc(cti.lz4_buf);
+		out = cti.s_buf;
+		out_len = cti.c_type == CTYPE_NONE ? 0 : cti.c_len;
+		reply[1] = cti.c_type;
+	} else if (head[4] == REMOTE_DECOMPRESS) {
+		memset(&uci, 0, sizeof(uci));
+		uci.c_type = head[5];
+		uci.c_len = len;
+		uci.u_len = u_len;
+		uci.s_buf = alloc_buf(control, MAX(len, MIN_SIZE));
+		if (unlikely(!uci.s_buf))
+			fatal_return(("Unable to malloc %lld byte block in serve_block\n", len), false);
+		if (!remote_read(fd, uci.s_buf, len, remote_deadline(len))) {
+			free_buf(control, uci.s_buf);
+			return false;
+		}
+		ret = backend_decompress(control, &uci, 0);
+		out = uci.s_buf;
+		out_len = uci.u_len;
+	} else
+		failure_return(("Unknown block request %d in serve_block\n", head[4]), false);
+
+	if (ret)
+		out_len = 0;
+	reply[0] = ret != 0;
+	reply[2] = control->lzma_prop_set;
+	memcpy(reply + 3, control->lzma_properties, 5);
+	put_val(reply + 8, out_len, 8);
+	deadline = remote_deadline(out_len);
+	ok = remote_write(fd, reply, REMOTE_REPLY, deadline) && remote_write(fd, out, out_len, deadline);
+	free_buf(control, out);
+	return ok;
+}
+
 /* Enter with s_buf allocated,s_buf points to the compressed data after the
  * backend compression and is then freed here */
 static void *compthread(void *data)
 {
 	stream_thread_struct *s = data;
 	rzip_control *control = s->control;
+	struct stream_ctx *sc = control->sctx;
 	int current_thread = s->i;
 	struct compress_thread *cti;
-	struct stream_info *ctis;
 	int waited = 0, ret = 0;
+	struct stats_mark start;
 	i64 padded_len;
-	int write_len;
+	uchar ctype;
 
 	/* Make sure this thread doesn't already exist */
 
 	dealloc(data);
-	cti = &cthreads[current_thread];
-	ctis = cti->sinfo;
+	cti = &sc->cthreads[current_thread];
+	mark_stats(control, &start);
 
 	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
 		print_err("Warning, unable to set thread nice value %d...Resetting to %d\n", control->nice_val, control->current_priority);
@@ -1362,72 +3918,50 @@ static void *compthread(void *data)
 	}
 	cti->c_type = CTYPE_NONE;
 	cti->c_len = cti->s_len;
-
-	/* Flushing writes to disk frees up any dirty ram, improving chances
-	 * of succeeding in allocating more ram */
-	fsync(ctis->fd);
+	cti->lz4_pct = -1;
+	ctype = stream_ctype(control, cti->streamno);
+	cti->level = control->compression_level;
+	if (cti->streamno == 0 && control->stream0_level)
+		cti->level = control->stream0_level;
+	if (ADAPTIVE && ctype != CTYPE_NONE && ctype != CTYPE_LZO && cti->c_len >= 64)
+		ctype = adaptive_ctype(control, cti, ctype);
 
 	/* This is a cludge in case we are compressing to stdout and our first
 	 * stream is not compressed, but subsequent ones are compressed by
 	 * lzma and we can no longer seek back to the beginning of the file
 	 * to write the lzma properties which are effectively always starting
 	 * with 93.= 0x5D. lc=3, lp=0, pb=2 */
-	if (TMP_OUTBUF && LZMA_COMPRESS)
+	if (TMP_OUTBUF && (LZMA_COMPRESS || control->stream0_ctype == CTYPE_LZMA))
 		control->lzma_properties[0] = 93;
+	numa_place(control, cti, current_thread);
+	cti->filter = 0;
+	if (cti->streamno == 1) {
+		if (FILTER_USED) {
+			cti->filter = control->filter_flag;
+			cti->delta = control->delta;
+		} else if (AUTO_FILTER && cti->s_len >= 64)
+			auto_filter(cti);
+	}
 retry:
 	/* Filters are used ragrdless of compression type */
-	if (FILTER_USED && cti->streamno == 1) {	// stream 0 is for matches, stream 1+ is for literals
+	if (cti->filter) {	// stream 0 is for matches, stream 1+ is for literals
 		print_maxverbose("Using %s filter prior to compression for thread %d...\n",
-				((control->filter_flag == FILTER_FLAG_X86) ? "x86" :
-				((control->filter_flag == FILTER_FLAG_ARM) ? "ARM" :
-				((control->filter_flag == FILTER_FLAG_ARMT) ? "ARMT" :
-				((control->filter_flag == FILTER_FLAG_PPC) ? "PPC" :
-				((control->filter_flag == FILTER_FLAG_SPARC) ? "SPARC" :
-				((control->filter_flag == FILTER_FLAG_IA64) ? "IA64" :
-				((control->filter_flag == FILTER_FLAG_DELTA) ? "Delta" : "wtf"))))))), current_thread);
-		if (control->filter_flag == FILTER_FLAG_X86) {
-			UInt32 x86State;
-			x86_Convert_Init(x86State);
-			x86_Convert(cti->s_buf, cti->s_len, 0, &x86State, 1);
-		}
-		else if (control->filter_flag == FILTER_FLAG_ARM) {
-			ARM_Convert(cti->s_buf, cti->s_len, 0, 1);
-		}
-		else if (control->filter_flag == FILTER_FLAG_ARMT) {
-			ARMT_Convert(cti->s_buf, cti->s_len, 0, 1);
-		}
-		else if (control->filter_flag == FILTER_FLAG_PPC) {
-			PPC_Convert(cti->s_buf, cti->s_len, 0, 1);
-		}
-		else if (control->filter_flag == FILTER_FLAG_SPARC) {
-			SPARC_Convert(cti->s_buf, cti->s_len, 0, 1);
-		}
-		if (control->filter_flag == FILTER_FLAG_IA64) {
-			IA64_Convert(cti->s_buf, cti->s_len, 0, 1);
-		}
-		if (control->filter_flag == FILTER_FLAG_DELTA) {
-			uchar delta_state[DELTA_STATE_SIZE];
-			Delta_Init(delta_state);
-			Delta_Encode(delta_state, control->delta, cti->s_buf,  cti->s_len);
-		}
+				 filter_name(cti->filter), current_thread);
+		filter_buf(cti->filter, cti->delta, cti->s_buf, cti->s_len, 1);
 	}
 	/* Very small buffers have issues to do with minimum amounts of ram
 	 * allocatable to a buffer combined with the MINIMUM_MATCH of rzip
 	 * being 31 bytes so don't bother trying to compress anything less
 	 * than 64 bytes. */
-	if (!NO_COMPRESS && cti->c_len >= 64) {
-		/* Any Filter */
-		if (LZMA_COMPRESS)
-			ret = lzma_compress_buf(control, cti, current_thread);
-		else if (LZO_COMPRESS)
-			ret = lzo_compress_buf(control, cti);
-		else if (BZIP2_COMPRESS)
-			ret = bzip2_compress_buf(control, cti);
-		else if (ZLIB_COMPRESS)
-			ret = gzip_compress_buf(control, cti);
-		else if (ZPAQ_COMPRESS)
-			ret = zpaq_compress_buf(control, cti, current_thread);
-		else failure_goto(("Dunno wtf compression to use!\n"), error);
+	if (ctype != CTYPE_NONE && cti->c_len >= 64) {
+		/* A worker's backend does not use the ram here */
+		if (remote_compress(control, cti, ctype, current_thread))
+			ret = 0;
+		else {
+			reserve_ram(control, control->overhead);
+			ret = backend_compress(control, cti, ctype, current_thread);
+			release_ram(control, control->overhead);
+		}
 	}
 
 	padded_len = cti->c_len;
@@ -1436,9 +3970,15 @@ retry:
 		 * long or encryption cannot work. We pad it with random
 		 * data */
 		padded_len = MIN_SIZE;
-		cti->s_buf = realloc(cti->s_buf, MIN_SIZE);
-		if (unlikely(!cti->s_buf))
-			fatal_goto(("Failed to realloc s_buf in compthread\n"), error);
+		if (BUF_SIZE(cti->s_buf) < MIN_SIZE) {
+			uchar *buf = alloc_buf(control, MIN_SIZE);
+
+			if (unlikely(!buf))
+				fatal_goto(("Failed to realloc s_buf in compthread\n"), error);
+			memcpy(buf, cti->s_buf, cti->c_len);
+			free_buf(control, cti->s_buf);
+			cti->s_buf = buf;
+		}
 		if (unlikely(!get_rand(control, cti->s_buf + cti->c_len, MIN_SIZE - cti->c_len)))
 			goto error;
 	}
@@ -1449,163 +3989,37 @@ retry:
 	if (unlikely(ret && waited))
 		failure_goto(("Failed to compress in compthread\n"), error);
 
-	if (!waited) {
-		lock_mutex(control, &output_lock);
-		while (output_thread != current_thread)
-			cond_wait(control, &output_cond, &output_lock);
-		unlock_mutex(control, &output_lock);
-		waited = 1;
-	}
 	if (unlikely(ret)) {
+		lock_mutex(control, &sc->output_lock);
+		while (sc->output_thread != current_thread)
+			cond_wait(control, &sc->output_cond, &sc->output_lock);
+		unlock_mutex(control, &sc->output_lock);
+		waited = 1;
 		print_maxverbose("Unable to compress in parallel, waiting for previous thread to complete before trying again\n");
-		if (FILTER_USED && cti->streamno == 1 ) {	// As unlikely as this is, we have to undo filtering here
-			print_maxverbose("Reverting filtering...\n");
-			if (control->filter_flag == FILTER_FLAG_X86) {
-				UInt32 x86State;
-				x86_Convert_Init(x86State);
-				x86_Convert(cti->s_buf, cti->s_len, 0, &x86State, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_ARM) {
-				ARM_Convert(cti->s_buf, cti->s_len, 0, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_ARMT) {
-				ARMT_Convert(cti->s_buf, cti->s_len, 0, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_PPC) {
-				PPC_Convert(cti->s_buf, cti->s_len, 0, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_SPARC) {
-				SPARC_Convert(cti->s_buf, cti->s_len, 0, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_IA64) {
-				IA64_Convert(cti->s_buf, cti->s_len, 0, 0);
-			}
-			else if (control->filter_flag == FILTER_FLAG_DELTA) {
-				uchar delta_state[DELTA_STATE_SIZE];
-				print_maxverbose("Reverting Delta filter data prior to trying again...\n");
-				Delta_Init(delta_state);
-				Delta_Decode(delta_state, control->delta, cti->s_buf,  cti->s_len);
-			}
+		if (cti->filter) {	// As unlikely as this is, we have to undo filtering here
+			print_maxverbose("Reverting %s filter data prior to trying again...\n", filter_name(cti->filter));
+			filter_buf(cti->filter, cti->delta, cti->s_buf, cti->s_len, 0);
 		}
 		goto retry;
 	}
 
-	/* Need to be big enough to fill one CBC_LEN */
-	if (ENCRYPT)
-		write_len = 8;
-	else
-		write_len = ctis->chunk_bytes;
-
-	if (!ctis->chunks++) {
-		int j;
-
-		if (TMP_OUTBUF) {
-			lock_mutex(control, &control->control_lock);
-			if (!control->magic_written)
-				write_magic(control);
-			unlock_mutex(control, &control->control_lock);
-
-			if (unlikely(!flush_tmpoutbuf(control))) {
-				print_err("Failed to flush_tmpoutbuf in compthread\n");
-				goto error;
-			}
-		}
-
-		print_maxverbose("Writing initial chunk bytes value %d at %lld\n",
-				 ctis->chunk_bytes, get_seek(control, ctis->fd));
-		/* Write chunk bytes of this block */
-		write_u8(control, ctis->chunk_bytes);
-
-		/* Write whether this is the last chunk, followed by the size
-		 * of this chunk */
-		print_maxverbose("Writing EOF flag as %d\n", control->eof);
-		write_u8(control, control->eof);
-		if (!ENCRYPT)
-			write_val(control, ctis->size, ctis->chunk_bytes);
-
-		/* First chunk of this stream, write headers */
-		ctis->initial_pos = get_seek(control, ctis->fd);
-		if (unlikely(ctis->initial_pos == -1))
-			goto error;
-
-		print_maxverbose("Writing initial header at %lld\n", ctis->initial_pos);
-		for (j = 0; j < ctis->num_streams; j++) {
-			/* If encrypting, we leave SALT_LEN room to write in salt
-			* later */
-			if (ENCRYPT) {
-				if (unlikely(write_val(control, 0, SALT_LEN)))
-					fatal_goto(("Failed to write_buf blank salt in compthread %d\n", current_thread), error);
-				ctis->cur_pos += SALT_LEN;
-			}
-			ctis->s[j].last_head = ctis->cur_pos + 1 + (write_len * 2);
-			write_u8(control, CTYPE_NONE);
-			write_val(control, 0, write_len);
-			write_val(control, 0, write_len);
-			write_val(control, 0, write_len);
-			ctis->cur_pos += 1 + (write_len * 3);
-		}
-	}
-
-	print_maxverbose("Compthread %d seeking to %lld to store length %d\n", current_thread, ctis->s[cti->streamno].last_head, write_len);
-
-	if (unlikely(seekto(control, ctis, ctis->s[cti->streamno].last_head)))
-		fatal_goto(("Failed to seekto in compthread %d\n", current_thread), error);
-
-	if (unlikely(write_val(control, ctis->cur_pos, write_len)))
-		fatal_goto(("Failed to write_val cur_pos in compthread %d\n", current_thread), error);
-
-	if (ENCRYPT)
-		rewrite_encrypted(control, ctis, ctis->s[cti->streamno].last_head - 17);
-
-	ctis->s[cti->streamno].last_head = ctis->cur_pos + 1 + (write_len * 2) + (ENCRYPT ? SALT_LEN : 0);
-
-	print_maxverbose("Compthread %d seeking to %lld to write header\n", current_thread, ctis->cur_pos);
-
-	if (unlikely(seekto(control, ctis, ctis->cur_pos)))
-		fatal_goto(("Failed to seekto cur_pos in compthread %d\n", current_thread), error);
-
-	print_maxverbose("Thread %d writing %lld compressed bytes from stream %d\n", current_thread, padded_len, cti->streamno);
-
-	if (ENCRYPT) {
-		if (unlikely(write_val(control, 0, SALT_LEN)))
-			fatal_goto(("Failed to write_buf header salt in compthread %d\n", current_thread), error);
-		ctis->cur_pos += SALT_LEN;
-		ctis->s[cti->streamno].last_headofs = ctis->cur_pos;
-	}
-	/* We store the actual c_len even though we might pad it out */
-	if (unlikely(write_u8(control, cti->c_type) ||
-		write_val(control, cti->c_len, write_len) ||
-		write_val(control, cti->s_len, write_len) ||
-		write_val(control, 0, write_len))) {
-			fatal_goto(("Failed write in compthread %d\n", current_thread), error);
-	}
-	ctis->cur_pos += 1 + (write_len * 3);
-
-	if (ENCRYPT) {
-		if (unlikely(!get_rand(control, cti->salt, SALT_LEN)))
-			goto error;
-		if (unlikely(write_buf(control, cti->salt, SALT_LEN)))
-			fatal_goto(("Failed to write_buf block salt in compthread %d\n", current_thread), error);
-		if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt)))
-			goto error;
-		ctis->cur_pos += SALT_LEN;
-	}
-
-	print_maxverbose("Compthread %d writing data at %lld\n", current_thread, ctis->cur_pos);
-
-	if (unlikely(write_buf(control, cti->s_buf, padded_len)))
-		fatal_goto(("Failed to write_buf s_buf in compthread %d\n", current_thread), error);
-
-	ctis->cur_pos += padded_len;
-	dealloc(cti->s_buf);
+	free_buf(control, cti->prime);
 
-	lock_mutex(control, &output_lock);
-	if (++output_thread == control->threads)
-		output_thread = 0;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
+	if (ENCRYPT && unlikely(!encrypt_blocks(control, cti)))
+		goto error;
+	if (control->stats)
+		stats_block(control, current_thread, cti->s_len, padded_len, &start);
+
+	/* Hand the block to the writer and go back for more work */
+	lock_mutex(control, &sc->output_lock);
+	cti->ready = true;
+	cond_broadcast(control, &sc->output_cond);
+	unlock_mutex(control, &sc->output_lock);
+	return NULL;
 
 error:
+	free_buf(control, cti->prime);
+	dealloc(cti->salt);
 	cksem_post(control, &cti->cksem);
 
 	return NULL;
@@ -1613,36 +4027,54 @@ error:
 
 static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int streamno, int newbuf)
 {
-	pthread_t *threads = control->pthreads;
+	struct stream_ctx *sc = control->sctx;
+	int current_thread = sc->next_thread;
 	stream_thread_struct *s;
-	static int current_thread = 0;
+	i64 start;
 
 	/* Make sure this thread doesn't already exist */
-	cksem_wait(control, &cthreads[current_thread].cksem);
-
-	cthreads[current_thread].sinfo = sinfo;
-	cthreads[current_thread].streamno = streamno;
-	cthreads[current_thread].s_buf = sinfo->s[streamno].buf;
-	cthreads[current_thread].s_len = sinfo->s[streamno].buflen;
+	start = stats_start(control);
+	cksem_wait(control, &sc->cthreads[current_thread].cksem);
+	stats_since(control, backend_wait_usecs, start);
+
+	sc->cthreads[current_thread].sinfo = sinfo;
+	sc->cthreads[current_thread].streamno = streamno;
+	sc->cthreads[current_thread].s_buf = sinfo->s[streamno].buf;
+	sc->cthreads[current_thread].s_len = sinfo->s[streamno].buflen;
+	sc->cthreads[current_thread].chunk_end = !newbuf && streamno == sinfo->num_streams - 1;
+	sc->cthreads[current_thread].prime_len = 0;
+	if (primed_stream(control, streamno) && sinfo->s[streamno].buflen) {
+		struct stream *st = &sinfo->s[streamno];
+
+		/* The block gets a copy of the end of the stream before it */
+		if (st->tail_len) {
+			sc->cthreads[current_thread].prime = alloc_buf(control, st->tail_len);
+			if (unlikely(!sc->cthreads[current_thread].prime))
+				failure("Unable to malloc preset dictionary in clear_buffer\n");
+			memcpy(sc->cthreads[current_thread].prime, st->tail, st->tail_len);
+			sc->cthreads[current_thread].prime_len = st->tail_len;
+		}
+		if (unlikely(!keep_tail(control, st, st->buf, st->buflen)))
+			failure("Unable to keep preset dictionary in clear_buffer\n");
+	}
 
 	print_maxverbose("Starting thread %d to compress %lld bytes from stream %d\n",
-			 current_thread, cthreads[current_thread].s_len, streamno);
+			 current_thread, sc->cthreads[current_thread].s_len, streamno);
 
 	s = malloc(sizeof(stream_thread_struct));
 	if (unlikely(!s)) {
-		cksem_post(control, &cthreads[current_thread].cksem);
+		cksem_post(control, &sc->cthreads[current_thread].cksem);
 		failure("Unable to malloc in clear_buffer");
 	}
 	s->i = current_thread;
 	s->control = control;
-	if (unlikely((!create_pthread(control, &threads[current_thread], NULL, compthread, s)) ||
-	             (!detach_pthread(control, &threads[current_thread]))))
-		failure("Unable to create compthread in clear_buffer");
+	if (unlikely(!pool_submit(control, compthread, s)))
+		failure("Unable to queue compthread in clear_buffer");
 
 	if (newbuf) {
 		/* The stream buffer has been given to the thread, allocate a
 		 * new one. */
-		sinfo->s[streamno].buf = malloc(sinfo->bufsize);
+		sinfo->s[streamno].buf = alloc_buf(control, sinfo->bufsize);
 		if (unlikely(!sinfo->s[streamno].buf))
 			failure("Unable to malloc buffer of size %lld in flush_buffer\n", sinfo->bufsize);
 		sinfo->s[streamno].buflen = 0;
@@ -1650,6 +4082,7 @@ static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int s
 
 	if (++current_thread == control->threads)
 		current_thread = 0;
+	sc->next_thread = current_thread;
 }
 
 /* flush out any data in a stream buffer */
@@ -1662,172 +4095,164 @@ static void *ucompthread(void *data)
 {
 	stream_thread_struct *sts = data;
 	rzip_control *control = sts->control;
+	struct stream_ctx *sc = control->sctx;
 	int waited = 0, ret = 0, current_thread = sts->i;
-	struct uncomp_thread *uci = &sts->sinfo->ucthreads[current_thread];
+	struct stream_info *sinfo = sts->sinfo;
+	struct uncomp_thread *uci = &sinfo->ucthreads[current_thread];
+	bool passed = false;
+	struct stats_mark start;
 
 	dealloc(data);
+	mark_stats(control, &start);
 
 	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
 		print_err("Warning, unable to set thread nice value %d...Resetting to %d\n", control->nice_val, control->current_priority);
 		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
 	}
 
+	// pass decrypt flag
+	if (unlikely(ENCRYPT && !lrz_decrypt(control, uci->s_buf, MAX(uci->c_len, MIN_SIZE), uci->salt, LRZ_DECRYPT)))
+		goto error;
+
 retry:
-	if (uci->c_type != CTYPE_NONE) {
-		switch (uci->c_type) {
-			case CTYPE_LZMA:
-				ret = lzma_decompress_buf(control, uci);
-				break;
-			case CTYPE_LZO:
-				ret = lzo_decompress_buf(control, uci);
-				break;
-			case CTYPE_BZIP2:
-				ret = bzip2_decompress_buf(control, uci);
-				break;
-			case CTYPE_GZIP:
-				ret = gzip_decompress_buf(control, uci);
-				break;
-			case CTYPE_ZPAQ:
-				ret = zpaq_decompress_buf(control, uci, current_thread);
-				break;
-			default:
-				failure_return(("Dunno wtf decompression type to use!\n"), NULL);
-				break;
-		}
-	}
-	if (FILTER_USED && uci->streamno == 1) { // restore unfiltered data, literals only
+	if (remote_decompress(control, uci))
+		ret = 0;
+	else if (uci->c_type == CTYPE_LZMA && uci->ring_len) {
+		ret = lzma_stream_buf(control, sinfo, uci, &start);
+		if (!ret)	/* Already handed over */
+			return NULL;
+	} else if (uci->c_type != CTYPE_NONE)
+		ret = backend_decompress(control, uci, current_thread);
+	if (!ret && uci->filter) { // restore unfiltered data, literals only
 		print_maxverbose("Restoring %s filter data post decompression for thread %d...\n",
-				((control->filter_flag == FILTER_FLAG_X86) ? "x86" :
-				((control->filter_flag == FILTER_FLAG_ARM) ? "ARM" :
-				((control->filter_flag == FILTER_FLAG_ARMT) ? "ARMT" :
-				((control->filter_flag == FILTER_FLAG_PPC) ? "PPC" :
-				((control->filter_flag == FILTER_FLAG_SPARC) ? "SPARC" :
-				((control->filter_flag == FILTER_FLAG_IA64) ? "IA64" :
-				((control->filter_flag == FILTER_FLAG_DELTA) ? "Delta" : "wtf"))))))), current_thread);
-		if (control->filter_flag == FILTER_FLAG_X86) {
-			UInt32 x86State;
-			x86_Convert_Init(x86State);
-			x86_Convert(uci->s_buf, uci->u_len, 0, &x86State, 0);
-		}
-		else if (control->filter_flag == FILTER_FLAG_ARM) {
-			ARM_Convert(uci->s_buf, uci->u_len, 0, 0);
-		}
-		else if (control->filter_flag == FILTER_FLAG_ARMT) {
-			ARMT_Convert(uci->s_buf, uci->u_len, 0, 0);
-		}
-		else if (control->filter_flag == FILTER_FLAG_PPC) {
-			PPC_Convert(uci->s_buf, uci->u_len, 0, 0);
-		}
-		else if (control->filter_flag == FILTER_FLAG_SPARC) {
-			SPARC_Convert(uci->s_buf, uci->u_len, 0, 0);
-		}
-		if (control->filter_flag == FILTER_FLAG_IA64) {
-			IA64_Convert(uci->s_buf, uci->u_len, 0, 0);
-		}
-		if (control->filter_flag == FILTER_FLAG_DELTA) {
-			uchar delta_state[DELTA_STATE_SIZE];
-			Delta_Init(delta_state);
-			Delta_Decode(delta_state, control->delta, uci->s_buf,  uci->u_len);
-		}
+				 filter_name(uci->filter), current_thread);
+		filter_buf(uci->filter, uci->delta, uci->s_buf, uci->u_len, 0);
 	}
 
 	/* As per compression, serialise the decompression if it fails in
 	 * parallel */
 	if (unlikely(ret)) {
 		if (unlikely(waited))
-			failure_return(("Failed to decompress in ucompthread\n"), (void*)1);
+			failure_goto(("Failed to decompress in ucompthread\n"), error);
 		print_maxverbose("Unable to decompress in parallel, waiting for previous thread to complete before trying again\n");
 		/* We do not strictly need to wait for this, so it's used when
 		 * decompression fails due to inadequate memory to try again
 		 * serialised. */
-		lock_mutex(control, &output_lock);
-		while (output_thread != current_thread)
-			cond_wait(control, &output_cond, &output_lock);
-		unlock_mutex(control, &output_lock);
+		lock_mutex(control, &sc->output_lock);
+		while (sc->output_thread != current_thread)
+			cond_wait(control, &sc->output_cond, &sc->output_lock);
+		unlock_mutex(control, &sc->output_lock);
 		waited = 1;
 		goto retry;
 	}
 
+	if (primed_stream(control, uci->streamno)) {
+		passed = true;
+		if (unlikely(!pass_tail(control, &sinfo->s[uci->streamno], uci, uci->s_buf, uci->u_len, NULL, 0)))
+			goto error;
+	}
 	print_maxverbose("Thread %d decompressed %lld bytes from stream %d\n", current_thread, uci->u_len, uci->streamno);
-
+	if (control->stats)
+		stats_block(control, current_thread, uci->c_len, uci->u_len, &start);
+	uci->failed = false;
+	cksem_post(control, &uci->cksem);
+	return NULL;
+error:
+	/* Whatever happened, the blocks after this one must not wait for it */
+	if (primed_stream(control, uci->streamno) && !passed)
+		pass_tail(control, &sinfo->s[uci->streamno], uci, NULL, 0, NULL, 0);
+	uci->failed = true;
+	cksem_post(control, &uci->cksem);
 	return NULL;
 }
 
+/* How much past a block header fill_buffer reads with it */
+#define HEAD_AHEAD	(64 * 1024)
+
 /* fill a buffer from a stream - return -1 on failure */
 static int fill_buffer(rzip_control *control, struct stream_info *sinfo, struct stream *s, int streamno)
 {
-	i64 u_len, c_len, last_head, padded_len, header_length, max_len;
-	uchar enc_head[25 + SALT_LEN], blocksalt[SALT_LEN];
+	struct stream_ctx *sc = control->sctx;
+	i64 u_len, c_len, last_head, padded_len, header_length, head_len, max_len, ring_len, start, got, have;
+	uchar enc_head[25 + SALT_LEN], blocksalt[SALT_LEN] = { 0 }, head[HEAD_AHEAD], *p;
 	struct uncomp_thread *ucthreads = sinfo->ucthreads;
-	pthread_t *threads = control->pthreads;
 	stream_thread_struct *sts;
-	uchar c_type, *s_buf;
-	void *thr_return;
-
-	dealloc(s->buf);
+	uchar c_type, filter, *s_buf;
+	unsigned delta = 0;
+	int ret, read_len;
+
+	if (s->ring) {
+		ret = next_window(control, s);
+		if (ret)
+			return ret < 0 ? -1 : 0;
+	} else
+		free_buf(control, s->buf);
 	if (s->eos)
 		goto out;
 fill_another:
 	if (unlikely(ucthreads[s->uthread_no].busy))
 		failure_return(("Trying to start a busy thread, this shouldn't happen!\n"), -1);
 
-	if (unlikely(read_seekto(control, sinfo, s->last_head)))
+	/* The header with the salts either side of it when encrypted comes in
+	 * one read along with what follows, all of a small block */
+	if (control->major_version == 0 && control->minor_version < 4)
+		read_len = 4;	/* Compatibility crap for versions < 0.4 */
+	else if ((control->major_version == 0 && control->minor_version < 6) || ENCRYPT)
+		read_len = 8;
+	else
+		read_len = sinfo->chunk_bytes;
+	header_length = 1 + (read_len * 3);
+	head_len = header_length + (ENCRYPT ? SALT_LEN * 2 : 0);
+	print_maxverbose("Reading ucomp header at %lld\n", sinfo->initial_pos + s->last_head);
+	got = read_ahead(control, sinfo, s->last_head, head, head_len, HEAD_AHEAD);
+	if (unlikely(got == -1))
 		return -1;
-
+	p = head;
 	if (ENCRYPT) {
-		if (unlikely(read_buf(control, sinfo->fd, enc_head, SALT_LEN)))
-			return -1;
-		sinfo->total_read += SALT_LEN;
-	}
-
-	if (unlikely(read_u8(control, sinfo->fd, &c_type)))
-		return -1;
-
-	/* Compatibility crap for versions < 0.4 */
-	if (control->major_version == 0 && control->minor_version < 4) {
-		u32 c_len32, u_len32, last_head32;
-
-		if (unlikely(read_u32(control, sinfo->fd, &c_len32)))
-			return -1;
-		if (unlikely(read_u32(control, sinfo->fd, &u_len32)))
-			return -1;
-		if (unlikely(read_u32(control, sinfo->fd, &last_head32)))
-			return -1;
-		c_len = c_len32;
-		u_len = u_len32;
-		last_head = last_head32;
-		header_length = 13;
-	} else {
-		int read_len;
-
-		print_maxverbose("Reading ucomp header at %lld\n", get_readseek(control, sinfo->fd));
-		if ((control->major_version == 0 && control->minor_version < 6) || ENCRYPT)
-			read_len = 8;
-		else
-			read_len = sinfo->chunk_bytes;
-		if (unlikely(read_val(control, sinfo->fd, &c_len, read_len)))
-			return -1;
-		if (unlikely(read_val(control, sinfo->fd, &u_len, read_len)))
-			return -1;
-		if (unlikely(read_val(control, sinfo->fd, &last_head, read_len)))
-			return -1;
-		header_length = 1 + (read_len * 3);
+		memcpy(enc_head, p, SALT_LEN);
+		p += SALT_LEN;
 	}
-	sinfo->total_read += header_length;
+	c_type = *p++;
+	/* Still as stored, zero extended, for decrypt_header */
+	c_len = u_len = last_head = 0;
+	memcpy(&c_len, p, read_len);
+	memcpy(&u_len, p + read_len, read_len);
+	memcpy(&last_head, p + read_len * 2, read_len);
+	p += read_len * 3;
+	sinfo->total_read += head_len;
 
 	if (ENCRYPT) {
 		// pass decrypt flag
 		if (unlikely(!decrypt_header(control, enc_head, &c_type, &c_len, &u_len, &last_head, LRZ_DECRYPT)))
 			return -1;
-		if (unlikely(read_buf(control, sinfo->fd, blocksalt, SALT_LEN)))
-			return -1;
-		sinfo->total_read += SALT_LEN;
+		memcpy(blocksalt, p, SALT_LEN);
 	}
 	c_len = le64toh(c_len);
 	u_len = le64toh(u_len);
 	last_head = le64toh(last_head);
+	/* A --streamable header has its stream where the next offset would be,
+	 * which scan_streamed has found already */
+	if (STREAMED) {
+		if (unlikely(last_head != streamno + 1))
+			failure_return(("Block of stream %lld read as stream %d, corrupt archive\n", last_head - 1, streamno), -1);
+		last_head = ++s->head_no < s->nheads ? s->heads[s->head_no] : 0;
+	}
 	print_maxverbose("Fill_buffer stream %d c_len %lld u_len %lld last_head %lld\n", streamno, c_len, u_len, last_head);
 
+	/* --auto-filter keeps the filter of the block with its c_type */
+	filter = BLOCK_FILTER(c_type);
+	c_type &= CTYPE_MASK;
+	if (unlikely(filter && streamno != 1))
+		failure_return(("Unknown filter %d for block of stream %d\n", filter, streamno), -1);
+	if (filter >= BLOCK_DELTA) {
+		delta = delta_strides[filter - BLOCK_DELTA];
+		filter = FILTER_FLAG_DELTA;
+	}
+	if (FILTER_USED && streamno == 1) {
+		filter = control->filter_flag;
+		delta = control->delta;
+	}
+
 	/* It is possible for there to be an empty match block at the end of
 	 * incompressible data */
 	if (unlikely(c_len == 0 && u_len == 0 && streamno == 1 && last_head == 0)) {
@@ -1843,13 +4268,16 @@ fill_another:
 	 * 	stream pointer extending beyond chunk (last_head > sinfo->size)
 	 * 	stream pointer less than last stream pointer (i.e. pointing backwards!)
 	 *	Encrypt check requires slightly different test. Doesn't know sinfo->size yet
+	 *	A chunk stored as it is, like incompressible data, also has the
+	 *	block headers and the match stream ahead of the last literals, and
+	 *	the match records can at worst be as long as the chunk again
 	 */
 	if (ENCRYPT) {
 		if (unlikely(c_len < 1 || u_len < 1 || last_head < 0 || (last_head && (last_head <= s->last_head))))
 			failure_return(("Invalid data compressed len %lld uncompressed %lld last_head %lld chunk size %lld\n",
 			     c_len, u_len, last_head, sinfo->size), false);
 	} else {
-		if (unlikely(c_len < 1 || u_len < 1 || last_head < 0 || last_head > sinfo->size ||
+		if (unlikely(c_len < 1 || u_len < 1 || last_head < 0 || last_head > sinfo->size * 2 + 64 ||
 				(last_head && (last_head <= s->last_head))))
 			failure_return(("Invalid data compressed len %lld uncompressed %lld last_head %lld chunk size %lld\n",
 			     c_len, u_len, last_head, sinfo->size), false);
@@ -1857,33 +4285,49 @@ fill_another:
 
 	padded_len = MAX(c_len, MIN_SIZE);
 	sinfo->total_read += padded_len;
-	fsync(control->fd_out);
-
-	if (unlikely(u_len > control->maxram))
-		print_progress("Warning, attempting to malloc very large buffer for this environment of size %lld\n", u_len);
-	max_len = MAX(u_len, MIN_SIZE);
-	max_len = MAX(max_len, c_len);
-	s_buf = malloc(max_len);
-	if (unlikely(!s_buf))
-		fatal_return(("Unable to malloc buffer of size %lld in fill_buffer\n", u_len), -1);
-	sinfo->ram_alloced += u_len;
-
-	if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
-		dealloc(s_buf);
-		return -1;
+	write_back(control, control->fd_out);
+	/* Have the kernel fetch the next block of the stream while this one
+	 * decompresses, guessing it is as long as this one */
+	if (last_head && !TMP_INBUF)
+		posix_fadvise(sinfo->fd, sinfo->initial_pos + last_head, head_len + padded_len, POSIX_FADV_WILLNEED);
+
+	/* LZMA blocks are read as they decode through a ring, unless the
+	 * whole block is needed for the filter */
+	if (c_type == CTYPE_LZMA && !filter) {
+		ring_len = lzma_ring_len(control, u_len, streamno);
+		max_len = padded_len;
+	} else {
+		ring_len = 0;
+		if (unlikely(u_len > unzip_budget(control)))
+			print_progress("Warning, attempting to malloc very large buffer for this environment of size %lld\n", u_len);
+		max_len = MAX(u_len, MIN_SIZE);
+		max_len = MAX(max_len, c_len);
 	}
-
-	// pass decrypt flag
-	if (unlikely(ENCRYPT && !lrz_decrypt(control, s_buf, padded_len, blocksalt, LRZ_DECRYPT))) {
-		dealloc(s_buf);
+	s_buf = alloc_buf(control, max_len);
+	if (unlikely(!s_buf))
+		fatal_return(("Unable to malloc buffer of size %lld in fill_buffer\n", max_len), -1);
+	sinfo->ram_alloced += ring_len ? ring_len : u_len;
+
+	/* Start with what came with the header and read the rest */
+	have = MIN(got - head_len, padded_len);
+	memcpy(s_buf, head + head_len, have);
+	if (have < padded_len && unlikely(read_ahead(control, sinfo, s->last_head + head_len + have, s_buf + have,
+						     padded_len - have, padded_len - have) == -1)) {
+		free_buf(control, s_buf);
 		return -1;
 	}
 
+	if (ENCRYPT)
+		memcpy(ucthreads[s->uthread_no].salt, blocksalt, SALT_LEN);
 	ucthreads[s->uthread_no].s_buf = s_buf;
 	ucthreads[s->uthread_no].c_len = c_len;
 	ucthreads[s->uthread_no].u_len = u_len;
 	ucthreads[s->uthread_no].c_type = c_type;
+	ucthreads[s->uthread_no].filter = filter;
+	ucthreads[s->uthread_no].delta = delta;
 	ucthreads[s->uthread_no].streamno = streamno;
+	ucthreads[s->uthread_no].ring_len = ring_len;
+	ucthreads[s->uthread_no].seq = s->blocks++;
 	s->last_head = last_head;
 
 	/* List this thread as busy */
@@ -1897,7 +4341,7 @@ fill_another:
 	sts->i = s->uthread_no;
 	sts->control = control;
 	sts->sinfo = sinfo;
-	if (unlikely(!create_pthread(control, &threads[s->uthread_no], NULL, ucompthread, sts))) {
+	if (unlikely(!pool_submit(control, ucompthread, sts))) {
 		dealloc(sts);
 		return -1;
 	}
@@ -1912,18 +4356,39 @@ skip_empty:
 	if (!last_head)
 		s->eos = 1;
 	else if (s->uthread_no != s->unext_thread && !ucthreads[s->uthread_no].busy &&
-		 sinfo->ram_alloced < control->maxram)
+		 sinfo->ram_alloced < unzip_budget(control))
 			goto fill_another;
 out:
-	lock_mutex(control, &output_lock);
-	output_thread = s->unext_thread;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
-
-	/* join_pthread here will make it wait till the data is ready */
-	thr_return = NULL;
-	if (unlikely(!join_pthread(control, threads[s->unext_thread], &thr_return) || !!thr_return))
+	/* Every block of the stream has been read out, as only --transcode
+	 * finds out by reading on */
+	if (!ucthreads[s->unext_thread].busy) {
+		s->buf = NULL;
+		s->buflen = s->bufp = 0;
+		return 0;
+	}
+	lock_mutex(control, &sc->output_lock);
+	sc->output_thread = s->unext_thread;
+	cond_broadcast(control, &sc->output_cond);
+	unlock_mutex(control, &sc->output_lock);
+
+	/* Wait till the data is ready */
+	start = stats_start(control);
+	cksem_wait(control, &ucthreads[s->unext_thread].cksem);
+	stats_since(control, backend_wait_usecs, start);
+	if (unlikely(ucthreads[s->unext_thread].failed))
 		return -1;
+
+	if (ucthreads[s->unext_thread].ring_len) {
+		/* The slot stays busy until the block is read out */
+		print_maxverbose("Reading data from thread %ld as it decompresses\n", s->unext_thread);
+		s->ring = &ucthreads[s->unext_thread];
+		s->buf = NULL;
+		s->buflen = s->bufp = 0;
+		sinfo->ram_alloced -= s->ring->ring_len;
+		if (++s->unext_thread == s->base_thread + s->total_threads)
+			s->unext_thread = s->base_thread;
+		return next_window(control, s) < 0 ? -1 : 0;
+	}
 	ucthreads[s->unext_thread].busy = 0;
 
 	print_maxverbose("Taking decompressed data from thread %ld\n", s->unext_thread);
@@ -1947,16 +4412,19 @@ void write_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 l
 	while (len) {
 		i64 n;
 
+		/* Flush the buffer every sinfo->bufsize into one thread. A full
+		 * buffer waits for more data, as one flushed at the very end
+		 * of the chunk would leave close_stream_out an empty block that
+		 * decompression never reads past */
+		if (sinfo->s[streamno].buflen == sinfo->bufsize)
+			flush_buffer(control, sinfo, streamno);
+
 		n = MIN(sinfo->bufsize - sinfo->s[streamno].buflen, len);
 
 		memcpy(sinfo->s[streamno].buf + sinfo->s[streamno].buflen, p, n);
 		sinfo->s[streamno].buflen += n;
 		p += n;
 		len -= n;
-
-		/* Flush the buffer every sinfo->bufsize into one thread */
-		if (sinfo->s[streamno].buflen == sinfo->bufsize)
-			flush_buffer(control, sinfo, streamno);
 	}
 }
 
@@ -1994,29 +4462,41 @@ i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len
 	return ret;
 }
 
+/* Point p at up to len bytes of a stream without copying them. They stay
+ * valid until the next read from the same stream. Returns the number of
+ * bytes available, 0 at the end of the stream or -1 on failure */
+i64 peek_stream(rzip_control *control, void *ss, int streamno, uchar **p, i64 len)
+{
+	struct stream_info *sinfo = ss;
+	struct stream *s = &sinfo->s[streamno];
+	i64 n;
+
+	if (len && s->bufp == s->buflen) {
+		if (unlikely(fill_buffer(control, sinfo, s, streamno)))
+			return -1;
+	}
+	n = MIN(s->buflen - s->bufp, len);
+	if (n > 0) {
+		if (unlikely(!s->buf))
+			failure_return(("Stream ran out prematurely, likely corrupt archive\n"), -1);
+		*p = s->buf + s->bufp;
+		s->bufp += n;
+	}
+	return n;
+}
+
 /* flush and close down a stream. return -1 on failure */
 int close_stream_out(rzip_control *control, void *ss)
 {
 	struct stream_info *sinfo = ss;
 	int i;
 
-	for (i = 0; i < sinfo->num_streams; i++)
+	/* The last block of the last stream encrypts the final headers once
+	 * written, so there is no need to wait for the threads here and the
+	 * next chunk can be searched while this one is still compressing. */
+	for (i = 0; i < sinfo->num_streams; i++) {
 		clear_buffer(control, sinfo, i, 0);
-
-	if (ENCRYPT) {
-		/* Last two compressed blocks do not have an offset written
-		 * to them so we have to go back and encrypt them now, but we
-		 * must wait till the threads return. */
-		int close_thread = output_thread;
-
-		for (i = 0; i < control->threads; i++) {
-			cksem_wait(control, &cthreads[close_thread].cksem);
-			cksem_post(control, &cthreads[close_thread].cksem);
-			if (++close_thread == control->threads)
-				close_thread = 0;
-		}
-		for (i = 0; i < sinfo->num_streams; i++)
-			rewrite_encrypted(control, sinfo, sinfo->s[i].last_headofs);
+		free_buf(control, sinfo->s[i].tail);
 	}
 
 	/* Note that sinfo->s and sinfo are not released here but after compression
@@ -2035,7 +4515,6 @@ static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
 	if (unlikely(!node))
 		failure("Failed to calloc struct node in add_rulist\n");
 	node->sinfo = sinfo;
-	node->pthreads = control->pthreads;
 	node->prev = control->rulist;
 	control->ruhead = node;
 }
@@ -2043,6 +4522,7 @@ static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
 /* close down an input stream */
 int close_stream_in(rzip_control *control, void *ss)
 {
+	struct stream_ctx *sc = control->sctx;
 	struct stream_info *sinfo = ss;
 	int i;
 
@@ -2051,11 +4531,19 @@ int close_stream_in(rzip_control *control, void *ss)
 			 sinfo->initial_pos + sinfo->total_read);
 	if (unlikely(read_seekto(control, sinfo, sinfo->total_read)))
 		return -1;
+	if (control->stats)
+		stats_io(control, sinfo->total_read, 0);
 
-	for (i = 0; i < sinfo->num_streams; i++)
-		dealloc(sinfo->s[i].buf);
+	for (i = 0; i < sinfo->num_streams; i++) {
+		if (sinfo->s[i].ring)
+			end_ring(control, &sinfo->s[i]);
+		else
+			free_buf(control, sinfo->s[i].buf);
+		free_buf(control, sinfo->s[i].tail);
+		dealloc(sinfo->s[i].heads);
+	}
 
-	output_thread = 0;
+	sc->output_thread = 0;
 	/* We cannot safely release the sinfo and pthread data here till all
 	 * threads are shut down. */
 	add_to_rulist(control, sinfo);
@@ -2063,62 +4551,68 @@ int close_stream_in(rzip_control *control, void *ss)
 	return 0;
 }
 
+/* lz4_compresses once per block, shared by --adaptive and the backends */
+static int block_compresses(rzip_control *control, struct compress_thread *cthread)
+{
+	if (cthread->lz4_pct < 0)
+		cthread->lz4_pct = lz4_compresses(control, cthread);
+	return cthread->lz4_pct;
+}
+
+/* Estimate compressibility from LZ4_SAMPLES slices spread over the buffer
+ * instead of compressing ever larger parts of it. The slices are visited in
+ * bit reversed order, so the first LZ4_EARLY of them already cover the whole
+ * buffer and if none of those shrink at all, the buffer is given up on. Short
+ * buffers are tested whole. The scratch buffer stays with the thread slot */
+#define LZ4_SAMPLES	16
+#define LZ4_SLICE	(64 * 1024)
+#define LZ4_EARLY	4
+
 /* As others are slow and lz4 very fast, it is worth doing a quick lz4 pass
    to see if there is any compression at all with lz4 first. It is unlikely
    that others will be able to compress if lz4 is unable to drop a single byte
    so do not compress any block that is incompressible by lz4. */
-static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
-{
-	int in_len, d_len, buftest_size, test_len = s_len;
-	char *c_buf = NULL, *test_buf = (char *)s_buf;
-	/* set minimum buffer test size based on the length of the test stream */
-	double pct = 101;	/* set to failure */
-	int return_value;
-	int workcounter = 0;	/* count # of passes */
-	int lz4_ret;
-
-	in_len = MIN(test_len, STREAM_BUFSIZE); // Set min of s_len or 10MB
-	buftest_size = in_len;
-	d_len = in_len+1;
-
-	c_buf = malloc(d_len);
-	if (unlikely(!c_buf))
-		fatal_return(("Unable to allocate c_buf in lz4_compresses\n"), 0);
-
-	/* Test progressively larger blocks at a time and as soon as anything
-	   compressible is found, including with Threshold, jump out as a success */
-	while (test_len > 0) {
-		workcounter++;
-		lz4_ret = LZ4_compress_default((const char *)test_buf, c_buf, in_len, d_len);
-
-		/* Apply threshold limit if applicable */
-		if (lz4_ret > 0) {
-			pct = 100 * ((double) lz4_ret / (double) in_len);
-			if (lz4_ret < in_len * ((double) control->threshold / 100))
-				break;
-		}
+static int lz4_compresses(rzip_control *control, struct compress_thread *cthread)
+{
+	static const uchar order[LZ4_SAMPLES] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+	i64 s_len = cthread->s_len, stride, in_total = 0, c_total = 0;
+	int samples, slice, i, lz4_ret, return_value;
+	double pct;
+
+	if (s_len <= LZ4_SAMPLES * LZ4_SLICE) {
+		samples = 1;
+		slice = s_len;
+	} else {
+		samples = LZ4_SAMPLES;
+		slice = LZ4_SLICE;
+	}
+	stride = s_len / samples;
+
+	if (!cthread->lz4_buf) {
+		cthread->lz4_buf = malloc(LZ4_SAMPLES * LZ4_SLICE);
+		if (unlikely(!cthread->lz4_buf))
+			fatal_return(("Unable to allocate lz4_buf in lz4_compresses\n"), 0);
+	}
+
+	for (i = 0; i < samples; i++) {
+		const char *sample = (const char *)cthread->s_buf + order[i] * stride;
 
-		/* expand and move buffer */
-		test_len -= in_len;
-		if (test_len > 0) {
-			// No. Don't move ptr. Just increase length tested
-			buftest_size += in_len;
-			if (buftest_size < STREAM_BUFSIZE)
-				buftest_size <<= 1;
-			in_len = MIN(test_len, buftest_size);
-			d_len = in_len+1;		// Make sure dlen is increased as buffer test does
-			c_buf = realloc(c_buf, d_len);
-			if (unlikely(!c_buf))
-				fatal_return(("Unable to reallocate c_buf in lz4_compresses\n"), 0);
+		/* Output no smaller than the input fails fast, and counts as is */
+		lz4_ret = LZ4_compress_default(sample, cthread->lz4_buf, slice, slice);
+		in_total += slice;
+		c_total += lz4_ret > 0 ? lz4_ret : slice;
+		if (i + 1 == LZ4_EARLY && c_total >= in_total) {
+			i++;
+			break;
 		}
 	}
+
+	pct = 100 * ((double) c_total / (double) in_total);
 	/* if pct >0 and <1 round up so return value won't show failed */
-	return_value = (int) (pct > control->threshold ? 0 : pct < 1 ? pct+1 : pct);
-	print_maxverbose("lz4 testing %s for chunk %ld. Compressed size = %5.2F%% of test size %d, %d Passes\n",
+	return_value = (int) (c_total >= in_total || pct > control->threshold ? 0 : pct < 1 ? pct+1 : pct);
+	print_maxverbose("lz4 testing %s for chunk %ld. Compressed size = %5.2F%% of test size %lld, %d Samples\n",
 			(return_value > 0 ? "OK" : "FAILED"), s_len,
-			pct, buftest_size, workcounter);
-
-	dealloc(c_buf);
+			pct, in_total, i);
 
 	return return_value;
 }
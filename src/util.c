@@ -62,6 +62,173 @@
 #define isparameter( parmstring, value )	(!strcasecmp( parmstring, value ))
 #define iscaseparameter( parmvalue, value )	(!strcmp( parmvalue, value ))
 
+/* Indexed by the hash type byte of the magic header. SHA256 is fastest on
+ * CPUs with SHA extensions, BLAKE2b on anything 64 bit without them. */
+const struct hash_type hash_types[] = {
+	[0]			= { "CRC32",		0,			0 },
+	[HASH_TYPE_MD5]		= { "MD5",		GCRY_MD_MD5,		MD5_DIGEST_SIZE },
+	[HASH_TYPE_SHA256]	= { "SHA256",		GCRY_MD_SHA256,		32 },
+	[HASH_TYPE_BLAKE2B]	= { "BLAKE2b-256",	GCRY_MD_BLAKE2B_256,	32 },
+};
+
+/* Select the hash stored on compression by name, md5, sha256 or blake2b */
+bool set_hash_type(rzip_control *control, const char *name)
+{
+	if (isparameter(name, "md5"))
+		control->hash_type = HASH_TYPE_MD5;
+	else if (isparameter(name, "sha256"))
+		control->hash_type = HASH_TYPE_SHA256;
+	else if (isparameter(name, "blake2b"))
+		control->hash_type = HASH_TYPE_BLAKE2B;
+	else
+		return false;
+	return true;
+}
+
+/* Select the write back policy by name, none, background, drop or block */
+bool set_sync_mode(rzip_control *control, const char *name)
+{
+	if (isparameter(name, "none"))
+		control->sync_mode = SYNC_NONE;
+	else if (isparameter(name, "background"))
+		control->sync_mode = SYNC_BACKGROUND;
+	else if (isparameter(name, "drop"))
+		control->sync_mode = SYNC_DROP;
+	else if (isparameter(name, "block"))
+		control->sync_mode = SYNC_BLOCK;
+	else
+		return false;
+	return true;
+}
+
+/* Select a backend of its own for the match stream, stream 0, as
+ * method[:level] with the methods of COMPRESSIONMETHOD */
+bool set_stream0(rzip_control *control, const char *arg)
+{
+	char name[8], *endptr;
+	size_t len = strcspn(arg, ":");
+	long level = 0;
+
+	if (len >= sizeof(name))
+		return false;
+	memcpy(name, arg, len);
+	name[len] = '\0';
+	if (arg[len]) {
+		level = strtol(arg + len + 1, &endptr, 10);
+		if (*endptr || level < 1 || level > 9)
+			return false;
+	}
+	if (isparameter(name, "rzip"))
+		control->stream0_ctype = CTYPE_NONE;
+	else if (isparameter(name, "lzo"))
+		control->stream0_ctype = CTYPE_LZO;
+	else if (isparameter(name, "gzip"))
+		control->stream0_ctype = CTYPE_GZIP;
+	else if (isparameter(name, "bzip2"))
+		control->stream0_ctype = CTYPE_BZIP2;
+	else if (isparameter(name, "lzma"))
+		control->stream0_ctype = CTYPE_LZMA;
+	else if (isparameter(name, "zpaq"))
+		control->stream0_ctype = CTYPE_ZPAQ;
+	else if (isparameter(name, "zstd"))
+		control->stream0_ctype = CTYPE_ZSTD;
+	else
+		return false;
+	control->stream0_level = level;
+	return true;
+}
+
+/* --rzip-table mb[:freq[:chain]] overriding the rzip level's hash table size
+ * in MB, initial_freq and max_chain_len. An empty or 0 field keeps the
+ * level's own */
+bool set_rzip_table(rzip_control *control, const char *arg)
+{
+	long val[3] = { 0, 0, 0 };
+	char *endptr;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (*arg && *arg != ':') {
+			val[i] = strtol(arg, &endptr, 10);
+			if (val[i] < 0 || (*endptr && *endptr != ':'))
+				return false;
+			arg = endptr;
+		}
+		if (!*arg)
+			break;
+		if (i == 2)
+			return false;
+		arg++;
+	}
+	if (val[0] > (8L << 10) || val[1] > 16 || val[2] > 1024)
+		return false;
+	control->hash_mb = val[0];
+	control->hash_freq = val[1];
+	control->chain_len = val[2];
+	return true;
+}
+
+/* --preset-dict size in KB, a power of 2, or the default with no size */
+bool set_preset_dict(rzip_control *control, const char *arg)
+{
+	char *endptr;
+	long size = PRESET_DICT_SIZE;
+
+	if (arg) {
+		size = strtol(arg, &endptr, 10) << 10;
+		if (*endptr || size < PRESET_DICT_MIN || size > PRESET_DICT_MAX || (size & (size - 1)))
+			return false;
+	}
+	control->preset_dict = size;
+	return true;
+}
+
+/* zstd level used for compression levels 1-9 */
+int zstd_level(int level)
+{
+	static const int zstd_levels[] = { 1, 3, 5, 8, 11, 13, 15, 17, 19 };
+
+	return zstd_levels[MAX(MIN(level, 9), 1) - 1];
+}
+
+/* Map the --reference file matches may point back into, read only and
+ * shared so repeated runs on the same reference come from the page cache */
+bool map_reference(rzip_control *control)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(control->reference, O_RDONLY);
+	if (unlikely(fd == -1))
+		fatal_return(("Failed to open reference file %s\n", control->reference), false);
+	if (unlikely(fstat(fd, &st))) {
+		close(fd);
+		fatal_return(("Failed to stat reference file %s\n", control->reference), false);
+	}
+	control->ref_len = st.st_size;
+	if (!control->ref_len) {
+		close(fd);
+		print_verbose("Reference file %s is empty\n", control->reference);
+		return true;
+	}
+	control->ref_buf = mmap(NULL, control->ref_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (unlikely(control->ref_buf == MAP_FAILED)) {
+		control->ref_buf = NULL;
+		fatal_return(("Failed to mmap reference file %s\n", control->reference), false);
+	}
+	print_verbose("Reference file %s: %lld bytes\n", control->reference, control->ref_len);
+	return true;
+}
+
+void unmap_reference(rzip_control *control)
+{
+	if (control->ref_buf)
+		munmap(control->ref_buf, control->ref_len);
+	control->ref_buf = NULL;
+	control->ref_len = 0;
+}
+
 void register_infile(rzip_control *control, const char *name, char delete)
 {
 	control->util_infile = name;
@@ -89,15 +256,9 @@ void unlink_files(rzip_control *control)
 		unlink(control->util_infile);
 }
 
-void fatal_exit(rzip_control *control)
+/* Remove what a run on control that did not finish leaves behind */
+void remove_broken(rzip_control *control)
 {
-	struct termios termios_p;
-
-	/* Make sure we haven't died after disabling stdin echo */
-	tcgetattr(fileno(stdin), &termios_p);
-	termios_p.c_lflag |= ECHO;
-	tcsetattr(fileno(stdin), 0, &termios_p);
-
 	unlink_files(control);
 	if (!STDOUT && !TEST_ONLY && control->outfile) {
 		if (!KEEP_BROKEN) {
@@ -106,6 +267,18 @@ void fatal_exit(rzip_control *control)
 		} else
 			print_verbose("Keeping broken file %s as requested\n", control->outfile);
 	}
+}
+
+void fatal_exit(rzip_control *control)
+{
+	struct termios termios_p;
+
+	/* Make sure we haven't died after disabling stdin echo */
+	tcgetattr(fileno(stdin), &termios_p);
+	termios_p.c_lflag |= ECHO;
+	tcsetattr(fileno(stdin), 0, &termios_p);
+
+	remove_broken(control);
 	fprintf(control->outputfile, "Fatal error - exiting\n");
 	fflush(control->outputfile);
 	exit(1);
@@ -115,8 +288,8 @@ void setup_overhead(rzip_control *control)
 {
 	/* Work out the compression overhead per compression thread for the
 	 * compression back-ends that need a lot of ram
-	 * and set Dictionary size */
-	if (LZMA_COMPRESS) {
+	 * and set Dictionary size. zstd uses the same sizes for its window */
+	if (LZMA_COMPRESS || ZSTD_COMPRESS) {
 		if (control->dictSize == 0) {
 			switch (control->compression_level) {
 			case 1:
@@ -136,9 +309,23 @@ void setup_overhead(rzip_control *control)
 				break; // 16MB -- should never reach here
 			}
 		}
-		/* LZMA spec shows memory requirements as 6MB, not 4MB and state size
-		 * where default is 16KB */
-		control->overhead = ((i64)control->dictSize * 23 / 2) + (6 * 1024 * 1024) + 16384;
+		if (LZMA_COMPRESS) {
+			/* LZMA spec shows memory requirements as 6MB, not 4MB and state size
+			 * where default is 16KB */
+			control->overhead = ((i64)control->dictSize * 23 / 2) + (6 * 1024 * 1024) + 16384;
+		} else {
+			/* MB the hash and chain tables of the zstd level take on
+			 * large blocks. The block is compressed in place so the
+			 * window itself costs nothing, only the long distance
+			 * matcher of levels 8 and 9 grows with it */
+			static const int zstd_tables[] = { 1, 1, 2, 12, 24, 32, 48, 64, 80 };
+			int level = MAX(MIN(control->compression_level, 9), 1) - 1;
+
+			control->zstd_level = zstd_level(control->compression_level);
+			control->overhead = ((i64)zstd_tables[level] << 20) + (4 * 1024 * 1024);
+			if (level >= 7)
+				control->overhead += control->dictSize / 16;
+		}
 	} else if (ZPAQ_COMPRESS) {
 		if (control->zpaq_bs == 0) {
 			control->zpaq_level = control->compression_level /4 + 3;	/* only use levels 3,4 and 5 */
@@ -168,8 +355,9 @@ void setup_overhead(rzip_control *control)
 
 void setup_ram(rzip_control *control)
 {
-	/* Use less ram when using STDOUT to store the temporary output file. */
-	if (STDOUT && ((STDIN && DECOMPRESS) || !(DECOMPRESS || TEST_ONLY)))
+	/* Use less ram when using STDOUT to store the temporary output file,
+	 * which a --streamable archive does not need. */
+	if (STDOUT && ((STDIN && DECOMPRESS) || !(DECOMPRESS || TEST_ONLY || STREAMED)))
 		control->maxram = control->ramsize / 6;
 	else
 		control->maxram = control->ramsize / 3;
@@ -289,7 +477,7 @@ bool read_config(rzip_control *control)
 				failure_return(("CONF.FILE error. RZIP Compression Level must between 1 and 9"), false);
 		}
 		else if (isparameter(parameter, "compressionmethod")) {
-			/* valid are rzip, gzip, bzip2, lzo, lzma (default), and zpaq */
+			/* valid are rzip, gzip, bzip2, lzo, lzma (default), zpaq and zstd */
 			if (control->flags & FLAG_NOT_LZMA)
 				failure_return(("CONF.FILE error. Can only specify one compression method"), false);
 			if (isparameter(parametervalue, "bzip2"))
@@ -302,6 +490,8 @@ bool read_config(rzip_control *control)
 				control->flags |= FLAG_NO_COMPRESS;
 			else if (isparameter(parametervalue, "zpaq"))
 				control->flags |= FLAG_ZPAQ_COMPRESS;
+			else if (isparameter(parametervalue, "zstd"))
+				control->flags |= FLAG_ZSTD_COMPRESS;
 			else if (!isparameter(parametervalue, "lzma")) /* oops, not lzma! */
 				failure_return(("CONF.FILE error. Invalid compression method %s specified\n",parametervalue), false);
 		}
@@ -316,6 +506,24 @@ bool read_config(rzip_control *control)
 			if (control->threshold < 1 || control->threshold > 99)
 				failure_return(("CONF.FILE error. LZO Threshold must be between 1 and 99"), false);
 		}
+		else if (isparameter(parameter, "adaptive")) {
+			/* yes, no or the lz4 target 1-99 */
+			if (isparameter(parametervalue, "yes"))
+				control->flags |= FLAG_ADAPTIVE;
+			else if (!isparameter(parametervalue, "no")) {
+				control->adaptive = atoi(parametervalue);
+				if (control->adaptive < 1 || control->adaptive > 99)
+					failure_return(("CONF.FILE error. Adaptive must be yes, no or a target between 1 and 99"), false);
+				control->flags |= FLAG_ADAPTIVE;
+			}
+		}
+		else if (isparameter(parameter, "presetdict")) {
+			/* yes, no or the size in KB */
+			if (isparameter(parametervalue, "no"))
+				control->preset_dict = 0;
+			else if (!set_preset_dict(control, isparameter(parametervalue, "yes") ? NULL : parametervalue))
+				failure_return(("CONF.FILE error. Presetdict must be yes, no or a power of 2 from 64 to 4096"), false);
+		}
 		else if (isparameter(parameter, "hashcheck")) {
 			if (isparameter(parametervalue, "yes")) {
 				control->flags |= FLAG_CHECK;
@@ -326,6 +534,26 @@ bool read_config(rzip_control *control)
 			if (isparameter(parametervalue, "yes"))
 				control->flags |= FLAG_HASH;
 		}
+		else if (isparameter(parameter, "hashtype")) {
+			if (!set_hash_type(control, parametervalue))
+				failure_return(("CONF FILE error. Hash type must be MD5, SHA256 or BLAKE2B."), false);
+		}
+		else if (isparameter(parameter, "rziptable")) {
+			if (!set_rzip_table(control, parametervalue))
+				failure_return(("CONF FILE error. Rziptable must be MB[:FREQ[:CHAIN]]."), false);
+		}
+		else if (isparameter(parameter, "rziptune")) {
+			if (isparameter(parametervalue, "yes"))
+				control->rzip_tune = true;
+		}
+		else if (isparameter(parameter, "stream0")) {
+			if (!set_stream0(control, parametervalue))
+				failure_return(("CONF FILE error. Stream0 must be a compression method, optionally followed by :level 1-9."), false);
+		}
+		else if (isparameter(parameter, "sync")) {
+			if (!set_sync_mode(control, parametervalue))
+				failure_return(("CONF FILE error. Sync must be NONE, BACKGROUND, DROP or BLOCK."), false);
+		}
 		else if (isparameter(parameter, "outputdirectory")) {
 			control->outdir = malloc(strlen(parametervalue) + 2);
 			if (!control->outdir)
@@ -0,0 +1,218 @@
+/*
+   Copyright (C) 2026 The lrzip-next contributors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* make check: round trips through liblrzip-next using nothing but its
+ * installed header, as a program linking it would */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lrzip_next.h"
+
+#define CORPUS_LEN	(3 * 1024 * 1024)
+/* Pieces the stream test feeds, not a divisor of anything */
+#define FEED_LEN	100003
+
+struct sink {
+	unsigned char *buf;
+	int64_t len, alloc;
+};
+
+static int failed;
+
+#define check(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL line %d: ", __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failed = 1; \
+	} \
+} while (0)
+
+static bool sink_cb(void *data, const unsigned char *buf, int64_t len)
+{
+	struct sink *s = data;
+
+	if (s->len + len > s->alloc) {
+		unsigned char *p;
+
+		s->alloc = (s->len + len) * 2;
+		p = realloc(s->buf, s->alloc);
+		if (!p)
+			return false;
+		s->buf = p;
+	}
+	memcpy(s->buf + s->len, buf, len);
+	s->len += len;
+	return true;
+}
+
+/* Text like data, words drawn from a small vocabulary */
+static unsigned char *make_corpus(void)
+{
+	static const char *words[] = { "stream", "chunk", "block", "match", "literal", "hash",
+				       "window", "thread", "buffer", "\n" };
+	unsigned char *buf = malloc(CORPUS_LEN);
+	unsigned seed = 42;
+	int64_t len = 0;
+
+	if (!buf)
+		return NULL;
+	while (len < CORPUS_LEN) {
+		const char *w;
+		size_t n;
+
+		seed = seed * 1103515245 + 12345;
+		w = words[(seed >> 16) % 10];
+		n = strlen(w);
+		if (n > (size_t)(CORPUS_LEN - len))
+			n = CORPUS_LEN - len;
+		memcpy(buf + len, w, n);
+		len += n;
+		if (len < CORPUS_LEN)
+			buf[len++] = ' ';
+	}
+	return buf;
+}
+
+static void test_buffer(rzip_control *control, const unsigned char *corpus, const char *method)
+{
+	struct sink arch = { 0 }, out = { 0 };
+	int i;
+
+	check(lrzip_set_method(control, method, 7), "%s: lrzip_set_method", method);
+	/* Nothing of one run may carry over into the next on the same control */
+	for (i = 0; i < 3; i++) {
+		int64_t last = arch.len;
+
+		arch.len = 0;
+		check(compress_buffer(control, corpus, CORPUS_LEN, sink_cb, &arch), "%s: compress_buffer", method);
+		check(!i || arch.len == last, "%s: run %d gave %lld bytes, not %lld",
+		      method, i + 1, (long long)arch.len, (long long)last);
+	}
+	check(arch.len > 0 && arch.len < CORPUS_LEN, "%s: archive of %lld bytes", method, (long long)arch.len);
+	check(decompress_buffer(control, arch.buf, arch.len, sink_cb, &out), "%s: decompress_buffer", method);
+	check(out.len == CORPUS_LEN && !memcmp(out.buf, corpus, CORPUS_LEN),
+	      "%s: decompressed %lld bytes differ", method, (long long)out.len);
+	free(arch.buf);
+	free(out.buf);
+}
+
+struct feed {
+	struct lrz_stream *ls;
+	const unsigned char *buf;
+	int64_t len;
+	bool flush, ret;
+};
+
+/* Feeds the stream while main reads it, with a flush half way */
+static void *feed_thread(void *data)
+{
+	struct feed *f = data;
+	int64_t ofs, n;
+
+	f->ret = true;
+	for (ofs = 0; ofs < f->len && f->ret; ofs += n) {
+		n = f->len - ofs < FEED_LEN ? f->len - ofs : FEED_LEN;
+		f->ret = lrz_stream_feed(f->ls, f->buf + ofs, n);
+		if (f->flush && ofs < f->len / 2 && ofs + n >= f->len / 2)
+			f->ret = f->ret && lrz_stream_flush(f->ls);
+	}
+	f->ret = f->ret && lrz_stream_finish(f->ls);
+	return NULL;
+}
+
+/* Run buf through ls from a feeding thread into s */
+static bool run_stream(struct lrz_stream *ls, const unsigned char *buf, int64_t len, bool flush,
+		       struct sink *s)
+{
+	struct feed f = { ls, buf, len, flush, false };
+	unsigned char out[65536];
+	pthread_t thread;
+	int64_t n;
+	bool ret;
+
+	if (!ls || pthread_create(&thread, NULL, feed_thread, &f))
+		return false;
+	while ((n = lrz_stream_read(ls, out, sizeof(out))) > 0)
+		sink_cb(s, out, n);
+	pthread_join(thread, NULL);
+	ret = lrz_stream_end(ls);
+	return ret && n == 0 && f.ret;
+}
+
+static void test_stream(rzip_control *control, const unsigned char *corpus)
+{
+	struct sink arch = { 0 }, out = { 0 };
+
+	check(lrzip_set_method(control, "lzma", 7), "stream: lrzip_set_method");
+	check(run_stream(compress_stream_init(control), corpus, CORPUS_LEN, true, &arch),
+	      "stream: compressing");
+	check(arch.len > 0 && arch.len < CORPUS_LEN, "stream: archive of %lld bytes", (long long)arch.len);
+	check(run_stream(decompress_stream_init(control), arch.buf, arch.len, false, &out),
+	      "stream: decompressing");
+	check(out.len == CORPUS_LEN && !memcmp(out.buf, corpus, CORPUS_LEN),
+	      "stream: decompressed %lld bytes differ", (long long)out.len);
+	free(arch.buf);
+	free(out.buf);
+}
+
+int main(void)
+{
+	unsigned char *corpus = make_corpus();
+	rzip_control *control;
+	long err_len;
+	FILE *err;
+
+	if (!corpus)
+		return 1;
+	/* Whatever the library prints goes here, and it should print nothing */
+	err = freopen("apitest.err", "w+", stderr);
+	if (!err)
+		return 1;
+	/* No CrcGenerateTable or anything else first */
+	control = lrzip_new();
+	check(control, "lrzip_new");
+	if (!control)
+		return 1;
+	check(lrzip_set_threads(control, 2), "lrzip_set_threads");
+	test_buffer(control, corpus, "lzma");
+	test_buffer(control, corpus, "bzip2");
+	test_buffer(control, corpus, "gzip");
+	test_stream(control, corpus);
+	/* and the buffer calls still work after a stream */
+	test_buffer(control, corpus, "lzma");
+	fflush(err);
+	err_len = ftell(err);
+	/* This one prints why */
+	check(!lrzip_set_method(control, "lz77", 7), "unknown method accepted");
+	lrzip_free(control);
+
+	if (err_len) {
+		char line[256];
+
+		printf("FAIL: messages from the library:\n");
+		rewind(err);
+		while (fgets(line, sizeof(line), err))
+			printf("%s", line);
+		failed = 1;
+	}
+	fclose(err);
+	free(corpus);
+	return failed;
+}
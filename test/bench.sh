@@ -0,0 +1,115 @@
+#!/bin/sh
+# lrzip-next benchmarks, run by make bench
+#
+# Runs the lrzip-bench stage benchmarks, then the command line over the same
+# generated corpus, compressing and decompressing each file with each method.
+# Results go to $BENCH_OUT as CSV (or JSON) so two trees can be compared:
+#   micro.csv	hash_search, runzip, backends, crc32 and md5 on their own
+#   cli.csv	whole runs of the command line, with peak RSS when GNU time is
+#		installed
+#   profile.json	the --profile=json line of every command line run
+#
+# Settings, from the environment:
+#   BENCH_SIZE		MB of each corpus file (default 32)
+#   BENCH_METHODS	methods to run (default rzip,lzo,gzip,bzip2,lzma,zstd)
+#   BENCH_RUNS		runs of each case, the best is kept (default 3)
+#   BENCH_FORMAT	csv or json for the stage benchmarks (default csv)
+#   BENCH_OUT		where results go (default bench-results)
+#   BENCH_TMP		where the corpus and archives go (default /tmp)
+
+usage() {
+echo "LRZIP Benchmarks"
+echo "usage: $0 path/to/lrzip-next path/to/lrzip-bench"
+exit 1
+}
+
+[ -x "$1" ] && [ -x "$2" ] || usage
+
+LRZIP=$1
+BENCH=$2
+SIZE=${BENCH_SIZE:-32}
+METHODS=${BENCH_METHODS:-rzip,lzo,gzip,bzip2,lzma,zstd}
+RUNS=${BENCH_RUNS:-3}
+OUT=${BENCH_OUT:-bench-results}
+TMP=$(mktemp -d "${BENCH_TMP:-/tmp}/lrzip-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+mkdir -p "$OUT" || exit 1
+
+if [ "$BENCH_FORMAT" = json ]; then
+	MICRO=$OUT/micro.json
+	"$BENCH" -j -s "$SIZE" -r "$RUNS" -m "$METHODS" > "$MICRO" || exit 1
+else
+	MICRO=$OUT/micro.csv
+	"$BENCH" -s "$SIZE" -r "$RUNS" -m "$METHODS" > "$MICRO" || exit 1
+fi
+cat "$MICRO"
+
+# Peak RSS of the command line needs GNU time
+TIME=
+if /usr/bin/time -f %M true >/dev/null 2>&1; then
+	TIME="/usr/bin/time -o $TMP/rss -f %M"
+fi
+
+now() {
+	date +%s.%N
+}
+
+calc() {
+	awk "BEGIN { print $* }"
+}
+
+# run lrzip-next options...: the best time of $RUNS runs and the largest RSS
+run() {
+	best=
+	rss=
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		sync
+		start=$(now)
+		$TIME "$LRZIP" -q -f "$@" >> "$TMP/profile" 2>&1 || return 1
+		t=$(calc "$(now) - $start")
+		if [ -z "$best" ] || [ "$(calc "$t < $best")" = 1 ]; then
+			best=$t
+		fi
+		if [ -n "$TIME" ] && [ "$(cat "$TMP/rss")" -gt "${rss:-0}" ]; then
+			rss=$(cat "$TMP/rss")
+		fi
+		i=$((i + 1))
+	done
+	return 0
+}
+
+"$BENCH" -s "$SIZE" -o "$TMP" > /dev/null || exit 1
+: > "$TMP/profile"
+echo "bench,corpus,method,bytes,seconds,mb_s,ratio,peak_rss_kb" > "$OUT/cli.csv"
+for corpus in logs vm source random; do
+	in=$TMP/$corpus
+	bytes=$(wc -c < "$in")
+	for method in $(echo "$METHODS" | tr , ' '); do
+		case $method in
+			rzip)	flag=-n ;;
+			lzo)	flag=-l ;;
+			gzip)	flag=-g ;;
+			bzip2)	flag=-b ;;
+			lzma)	flag=--lzma ;;
+			zstd)	flag=-Z ;;
+			zpaq)	flag=-z ;;
+			*)	echo "Unknown method $method"; exit 1 ;;
+		esac
+		run $flag --profile=json -o "$TMP/a.lrz" "$in" || exit 1
+		arch=$(wc -c < "$TMP/a.lrz")
+		ratio=$(calc "$bytes / $arch")
+		echo "compress,$corpus,$method,$bytes,$best,$(calc "$bytes / 1048576 / $best"),$ratio,$rss" >> "$OUT/cli.csv"
+		run -d --profile=json -o "$TMP/a.out" "$TMP/a.lrz" || exit 1
+		if ! cmp -s "$in" "$TMP/a.out"; then
+			echo "Mismatch after decompressing $corpus with $method"
+			exit 1
+		fi
+		echo "decompress,$corpus,$method,$bytes,$best,$(calc "$bytes / 1048576 / $best"),$ratio,$rss" >> "$OUT/cli.csv"
+	done
+done
+cat "$OUT/cli.csv"
+grep '^{' "$TMP/profile" > "$OUT/profile.json"
+
+exit 0
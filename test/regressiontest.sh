@@ -107,6 +107,55 @@ bash > regressiontest.out 2>&1  <<'_EOS'
       sort --compress-program lrz |
       wc -c
 
+  echo 'Test --archive refuses to extract through an archived symlink'
+    mkdir -p t/r evil out
+    ln -s ../evil t/q
+    ln -s aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa t/r/t
+    seq 100000 > t/r/data
+    lrz --archive -o t.lrz t/q t/r
+    # Rename r/t to q/t in the file table, so it comes after the symlink q
+    perl -0777 -pe 's{r/t}{q/t}' t.lrz > evil.lrz
+    lrz -d -O out/ evil.lrz 2>&1 | head -1
+    ls evil | wc -l
+    rm -rf t evil out t.lrz evil.lrz
+
+  echo 'Test zstd round trip'
+    seq 100000 > t.in
+    lrz -k -Z -o t.lrz t.in
+    lrz -d -o t.out t.lrz
+    cmp t.in t.out && echo OK
+    rm -f t.lrz t.out
+
+  echo 'Test --streamable round trip, to a file and through pipes'
+    lrz -k --streamable -o t.lrz t.in
+    lrz -d -o t.out t.lrz
+    cmp t.in t.out && echo OK
+    lrz --streamable < t.in | lrz -d 2>/dev/null | cmp - t.in && echo OK
+    rm -f t.lrz t.out
+
+  echo 'Test --index and --range'
+    lrz -k --index -o t.lrz t.in
+    lrz -d --range 1000:20 -o t.out t.lrz
+    head -c 1020 t.in | tail -c 20 | cmp - t.out && echo OK
+    rm -f t.lrz t.out
+
+  echo 'Test --reference round trip'
+    (seq 100000; seq 10) > t.new
+    lrz -k --reference t.in -o t.lrz t.new
+    lrz -d --reference t.in -o t.out t.lrz
+    cmp t.new t.out && echo OK
+    rm -f t.new t.lrz t.out
+
+  echo 'Test --archive round trip'
+    mkdir -p t/d out
+    cp t.in t/d/data
+    echo hello > t/hello
+    ln -s d/data t/link
+    lrz -k --archive -o t.lrz t
+    lrz -d -O out/ t.lrz
+    diff -r t out/t && echo OK
+    rm -rf t out t.lrz t.in
+
   echo 'test should not lrz -dc removes file'
     rm testfile.lrz
     echo OK > testfile